@@ -15,6 +15,26 @@
 """Wrapper for the Lintel C extension APIs."""
 import _lintel
 
+from lintel import sampling
+from lintel.batch import batch_layout, unpack_batch
+from lintel.cost import CostModel, estimate_cost
+from lintel.index import DatasetIndex, VideoMeta, index_dataset
+
 
 loadvid = _lintel.loadvid
 loadvid_frame_nums = _lintel.loadvid_frame_nums
+loadvid_stream = _lintel.loadvid_stream
+loadvid_batch = _lintel.loadvid_batch
+reset_memory_peaks = _lintel.reset_memory_peaks
+set_decoder_options = _lintel.set_decoder_options
+set_decoder_preference = _lintel.set_decoder_preference
+set_format_cache_capacity = _lintel.set_format_cache_capacity
+set_max_alloc = _lintel.set_max_alloc
+set_quality_control = _lintel.set_quality_control
+set_streaming_store_threshold = _lintel.set_streaming_store_threshold
+set_thread_budget = _lintel.set_thread_budget
+seed = _lintel.seed
+stats = _lintel.stats
+save_keyframe_index = _lintel.save_keyframe_index
+load_keyframe_index = _lintel.load_keyframe_index
+set_keyframe_index_capacity = _lintel.set_keyframe_index_capacity
@@ -0,0 +1,41 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+"""Views of the ragged batches returned by `lintel.loadvid_batch`."""
+import numpy as np
+
+
+def batch_layout(layout):
+    """Returns the layout of a batch as an int64 numpy array of shape
+    `(batch_size, 5)`, with columns offset_bytes, num_frames, height, width
+    and quality_level (see `lintel.set_quality_control`)."""
+    return np.frombuffer(layout, dtype=np.int64).reshape((-1, 5))
+
+
+def unpack_batch(arena, layout):
+    """Splits the arena of a batch into a list of uint8 numpy arrays of shape
+    `(num_frames, height, width, 3)`, one per video. The arrays are views of
+    the arena, so no frames are copied. Videos that could not be decoded give
+    arrays with zero frames.
+    """
+    arena = np.frombuffer(arena, dtype=np.uint8)
+
+    clips = []
+    for offset, num_frames, height, width, _ in batch_layout(layout):
+        size = num_frames*height*width*3
+        clip = arena[offset:offset + size]
+        clips.append(clip.reshape((num_frames, height, width, 3)))
+
+    return clips
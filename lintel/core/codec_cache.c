@@ -0,0 +1,264 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "codec_cache.h"
+#include "mem_stats.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * struct thread_codec_cache - The caches of one thread.
+ * @scaler: Scaler, or NULL.
+ * @scaler_width: Source width `scaler` was set up for.
+ * @scaler_height: Source height `scaler` was set up for.
+ * @scaler_format: Source pixel format `scaler` was set up for.
+ * @scaler_flags: Interpolation flags `scaler` was set up with.
+ * @decoders: Idle decoders, least recently released first.
+ * @num_decoders: Number of idle decoders.
+ */
+struct thread_codec_cache {
+        struct SwsContext *scaler;
+        int32_t scaler_width;
+        int32_t scaler_height;
+        int32_t scaler_format;
+        int32_t scaler_flags;
+        AVCodecContext *decoders[CODEC_CACHE_NUM_DECODERS];
+        uint32_t num_decoders;
+};
+
+/**
+ * struct decoder_tag - What a cacheable decoder's `opaque` points to.
+ * @key: Copy of the decoder's key, with its extradata following the tag.
+ * @mem_bytes: Estimated bytes held by the decoder while it is idle.
+ */
+struct decoder_tag {
+        struct codec_cache_key key;
+        int64_t mem_bytes;
+};
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread struct thread_codec_cache *thread_cache;
+static struct codec_cache_stats cache_stats;
+
+static void
+free_decoder(AVCodecContext *codec_context)
+{
+        struct decoder_tag *tag = (struct decoder_tag *)codec_context->opaque;
+        if (tag != NULL)
+                mem_stats_sub(MEM_STATS_CACHES, tag->mem_bytes);
+        free(tag);
+        codec_context->opaque = NULL;
+        avcodec_close(codec_context);
+        avcodec_free_context(&codec_context);
+}
+
+/**
+ * free_thread_cache() - Destructor of `cache_key`, which frees a thread's
+ * caches when it exits.
+ */
+static void
+free_thread_cache(void *opaque)
+{
+        struct thread_codec_cache *cache = (struct thread_codec_cache *)opaque;
+
+        sws_freeContext(cache->scaler);
+        for (uint32_t i = 0;
+             i < cache->num_decoders;
+             ++i)
+                free_decoder(cache->decoders[i]);
+        free(cache);
+}
+
+static void
+init_cache_key(void)
+{
+        pthread_key_create(&cache_key, free_thread_cache);
+}
+
+/**
+ * get_thread_cache() - Returns the calling thread's caches, creating them if
+ * needed, or NULL if they could not be allocated.
+ */
+static struct thread_codec_cache *
+get_thread_cache(void)
+{
+        if (thread_cache != NULL)
+                return thread_cache;
+
+        pthread_once(&cache_once, init_cache_key);
+
+        struct thread_codec_cache *cache = calloc(1, sizeof(*cache));
+        if (cache == NULL)
+                return NULL;
+
+        if (pthread_setspecific(cache_key, cache) != 0) {
+                free(cache);
+                return NULL;
+        }
+        thread_cache = cache;
+
+        return cache;
+}
+
+struct SwsContext *
+codec_cache_get_scaler(int32_t width,
+                       int32_t height,
+                       enum AVPixelFormat format,
+                       int32_t flags)
+{
+        struct thread_codec_cache *cache = get_thread_cache();
+        if (cache == NULL)
+                return NULL;
+
+        if ((cache->scaler != NULL) &&
+            (cache->scaler_width == width) &&
+            (cache->scaler_height == height) &&
+            (cache->scaler_format == format) &&
+            (cache->scaler_flags == flags)) {
+                __atomic_add_fetch(&cache_stats.scaler_reuses,
+                                   1,
+                                   __ATOMIC_RELAXED);
+                return cache->scaler;
+        }
+
+        __atomic_add_fetch(&cache_stats.scaler_creates, 1, __ATOMIC_RELAXED);
+        cache->scaler = sws_getCachedContext(cache->scaler,
+                                             width,
+                                             height,
+                                             format,
+                                             width,
+                                             height,
+                                             AV_PIX_FMT_RGB24,
+                                             flags,
+                                             NULL,
+                                             NULL,
+                                             NULL);
+        cache->scaler_width = width;
+        cache->scaler_height = height;
+        cache->scaler_format = format;
+        cache->scaler_flags = flags;
+
+        return cache->scaler;
+}
+
+static bool
+keys_match(const struct codec_cache_key *a, const struct codec_cache_key *b)
+{
+        return (a->codec == b->codec) &&
+               (a->thread_count == b->thread_count) &&
+               (a->fast == b->fast) &&
+               (a->width == b->width) &&
+               (a->height == b->height) &&
+               (a->format == b->format) &&
+               (a->extradata_size == b->extradata_size) &&
+               ((a->extradata_size == 0) ||
+                (memcmp(a->extradata, b->extradata, a->extradata_size) == 0));
+}
+
+AVCodecContext *
+codec_cache_acquire_decoder(const struct codec_cache_key *key)
+{
+        struct thread_codec_cache *cache = get_thread_cache();
+
+        for (uint32_t i = 0;
+             (cache != NULL) && (i < cache->num_decoders);
+             ++i) {
+                AVCodecContext *codec_context = cache->decoders[i];
+                struct decoder_tag *tag =
+                        (struct decoder_tag *)codec_context->opaque;
+                if (!keys_match(&tag->key, key))
+                        continue;
+
+                mem_stats_sub(MEM_STATS_CACHES, tag->mem_bytes);
+                tag->mem_bytes = 0;
+
+                --cache->num_decoders;
+                memmove(cache->decoders + i,
+                        cache->decoders + i + 1,
+                        (cache->num_decoders - i)*sizeof(*cache->decoders));
+                __atomic_add_fetch(&cache_stats.decoder_reuses,
+                                   1,
+                                   __ATOMIC_RELAXED);
+
+                return codec_context;
+        }
+
+        __atomic_add_fetch(&cache_stats.decoder_creates, 1, __ATOMIC_RELAXED);
+
+        return NULL;
+}
+
+bool
+codec_cache_tag_decoder(AVCodecContext *codec_context,
+                        const struct codec_cache_key *key)
+{
+        struct decoder_tag *tag = malloc(sizeof(*tag) + key->extradata_size);
+        if (tag == NULL)
+                return false;
+
+        tag->key = *key;
+        tag->key.extradata = (uint8_t *)(tag + 1);
+        tag->mem_bytes = 0;
+        if (key->extradata_size > 0)
+                memcpy(tag + 1, key->extradata, key->extradata_size);
+        codec_context->opaque = tag;
+
+        return true;
+}
+
+void
+codec_cache_release_decoder(AVCodecContext **codec_context, int64_t mem_bytes)
+{
+        AVCodecContext *released = *codec_context;
+        *codec_context = NULL;
+        if (released == NULL)
+                return;
+
+        struct thread_codec_cache *cache = get_thread_cache();
+        if ((released->opaque == NULL) || (cache == NULL)) {
+                free_decoder(released);
+                return;
+        }
+
+        if (cache->num_decoders == CODEC_CACHE_NUM_DECODERS) {
+                free_decoder(cache->decoders[0]);
+                --cache->num_decoders;
+                memmove(cache->decoders,
+                        cache->decoders + 1,
+                        cache->num_decoders*sizeof(*cache->decoders));
+        }
+
+        avcodec_flush_buffers(released);
+        struct decoder_tag *tag = (struct decoder_tag *)released->opaque;
+        tag->mem_bytes = mem_bytes;
+        mem_stats_add(MEM_STATS_CACHES, mem_bytes);
+        cache->decoders[cache->num_decoders] = released;
+        ++cache->num_decoders;
+}
+
+void
+codec_cache_get_stats(struct codec_cache_stats *stats)
+{
+        stats->scaler_reuses = __atomic_load_n(&cache_stats.scaler_reuses,
+                                               __ATOMIC_RELAXED);
+        stats->scaler_creates = __atomic_load_n(&cache_stats.scaler_creates,
+                                                __ATOMIC_RELAXED);
+        stats->decoder_reuses = __atomic_load_n(&cache_stats.decoder_reuses,
+                                                __ATOMIC_RELAXED);
+        stats->decoder_creates = __atomic_load_n(&cache_stats.decoder_creates,
+                                                 __ATOMIC_RELAXED);
+}
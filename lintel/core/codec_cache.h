@@ -0,0 +1,131 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _CODEC_CACHE_H_
+#define _CODEC_CACHE_H_
+
+/**
+ * Per-thread caches of scalers (`SwsContext`s) and idle decoders
+ * (`AVCodecContext`s), so that consecutive decodes of videos with the same
+ * codec, size and pixel format on one thread skip re-initializing them.
+ *
+ * Decoders are only reused for streams with byte-identical codec extradata
+ * (e.g. H.264 SPS/PPS), and are flushed before reuse. Each thread's caches are
+ * freed when the thread exits.
+ *
+ * Only single-threaded decoders are cached, since the codec threads of an
+ * idle decoder would otherwise escape the thread budget. The estimated memory
+ * of idle decoders is accounted in `MEM_STATS_CACHES`.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#ifdef __cplusplus
+};
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Idle decoders cached per thread. */
+#define CODEC_CACHE_NUM_DECODERS 4
+
+/**
+ * struct codec_cache_key - What a cached decoder must match to be reused.
+ * @codec: The decoder.
+ * @thread_count: Codec threads the decoder was opened with.
+ * @fast: Whether the decoder was opened for fast decoding.
+ * @width: Coded width of the stream.
+ * @height: Coded height of the stream.
+ * @format: Pixel format of the stream.
+ * @extradata: Codec extradata of the stream, e.g. H.264 SPS/PPS.
+ * @extradata_size: Size of `extradata`.
+ */
+struct codec_cache_key {
+        const AVCodec *codec;
+        int32_t thread_count;
+        bool fast;
+        int32_t width;
+        int32_t height;
+        int32_t format;
+        const uint8_t *extradata;
+        int32_t extradata_size;
+};
+
+/**
+ * struct codec_cache_stats - Process-wide counts of cache lookups.
+ * @scaler_reuses: Scalers reused as-is.
+ * @scaler_creates: Scalers (re-)initialized.
+ * @decoder_reuses: Decoders reused from the cache.
+ * @decoder_creates: Decoders opened because none matched.
+ */
+struct codec_cache_stats {
+        uint64_t scaler_reuses;
+        uint64_t scaler_creates;
+        uint64_t decoder_reuses;
+        uint64_t decoder_creates;
+};
+
+/**
+ * codec_cache_get_scaler() - Returns the calling thread's scaler, set up to
+ * convert frames of `width` by `height` in `format` to RGB24 with `flags`.
+ *
+ * The scaler is owned by the thread's cache, and must not be freed. It stays
+ * valid until the next call on the same thread. Returns NULL on failure.
+ */
+struct SwsContext *
+codec_cache_get_scaler(int32_t width,
+                       int32_t height,
+                       enum AVPixelFormat format,
+                       int32_t flags);
+
+/**
+ * codec_cache_acquire_decoder() - Takes an idle decoder matching `key` out of
+ * the calling thread's cache.
+ *
+ * Returns NULL if there is none, in which case the caller opens a decoder and
+ * should tag it with `codec_cache_tag_decoder` so that it can be cached.
+ */
+AVCodecContext *codec_cache_acquire_decoder(const struct codec_cache_key *key);
+
+/**
+ * codec_cache_tag_decoder() - Records `key` with a newly opened decoder, so
+ * that `codec_cache_release_decoder` caches it. The decoder's `opaque` is used
+ * for the key.
+ *
+ * Returns false if the key could not be recorded, in which case the decoder
+ * is freed rather than cached when released.
+ */
+bool
+codec_cache_tag_decoder(AVCodecContext *codec_context,
+                        const struct codec_cache_key *key);
+
+/**
+ * codec_cache_release_decoder() - Flushes `*codec_context` into the calling
+ * thread's cache if it was tagged, evicting the least recently released
+ * decoder if the cache is full, or else closes and frees it. Sets
+ * `*codec_context` to NULL.
+ * @mem_bytes: Estimated bytes held by the decoder, accounted in
+ * `MEM_STATS_CACHES` while it is idle in the cache.
+ */
+void
+codec_cache_release_decoder(AVCodecContext **codec_context, int64_t mem_bytes);
+
+/* codec_cache_get_stats() - Copies the process-wide cache counters. */
+void codec_cache_get_stats(struct codec_cache_stats *stats);
+
+#endif // _CODEC_CACHE_H_
@@ -0,0 +1,165 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "decoder_select.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+/**
+ * struct decoder_options - Options that a decoder is opened with.
+ * @codec: The decoder.
+ * @options: Its options, never empty.
+ */
+struct decoder_options {
+        AVCodec *codec;
+        AVDictionary *options;
+};
+
+static pthread_mutex_t select_lock = PTHREAD_MUTEX_INITIALIZER;
+static AVCodec *preferred[DECODER_SELECT_MAX_DECODERS];
+static uint32_t num_preferred;
+static struct decoder_options decoder_options[DECODER_SELECT_MAX_DECODERS];
+static uint32_t num_decoder_options;
+
+/**
+ * find_decoder_by_name() - Returns the decoder called `name`, or NULL if
+ * there is no such decoder (including if `name` is an encoder).
+ */
+static AVCodec *
+find_decoder_by_name(const char *name)
+{
+        AVCodec *codec = avcodec_find_decoder_by_name(name);
+        if ((codec == NULL) || (codec->type != AVMEDIA_TYPE_VIDEO))
+                return NULL;
+
+        return codec;
+}
+
+int32_t
+decoder_select_set_preference(const char *const *decoder_names,
+                              uint32_t num_names)
+{
+        AVCodec *codecs[DECODER_SELECT_MAX_DECODERS];
+
+        if (num_names > DECODER_SELECT_MAX_DECODERS)
+                return -1;
+
+        for (uint32_t i = 0;
+             i < num_names;
+             ++i) {
+                codecs[i] = find_decoder_by_name(decoder_names[i]);
+                if (codecs[i] == NULL)
+                        return i + 1;
+        }
+
+        pthread_mutex_lock(&select_lock);
+        for (uint32_t i = 0;
+             i < num_names;
+             ++i)
+                preferred[i] = codecs[i];
+        num_preferred = num_names;
+        pthread_mutex_unlock(&select_lock);
+
+        return 0;
+}
+
+int32_t
+decoder_select_set_options(const char *decoder_name,
+                           const AVDictionary *options)
+{
+        AVCodec *codec = find_decoder_by_name(decoder_name);
+        if (codec == NULL)
+                return 1;
+
+        AVDictionary *options_copy = NULL;
+        if (av_dict_count(options) > 0)
+                av_dict_copy(&options_copy, options, 0);
+
+        int32_t status = 0;
+        pthread_mutex_lock(&select_lock);
+
+        uint32_t i;
+        for (i = 0;
+             i < num_decoder_options;
+             ++i) {
+                if (decoder_options[i].codec == codec)
+                        break;
+        }
+
+        if (i < num_decoder_options) {
+                av_dict_free(&decoder_options[i].options);
+                if (options_copy != NULL) {
+                        decoder_options[i].options = options_copy;
+                } else {
+                        --num_decoder_options;
+                        decoder_options[i] =
+                                decoder_options[num_decoder_options];
+                }
+        } else if (options_copy != NULL) {
+                if (num_decoder_options < DECODER_SELECT_MAX_DECODERS) {
+                        decoder_options[i].codec = codec;
+                        decoder_options[i].options = options_copy;
+                        ++num_decoder_options;
+                } else {
+                        av_dict_free(&options_copy);
+                        status = -1;
+                }
+        }
+
+        pthread_mutex_unlock(&select_lock);
+
+        return status;
+}
+
+AVCodec *
+decoder_select_find(enum AVCodecID codec_id,
+                    const char *decoder_name,
+                    AVDictionary **options)
+{
+        AVCodec *codec = NULL;
+
+        *options = NULL;
+
+        if (decoder_name != NULL) {
+                codec = find_decoder_by_name(decoder_name);
+                if ((codec != NULL) && (codec->id != codec_id))
+                        codec = NULL;
+        }
+
+        pthread_mutex_lock(&select_lock);
+
+        for (uint32_t i = 0;
+             (codec == NULL) && (i < num_preferred);
+             ++i) {
+                if (preferred[i]->id == codec_id)
+                        codec = preferred[i];
+        }
+
+        if (codec == NULL)
+                codec = avcodec_find_decoder(codec_id);
+
+        for (uint32_t i = 0;
+             (codec != NULL) && (i < num_decoder_options);
+             ++i) {
+                if (decoder_options[i].codec == codec) {
+                        av_dict_copy(options, decoder_options[i].options, 0);
+                        break;
+                }
+        }
+
+        pthread_mutex_unlock(&select_lock);
+
+        return codec;
+}
@@ -0,0 +1,93 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _DECODER_SELECT_H_
+#define _DECODER_SELECT_H_
+
+/**
+ * Process-wide choice of decoder for each codec, e.g. libdav1d rather than
+ * FFmpeg's native AV1 decoder, and of private options for each decoder, e.g.
+ * dav1d's tile and frame threads.
+ *
+ * By default, the decoder is FFmpeg's default for the codec
+ * (`avcodec_find_decoder`), opened with no options.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <libavcodec/avcodec.h>
+#ifdef __cplusplus
+};
+#endif
+#include <stdint.h>
+
+/* Most decoders that can be preferred, or given options. */
+#define DECODER_SELECT_MAX_DECODERS 32
+
+/**
+ * decoder_select_set_preference() - Sets the preferred decoders, most
+ * preferred first.
+ * @decoder_names: Decoder names, as for `avcodec_find_decoder_by_name`, e.g.
+ * "libdav1d" or "libvpx-vp9".
+ * @num_names: Length of `decoder_names`. Zero restores FFmpeg's defaults.
+ *
+ * A video is decoded with the first preferred decoder for its codec, or with
+ * FFmpeg's default decoder if none of the preferred decoders are for its
+ * codec.
+ *
+ * Returns 0 on success, or the index plus one of the first name that is not a
+ * decoder in this build of FFmpeg, in which case the preferences are
+ * unchanged. Returns -1 if there are more than DECODER_SELECT_MAX_DECODERS
+ * names.
+ */
+int32_t
+decoder_select_set_preference(const char *const *decoder_names,
+                              uint32_t num_names);
+
+/**
+ * decoder_select_set_options() - Sets the private options that a decoder is
+ * opened with, replacing any set before.
+ * @decoder_name: Name of the decoder.
+ * @options: Options, which are copied. NULL or empty clears the options.
+ *
+ * The options are passed to `avcodec_open2`, so they may also set generic
+ * codec context options, e.g. "threads" overrides the thread budget.
+ *
+ * Returns 0 on success, 1 if `decoder_name` is not a decoder, or -1 if
+ * DECODER_SELECT_MAX_DECODERS decoders already have options.
+ */
+int32_t
+decoder_select_set_options(const char *decoder_name,
+                           const AVDictionary *options);
+
+/**
+ * decoder_select_find() - Returns the decoder to open for a codec, and the
+ * options to open it with.
+ * @codec_id: Codec of the video stream.
+ * @decoder_name: Decoder explicitly requested for this video, or NULL. It is
+ * only used if it decodes `codec_id`, so that one name (e.g. "libdav1d") can
+ * be requested for a batch of videos with mixed codecs.
+ * @options: Output copy of the decoder's options, to be freed by the caller
+ * with `av_dict_free`. Left NULL if the decoder has no options.
+ *
+ * Returns NULL if there is no decoder for `codec_id`.
+ */
+AVCodec *
+decoder_select_find(enum AVCodecID codec_id,
+                    const char *decoder_name,
+                    AVDictionary **options);
+
+#endif // _DECODER_SELECT_H_
@@ -0,0 +1,257 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "format_cache.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * struct format_cache_entry - A demuxer that is not currently in use.
+ * @key: Video key the demuxer was cached under.
+ * @last_used: Value of the cache's clock when the entry was released, for LRU
+ * eviction.
+ * @format_context: Opened demuxer, or NULL if the entry is empty.
+ * @input_buf: Saved state of the demuxer's `struct buffer_data`. The input
+ * pointer dies with the caller, so it is only used to rebase in-place buffer
+ * windows (see `rebind_memory_input`), and never dereferenced.
+ * @video_stream_index: Index of the video stream in `format_context`.
+ * @duration: Duration of the video stream, in its timebase.
+ * @nb_frames: (Possibly approximate) number of frames in the video stream.
+ */
+struct format_cache_entry {
+        uint64_t key;
+        uint64_t last_used;
+        AVFormatContext *format_context;
+        struct buffer_data input_buf;
+        int32_t video_stream_index;
+        int64_t duration;
+        int64_t nb_frames;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct format_cache_entry *cache_entries;
+static uint32_t cache_capacity = FORMAT_CACHE_DEFAULT_CAPACITY;
+static uint64_t cache_clock;
+
+/**
+ * rewind_format_context() - Seeks a cached demuxer back to the start of its
+ * video stream, and discards any state left over from the previous decode.
+ *
+ * Returns true on success.
+ */
+static bool
+rewind_format_context(struct format_cache_entry *entry)
+{
+        AVStream *video_stream =
+                entry->format_context->streams[entry->video_stream_index];
+        int64_t start_time = 0;
+        if (video_stream->start_time != AV_NOPTS_VALUE)
+                start_time = video_stream->start_time;
+
+        int32_t status = av_seek_frame(entry->format_context,
+                                       entry->video_stream_index,
+                                       start_time,
+                                       AVSEEK_FLAG_BACKWARD);
+
+        return status >= 0;
+}
+
+/**
+ * find_entry() - Returns the slot caching `key`, or NULL. Must be called with
+ * `cache_lock` held.
+ */
+static struct format_cache_entry *
+find_entry(uint64_t key)
+{
+        if (cache_entries == NULL)
+                return NULL;
+
+        for (uint32_t i = 0;
+             i < cache_capacity;
+             ++i) {
+                struct format_cache_entry *entry = cache_entries + i;
+                if ((entry->format_context != NULL) && (entry->key == key))
+                        return entry;
+        }
+
+        return NULL;
+}
+
+bool
+format_cache_acquire(struct video_stream_context *vid_ctx,
+                     struct buffer_data *input_buf,
+                     uint64_t key)
+{
+        struct format_cache_entry entry;
+
+        pthread_mutex_lock(&cache_lock);
+        struct format_cache_entry *cached = find_entry(key);
+        if (cached != NULL) {
+                entry = *cached;
+                cached->format_context = NULL;
+        }
+        pthread_mutex_unlock(&cache_lock);
+
+        if (cached == NULL)
+                return false;
+
+        /**
+         * NOTE(brendan): The cache is keyed by the caller, so the size check
+         * only catches a stale entry for a video that has been re-encoded.
+         */
+        if (entry.input_buf.total_size_bytes != input_buf->total_size_bytes)
+                goto close_stale_entry;
+
+        input_buf->offset_bytes = entry.input_buf.offset_bytes;
+        rebind_memory_input(entry.format_context->pb,
+                            input_buf,
+                            entry.input_buf.ptr);
+
+        if (!rewind_format_context(&entry))
+                goto close_stale_entry;
+
+        vid_ctx->format_context = entry.format_context;
+        vid_ctx->video_stream_index = entry.video_stream_index;
+        vid_ctx->duration = entry.duration;
+        vid_ctx->nb_frames = entry.nb_frames;
+
+        return true;
+
+close_stale_entry:
+        close_format_context(&entry.format_context);
+        input_buf->offset_bytes = 0;
+
+        return false;
+}
+
+bool
+format_cache_release(struct video_stream_context *vid_ctx,
+                     const struct buffer_data *input_buf,
+                     uint64_t key)
+{
+        bool is_cached = false;
+
+        pthread_mutex_lock(&cache_lock);
+        if (cache_capacity == 0)
+                goto out_unlock;
+
+        if (cache_entries == NULL) {
+                cache_entries = calloc(cache_capacity, sizeof(*cache_entries));
+                if (cache_entries == NULL)
+                        goto out_unlock;
+        }
+
+        /**
+         * NOTE(brendan): If another caller released the same video first, keep
+         * theirs.
+         */
+        if (find_entry(key) != NULL)
+                goto out_unlock;
+
+        struct format_cache_entry *victim = cache_entries;
+        for (uint32_t i = 0;
+             i < cache_capacity;
+             ++i) {
+                struct format_cache_entry *entry = cache_entries + i;
+                if (entry->format_context == NULL) {
+                        victim = entry;
+                        break;
+                }
+
+                if (entry->last_used < victim->last_used)
+                        victim = entry;
+        }
+
+        AVFormatContext *evicted = victim->format_context;
+
+        victim->key = key;
+        victim->last_used = ++cache_clock;
+        victim->format_context = vid_ctx->format_context;
+        victim->input_buf = *input_buf;
+        victim->video_stream_index = vid_ctx->video_stream_index;
+        victim->duration = vid_ctx->duration;
+        victim->nb_frames = vid_ctx->nb_frames;
+        victim->format_context->pb->opaque = &victim->input_buf;
+
+        vid_ctx->format_context = NULL;
+        is_cached = true;
+
+        pthread_mutex_unlock(&cache_lock);
+
+        if (evicted != NULL)
+                close_format_context(&evicted);
+
+        return is_cached;
+
+out_unlock:
+        pthread_mutex_unlock(&cache_lock);
+
+        return is_cached;
+}
+
+int32_t format_cache_set_capacity(uint32_t capacity)
+{
+        struct format_cache_entry *new_entries = NULL;
+        if (capacity > 0) {
+                new_entries = calloc(capacity, sizeof(*new_entries));
+                if (new_entries == NULL)
+                        return VID_DECODE_FFMPEG_ERR;
+        }
+
+        pthread_mutex_lock(&cache_lock);
+        struct format_cache_entry *old_entries = cache_entries;
+        uint32_t old_capacity = cache_capacity;
+
+        /* NOTE(brendan): Keep the most recently used entries that fit. */
+        uint32_t num_kept = 0;
+        while ((old_entries != NULL) && (num_kept < capacity)) {
+                struct format_cache_entry *newest = NULL;
+                for (uint32_t i = 0;
+                     i < old_capacity;
+                     ++i) {
+                        struct format_cache_entry *entry = old_entries + i;
+                        if ((entry->format_context != NULL) &&
+                            ((newest == NULL) ||
+                             (entry->last_used > newest->last_used)))
+                                newest = entry;
+                }
+                if (newest == NULL)
+                        break;
+
+                new_entries[num_kept] = *newest;
+                new_entries[num_kept].format_context->pb->opaque =
+                        &new_entries[num_kept].input_buf;
+                newest->format_context = NULL;
+                ++num_kept;
+        }
+
+        cache_entries = new_entries;
+        cache_capacity = capacity;
+        pthread_mutex_unlock(&cache_lock);
+
+        if (old_entries == NULL)
+                return VID_DECODE_SUCCESS;
+
+        for (uint32_t i = 0;
+             i < old_capacity;
+             ++i) {
+                if (old_entries[i].format_context != NULL)
+                        close_format_context(&old_entries[i].format_context);
+        }
+        free(old_entries);
+
+        return VID_DECODE_SUCCESS;
+}
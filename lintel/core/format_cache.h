@@ -0,0 +1,78 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _FORMAT_CACHE_H_
+#define _FORMAT_CACHE_H_
+
+/**
+ * A process-wide cache of opened demuxers (`AVFormatContext`s), keyed by a
+ * caller-supplied video key.
+ *
+ * Opening a container parses its header, e.g. the full `moov` sample tables
+ * of an MP4, which for long videos costs far more than decoding a short clip.
+ * Cached demuxers keep their parsed index, and are rewound to the start of
+ * the video instead of being re-opened.
+ */
+
+#include "video_decode.h"
+
+#define FORMAT_CACHE_DEFAULT_CAPACITY 32
+
+/**
+ * format_cache_acquire() - Takes the demuxer cached under `key`, if any, out
+ * of the cache and injects it into `vid_ctx`.
+ * @vid_ctx: Output context. Only `format_context`, `video_stream_index`,
+ * `duration` and `nb_frames` are filled in.
+ * @input_buf: Buffer tracking the input byte string. The encoded video must be
+ * byte-for-byte identical to the one that was cached under `key`.
+ * @key: Video key, e.g. a hash of a video ID.
+ *
+ * On a hit, the demuxer's byte-stream I/O context is rebound to `input_buf`,
+ * and the demuxer is rewound to the start of the video stream.
+ *
+ * Returns true on a cache hit, in which case ownership of the demuxer (and its
+ * AV I/O context) is transferred to `vid_ctx`.
+ */
+bool
+format_cache_acquire(struct video_stream_context *vid_ctx,
+                     struct buffer_data *input_buf,
+                     uint64_t key);
+
+/**
+ * format_cache_release() - Returns the demuxer in `vid_ctx` to the cache under
+ * `key`, evicting the least recently used entry if the cache is full.
+ * @vid_ctx: Context holding the demuxer to cache.
+ * @input_buf: Buffer that `vid_ctx`'s AV I/O context reads from.
+ * @key: Video key to cache the demuxer under.
+ *
+ * Returns true if the cache took ownership of `vid_ctx->format_context`. If
+ * false is returned, the caller must still close the demuxer.
+ */
+bool
+format_cache_release(struct video_stream_context *vid_ctx,
+                     const struct buffer_data *input_buf,
+                     uint64_t key);
+
+/**
+ * format_cache_set_capacity() - Sets the maximum number of cached demuxers,
+ * closing any entries that no longer fit. A capacity of zero disables (and
+ * empties) the cache.
+ *
+ * Returns VID_DECODE_SUCCESS, or VID_DECODE_FFMPEG_ERR if the cache could not
+ * be resized.
+ */
+int32_t format_cache_set_capacity(uint32_t capacity);
+
+#endif // _FORMAT_CACHE_H_
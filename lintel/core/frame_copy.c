@@ -0,0 +1,365 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "frame_copy.h"
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define FRAME_COPY_HAVE_SSE2 1
+#endif
+
+static pthread_once_t frame_copy_once = PTHREAD_ONCE_INIT;
+static bool has_streaming_stores = false;
+static int64_t default_threshold_bytes = FRAME_COPY_DEFAULT_THRESHOLD_BYTES;
+/* NOTE(brendan): Negative means default. Accessed atomically. */
+static int64_t stream_threshold_bytes = -1;
+
+static void
+init_frame_copy(void)
+{
+#ifdef FRAME_COPY_HAVE_SSE2
+        __builtin_cpu_init();
+        has_streaming_stores = __builtin_cpu_supports("sse2");
+#endif
+
+        long cache_size_bytes = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+        cache_size_bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+        if (cache_size_bytes <= 0)
+                cache_size_bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        if (cache_size_bytes > 0)
+                default_threshold_bytes = cache_size_bytes;
+}
+
+bool frame_copy_should_stream(uint64_t out_size_bytes)
+{
+        pthread_once(&frame_copy_once, init_frame_copy);
+        if (!has_streaming_stores)
+                return false;
+
+        int64_t threshold_bytes = __atomic_load_n(&stream_threshold_bytes,
+                                                  __ATOMIC_RELAXED);
+        if (threshold_bytes < 0)
+                threshold_bytes = default_threshold_bytes;
+
+        return out_size_bytes > (uint64_t)threshold_bytes;
+}
+
+void frame_copy_set_stream_threshold(int64_t threshold_bytes)
+{
+        __atomic_store_n(&stream_threshold_bytes,
+                         threshold_bytes,
+                         __ATOMIC_RELAXED);
+}
+
+#ifdef FRAME_COPY_HAVE_SSE2
+/**
+ * stream_copy() - `memcpy` with streaming stores for the 16-byte aligned body
+ * of `dest`. The unaligned head and tail are copied normally.
+ */
+__attribute__((target("sse2")))
+static void
+stream_copy(uint8_t *dest, const uint8_t *src, size_t size_bytes)
+{
+        size_t head_bytes = (16 - ((uintptr_t)dest & 15)) & 15;
+        if (head_bytes > size_bytes)
+                head_bytes = size_bytes;
+
+        memcpy(dest, src, head_bytes);
+        dest += head_bytes;
+        src += head_bytes;
+        size_bytes -= head_bytes;
+
+        for (;
+             size_bytes >= 64;
+             size_bytes -= 64, dest += 64, src += 64) {
+                __m128i a = _mm_loadu_si128((const __m128i *)src);
+                __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+                __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+                __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+                _mm_stream_si128((__m128i *)dest, a);
+                _mm_stream_si128((__m128i *)(dest + 16), b);
+                _mm_stream_si128((__m128i *)(dest + 32), c);
+                _mm_stream_si128((__m128i *)(dest + 48), d);
+        }
+
+        for (;
+             size_bytes >= 16;
+             size_bytes -= 16, dest += 16, src += 16)
+                _mm_stream_si128((__m128i *)dest,
+                                 _mm_loadu_si128((const __m128i *)src));
+
+        memcpy(dest, src, size_bytes);
+}
+
+__attribute__((target("sse2")))
+static void
+stream_copy_rows(uint8_t *dest,
+                 const uint8_t *src,
+                 int32_t src_stride,
+                 uint32_t bytes_per_row,
+                 int32_t num_rows)
+{
+        for (int32_t row_index = 0;
+             row_index < num_rows;
+             ++row_index) {
+                stream_copy(dest, src, bytes_per_row);
+
+                src += src_stride;
+                dest += bytes_per_row;
+        }
+}
+
+/**
+ * NOTE(brendan): Streaming stores are weakly ordered, so fence before the
+ * output can be handed to another thread.
+ */
+__attribute__((target("sse2")))
+static void
+stream_fence(void)
+{
+        _mm_sfence();
+}
+#endif // FRAME_COPY_HAVE_SSE2
+
+/**
+ * copy_rows() - `frame_copy_rows` without the store fence, which the caller
+ * issues after its last streaming copy.
+ */
+static void
+copy_rows(uint8_t *dest,
+          const uint8_t *src,
+          int32_t src_stride,
+          uint32_t bytes_per_row,
+          int32_t num_rows,
+          bool use_streaming_stores)
+{
+#ifdef FRAME_COPY_HAVE_SSE2
+        if (use_streaming_stores && has_streaming_stores) {
+                stream_copy_rows(dest,
+                                 src,
+                                 src_stride,
+                                 bytes_per_row,
+                                 num_rows);
+                return;
+        }
+#endif
+
+        for (int32_t row_index = 0;
+             row_index < num_rows;
+             ++row_index) {
+                memcpy(dest, src, bytes_per_row);
+
+                src += src_stride;
+                dest += bytes_per_row;
+        }
+}
+
+static void
+fence_streaming_stores(bool use_streaming_stores)
+{
+#ifdef FRAME_COPY_HAVE_SSE2
+        if (use_streaming_stores && has_streaming_stores)
+                stream_fence();
+#endif
+}
+
+void
+frame_copy_rows(uint8_t *dest,
+                const uint8_t *src,
+                int32_t src_stride,
+                uint32_t bytes_per_row,
+                int32_t num_rows,
+                bool use_streaming_stores)
+{
+        copy_rows(dest,
+                  src,
+                  src_stride,
+                  bytes_per_row,
+                  num_rows,
+                  use_streaming_stores);
+        fence_streaming_stores(use_streaming_stores);
+}
+
+/**
+ * tubelet_chunk() - Returns where frame `frame_index`'s `size` by `size` block
+ * at (`block_row`, `block_col`) starts in a tubelet-ordered clip. The block's
+ * rows are contiguous there.
+ */
+static uint8_t *
+tubelet_chunk(uint8_t *clip,
+              const struct tubelet_layout *tubelet,
+              uint32_t frame_index,
+              uint32_t block_row,
+              uint32_t block_col,
+              uint32_t width,
+              uint32_t height)
+{
+        const uint64_t bytes_per_chunk = 3*tubelet->size*tubelet->size;
+        const uint64_t blocks_per_row = width/tubelet->size;
+        const uint64_t blocks_per_frame = blocks_per_row*(height/tubelet->size);
+        const uint64_t tubelet_index =
+                (frame_index/tubelet->num_frames)*blocks_per_frame +
+                block_row*blocks_per_row +
+                block_col;
+
+        return clip +
+               (tubelet_index*tubelet->num_frames +
+                frame_index%tubelet->num_frames)*bytes_per_chunk;
+}
+
+void
+frame_copy_to_tubelets(uint8_t *clip,
+                       const uint8_t *src,
+                       int32_t src_stride,
+                       uint32_t frame_index,
+                       uint32_t width,
+                       uint32_t height,
+                       const struct tubelet_layout *tubelet,
+                       bool use_streaming_stores)
+{
+        const uint32_t size = tubelet->size;
+
+        for (uint32_t block_row = 0;
+             block_row < height/size;
+             ++block_row) {
+                for (uint32_t block_col = 0;
+                     block_col < width/size;
+                     ++block_col)
+                        copy_rows(tubelet_chunk(clip,
+                                                tubelet,
+                                                frame_index,
+                                                block_row,
+                                                block_col,
+                                                width,
+                                                height),
+                                  src + block_row*size*src_stride +
+                                  3*block_col*size,
+                                  src_stride,
+                                  3*size,
+                                  size,
+                                  use_streaming_stores);
+        }
+        fence_streaming_stores(use_streaming_stores);
+}
+
+void
+frame_copy_tubelet_frame(uint8_t *clip,
+                         int32_t dest_index,
+                         int32_t src_index,
+                         uint32_t width,
+                         uint32_t height,
+                         const struct tubelet_layout *tubelet)
+{
+        const uint32_t size = tubelet->size;
+
+        for (uint32_t block_row = 0;
+             block_row < height/size;
+             ++block_row) {
+                for (uint32_t block_col = 0;
+                     block_col < width/size;
+                     ++block_col) {
+                        uint8_t *dest = tubelet_chunk(clip,
+                                                      tubelet,
+                                                      dest_index,
+                                                      block_row,
+                                                      block_col,
+                                                      width,
+                                                      height);
+                        if (src_index < 0)
+                                memset(dest, 0, 3*size*size);
+                        else
+                                memcpy(dest,
+                                       tubelet_chunk(clip,
+                                                     tubelet,
+                                                     src_index,
+                                                     block_row,
+                                                     block_col,
+                                                     width,
+                                                     height),
+                                       3*size*size);
+                }
+        }
+}
+
+uint32_t frame_diff_type_size(enum frame_diff_type type)
+{
+        switch (type) {
+        case FRAME_DIFF_INT8:
+                return sizeof(int8_t);
+        case FRAME_DIFF_INT16:
+                return sizeof(int16_t);
+        case FRAME_DIFF_FLOAT32:
+                return sizeof(float);
+        default:
+                return 0;
+        }
+}
+
+/**
+ * NOTE(brendan): One loop per element type, with the type switch outside the
+ * loop, so that the compiler vectorizes each of them.
+ */
+void
+frame_diff_rows(uint8_t *dest,
+                const uint8_t *cur,
+                int32_t cur_stride,
+                const uint8_t *prev,
+                int32_t prev_stride,
+                uint32_t bytes_per_row,
+                int32_t num_rows,
+                enum frame_diff_type type)
+{
+        const uint32_t dest_stride = bytes_per_row*frame_diff_type_size(type);
+
+        for (int32_t row_index = 0;
+             row_index < num_rows;
+             ++row_index) {
+                const uint8_t *restrict cur_row =
+                        (cur != NULL) ? cur + row_index*cur_stride : NULL;
+                const uint8_t *restrict prev_row = prev + row_index*prev_stride;
+                uint8_t *restrict dest_row = dest + row_index*dest_stride;
+
+                if (type == FRAME_DIFF_INT8) {
+                        int8_t *out = (int8_t *)dest_row;
+                        for (uint32_t i = 0;
+                             i < bytes_per_row;
+                             ++i) {
+                                int32_t diff = ((cur_row != NULL) ?
+                                                cur_row[i] : 0) - prev_row[i];
+                                diff = (diff < INT8_MIN) ? INT8_MIN : diff;
+                                out[i] = (diff > INT8_MAX) ? INT8_MAX : diff;
+                        }
+                } else if (type == FRAME_DIFF_INT16) {
+                        int16_t *out = (int16_t *)dest_row;
+                        for (uint32_t i = 0;
+                             i < bytes_per_row;
+                             ++i)
+                                out[i] = ((cur_row != NULL) ? cur_row[i] : 0) -
+                                         prev_row[i];
+                } else if (type == FRAME_DIFF_FLOAT32) {
+                        float *out = (float *)dest_row;
+                        for (uint32_t i = 0;
+                             i < bytes_per_row;
+                             ++i)
+                                out[i] = ((cur_row != NULL) ? cur_row[i] : 0) -
+                                         prev_row[i];
+                }
+        }
+}
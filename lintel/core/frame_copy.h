@@ -0,0 +1,151 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _FRAME_COPY_H_
+#define _FRAME_COPY_H_
+
+/**
+ * Copying of converted frames into the output buffer.
+ *
+ * Decoded clips are written once and never read again by the decoder, so for
+ * outputs larger than the last-level cache the copy uses non-temporal
+ * (streaming) stores, which bypass the cache instead of evicting the
+ * decoder's reference frames from it. Streaming stores are used only if the
+ * CPU supports them (SSE2 on x86), as detected at runtime.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * struct tubelet_layout - Video transformer patch order for a clip's output.
+ * @num_frames: Frames per tubelet (t), or zero for plain (T, H, W, 3) frames.
+ * @size: Height and width of each tubelet's patches (p), in pixels.
+ *
+ * In tubelet order a clip is a (T/t * H/p * W/p, t, p, p, 3) array, i.e.
+ * tubelets in (time, row, column) order, each holding its t*p*p*3 pixels
+ * ready to be flattened into a token.
+ */
+struct tubelet_layout {
+        uint32_t num_frames;
+        uint32_t size;
+};
+
+/**
+ * enum frame_diff_type - Element type of temporal differences of RGB24 frames.
+ * @FRAME_DIFF_NONE: No differences.
+ * @FRAME_DIFF_INT8: int8, saturated to [-128, 127].
+ * @FRAME_DIFF_INT16: int16, exact.
+ * @FRAME_DIFF_FLOAT32: float32, exact (unnormalized, in [-255, 255]).
+ */
+enum frame_diff_type {
+        FRAME_DIFF_NONE = 0,
+        FRAME_DIFF_INT8,
+        FRAME_DIFF_INT16,
+        FRAME_DIFF_FLOAT32,
+};
+
+/**
+ * struct frame_diff_output - Temporal differences x[t + 1] - x[t] of a clip's
+ * frames, emitted as the frames are converted.
+ * @type: Element type, or FRAME_DIFF_NONE for no differences.
+ * @dest: Output of num_frames - 1 (height, width, 3) arrays of @type.
+ */
+struct frame_diff_output {
+        enum frame_diff_type type;
+        uint8_t *dest;
+};
+
+/* Threshold used when the cache size cannot be queried. */
+#define FRAME_COPY_DEFAULT_THRESHOLD_BYTES (8*1024*1024)
+
+/**
+ * frame_copy_should_stream() - Returns true if an output of `out_size_bytes`
+ * should be written with streaming stores.
+ */
+bool frame_copy_should_stream(uint64_t out_size_bytes);
+
+/**
+ * frame_copy_set_stream_threshold() - Sets the output size, in bytes, above
+ * which streaming stores are used.
+ * @threshold_bytes: New threshold, or a negative value to restore the default
+ * (the size of the last-level cache).
+ */
+void frame_copy_set_stream_threshold(int64_t threshold_bytes);
+
+/**
+ * frame_copy_rows() - Copies `num_rows` rows of `bytes_per_row` bytes from
+ * `src`, whose rows are `src_stride` bytes apart, to be contiguous in `dest`.
+ * @use_streaming_stores: If true (and supported), write `dest` with streaming
+ * stores, followed by a store fence.
+ */
+void
+frame_copy_rows(uint8_t *dest,
+                const uint8_t *src,
+                int32_t src_stride,
+                uint32_t bytes_per_row,
+                int32_t num_rows,
+                bool use_streaming_stores);
+
+/**
+ * frame_copy_to_tubelets() - Like `frame_copy_rows` for a whole frame of
+ * `width` by `height` RGB24 pixels, but scatters it straight into its place
+ * in the tubelet-ordered `clip`, as frame `frame_index`. `width` and `height`
+ * must be multiples of `tubelet->size`.
+ */
+void
+frame_copy_to_tubelets(uint8_t *clip,
+                       const uint8_t *src,
+                       int32_t src_stride,
+                       uint32_t frame_index,
+                       uint32_t width,
+                       uint32_t height,
+                       const struct tubelet_layout *tubelet,
+                       bool use_streaming_stores);
+
+/**
+ * frame_copy_tubelet_frame() - Copies frame `src_index` of the tubelet-ordered
+ * `clip` over frame `dest_index`, e.g. for padding, or zeros frame
+ * `dest_index` if `src_index` is negative.
+ */
+void
+frame_copy_tubelet_frame(uint8_t *clip,
+                         int32_t dest_index,
+                         int32_t src_index,
+                         uint32_t width,
+                         uint32_t height,
+                         const struct tubelet_layout *tubelet);
+
+/**
+ * frame_diff_type_size() - Returns the size in bytes of an element of `type`.
+ */
+uint32_t frame_diff_type_size(enum frame_diff_type type);
+
+/**
+ * frame_diff_rows() - Writes `cur` - `prev` for `num_rows` rows of
+ * `bytes_per_row` RGB24 bytes to `dest`, packed as elements of `type`. A NULL
+ * `cur` stands for a black frame.
+ */
+void
+frame_diff_rows(uint8_t *dest,
+                const uint8_t *cur,
+                int32_t cur_stride,
+                const uint8_t *prev,
+                int32_t prev_stride,
+                uint32_t bytes_per_row,
+                int32_t num_rows,
+                enum frame_diff_type type);
+
+#endif // _FRAME_COPY_H_
@@ -0,0 +1,414 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _FRAMES_HPP_
+#define _FRAMES_HPP_
+
+/**
+ * C++20 coroutine interface to the decoder, for e.g. inference servers that
+ * multiplex many streams over a few threads, without callbacks:
+ *
+ *         lintel::reader reader{encoded_video};
+ *         for (const lintel::frame &frame : lintel::frames(reader, spec))
+ *                 consume(frame.rgb, frame.width, frame.height);
+ *
+ *         lintel::clip clip = co_await reader.decode_clip(pool, spec);
+ *
+ * `frames` is a lazy generator: each step of the loop decodes up to the next
+ * sampled frame, on the thread that advances it. `decode_clip` decodes a whole
+ * clip on a `struct thread_pool` worker, and resumes the awaiting coroutine on
+ * that worker once the clip is decoded.
+ *
+ * A reader must only be used by one coroutine at a time.
+ */
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "keyframe_index.h"
+#include "sampling.h"
+#include "thread_pool.h"
+#include "video_decode.h"
+}
+
+namespace lintel {
+
+/* decode_error - A failed decode, with its VID_DECODE_* status. */
+class decode_error : public std::runtime_error {
+public:
+        decode_error(const char *what, int32_t status)
+                : std::runtime_error{std::string{what} +
+                                     " (status " +
+                                     std::to_string(status) +
+                                     ")"},
+                  status{status}
+        {
+        }
+
+        int32_t status;
+};
+
+/**
+ * struct frame - A frame yielded by `frames`.
+ * @number: Display-order frame number.
+ * @width: Width of the frame, in pixels.
+ * @height: Height of the frame, in pixels.
+ * @rgb: The frame as packed RGB24, valid until the generator is advanced.
+ */
+struct frame {
+        int64_t number;
+        int32_t width;
+        int32_t height;
+        std::span<const uint8_t> rgb;
+};
+
+/**
+ * struct clip - A clip decoded by `reader::decode_clip`.
+ * @rgb: The clip as (num_frames, height, width, 3) packed RGB24.
+ * @width: Width of the frames, in pixels.
+ * @height: Height of the frames, in pixels.
+ * @num_frames: Number of frames in `rgb`, including padding.
+ * @num_decoded_frames: Number of frames decoded, not counting padding.
+ */
+struct clip {
+        std::vector<uint8_t> rgb;
+        int32_t width;
+        int32_t height;
+        int32_t num_frames;
+        int32_t num_decoded_frames;
+};
+
+/**
+ * generator - A minimal lazy generator coroutine (std::generator is C++23),
+ * iterated as an input range of `const T &`.
+ */
+template<typename T>
+class generator {
+public:
+        struct promise_type {
+                const T *value = nullptr;
+                std::exception_ptr exception;
+
+                generator get_return_object()
+                {
+                        return generator{handle::from_promise(*this)};
+                }
+
+                std::suspend_always initial_suspend() noexcept { return {}; }
+
+                std::suspend_always final_suspend() noexcept { return {}; }
+
+                std::suspend_always yield_value(const T &yielded) noexcept
+                {
+                        value = &yielded;
+                        return {};
+                }
+
+                void return_void() noexcept {}
+
+                void unhandled_exception()
+                {
+                        exception = std::current_exception();
+                }
+        };
+
+        using handle = std::coroutine_handle<promise_type>;
+
+        class iterator {
+        public:
+                using value_type = T;
+                using difference_type = std::ptrdiff_t;
+
+                explicit iterator(handle coro = nullptr) : coro{coro} {}
+
+                const T &operator*() const { return *coro.promise().value; }
+
+                iterator &operator++()
+                {
+                        advance(coro);
+                        return *this;
+                }
+
+                void operator++(int) { ++*this; }
+
+                bool operator==(std::default_sentinel_t) const
+                {
+                        return !coro || coro.done();
+                }
+
+        private:
+                handle coro;
+        };
+
+        explicit generator(handle coro) : coro{coro} {}
+
+        generator(generator &&other) noexcept
+                : coro{std::exchange(other.coro, nullptr)}
+        {
+        }
+
+        generator(const generator &) = delete;
+        generator &operator=(const generator &) = delete;
+
+        ~generator()
+        {
+                if (coro)
+                        coro.destroy();
+        }
+
+        iterator begin()
+        {
+                advance(coro);
+                return iterator{coro};
+        }
+
+        std::default_sentinel_t end() { return {}; }
+
+private:
+        static void advance(handle coro)
+        {
+                coro.resume();
+                if (coro.promise().exception)
+                        std::rethrow_exception(coro.promise().exception);
+        }
+
+        handle coro;
+};
+
+class clip_awaiter;
+
+/**
+ * reader - An encoded video in memory, opened for decoding. The bytes must
+ * outlive the reader, which is neither copyable nor movable since the demuxer
+ * points into it. Videos of more than INT32_MAX bytes are rejected with
+ * std::length_error, as the demuxer's buffer offsets are 32-bit.
+ */
+class reader {
+public:
+        explicit reader(std::span<const uint8_t> encoded_video,
+                        const decoder_config *decoder = nullptr)
+        {
+                if (encoded_video.size() >
+                    static_cast<size_t>(std::numeric_limits<int32_t>::max()))
+                        throw std::length_error{"encoded video is larger "
+                                                "than INT32_MAX bytes"};
+
+                input_buf.ptr =
+                        reinterpret_cast<const char *>(encoded_video.data());
+                input_buf.total_size_bytes =
+                        static_cast<int32_t>(encoded_video.size());
+
+                int32_t status = setup_vid_stream_context(&vid_ctx,
+                                                          &input_buf,
+                                                          nullptr,
+                                                          nullptr,
+                                                          decoder);
+                if (status != VID_DECODE_SUCCESS)
+                        throw decode_error{"could not open video", status};
+        }
+
+        reader(const reader &) = delete;
+        reader &operator=(const reader &) = delete;
+
+        ~reader() { clean_up_vid_ctx(&vid_ctx, &input_buf, nullptr); }
+
+        int32_t width() const { return vid_ctx.codec_context->width; }
+
+        int32_t height() const { return vid_ctx.codec_context->height; }
+
+        /* Number of frames from the container, or zero if unknown. */
+        int64_t num_frames() const { return vid_ctx.nb_frames; }
+
+        video_stream_context *context() { return &vid_ctx; }
+
+        /**
+         * decode_clip() - Returns an awaitable that decodes the frames of
+         * `spec` (seeking to the keyframe before the first) on `pool`, or on
+         * the awaiting thread if `pool` is NULL or its queue is full.
+         */
+        clip_awaiter decode_clip(thread_pool *pool,
+                                 const frame_sampling_spec &spec,
+                                 vid_pad_mode pad_mode = VID_PAD_ZEROS);
+
+private:
+        buffer_data input_buf{};
+        video_stream_context vid_ctx{};
+};
+
+/**
+ * NOTE(brendan): Coroutine jobs are never waited on as a group, and the
+ * awaiting coroutine (and so its awaiter) can be destroyed as soon as it is
+ * resumed, so the pool counts them in this process-wide group instead.
+ */
+inline thread_pool_group detached_jobs{};
+
+class clip_awaiter {
+public:
+        clip_awaiter(reader &source,
+                     thread_pool *pool,
+                     const frame_sampling_spec &spec,
+                     vid_pad_mode pad_mode)
+                : source{source}, pool{pool}, spec{spec}, pad_mode{pad_mode}
+        {
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> coro)
+        {
+                continuation = coro;
+                if ((pool != nullptr) &&
+                    (thread_pool_submit(pool,
+                                        &detached_jobs,
+                                        run_job,
+                                        this) == 0))
+                        return true;
+
+                decode();
+
+                return false;
+        }
+
+        clip await_resume()
+        {
+                if (exception)
+                        std::rethrow_exception(exception);
+
+                return std::move(result);
+        }
+
+private:
+        static void run_job(void *opaque)
+        {
+                clip_awaiter *awaiter = static_cast<clip_awaiter *>(opaque);
+
+                awaiter->decode();
+                /* NOTE(brendan): `awaiter` may be destroyed by the resume. */
+                awaiter->continuation.resume();
+        }
+
+        void decode() noexcept
+        {
+                try {
+                        video_stream_context *vid_ctx = source.context();
+                        std::vector<int32_t> frame_nums(
+                                frame_sampling_num_frames(&spec,
+                                                          vid_ctx->nb_frames));
+                        frame_sampling_resolve(frame_nums.data(),
+                                               &spec,
+                                               vid_ctx->nb_frames);
+
+                        result.width = source.width();
+                        result.height = source.height();
+                        result.num_frames =
+                                static_cast<int32_t>(frame_nums.size());
+                        result.rgb.resize(size_t{3}*result.width*
+                                          result.height*result.num_frames);
+                        result.num_decoded_frames =
+                                decode_video_from_frame_nums(
+                                        result.rgb.data(),
+                                        vid_ctx,
+                                        result.num_frames,
+                                        frame_nums.data(),
+                                        true,
+                                        false,
+                                        pad_mode);
+                } catch (...) {
+                        exception = std::current_exception();
+                }
+        }
+
+        reader &source;
+        thread_pool *pool;
+        frame_sampling_spec spec;
+        vid_pad_mode pad_mode;
+        std::coroutine_handle<> continuation;
+        clip result{};
+        std::exception_ptr exception;
+};
+
+inline clip_awaiter
+reader::decode_clip(thread_pool *pool,
+                    const frame_sampling_spec &spec,
+                    vid_pad_mode pad_mode)
+{
+        if (!frame_sampling_is_valid(&spec))
+                throw std::invalid_argument{"invalid frame sampling spec"};
+
+        return clip_awaiter{*this, pool, spec, pad_mode};
+}
+
+/**
+ * frames() - Lazily decodes the frames of `spec` from the start of `source`,
+ * in order, yielding each as RGB24. The generator ends early if the video
+ * does, without padding.
+ *
+ * Specs other than ranges need the frame count from the container (see
+ * `reader::num_frames`). `source` must outlive the generator, and be freshly
+ * opened.
+ */
+inline generator<frame>
+frames(reader &source, frame_sampling_spec spec)
+{
+        if (!frame_sampling_is_valid(&spec))
+                throw std::invalid_argument{"invalid frame sampling spec"};
+
+        video_stream_context *vid_ctx = source.context();
+        std::vector<int32_t> frame_nums(
+                frame_sampling_num_frames(&spec, vid_ctx->nb_frames));
+        frame_sampling_resolve(frame_nums.data(), &spec, vid_ctx->nb_frames);
+
+        const int32_t width = source.width();
+        const int32_t height = source.height();
+        std::vector<uint8_t> rgb(size_t{3}*width*height);
+        int64_t next_frame_number = 0;
+        for (int32_t wanted : frame_nums) {
+                int64_t frame_number;
+                do {
+                        int32_t status = decode_next_frame(vid_ctx,
+                                                           &frame_number);
+                        if (status == VID_DECODE_EOF)
+                                co_return;
+                        if (status != VID_DECODE_SUCCESS)
+                                throw decode_error{"could not decode frame",
+                                                   status};
+
+                        /* NOTE(brendan): Count frames without timestamps. */
+                        if (frame_number == KEYFRAME_INDEX_UNKNOWN)
+                                frame_number = next_frame_number;
+                        next_frame_number = frame_number + 1;
+                } while (frame_number < wanted);
+
+                int32_t status = copy_frame_to_rgb(rgb.data(), vid_ctx);
+                if (status != VID_DECODE_SUCCESS)
+                        throw decode_error{"could not convert frame", status};
+
+                co_yield frame{frame_number, width, height, rgb};
+        }
+}
+
+} // namespace lintel
+
+#endif // _FRAMES_HPP_
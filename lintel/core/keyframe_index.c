@@ -0,0 +1,542 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "keyframe_index.h"
+#include "mem_stats.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEYFRAME_INDEX_MAGIC "LNTLKFI1"
+
+/**
+ * struct keyframe_index - Keyframes of one video, sorted by PTS.
+ * @key: Video key.
+ * @entries: Keyframes, sorted by strictly increasing PTS.
+ * @num_entries: Number of keyframes in `entries`.
+ * @capacity: Allocated length of `entries`.
+ * @num_users: Number of holders from `keyframe_index_get`.
+ * @newer: Next more recently used index, or NULL.
+ * @older: Next less recently used index, or NULL.
+ */
+struct keyframe_index {
+        uint64_t key;
+        struct keyframe_entry *entries;
+        uint64_t num_entries;
+        uint64_t capacity;
+        uint32_t num_users;
+        struct keyframe_index *newer;
+        struct keyframe_index *older;
+};
+
+/**
+ * NOTE(brendan): Keyframes are recorded only once per GOP, so a single lock
+ * over all indices is not contended.
+ */
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct keyframe_index **index_table;
+static uint64_t index_table_size;
+static uint64_t num_indices;
+static uint32_t index_capacity = KEYFRAME_INDEX_DEFAULT_CAPACITY;
+/* NOTE(brendan): Indices in least recently used order, from oldest. */
+static struct keyframe_index *oldest_index;
+static struct keyframe_index *newest_index;
+
+static uint64_t
+hash_key(uint64_t key)
+{
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+
+        return key;
+}
+
+/**
+ * find_slot() - Returns the hash table slot for `key`, which is either empty
+ * or holds the index for `key`. Must be called with `index_lock` held, and
+ * with a non-empty table.
+ */
+static struct keyframe_index **
+find_slot(struct keyframe_index **table, uint64_t table_size, uint64_t key)
+{
+        uint64_t slot = hash_key(key) & (table_size - 1);
+        while ((table[slot] != NULL) && (table[slot]->key != key))
+                slot = (slot + 1) & (table_size - 1);
+
+        return table + slot;
+}
+
+static bool
+grow_table(void)
+{
+        uint64_t new_size = (index_table_size == 0) ? 1024 : 2*index_table_size;
+        struct keyframe_index **new_table = calloc(new_size,
+                                                   sizeof(*new_table));
+        if (new_table == NULL)
+                return false;
+
+        for (uint64_t i = 0;
+             i < index_table_size;
+             ++i) {
+                if (index_table[i] == NULL)
+                        continue;
+
+                *find_slot(new_table, new_size, index_table[i]->key) =
+                        index_table[i];
+        }
+
+        free(index_table);
+        mem_stats_add(MEM_STATS_CACHES,
+                      (new_size - index_table_size)*sizeof(*new_table));
+        index_table = new_table;
+        index_table_size = new_size;
+
+        return true;
+}
+
+/* Must be called with `index_lock` held. */
+static void
+unlink_lru(struct keyframe_index *index)
+{
+        if (index->newer != NULL)
+                index->newer->older = index->older;
+        else
+                newest_index = index->older;
+        if (index->older != NULL)
+                index->older->newer = index->newer;
+        else
+                oldest_index = index->newer;
+
+        index->newer = NULL;
+        index->older = NULL;
+}
+
+/* Must be called with `index_lock` held. */
+static void
+mark_newest(struct keyframe_index *index)
+{
+        if (index == newest_index)
+                return;
+
+        if ((index->newer != NULL) || (index->older != NULL) ||
+            (index == oldest_index))
+                unlink_lru(index);
+
+        index->older = newest_index;
+        if (newest_index != NULL)
+                newest_index->newer = index;
+        newest_index = index;
+        if (oldest_index == NULL)
+                oldest_index = index;
+}
+
+/**
+ * remove_slot() - Empties hash table slot `slot`, moving later entries of its
+ * probe sequence back so that they stay reachable. Must be called with
+ * `index_lock` held.
+ */
+static void
+remove_slot(uint64_t slot)
+{
+        uint64_t mask = index_table_size - 1;
+        uint64_t hole = slot;
+        for (uint64_t next = (hole + 1) & mask;
+             index_table[next] != NULL;
+             next = (next + 1) & mask) {
+                uint64_t home = hash_key(index_table[next]->key) & mask;
+                if (((next - home) & mask) >= ((next - hole) & mask)) {
+                        index_table[hole] = index_table[next];
+                        hole = next;
+                }
+        }
+        index_table[hole] = NULL;
+}
+
+/**
+ * evict_excess() - Frees the least recently used indices that are not held,
+ * until at most `index_capacity` remain. Must be called with `index_lock`
+ * held.
+ */
+static void
+evict_excess(void)
+{
+        struct keyframe_index *index = oldest_index;
+        while ((num_indices > index_capacity) && (index != NULL)) {
+                struct keyframe_index *newer = index->newer;
+                if (index->num_users > 0) {
+                        index = newer;
+                        continue;
+                }
+
+                unlink_lru(index);
+                remove_slot(find_slot(index_table,
+                                      index_table_size,
+                                      index->key) - index_table);
+                --num_indices;
+                mem_stats_sub(MEM_STATS_CACHES,
+                              sizeof(*index) +
+                              index->capacity*sizeof(*index->entries));
+                free(index->entries);
+                free(index);
+
+                index = newer;
+        }
+}
+
+/**
+ * get_index_locked() - Gets the index for `key`, creating it if needed, and
+ * marks it most recently used. Must be called with `index_lock` held.
+ */
+static struct keyframe_index *
+get_index_locked(uint64_t key)
+{
+        if (index_capacity == 0)
+                return NULL;
+
+        if ((2*(num_indices + 1) > index_table_size) && !grow_table())
+                return NULL;
+
+        struct keyframe_index **slot = find_slot(index_table,
+                                                 index_table_size,
+                                                 key);
+        if (*slot == NULL) {
+                *slot = calloc(1, sizeof(**slot));
+                if (*slot == NULL)
+                        return NULL;
+
+                (*slot)->key = key;
+                ++num_indices;
+                mem_stats_add(MEM_STATS_CACHES, sizeof(**slot));
+        }
+        mark_newest(*slot);
+
+        return *slot;
+}
+
+struct keyframe_index *keyframe_index_get(uint64_t key)
+{
+        pthread_mutex_lock(&index_lock);
+        struct keyframe_index *index = get_index_locked(key);
+        if (index != NULL) {
+                ++index->num_users;
+                evict_excess();
+        }
+        pthread_mutex_unlock(&index_lock);
+
+        return index;
+}
+
+void keyframe_index_put(struct keyframe_index **index)
+{
+        if (*index == NULL)
+                return;
+
+        pthread_mutex_lock(&index_lock);
+        --(*index)->num_users;
+        evict_excess();
+        pthread_mutex_unlock(&index_lock);
+
+        *index = NULL;
+}
+
+void keyframe_index_set_capacity(uint32_t capacity)
+{
+        pthread_mutex_lock(&index_lock);
+        index_capacity = capacity;
+        evict_excess();
+        pthread_mutex_unlock(&index_lock);
+}
+
+/**
+ * lower_bound() - Returns the position of the first entry with PTS >= `pts`.
+ * Must be called with `index_lock` held.
+ */
+static uint64_t
+lower_bound(const struct keyframe_index *index, int64_t pts)
+{
+        uint64_t lo = 0;
+        uint64_t hi = index->num_entries;
+        while (lo < hi) {
+                uint64_t mid = lo + (hi - lo)/2;
+                if (index->entries[mid].pts < pts)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+/**
+ * insert_entry() - Returns the entry with PTS `pts`, inserting an empty one if
+ * needed. Must be called with `index_lock` held.
+ */
+static struct keyframe_entry *
+insert_entry(struct keyframe_index *index, int64_t pts)
+{
+        uint64_t pos = lower_bound(index, pts);
+        if ((pos < index->num_entries) && (index->entries[pos].pts == pts))
+                return index->entries + pos;
+
+        if (index->num_entries == index->capacity) {
+                uint64_t new_capacity =
+                        (index->capacity == 0) ? 16 : 2*index->capacity;
+                struct keyframe_entry *new_entries =
+                        realloc(index->entries,
+                                new_capacity*sizeof(*new_entries));
+                if (new_entries == NULL)
+                        return NULL;
+
+                mem_stats_add(MEM_STATS_CACHES,
+                              (new_capacity - index->capacity)*
+                              sizeof(*new_entries));
+                index->entries = new_entries;
+                index->capacity = new_capacity;
+        }
+
+        memmove(index->entries + pos + 1,
+                index->entries + pos,
+                (index->num_entries - pos)*sizeof(*index->entries));
+        ++index->num_entries;
+
+        struct keyframe_entry *entry = index->entries + pos;
+        entry->pts = pts;
+        entry->next_pts = KEYFRAME_INDEX_UNKNOWN;
+        entry->frame_number = KEYFRAME_INDEX_UNKNOWN;
+
+        return entry;
+}
+
+/* Must be called with `index_lock` held. */
+static void
+merge_entry(struct keyframe_index *index, const struct keyframe_entry *src)
+{
+        struct keyframe_entry *entry = insert_entry(index, src->pts);
+        if (entry == NULL)
+                return;
+
+        if (src->next_pts != KEYFRAME_INDEX_UNKNOWN)
+                entry->next_pts = src->next_pts;
+        if (src->frame_number != KEYFRAME_INDEX_UNKNOWN)
+                entry->frame_number = src->frame_number;
+}
+
+void
+keyframe_index_record(struct keyframe_index *index,
+                      int64_t pts,
+                      int64_t prev_pts,
+                      int64_t frame_number)
+{
+        struct keyframe_entry entry = {.pts = pts,
+                                       .next_pts = KEYFRAME_INDEX_UNKNOWN,
+                                       .frame_number = frame_number};
+
+        pthread_mutex_lock(&index_lock);
+        merge_entry(index, &entry);
+        if ((prev_pts != KEYFRAME_INDEX_UNKNOWN) && (prev_pts < pts)) {
+                struct keyframe_entry *prev = insert_entry(index, prev_pts);
+                if (prev != NULL)
+                        prev->next_pts = pts;
+        }
+        pthread_mutex_unlock(&index_lock);
+}
+
+void keyframe_index_record_last(struct keyframe_index *index, int64_t pts)
+{
+        struct keyframe_entry entry = {.pts = pts,
+                                       .next_pts = KEYFRAME_INDEX_LAST_GOP,
+                                       .frame_number = KEYFRAME_INDEX_UNKNOWN};
+
+        pthread_mutex_lock(&index_lock);
+        merge_entry(index, &entry);
+        pthread_mutex_unlock(&index_lock);
+}
+
+bool
+keyframe_index_find_pts(struct keyframe_index *index,
+                        int64_t pts,
+                        struct keyframe_entry *entry)
+{
+        bool is_found = false;
+
+        pthread_mutex_lock(&index_lock);
+        uint64_t pos = lower_bound(index, pts);
+        if ((pos < index->num_entries) && (index->entries[pos].pts == pts)) {
+                *entry = index->entries[pos];
+                is_found = true;
+        }
+        pthread_mutex_unlock(&index_lock);
+
+        return is_found;
+}
+
+bool
+keyframe_index_find_closest(struct keyframe_index *index,
+                            int64_t timestamp,
+                            struct keyframe_entry *entry)
+{
+        bool is_found = false;
+
+        pthread_mutex_lock(&index_lock);
+        uint64_t pos = lower_bound(index, timestamp);
+        if ((pos < index->num_entries) &&
+            (index->entries[pos].pts == timestamp))
+                ++pos;
+
+        if (pos > 0) {
+                const struct keyframe_entry *closest = index->entries + pos - 1;
+                if ((closest->next_pts != KEYFRAME_INDEX_UNKNOWN) &&
+                    (closest->next_pts > timestamp)) {
+                        *entry = *closest;
+                        is_found = true;
+                }
+        }
+        pthread_mutex_unlock(&index_lock);
+
+        return is_found;
+}
+
+bool
+keyframe_index_find_frame(struct keyframe_index *index,
+                          int64_t frame_number,
+                          struct keyframe_entry *entry)
+{
+        bool is_found = false;
+
+        pthread_mutex_lock(&index_lock);
+        for (uint64_t pos = index->num_entries;
+             pos > 0;
+             --pos) {
+                const struct keyframe_entry *closest = index->entries + pos - 1;
+                if ((closest->frame_number == KEYFRAME_INDEX_UNKNOWN) ||
+                    (closest->frame_number > frame_number))
+                        continue;
+
+                if (closest->next_pts == KEYFRAME_INDEX_LAST_GOP) {
+                        is_found = true;
+                } else if ((pos < index->num_entries) &&
+                           (closest->next_pts == index->entries[pos].pts)) {
+                        int64_t next_frame_number =
+                                index->entries[pos].frame_number;
+                        is_found = (next_frame_number > frame_number);
+                }
+
+                if (is_found)
+                        *entry = *closest;
+                break;
+        }
+        pthread_mutex_unlock(&index_lock);
+
+        return is_found;
+}
+
+int32_t keyframe_index_save(const char *path)
+{
+        FILE *file = fopen(path, "wb");
+        if (file == NULL)
+                return -1;
+
+        bool is_ok = true;
+
+        pthread_mutex_lock(&index_lock);
+        is_ok &= (fwrite(KEYFRAME_INDEX_MAGIC, 8, 1, file) == 1);
+        is_ok &= (fwrite(&num_indices, sizeof(num_indices), 1, file) == 1);
+        for (uint64_t i = 0;
+             is_ok && (i < index_table_size);
+             ++i) {
+                const struct keyframe_index *index = index_table[i];
+                if (index == NULL)
+                        continue;
+
+                is_ok &= (fwrite(&index->key,
+                                 sizeof(index->key),
+                                 1,
+                                 file) == 1);
+                is_ok &= (fwrite(&index->num_entries,
+                                 sizeof(index->num_entries),
+                                 1,
+                                 file) == 1);
+                is_ok &= (fwrite(index->entries,
+                                 sizeof(*index->entries),
+                                 index->num_entries,
+                                 file) == index->num_entries);
+        }
+        pthread_mutex_unlock(&index_lock);
+
+        is_ok &= (fclose(file) == 0);
+
+        return is_ok ? 0 : -1;
+}
+
+int32_t keyframe_index_load(const char *path)
+{
+        char magic[8];
+        uint64_t num_saved;
+
+        FILE *file = fopen(path, "rb");
+        if (file == NULL)
+                return -1;
+
+        int32_t status = -1;
+        if ((fread(magic, sizeof(magic), 1, file) != 1) ||
+            (memcmp(magic, KEYFRAME_INDEX_MAGIC, sizeof(magic)) != 0) ||
+            (fread(&num_saved, sizeof(num_saved), 1, file) != 1))
+                goto out_close_file;
+
+        for (uint64_t i = 0;
+             i < num_saved;
+             ++i) {
+                uint64_t key;
+                uint64_t num_entries;
+                if ((fread(&key, sizeof(key), 1, file) != 1) ||
+                    (fread(&num_entries, sizeof(num_entries), 1, file) != 1))
+                        goto out_close_file;
+
+                pthread_mutex_lock(&index_lock);
+                struct keyframe_index *index = get_index_locked(key);
+                if ((index == NULL) && (index_capacity == 0)) {
+                        pthread_mutex_unlock(&index_lock);
+                        if (fseek(file,
+                                  num_entries*sizeof(struct keyframe_entry),
+                                  SEEK_CUR) != 0)
+                                goto out_close_file;
+                        continue;
+                }
+
+                for (uint64_t j = 0;
+                     j < num_entries;
+                     ++j) {
+                        struct keyframe_entry entry;
+                        if ((index == NULL) ||
+                            (fread(&entry, sizeof(entry), 1, file) != 1)) {
+                                pthread_mutex_unlock(&index_lock);
+                                goto out_close_file;
+                        }
+
+                        merge_entry(index, &entry);
+                }
+                evict_excess();
+                pthread_mutex_unlock(&index_lock);
+        }
+
+        status = 0;
+
+out_close_file:
+        fclose(file);
+
+        return status;
+}
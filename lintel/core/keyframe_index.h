@@ -0,0 +1,152 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _KEYFRAME_INDEX_H_
+#define _KEYFRAME_INDEX_H_
+
+/**
+ * A process-wide, per-video index of keyframes that is filled in as a side
+ * effect of normal decoding, rather than by a separate indexing pass.
+ *
+ * Every keyframe packet demuxed is recorded by its PTS. Keyframes that are
+ * decoded while the decoder knows its display-order frame number (i.e., it has
+ * decoded from the start of the video, or from a keyframe whose number is
+ * already known) also record that frame number.
+ *
+ * At most a set number of videos are indexed, evicting the least recently
+ * used indices that no decode is using.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KEYFRAME_INDEX_UNKNOWN INT64_MIN
+#define KEYFRAME_INDEX_LAST_GOP INT64_MAX
+#define KEYFRAME_INDEX_DEFAULT_CAPACITY 16384
+
+/**
+ * struct keyframe_entry - A single keyframe in a video stream.
+ * @pts: Presentation timestamp of the keyframe, in the stream timebase.
+ * @next_pts: PTS of the next keyframe in the stream, if the packets between
+ * the two keyframes have been demuxed contiguously, so that no keyframe can
+ * lie between them. KEYFRAME_INDEX_LAST_GOP if this is known to be the last
+ * keyframe, and KEYFRAME_INDEX_UNKNOWN otherwise.
+ * @frame_number: Display-order frame number of the keyframe, or
+ * KEYFRAME_INDEX_UNKNOWN.
+ */
+struct keyframe_entry {
+        int64_t pts;
+        int64_t next_pts;
+        int64_t frame_number;
+};
+
+struct keyframe_index;
+
+/**
+ * keyframe_index_get() - Gets the keyframe index for the video identified by
+ * `key`, creating an empty index if there is none, and marks it most recently
+ * used. Must be paired with `keyframe_index_put`.
+ *
+ * The index is not evicted while it is held.
+ *
+ * Returns NULL if allocation failed, or if the capacity is zero.
+ */
+struct keyframe_index *keyframe_index_get(uint64_t key);
+
+/**
+ * keyframe_index_put() - Releases an index held through `keyframe_index_get`,
+ * and resets `*index` to NULL. Does nothing if `*index` is NULL.
+ */
+void keyframe_index_put(struct keyframe_index **index);
+
+/**
+ * keyframe_index_set_capacity() - Sets the maximum number of indexed videos,
+ * evicting the least recently used indices that no longer fit. A capacity of
+ * zero disables (and empties) the keyframe index.
+ */
+void keyframe_index_set_capacity(uint32_t capacity);
+
+/**
+ * keyframe_index_record() - Records a keyframe.
+ * @index: Index to record into.
+ * @pts: PTS of the keyframe.
+ * @prev_pts: PTS of the previous keyframe, if it was demuxed contiguously
+ * before this one, else KEYFRAME_INDEX_UNKNOWN.
+ * @frame_number: Display-order frame number of the keyframe, or
+ * KEYFRAME_INDEX_UNKNOWN.
+ */
+void
+keyframe_index_record(struct keyframe_index *index,
+                      int64_t pts,
+                      int64_t prev_pts,
+                      int64_t frame_number);
+
+/**
+ * keyframe_index_record_last() - Records that the keyframe at `pts` starts the
+ * last GOP in the video stream.
+ */
+void keyframe_index_record_last(struct keyframe_index *index, int64_t pts);
+
+/**
+ * keyframe_index_find_pts() - Finds the keyframe at exactly `pts`.
+ *
+ * Returns true if `pts` is a known keyframe, in which case `entry` is filled.
+ */
+bool
+keyframe_index_find_pts(struct keyframe_index *index,
+                        int64_t pts,
+                        struct keyframe_entry *entry);
+
+/**
+ * keyframe_index_find_closest() - Finds the closest keyframe at or before
+ * `timestamp`.
+ *
+ * Returns true only if the closest keyframe is known exactly, i.e. the GOP
+ * starting at the returned keyframe is known to contain `timestamp`.
+ */
+bool
+keyframe_index_find_closest(struct keyframe_index *index,
+                            int64_t timestamp,
+                            struct keyframe_entry *entry);
+
+/**
+ * keyframe_index_find_frame() - Finds the closest keyframe at or before
+ * display-order frame `frame_number`.
+ *
+ * Returns true only if the keyframe's frame number is known, and the next
+ * keyframe is known to come after `frame_number`.
+ */
+bool
+keyframe_index_find_frame(struct keyframe_index *index,
+                          int64_t frame_number,
+                          struct keyframe_entry *entry);
+
+/**
+ * keyframe_index_save() - Writes every keyframe index in the process to the
+ * file at `path`, in native byte order.
+ *
+ * Returns 0 on success, a negative value on failure.
+ */
+int32_t keyframe_index_save(const char *path);
+
+/**
+ * keyframe_index_load() - Merges the keyframe indices saved at `path` into the
+ * process-wide indices, up to the capacity.
+ *
+ * Returns 0 on success, a negative value on failure.
+ */
+int32_t keyframe_index_load(const char *path);
+
+#endif // _KEYFRAME_INDEX_H_
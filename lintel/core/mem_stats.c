@@ -0,0 +1,111 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "mem_stats.h"
+#include <stdbool.h>
+
+/**
+ * struct mem_counter - Accounted bytes of one subsystem.
+ * @current_bytes: Bytes held now.
+ * @peak_bytes: Most bytes held since peaks were last reset.
+ */
+struct mem_counter {
+        int64_t current_bytes;
+        int64_t peak_bytes;
+};
+
+static struct mem_counter counters[MEM_STATS_NUM_SUBSYSTEMS];
+
+static const char *const subsystem_names[MEM_STATS_NUM_SUBSYSTEMS] = {
+        [MEM_STATS_AVIO] = "avio",
+        [MEM_STATS_PROBE] = "probe",
+        [MEM_STATS_FRAME_RGB] = "frame_rgb",
+        [MEM_STATS_DECODER] = "decoder",
+        [MEM_STATS_OUTPUT] = "output",
+        [MEM_STATS_CACHES] = "caches",
+        [MEM_STATS_TOTAL] = "total",
+};
+
+/**
+ * raise_peak() - Raises the peak of `counter` to `current_bytes`, unless
+ * another thread has already raised it past that.
+ */
+static void
+raise_peak(struct mem_counter *counter, int64_t current_bytes)
+{
+        int64_t peak_bytes = __atomic_load_n(&counter->peak_bytes,
+                                             __ATOMIC_RELAXED);
+        while ((current_bytes > peak_bytes) &&
+               !__atomic_compare_exchange_n(&counter->peak_bytes,
+                                            &peak_bytes,
+                                            current_bytes,
+                                            true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                ;
+}
+
+static void
+update_counter(enum mem_stats_subsystem subsystem, int64_t delta_bytes)
+{
+        struct mem_counter *counter = counters + subsystem;
+        struct mem_counter *total = counters + MEM_STATS_TOTAL;
+
+        raise_peak(counter,
+                   __atomic_add_fetch(&counter->current_bytes,
+                                      delta_bytes,
+                                      __ATOMIC_RELAXED));
+        raise_peak(total,
+                   __atomic_add_fetch(&total->current_bytes,
+                                      delta_bytes,
+                                      __ATOMIC_RELAXED));
+}
+
+void mem_stats_add(enum mem_stats_subsystem subsystem, int64_t num_bytes)
+{
+        update_counter(subsystem, num_bytes);
+}
+
+void mem_stats_sub(enum mem_stats_subsystem subsystem, int64_t num_bytes)
+{
+        update_counter(subsystem, -num_bytes);
+}
+
+void
+mem_stats_get(enum mem_stats_subsystem subsystem,
+              int64_t *current_bytes,
+              int64_t *peak_bytes)
+{
+        *current_bytes = __atomic_load_n(&counters[subsystem].current_bytes,
+                                         __ATOMIC_RELAXED);
+        *peak_bytes = __atomic_load_n(&counters[subsystem].peak_bytes,
+                                      __ATOMIC_RELAXED);
+}
+
+void mem_stats_reset_peaks(void)
+{
+        for (uint32_t i = 0;
+             i < MEM_STATS_NUM_SUBSYSTEMS;
+             ++i)
+                __atomic_store_n(&counters[i].peak_bytes,
+                                 __atomic_load_n(&counters[i].current_bytes,
+                                                 __ATOMIC_RELAXED),
+                                 __ATOMIC_RELAXED);
+}
+
+const char *mem_stats_name(enum mem_stats_subsystem subsystem)
+{
+        return subsystem_names[subsystem];
+}
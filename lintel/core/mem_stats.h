@@ -0,0 +1,78 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _MEM_STATS_H_
+#define _MEM_STATS_H_
+
+/**
+ * Process-wide accounting of the bytes held by each stage of decoding, with
+ * their peaks, so that e.g. an out-of-memory kill on a rare huge video can be
+ * traced to the stage that grew.
+ *
+ * Counters are updated with atomics, and cost nothing else.
+ */
+
+#include <stdint.h>
+
+/**
+ * enum mem_stats_subsystem - Where accounted bytes are held.
+ * @MEM_STATS_AVIO: AV I/O read buffers of open demuxers, including demuxers
+ * kept in the format cache.
+ * @MEM_STATS_PROBE: Buffers for probing the input format.
+ * @MEM_STATS_FRAME_RGB: Temporary RGB24 conversion frames.
+ * @MEM_STATS_DECODER: Decoded frames held by open decoders. This is an
+ * estimate, of one frame per codec thread plus reordering delay, since FFmpeg
+ * has no allocation hooks to count them.
+ * @MEM_STATS_OUTPUT: Output buffers being decoded into.
+ * @MEM_STATS_CACHES: Keyframe index tables and entries, and (estimated) idle
+ * decoders cached for reuse.
+ * @MEM_STATS_TOTAL: Sum over the subsystems, with its own peak. Read only.
+ */
+enum mem_stats_subsystem {
+        MEM_STATS_AVIO,
+        MEM_STATS_PROBE,
+        MEM_STATS_FRAME_RGB,
+        MEM_STATS_DECODER,
+        MEM_STATS_OUTPUT,
+        MEM_STATS_CACHES,
+        MEM_STATS_TOTAL,
+        MEM_STATS_NUM_SUBSYSTEMS,
+};
+
+/* mem_stats_add() - Accounts `num_bytes` more held by `subsystem`. */
+void mem_stats_add(enum mem_stats_subsystem subsystem, int64_t num_bytes);
+
+/* mem_stats_sub() - Accounts `num_bytes` released by `subsystem`. */
+void mem_stats_sub(enum mem_stats_subsystem subsystem, int64_t num_bytes);
+
+/**
+ * mem_stats_get() - Reads the bytes currently held by `subsystem`, and the
+ * most it has held since the last `mem_stats_reset_peaks`.
+ */
+void
+mem_stats_get(enum mem_stats_subsystem subsystem,
+              int64_t *current_bytes,
+              int64_t *peak_bytes);
+
+/**
+ * mem_stats_reset_peaks() - Resets every peak to its current value, e.g. to
+ * measure the peaks of a single call.
+ */
+void mem_stats_reset_peaks(void);
+
+/* mem_stats_name() - Returns the lower-case name of `subsystem`. */
+const char *mem_stats_name(enum mem_stats_subsystem subsystem);
+
+#endif // _MEM_STATS_H_
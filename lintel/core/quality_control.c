@@ -0,0 +1,95 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "quality_control.h"
+#include <stdbool.h>
+
+void quality_control_init(struct quality_control *qc)
+{
+        pthread_mutex_init(&qc->lock, NULL);
+        qc->target_latency_s = 0.0;
+        qc->max_level = VID_QUALITY_NUM_LEVELS - 1;
+        qc->level = VID_QUALITY_EXACT;
+        qc->latency_ewma_s = 0.0;
+        qc->cooldown = 0;
+}
+
+void quality_control_destroy(struct quality_control *qc)
+{
+        pthread_mutex_destroy(&qc->lock);
+}
+
+void
+quality_control_configure(struct quality_control *qc,
+                          double target_latency_s,
+                          enum vid_quality_level max_level)
+{
+        pthread_mutex_lock(&qc->lock);
+        qc->target_latency_s = target_latency_s;
+        qc->max_level = max_level;
+        qc->level = VID_QUALITY_EXACT;
+        qc->latency_ewma_s = 0.0;
+        qc->cooldown = 0;
+        pthread_mutex_unlock(&qc->lock);
+}
+
+enum vid_quality_level quality_control_level(struct quality_control *qc)
+{
+        pthread_mutex_lock(&qc->lock);
+        enum vid_quality_level level = qc->level;
+        pthread_mutex_unlock(&qc->lock);
+
+        return level;
+}
+
+void
+quality_control_update(struct quality_control *qc,
+                       double latency_s,
+                       uint32_t queue_depth,
+                       uint32_t num_threads)
+{
+        pthread_mutex_lock(&qc->lock);
+        if (qc->target_latency_s <= 0.0)
+                goto out_unlock;
+
+        if (qc->latency_ewma_s == 0.0)
+                qc->latency_ewma_s = latency_s;
+        else
+                qc->latency_ewma_s +=
+                        QUALITY_CONTROL_EWMA_WEIGHT*(latency_s -
+                                                     qc->latency_ewma_s);
+
+        if (qc->cooldown > 0) {
+                --qc->cooldown;
+                goto out_unlock;
+        }
+
+        const bool is_behind = (qc->latency_ewma_s > qc->target_latency_s) ||
+                               (queue_depth > num_threads);
+        const bool is_caught_up =
+                (qc->latency_ewma_s <
+                 QUALITY_CONTROL_RECOVER_RATIO*qc->target_latency_s) &&
+                (queue_depth == 0);
+        if (is_behind && (qc->level < qc->max_level)) {
+                ++qc->level;
+                qc->cooldown = QUALITY_CONTROL_COOLDOWN;
+        } else if (is_caught_up && (qc->level > VID_QUALITY_EXACT)) {
+                --qc->level;
+                qc->cooldown = QUALITY_CONTROL_COOLDOWN;
+        }
+
+out_unlock:
+        pthread_mutex_unlock(&qc->lock);
+}
@@ -0,0 +1,113 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _QUALITY_CONTROL_H_
+#define _QUALITY_CONTROL_H_
+
+/**
+ * Adaptive degradation of decode quality under load.
+ *
+ * When decodes fall behind a target latency, or jobs back up in the thread
+ * pool's queue, the quality level is stepped down one level at a time, making
+ * samples cheaper rather than stalling the consumer. Once decodes catch up,
+ * the level is stepped back up.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * enum vid_quality_level - Quality levels, from best to cheapest. Each level
+ * includes the degradations of the levels before it.
+ * @VID_QUALITY_EXACT: Exact decoding.
+ * @VID_QUALITY_FAST_DECODE: Approximate decoding (see `struct decoder_config`).
+ * @VID_QUALITY_KEYFRAME_SEEK: Clips start at the keyframe that random seeks
+ * land on, rather than decoding (and discarding) frames up to the seek point.
+ * @VID_QUALITY_FAST_SCALE: Nearest-neighbour chroma upsampling, rather than
+ * bilinear, when converting frames to RGB.
+ * @VID_QUALITY_NUM_LEVELS: Number of levels.
+ */
+enum vid_quality_level {
+        VID_QUALITY_EXACT,
+        VID_QUALITY_FAST_DECODE,
+        VID_QUALITY_KEYFRAME_SEEK,
+        VID_QUALITY_FAST_SCALE,
+        VID_QUALITY_NUM_LEVELS,
+};
+
+/* Weight of the newest latency in the moving average. */
+#define QUALITY_CONTROL_EWMA_WEIGHT 0.25
+/* Fraction of the target latency below which the level is stepped back up. */
+#define QUALITY_CONTROL_RECOVER_RATIO 0.7
+/* Updates to wait after a level change, before changing level again. */
+#define QUALITY_CONTROL_COOLDOWN 4
+
+/**
+ * struct quality_control - State of the quality controller.
+ * @lock: Protects the other members.
+ * @target_latency_s: Target latency of a decode, or zero if the controller is
+ * disabled (and decodes are exact).
+ * @max_level: Cheapest level that may be stepped down to.
+ * @level: Current level.
+ * @latency_ewma_s: Moving average of decode latencies.
+ * @cooldown: Updates left before the level may change again.
+ */
+struct quality_control {
+        pthread_mutex_t lock;
+        double target_latency_s;
+        enum vid_quality_level max_level;
+        enum vid_quality_level level;
+        double latency_ewma_s;
+        uint32_t cooldown;
+};
+
+void quality_control_init(struct quality_control *qc);
+
+void quality_control_destroy(struct quality_control *qc);
+
+/**
+ * quality_control_configure() - Sets the target latency and cheapest level,
+ * and resets the controller to exact decoding.
+ * @target_latency_s: Target latency, in seconds, or zero to disable.
+ * @max_level: Cheapest level to step down to, at most
+ * VID_QUALITY_NUM_LEVELS - 1.
+ */
+void
+quality_control_configure(struct quality_control *qc,
+                          double target_latency_s,
+                          enum vid_quality_level max_level);
+
+/* quality_control_level() - Returns the level to decode at. */
+enum vid_quality_level quality_control_level(struct quality_control *qc);
+
+/**
+ * quality_control_update() - Feeds one decode's measurements to the
+ * controller.
+ * @latency_s: Time from submitting the decode to its completion.
+ * @queue_depth: Jobs queued on the thread pool, not yet started, when the
+ * decode was submitted.
+ * @num_threads: Worker threads of the thread pool.
+ *
+ * The level steps down if the average latency is above target, or if more
+ * jobs are queued than there are workers to run them, and steps up if the
+ * average latency is comfortably below target with nothing queued.
+ */
+void
+quality_control_update(struct quality_control *qc,
+                       double latency_s,
+                       uint32_t queue_depth,
+                       uint32_t num_threads);
+
+#endif // _QUALITY_CONTROL_H_
@@ -0,0 +1,174 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "sampling.h"
+#include "video_decode.h"
+#include <assert.h>
+
+/**
+ * NOTE(brendan): Frame numbers are resolved to int32, so a range may stop at
+ * most one past INT32_MAX, and a video's frames past that are not sampled.
+ */
+#define FRAME_SAMPLING_MAX_STOP ((int64_t)INT32_MAX + 1)
+
+bool frame_sampling_is_valid(const struct frame_sampling_spec *spec)
+{
+        const int64_t *params = spec->params;
+
+        switch (spec->kind) {
+        case FRAME_SAMPLING_RANGE:
+                return (params[0] >= 0) &&
+                       (params[0] <= INT32_MAX) &&
+                       (((params[1] >= params[0]) &&
+                         (params[1] <= FRAME_SAMPLING_MAX_STOP)) ||
+                        (params[1] == FRAME_SAMPLING_TO_END)) &&
+                       (params[2] > 0) &&
+                       (params[2] <= INT32_MAX);
+        case FRAME_SAMPLING_UNIFORM:
+                return (params[0] > 0) && (params[0] <= INT32_MAX);
+        case FRAME_SAMPLING_SEGMENTS:
+                /* NOTE(brendan): The product is the number of frames. */
+                return (params[0] > 0) &&
+                       (params[1] > 0) &&
+                       (params[1] <= INT32_MAX/params[0]);
+        case FRAME_SAMPLING_RANDOM_DENSE:
+                /* NOTE(brendan): The span reaches past short videos. */
+                return (params[0] > 0) &&
+                       (params[0] <= INT32_MAX) &&
+                       (params[1] > 0) &&
+                       (params[1] <= INT32_MAX) &&
+                       (params[0] - 1 <= INT32_MAX/params[1]);
+        }
+
+        return false;
+}
+
+int64_t
+frame_sampling_num_frames(const struct frame_sampling_spec *spec,
+                          int64_t nb_frames)
+{
+        const int64_t *params = spec->params;
+
+        if (nb_frames > FRAME_SAMPLING_MAX_STOP)
+                nb_frames = FRAME_SAMPLING_MAX_STOP;
+
+        switch (spec->kind) {
+        case FRAME_SAMPLING_RANGE: {
+                int64_t stop = (params[1] == FRAME_SAMPLING_TO_END) ?
+                               nb_frames : params[1];
+                if (stop <= params[0])
+                        return 0;
+
+                return (stop - params[0] + params[2] - 1)/params[2];
+        }
+        case FRAME_SAMPLING_UNIFORM:
+                return params[0];
+        case FRAME_SAMPLING_SEGMENTS:
+                return params[0]*params[1];
+        case FRAME_SAMPLING_RANDOM_DENSE:
+                return params[0];
+        }
+
+        return 0;
+}
+
+/**
+ * random_below() - Returns a random integer in [0, limit], or 0 if `limit` is
+ * negative.
+ */
+static int64_t
+random_below(int64_t limit)
+{
+        if (limit <= 0)
+                return 0;
+
+        return vid_decode_random() % (uint64_t)(limit + 1);
+}
+
+void
+frame_sampling_resolve(int32_t *frame_nums,
+                       const struct frame_sampling_spec *spec,
+                       int64_t nb_frames)
+{
+        const int64_t *params = spec->params;
+        const int64_t num_frames = frame_sampling_num_frames(spec, nb_frames);
+
+        if (nb_frames > FRAME_SAMPLING_MAX_STOP)
+                nb_frames = FRAME_SAMPLING_MAX_STOP;
+
+        /**
+         * NOTE(brendan): Except for ranges, which are explicit, fall back to
+         * the first frames of too short a video, so that the frame numbers
+         * stay strictly increasing and the decoder pads the rest.
+         */
+        if ((spec->kind != FRAME_SAMPLING_RANGE) && (nb_frames < num_frames)) {
+                for (int64_t i = 0;
+                     i < num_frames;
+                     ++i)
+                        frame_nums[i] = i;
+                return;
+        }
+
+        switch (spec->kind) {
+        case FRAME_SAMPLING_RANGE:
+                for (int64_t i = 0;
+                     i < num_frames;
+                     ++i)
+                        frame_nums[i] = params[0] + i*params[2];
+                break;
+        case FRAME_SAMPLING_UNIFORM:
+                for (int64_t i = 0;
+                     i < num_frames;
+                     ++i)
+                        frame_nums[i] = ((2*i + 1)*nb_frames)/(2*num_frames);
+                break;
+        case FRAME_SAMPLING_SEGMENTS: {
+                const int64_t num_segments = params[0];
+                const int64_t per_segment = params[1];
+                for (int64_t segment = 0;
+                     segment < num_segments;
+                     ++segment) {
+                        /**
+                         * NOTE(brendan): Every segment is at least
+                         * `per_segment` frames long, since
+                         * nb_frames >= num_segments*per_segment.
+                         */
+                        int64_t seg_start = (segment*nb_frames)/num_segments;
+                        int64_t seg_end =
+                                ((segment + 1)*nb_frames)/num_segments;
+                        int64_t start = seg_start +
+                                random_below(seg_end - seg_start -
+                                             per_segment);
+                        for (int64_t i = 0;
+                             i < per_segment;
+                             ++i)
+                                frame_nums[segment*per_segment + i] = start + i;
+                }
+                break;
+        }
+        case FRAME_SAMPLING_RANDOM_DENSE: {
+                const int64_t stride = params[1];
+                int64_t span = (num_frames - 1)*stride + 1;
+                int64_t start = random_below(nb_frames - span);
+                for (int64_t i = 0;
+                     i < num_frames;
+                     ++i)
+                        frame_nums[i] = start + i*stride;
+                break;
+        }
+        default:
+                assert(false);
+        }
+}
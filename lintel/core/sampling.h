@@ -0,0 +1,84 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _SAMPLING_H_
+#define _SAMPLING_H_
+
+/**
+ * Declarative frame sampling specs, resolved to frame numbers once the number
+ * of frames in the video is known.
+ *
+ * Every spec resolves to strictly increasing frame numbers, as
+ * `decode_video_from_frame_nums` requires. If the video is too short for a
+ * spec, frame numbers past its end are used, and the decoder pads them.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Range stop meaning "the end of the video". */
+#define FRAME_SAMPLING_TO_END -1
+
+/**
+ * enum frame_sampling_kind - The kinds of spec, and their parameters.
+ * @FRAME_SAMPLING_RANGE: (start, stop, step) as in Python's range, where stop
+ * can be FRAME_SAMPLING_TO_END.
+ * @FRAME_SAMPLING_UNIFORM: (num_frames) frames, one from the middle of each of
+ * `num_frames` equal parts of the video.
+ * @FRAME_SAMPLING_SEGMENTS: (num_segments, per_segment) consecutive frames at
+ * a random offset within each of `num_segments` equal parts of the video, as
+ * in TSN.
+ * @FRAME_SAMPLING_RANDOM_DENSE: (num_frames, stride) frames `stride` apart,
+ * starting at a random frame.
+ */
+enum frame_sampling_kind {
+        FRAME_SAMPLING_RANGE,
+        FRAME_SAMPLING_UNIFORM,
+        FRAME_SAMPLING_SEGMENTS,
+        FRAME_SAMPLING_RANDOM_DENSE,
+};
+
+struct frame_sampling_spec {
+        enum frame_sampling_kind kind;
+        int64_t params[3];
+};
+
+/**
+ * frame_sampling_is_valid() - Returns true if the parameters of `spec` are in
+ * range, i.e. counts and strides are positive and start is non-negative, and
+ * neither the frame numbers nor the number of frames can exceed INT32_MAX.
+ */
+bool frame_sampling_is_valid(const struct frame_sampling_spec *spec);
+
+/**
+ * frame_sampling_num_frames() - Returns the number of frame numbers that
+ * `spec` resolves to, for a video of `nb_frames` frames.
+ */
+int64_t
+frame_sampling_num_frames(const struct frame_sampling_spec *spec,
+                          int64_t nb_frames);
+
+/**
+ * frame_sampling_resolve() - Writes the frame_sampling_num_frames() frame
+ * numbers of `spec` to `frame_nums`, for a video of `nb_frames` frames.
+ * Random specs draw from the calling thread's generator (see
+ * `vid_decode_seed`).
+ */
+void
+frame_sampling_resolve(int32_t *frame_nums,
+                       const struct frame_sampling_spec *spec,
+                       int64_t nb_frames);
+
+#endif // _SAMPLING_H_
@@ -0,0 +1,454 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "thread_budget.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define THREAD_BUDGET_MAGIC 0x4c4e544c42444755ULL
+/* Marks a process slot whose grants are being returned to the budget. */
+#define THREAD_BUDGET_REAPING_PID (-1)
+
+/**
+ * struct thread_budget_process - Grants held by one process attached to a
+ * shared budget. All fields are accessed atomically.
+ * @pid: Process holding the grants, zero for a free slot, or
+ * THREAD_BUDGET_REAPING_PID.
+ * @num_threads_in_use: Threads granted to the process.
+ * @num_decodes: Decodes of the process holding a grant.
+ */
+struct thread_budget_process {
+        int32_t pid;
+        uint32_t num_threads_in_use;
+        uint32_t num_decodes;
+};
+
+/**
+ * struct thread_budget_state - Budget counters, in process memory or in
+ * shared memory. All fields are accessed atomically.
+ * @magic: THREAD_BUDGET_MAGIC once a shared budget has been initialized.
+ * @max_threads: Total threads in the budget, or zero for unmanaged.
+ * @num_threads_in_use: Threads currently granted.
+ * @num_decodes: Decodes currently holding a grant.
+ * @processes: Per-process grants, for shared budgets only.
+ */
+struct thread_budget_state {
+        uint64_t magic;
+        uint32_t max_threads;
+        uint32_t num_threads_in_use;
+        uint32_t num_decodes;
+        struct thread_budget_process processes[THREAD_BUDGET_MAX_PROCESSES];
+};
+
+static struct thread_budget_state local_state = {
+        .magic = THREAD_BUDGET_MAGIC,
+};
+/* NOTE(brendan): Shared budgets are never unmapped, as grants may use them. */
+static struct thread_budget_state *current_state = &local_state;
+/**
+ * NOTE(brendan): Queued jobs are counted per process, as they outlive
+ * reconfiguring the budget.
+ */
+static uint32_t num_queued_jobs;
+
+/**
+ * NOTE(brendan): This process's slot in `current_state`, claimed again after
+ * a fork since the child has a new PID.
+ */
+static pthread_mutex_t process_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_budget_state *process_state;
+static struct thread_budget_process *process_slot;
+static pid_t process_pid;
+
+/**
+ * claim_process() - Claims a free slot of `state` for this process.
+ *
+ * Returns NULL if every slot is taken, in which case the process's grants are
+ * not tracked.
+ */
+static struct thread_budget_process *
+claim_process(struct thread_budget_state *state, pid_t pid)
+{
+        for (uint32_t i = 0;
+             i < THREAD_BUDGET_MAX_PROCESSES;
+             ++i) {
+                struct thread_budget_process *process = state->processes + i;
+                int32_t free_pid = 0;
+                if (__atomic_compare_exchange_n(&process->pid,
+                                                &free_pid,
+                                                pid,
+                                                false,
+                                                __ATOMIC_ACQ_REL,
+                                                __ATOMIC_RELAXED))
+                        return process;
+        }
+
+        return NULL;
+}
+
+/**
+ * get_process() - Returns this process's slot in the shared budget `state`,
+ * claiming one if needed.
+ */
+static struct thread_budget_process *
+get_process(struct thread_budget_state *state)
+{
+        pid_t pid = getpid();
+
+        pthread_mutex_lock(&process_lock);
+        if ((state != process_state) || (pid != process_pid)) {
+                process_slot = claim_process(state, pid);
+                process_state = state;
+                process_pid = pid;
+        }
+        struct thread_budget_process *process = process_slot;
+        pthread_mutex_unlock(&process_lock);
+
+        return process;
+}
+
+/**
+ * reap_dead_processes() - Returns the grants of processes that exited without
+ * releasing them to `state`, and frees their slots.
+ *
+ * NOTE(brendan): A PID reused by a live process keeps its dead predecessor's
+ * grants until that process exits too.
+ *
+ * Returns the number of live processes attached to `state`, other than this
+ * one.
+ */
+static uint32_t
+reap_dead_processes(struct thread_budget_state *state)
+{
+        pid_t self = getpid();
+        uint32_t num_live = 0;
+
+        for (uint32_t i = 0;
+             i < THREAD_BUDGET_MAX_PROCESSES;
+             ++i) {
+                struct thread_budget_process *process = state->processes + i;
+                int32_t pid = __atomic_load_n(&process->pid, __ATOMIC_ACQUIRE);
+                if ((pid <= 0) || (pid == self))
+                        continue;
+
+                if ((kill(pid, 0) == 0) || (errno != ESRCH)) {
+                        ++num_live;
+                        continue;
+                }
+
+                if (!__atomic_compare_exchange_n(&process->pid,
+                                                 &pid,
+                                                 THREAD_BUDGET_REAPING_PID,
+                                                 false,
+                                                 __ATOMIC_ACQ_REL,
+                                                 __ATOMIC_RELAXED))
+                        continue;
+
+                uint32_t num_threads = __atomic_exchange_n(
+                        &process->num_threads_in_use, 0, __ATOMIC_RELAXED);
+                uint32_t num_decodes = __atomic_exchange_n(
+                        &process->num_decodes, 0, __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&state->num_threads_in_use,
+                                   num_threads,
+                                   __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&state->num_decodes,
+                                   num_decodes,
+                                   __ATOMIC_RELAXED);
+                __atomic_store_n(&process->pid, 0, __ATOMIC_RELEASE);
+        }
+
+        return num_live;
+}
+
+/**
+ * map_shared_state() - Opens (creating if needed) the shared budget named
+ * `shared_name`, and maps it.
+ *
+ * Returns NULL on failure.
+ */
+static struct thread_budget_state *
+map_shared_state(uint32_t max_threads, const char *shared_name)
+{
+        bool is_creator = true;
+        int32_t fd = shm_open(shared_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if ((fd < 0) && (errno == EEXIST)) {
+                is_creator = false;
+                fd = shm_open(shared_name, O_RDWR, 0600);
+        }
+        if (fd < 0)
+                return NULL;
+
+        if (is_creator && (ftruncate(fd, sizeof(struct thread_budget_state)) != 0)) {
+                close(fd);
+                shm_unlink(shared_name);
+                return NULL;
+        }
+
+        /**
+         * NOTE(brendan): The creator sizes the object after creating it, and
+         * mapping it before then would fault on the first access, so wait.
+         */
+        for (uint32_t i = 0;
+             !is_creator;
+             ++i) {
+                struct stat st;
+                if (fstat(fd, &st) != 0) {
+                        close(fd);
+                        return NULL;
+                }
+                if (st.st_size >= (off_t)sizeof(struct thread_budget_state))
+                        break;
+
+                if (i == 1000) {
+                        close(fd);
+                        errno = EINVAL;
+                        return NULL;
+                }
+                usleep(1000);
+        }
+
+        struct thread_budget_state *state = mmap(NULL,
+                                                 sizeof(*state),
+                                                 PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED,
+                                                 fd,
+                                                 0);
+        close(fd);
+        if (state == MAP_FAILED)
+                return NULL;
+
+        if (is_creator) {
+                __atomic_store_n(&state->max_threads,
+                                 max_threads,
+                                 __ATOMIC_RELAXED);
+                __atomic_store_n(&state->magic,
+                                 THREAD_BUDGET_MAGIC,
+                                 __ATOMIC_RELEASE);
+                return state;
+        }
+
+        /* NOTE(brendan): Wait for the creator to finish initializing. */
+        for (uint32_t i = 0;
+             __atomic_load_n(&state->magic, __ATOMIC_ACQUIRE) !=
+             THREAD_BUDGET_MAGIC;
+             ++i) {
+                if (i == 1000) {
+                        munmap(state, sizeof(*state));
+                        errno = EINVAL;
+                        return NULL;
+                }
+                usleep(1000);
+        }
+
+        uint32_t num_live = reap_dead_processes(state);
+        uint32_t old_max_threads = __atomic_load_n(&state->max_threads,
+                                                   __ATOMIC_RELAXED);
+        if (old_max_threads == max_threads)
+                return state;
+
+        /**
+         * NOTE(brendan): A budget left behind by processes that have all
+         * exited is free to take the new size.
+         */
+        if ((num_live > 0) ||
+            !__atomic_compare_exchange_n(&state->max_threads,
+                                         &old_max_threads,
+                                         max_threads,
+                                         false,
+                                         __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED)) {
+                munmap(state, sizeof(*state));
+                errno = EEXIST;
+                return NULL;
+        }
+
+        return state;
+}
+
+int32_t thread_budget_configure(uint32_t max_threads, const char *shared_name)
+{
+        if (shared_name == NULL) {
+                __atomic_store_n(&local_state.max_threads,
+                                 max_threads,
+                                 __ATOMIC_RELAXED);
+                __atomic_store_n(&current_state,
+                                 &local_state,
+                                 __ATOMIC_RELEASE);
+                return 0;
+        }
+
+        struct thread_budget_state *state = map_shared_state(max_threads,
+                                                             shared_name);
+        if (state == NULL)
+                return -1;
+
+        /**
+         * NOTE(brendan): Claim a slot now, so that processes attaching later
+         * see this one as alive.
+         */
+        get_process(state);
+        __atomic_store_n(&current_state, state, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+/**
+ * get_wanted_threads() - Returns the number of codec threads that a frame of
+ * `width` by `height` pixels can make use of.
+ */
+static uint32_t
+get_wanted_threads(int32_t width, int32_t height)
+{
+        if ((width <= 0) || (height <= 0))
+                return 1;
+
+        uint64_t wanted = ((uint64_t)width*height)/THREAD_BUDGET_PIXELS_PER_THREAD;
+        if (wanted < 1)
+                return 1;
+        if (wanted > THREAD_BUDGET_MAX_CODEC_THREADS)
+                return THREAD_BUDGET_MAX_CODEC_THREADS;
+
+        return (uint32_t)wanted;
+}
+
+struct thread_budget_grant thread_budget_acquire(int32_t width, int32_t height)
+{
+        struct thread_budget_grant grant = {
+                .state = NULL,
+                .process = NULL,
+                .num_threads = 1,
+        };
+        struct thread_budget_state *state =
+                __atomic_load_n(&current_state, __ATOMIC_ACQUIRE);
+
+        uint32_t max_threads = __atomic_load_n(&state->max_threads,
+                                               __ATOMIC_RELAXED);
+        if (max_threads == 0)
+                return grant;
+
+        uint32_t num_decodes = __atomic_add_fetch(&state->num_decodes,
+                                                  1,
+                                                  __ATOMIC_RELAXED);
+        /**
+         * NOTE(brendan): Leave threads for queued jobs, which will each
+         * start a decode as soon as a pool worker is free.
+         */
+        uint32_t num_sharing = num_decodes +
+                               __atomic_load_n(&num_queued_jobs,
+                                               __ATOMIC_RELAXED);
+        uint32_t fair_share = max_threads/num_sharing;
+        if (fair_share < 1)
+                fair_share = 1;
+        uint32_t wanted = get_wanted_threads(width, height);
+        if (wanted > fair_share)
+                wanted = fair_share;
+
+        uint32_t in_use = __atomic_load_n(&state->num_threads_in_use,
+                                          __ATOMIC_RELAXED);
+        uint32_t num_threads;
+        do {
+                uint32_t num_free = (in_use < max_threads) ?
+                                    (max_threads - in_use) : 0;
+                num_threads = (wanted < num_free) ? wanted : num_free;
+                if (num_threads < 1)
+                        num_threads = 1;
+        } while (!__atomic_compare_exchange_n(&state->num_threads_in_use,
+                                              &in_use,
+                                              in_use + num_threads,
+                                              true,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+
+        grant.state = state;
+        grant.num_threads = num_threads;
+        if (state != &local_state) {
+                grant.process = get_process(state);
+                if (grant.process != NULL) {
+                        __atomic_add_fetch(&grant.process->num_threads_in_use,
+                                           num_threads,
+                                           __ATOMIC_RELAXED);
+                        __atomic_add_fetch(&grant.process->num_decodes,
+                                           1,
+                                           __ATOMIC_RELAXED);
+                }
+        }
+
+        return grant;
+}
+
+void thread_budget_release(struct thread_budget_grant *grant)
+{
+        if (grant->state == NULL)
+                return;
+
+        if (grant->process != NULL) {
+                __atomic_sub_fetch(&grant->process->num_threads_in_use,
+                                   grant->num_threads,
+                                   __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&grant->process->num_decodes,
+                                   1,
+                                   __ATOMIC_RELAXED);
+        }
+        __atomic_sub_fetch(&grant->state->num_threads_in_use,
+                           grant->num_threads,
+                           __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&grant->state->num_decodes, 1, __ATOMIC_RELAXED);
+
+        grant->state = NULL;
+        grant->process = NULL;
+        grant->num_threads = 1;
+}
+
+uint32_t thread_budget_pool_size(uint32_t requested)
+{
+        if (requested == 0) {
+                long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                requested = (num_cpus > 0) ? (uint32_t)num_cpus : 1;
+        }
+
+        struct thread_budget_state *state =
+                __atomic_load_n(&current_state, __ATOMIC_ACQUIRE);
+        uint32_t max_threads = __atomic_load_n(&state->max_threads,
+                                               __ATOMIC_RELAXED);
+        if ((max_threads > 0) && (requested > max_threads))
+                return max_threads;
+
+        return requested;
+}
+
+void thread_budget_queued_jobs(int32_t delta)
+{
+        __atomic_add_fetch(&num_queued_jobs, (uint32_t)delta, __ATOMIC_RELAXED);
+}
+
+void thread_budget_get_stats(struct thread_budget_stats *stats)
+{
+        struct thread_budget_state *state =
+                __atomic_load_n(&current_state, __ATOMIC_ACQUIRE);
+
+        stats->max_threads = __atomic_load_n(&state->max_threads,
+                                             __ATOMIC_RELAXED);
+        stats->num_threads_in_use = __atomic_load_n(&state->num_threads_in_use,
+                                                    __ATOMIC_RELAXED);
+        stats->num_decodes = __atomic_load_n(&state->num_decodes,
+                                             __ATOMIC_RELAXED);
+}
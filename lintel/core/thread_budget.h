@@ -0,0 +1,125 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _THREAD_BUDGET_H_
+#define _THREAD_BUDGET_H_
+
+/**
+ * A budget of decoding threads, shared by every decode in the process, or
+ * (through POSIX shared memory) by every process attached to the same named
+ * budget, e.g. the workers of a data loader.
+ *
+ * Each decode is granted a number of codec threads based on its resolution,
+ * and on its fair share of the budget given how many decodes are running or
+ * queued on a thread pool in this process, so that the machine stays busy
+ * without being oversubscribed. Every decode is granted at least one thread,
+ * so decodes never block on the budget.
+ *
+ * A grant counts the thread running the decode (the caller's, or a pool
+ * worker's) as its first thread, and a thread pool runs at most
+ * `thread_budget_pool_size` jobs at once, so pool workers are counted against
+ * the budget.
+ *
+ * The budget is unmanaged (zero) by default, in which case decoders are
+ * single-threaded, as FFmpeg's default.
+ */
+
+#include <stdint.h>
+
+/* Pixels per frame that justify one more codec thread. */
+#define THREAD_BUDGET_PIXELS_PER_THREAD (512*512)
+/* Most threads granted to one decoder, as for FFmpeg's automatic threads. */
+#define THREAD_BUDGET_MAX_CODEC_THREADS 16
+/* Most processes whose grants a shared budget tracks. */
+#define THREAD_BUDGET_MAX_PROCESSES 256
+
+struct thread_budget_state;
+struct thread_budget_process;
+
+/**
+ * struct thread_budget_grant - Threads granted to one decode.
+ * @state: Budget the threads were taken from, or NULL if nothing is held.
+ * @process: This process's grants in a shared `state`, or NULL if untracked.
+ * @num_threads: Number of threads granted, at least one.
+ */
+struct thread_budget_grant {
+        struct thread_budget_state *state;
+        struct thread_budget_process *process;
+        uint32_t num_threads;
+};
+
+/**
+ * struct thread_budget_stats - Snapshot of the current budget.
+ * @max_threads: Total threads that decodes may use, or zero for unmanaged.
+ * @num_threads_in_use: Threads granted to running decodes, by every process
+ * attached to the budget.
+ * @num_decodes: Grants not yet released, by every attached process.
+ */
+struct thread_budget_stats {
+        uint32_t max_threads;
+        uint32_t num_threads_in_use;
+        uint32_t num_decodes;
+};
+
+/**
+ * thread_budget_configure() - Sets the thread budget.
+ * @max_threads: Total threads that decodes may use, or zero for unmanaged.
+ * @shared_name: If not NULL, the name of a POSIX shared memory object (e.g.
+ * "/lintel") holding a budget shared with other processes. The first process
+ * to create it sets its `max_threads`.
+ *
+ * A shared budget tracks the grants of each attached process (up to
+ * THREAD_BUDGET_MAX_PROCESSES), and returns the grants of processes that have
+ * exited without releasing them (e.g. crashed workers) whenever a process
+ * attaches. Attaching with a different `max_threads` fails with EEXIST,
+ * unless no other attached process is alive, in which case the budget takes
+ * the new `max_threads`.
+ *
+ * Decodes that are running keep their grants, and return them to the budget
+ * they were taken from.
+ *
+ * Returns 0 on success, or a negative value (with errno set) on failure.
+ */
+int32_t thread_budget_configure(uint32_t max_threads, const char *shared_name);
+
+/**
+ * thread_budget_acquire() - Grants threads to a decoder of frames of size
+ * `width` by `height`. Must be paired with `thread_budget_release`.
+ */
+struct thread_budget_grant thread_budget_acquire(int32_t width, int32_t height);
+
+/**
+ * thread_budget_release() - Returns the threads in `grant` to their budget,
+ * and resets `grant`.
+ */
+void thread_budget_release(struct thread_budget_grant *grant);
+
+/**
+ * thread_budget_pool_size() - Returns the number of pool threads that may run
+ * jobs at once for `requested` threads (zero meaning one per online CPU),
+ * capped by the budget.
+ */
+uint32_t thread_budget_pool_size(uint32_t requested);
+
+/**
+ * thread_budget_queued_jobs() - Adds `delta` to the number of jobs queued on
+ * thread pools in this process, which share the budget with running decodes.
+ */
+void thread_budget_queued_jobs(int32_t delta);
+
+/* thread_budget_get_stats() - Copies the counters of the current budget. */
+void thread_budget_get_stats(struct thread_budget_stats *stats);
+
+#endif // _THREAD_BUDGET_H_
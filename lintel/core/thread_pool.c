@@ -0,0 +1,445 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "thread_pool.h"
+#include "thread_budget.h"
+#include <limits.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Slots in the submission ring. Must be a power of two. */
+#define THREAD_POOL_QUEUE_CAPACITY 4096
+#define THREAD_POOL_CACHE_LINE_BYTES 64
+
+/**
+ * struct thread_pool_slot - A slot of the submission ring.
+ * @sequence: Position the slot is next free to be written at, or that
+ * position plus one once it holds a job that can be read.
+ * @fn: Function to run.
+ * @arg: Argument to `fn`.
+ * @group: Group to notify when the job finishes.
+ */
+struct thread_pool_slot {
+        uint64_t sequence;
+        thread_pool_fn fn;
+        void *arg;
+        struct thread_pool_group *group;
+};
+
+/**
+ * struct thread_pool - Worker threads and their job queue.
+ * @enqueue_pos: Position of the next job to be submitted.
+ * @dequeue_pos: Position of the next job to be started.
+ * @wake_seq: Futex word bumped after each submission, and on shutdown.
+ * @num_sleepers: Number of workers waiting (or about to wait) on `wake_seq`.
+ * @num_active: Number of workers running (or about to run) a job.
+ * @max_active: Cap on `num_active`.
+ * @is_shutting_down: Set when workers should exit once the queue is empty.
+ * @slots: Bounded multi-producer, multi-consumer ring of queued jobs.
+ * @threads: Worker threads.
+ * @num_threads: Number of worker threads.
+ *
+ * NOTE(brendan): The ring positions are on separate cache lines, so that
+ * submitting threads and workers do not false-share them.
+ */
+struct thread_pool {
+        uint64_t enqueue_pos
+                __attribute__((aligned(THREAD_POOL_CACHE_LINE_BYTES)));
+        uint64_t dequeue_pos
+                __attribute__((aligned(THREAD_POOL_CACHE_LINE_BYTES)));
+        uint32_t wake_seq
+                __attribute__((aligned(THREAD_POOL_CACHE_LINE_BYTES)));
+        uint32_t num_sleepers;
+        uint32_t num_active
+                __attribute__((aligned(THREAD_POOL_CACHE_LINE_BYTES)));
+        uint32_t max_active;
+        bool is_shutting_down;
+        struct thread_pool_slot *slots;
+        pthread_t *threads;
+        uint32_t num_threads;
+};
+
+static void
+futex_wait(uint32_t *word, uint32_t expected)
+{
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void
+futex_wake(uint32_t *word, int32_t num_waiters)
+{
+        syscall(SYS_futex,
+                word,
+                FUTEX_WAKE_PRIVATE,
+                num_waiters,
+                NULL,
+                NULL,
+                0);
+}
+
+/**
+ * ring_push() - Queues a job in the submission ring, without blocking.
+ *
+ * Returns false if the ring is full.
+ */
+static bool
+ring_push(struct thread_pool *pool,
+          thread_pool_fn fn,
+          void *arg,
+          struct thread_pool_group *group)
+{
+        struct thread_pool_slot *slot;
+        uint64_t pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+
+        for (;;) {
+                slot = pool->slots + (pos & (THREAD_POOL_QUEUE_CAPACITY - 1));
+                uint64_t sequence = __atomic_load_n(&slot->sequence,
+                                                    __ATOMIC_ACQUIRE);
+                int64_t diff = (int64_t)(sequence - pos);
+                if (diff < 0)
+                        return false;
+
+                if (diff > 0) {
+                        pos = __atomic_load_n(&pool->enqueue_pos,
+                                              __ATOMIC_RELAXED);
+                        continue;
+                }
+
+                if (__atomic_compare_exchange_n(&pool->enqueue_pos,
+                                                &pos,
+                                                pos + 1,
+                                                true,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED))
+                        break;
+        }
+
+        slot->fn = fn;
+        slot->arg = arg;
+        slot->group = group;
+        __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+        return true;
+}
+
+/**
+ * ring_pop() - Takes the oldest job out of the submission ring, without
+ * blocking.
+ *
+ * Returns false if the ring is empty.
+ */
+static bool
+ring_pop(struct thread_pool *pool, struct thread_pool_slot *job)
+{
+        struct thread_pool_slot *slot;
+        uint64_t pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+
+        for (;;) {
+                slot = pool->slots + (pos & (THREAD_POOL_QUEUE_CAPACITY - 1));
+                uint64_t sequence = __atomic_load_n(&slot->sequence,
+                                                    __ATOMIC_ACQUIRE);
+                int64_t diff = (int64_t)(sequence - (pos + 1));
+                if (diff < 0)
+                        return false;
+
+                if (diff > 0) {
+                        pos = __atomic_load_n(&pool->dequeue_pos,
+                                              __ATOMIC_RELAXED);
+                        continue;
+                }
+
+                if (__atomic_compare_exchange_n(&pool->dequeue_pos,
+                                                &pos,
+                                                pos + 1,
+                                                true,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED))
+                        break;
+        }
+
+        job->fn = slot->fn;
+        job->arg = slot->arg;
+        job->group = slot->group;
+        __atomic_store_n(&slot->sequence,
+                         pos + THREAD_POOL_QUEUE_CAPACITY,
+                         __ATOMIC_RELEASE);
+
+        return true;
+}
+
+/**
+ * finish_job() - Counts a job of `group` as finished, waking its waiters if
+ * it was the last.
+ *
+ * NOTE(brendan): A waiter can see `num_pending` reach zero and destroy the
+ * group before the wake below, which is then a harmless spurious wake of
+ * whatever (mapped) memory the group was in.
+ */
+static void
+finish_job(struct thread_pool_group *group)
+{
+        if (__atomic_sub_fetch(&group->num_pending, 1, __ATOMIC_ACQ_REL) == 0)
+                futex_wake(&group->num_pending, INT_MAX);
+}
+
+static void
+wake_workers(struct thread_pool *pool, int32_t num_workers)
+{
+        __atomic_add_fetch(&pool->wake_seq, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pool->num_sleepers, __ATOMIC_SEQ_CST) > 0)
+                futex_wake(&pool->wake_seq, num_workers);
+}
+
+/**
+ * run_next_job() - Runs the oldest queued job, if any, and if fewer than
+ * `max_active` workers are running jobs.
+ *
+ * Returns false if no job was run.
+ */
+static bool
+run_next_job(struct thread_pool *pool)
+{
+        uint32_t num_active = __atomic_load_n(&pool->num_active,
+                                              __ATOMIC_SEQ_CST);
+        do {
+                if (num_active >= __atomic_load_n(&pool->max_active,
+                                                  __ATOMIC_SEQ_CST))
+                        return false;
+        } while (!__atomic_compare_exchange_n(&pool->num_active,
+                                              &num_active,
+                                              num_active + 1,
+                                              true,
+                                              __ATOMIC_SEQ_CST,
+                                              __ATOMIC_SEQ_CST));
+
+        struct thread_pool_slot job;
+        bool has_job = ring_pop(pool, &job);
+        if (has_job) {
+                thread_budget_queued_jobs(-1);
+                job.fn(job.arg);
+                finish_job(job.group);
+        }
+
+        /**
+         * NOTE(brendan): Workers may be asleep because too many were active,
+         * so hand any queued jobs on.
+         */
+        __atomic_sub_fetch(&pool->num_active, 1, __ATOMIC_SEQ_CST);
+        if (has_job && (thread_pool_queue_depth(pool) > 0))
+                wake_workers(pool, 1);
+
+        return has_job;
+}
+
+static void *
+worker_main(void *opaque)
+{
+        struct thread_pool *pool = (struct thread_pool *)opaque;
+
+        for (;;) {
+                if (run_next_job(pool))
+                        continue;
+
+                /**
+                 * NOTE(brendan): Read `wake_seq` before re-checking the ring,
+                 * so that a job submitted (or a worker going idle) after the
+                 * check changes it and the futex wait returns immediately.
+                 */
+                __atomic_add_fetch(&pool->num_sleepers, 1, __ATOMIC_SEQ_CST);
+                uint32_t wake_seq = __atomic_load_n(&pool->wake_seq,
+                                                    __ATOMIC_SEQ_CST);
+                if (run_next_job(pool)) {
+                        __atomic_sub_fetch(&pool->num_sleepers,
+                                           1,
+                                           __ATOMIC_SEQ_CST);
+                        continue;
+                }
+
+                if (__atomic_load_n(&pool->is_shutting_down,
+                                    __ATOMIC_ACQUIRE)) {
+                        __atomic_sub_fetch(&pool->num_sleepers,
+                                           1,
+                                           __ATOMIC_SEQ_CST);
+                        return NULL;
+                }
+
+                futex_wait(&pool->wake_seq, wake_seq);
+                __atomic_sub_fetch(&pool->num_sleepers, 1, __ATOMIC_SEQ_CST);
+        }
+}
+
+struct thread_pool *thread_pool_create(uint32_t num_threads)
+{
+        if (num_threads == 0) {
+                long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                num_threads = (num_cpus > 0) ? (uint32_t)num_cpus : 1;
+        }
+
+        struct thread_pool *pool;
+        if (posix_memalign((void **)&pool,
+                           THREAD_POOL_CACHE_LINE_BYTES,
+                           sizeof(*pool)) != 0)
+                return NULL;
+        *pool = (struct thread_pool){0};
+
+        pool->slots = calloc(THREAD_POOL_QUEUE_CAPACITY, sizeof(*pool->slots));
+        if (pool->slots == NULL)
+                goto clean_up_pool;
+
+        for (uint64_t i = 0;
+             i < THREAD_POOL_QUEUE_CAPACITY;
+             ++i)
+                pool->slots[i].sequence = i;
+
+        pool->threads = calloc(num_threads, sizeof(*pool->threads));
+        if (pool->threads == NULL)
+                goto clean_up_slots;
+
+        /* NOTE(brendan): Uncapped until every worker has started. */
+        pool->max_active = num_threads;
+
+        for (;
+             pool->num_threads < num_threads;
+             ++pool->num_threads) {
+                if (pthread_create(pool->threads + pool->num_threads,
+                                   NULL,
+                                   worker_main,
+                                   pool) != 0)
+                        break;
+        }
+
+        if (pool->num_threads == 0) {
+                thread_pool_destroy(pool);
+                return NULL;
+        }
+        thread_pool_set_concurrency(pool, pool->num_threads);
+
+        return pool;
+
+clean_up_slots:
+        free(pool->slots);
+clean_up_pool:
+        free(pool);
+
+        return NULL;
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+        /**
+         * NOTE(brendan): Workers exit when they cannot run a job, so let
+         * every worker drain the queue.
+         */
+        __atomic_store_n(&pool->max_active, UINT32_MAX, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&pool->is_shutting_down, true, __ATOMIC_RELEASE);
+        wake_workers(pool, INT_MAX);
+
+        for (uint32_t i = 0;
+             i < pool->num_threads;
+             ++i)
+                pthread_join(pool->threads[i], NULL);
+
+        free(pool->threads);
+        free(pool->slots);
+        free(pool);
+}
+
+uint32_t thread_pool_num_threads(const struct thread_pool *pool)
+{
+        return pool->num_threads;
+}
+
+void
+thread_pool_set_concurrency(struct thread_pool *pool, uint32_t max_active)
+{
+        if (max_active < 1)
+                max_active = 1;
+        if (max_active > pool->num_threads)
+                max_active = pool->num_threads;
+
+        uint32_t old_max_active = __atomic_exchange_n(&pool->max_active,
+                                                      max_active,
+                                                      __ATOMIC_SEQ_CST);
+        if (max_active > old_max_active)
+                wake_workers(pool, INT_MAX);
+}
+
+uint32_t thread_pool_concurrency(struct thread_pool *pool)
+{
+        return __atomic_load_n(&pool->max_active, __ATOMIC_RELAXED);
+}
+
+uint32_t thread_pool_queue_depth(struct thread_pool *pool)
+{
+        uint64_t dequeue_pos = __atomic_load_n(&pool->dequeue_pos,
+                                               __ATOMIC_RELAXED);
+        uint64_t enqueue_pos = __atomic_load_n(&pool->enqueue_pos,
+                                               __ATOMIC_RELAXED);
+
+        /* NOTE(brendan): The two loads race, so clamp to the ring's range. */
+        if (enqueue_pos <= dequeue_pos)
+                return 0;
+        if (enqueue_pos - dequeue_pos > THREAD_POOL_QUEUE_CAPACITY)
+                return THREAD_POOL_QUEUE_CAPACITY;
+
+        return (uint32_t)(enqueue_pos - dequeue_pos);
+}
+
+void thread_pool_group_init(struct thread_pool_group *group)
+{
+        group->num_pending = 0;
+}
+
+void thread_pool_group_destroy(struct thread_pool_group *group)
+{
+        /* NOTE(brendan): Groups hold no resources besides their counter. */
+        (void)group;
+}
+
+int32_t
+thread_pool_submit(struct thread_pool *pool,
+                   struct thread_pool_group *group,
+                   thread_pool_fn fn,
+                   void *arg)
+{
+        __atomic_add_fetch(&group->num_pending, 1, __ATOMIC_RELAXED);
+
+        thread_budget_queued_jobs(1);
+        if (!ring_push(pool, fn, arg, group)) {
+                thread_budget_queued_jobs(-1);
+                finish_job(group);
+                return -1;
+        }
+
+        wake_workers(pool, 1);
+
+        return 0;
+}
+
+void thread_pool_group_wait(struct thread_pool_group *group)
+{
+        for (;;) {
+                uint32_t num_pending = __atomic_load_n(&group->num_pending,
+                                                       __ATOMIC_ACQUIRE);
+                if (num_pending == 0)
+                        return;
+
+                futex_wait(&group->num_pending, num_pending);
+        }
+}
@@ -0,0 +1,109 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+/**
+ * A fixed-size pool of native worker threads, for running decode jobs without
+ * holding the Python GIL.
+ *
+ * Jobs are submitted as part of a `struct thread_pool_group`, so that several
+ * callers can share one pool and each wait only for their own jobs.
+ *
+ * Submission goes through a bounded lock-free ring shared by all submitting
+ * threads and workers, and idle workers and group waiters sleep on futexes, so
+ * that neither submitting nor finishing a job takes a lock. Linux only.
+ *
+ * How many workers run jobs at once can be capped below the number of
+ * workers (see `thread_pool_set_concurrency`), e.g. by the thread budget, and
+ * queued jobs are counted in the thread budget (see
+ * `thread_budget_queued_jobs`).
+ */
+
+#include <stdint.h>
+
+typedef void (*thread_pool_fn)(void *arg);
+
+struct thread_pool;
+
+/**
+ * struct thread_pool_group - A set of jobs that can be waited on together.
+ * @num_pending: Number of submitted jobs that have not finished, updated
+ * atomically. Waiters sleep on it as a futex.
+ */
+struct thread_pool_group {
+        uint32_t num_pending;
+};
+
+/**
+ * thread_pool_create() - Starts a pool of `num_threads` worker threads. If
+ * `num_threads` is zero, one thread per online CPU is started.
+ *
+ * Returns NULL on failure.
+ */
+struct thread_pool *thread_pool_create(uint32_t num_threads);
+
+/**
+ * thread_pool_destroy() - Finishes all queued jobs, then joins and frees the
+ * worker threads.
+ */
+void thread_pool_destroy(struct thread_pool *pool);
+
+/* thread_pool_num_threads() - Returns the number of worker threads. */
+uint32_t thread_pool_num_threads(const struct thread_pool *pool);
+
+/**
+ * thread_pool_set_concurrency() - Caps the number of workers running jobs at
+ * once to `max_active`, clamped to [1, number of workers]. Workers that are
+ * running jobs finish them.
+ */
+void
+thread_pool_set_concurrency(struct thread_pool *pool, uint32_t max_active);
+
+/* thread_pool_concurrency() - Returns the cap on workers running jobs. */
+uint32_t thread_pool_concurrency(struct thread_pool *pool);
+
+/**
+ * thread_pool_queue_depth() - Returns the number of jobs queued on `pool` that
+ * no worker has started yet, e.g. as a measure of backpressure.
+ */
+uint32_t thread_pool_queue_depth(struct thread_pool *pool);
+
+void thread_pool_group_init(struct thread_pool_group *group);
+
+void thread_pool_group_destroy(struct thread_pool_group *group);
+
+/**
+ * thread_pool_submit() - Queues `fn(arg)` to run on a worker thread, as part of
+ * `group`.
+ *
+ * Returns 0 on success, or a negative value if the job could not be queued
+ * because the pool's queue is full, in which case callers run the job
+ * themselves.
+ */
+int32_t
+thread_pool_submit(struct thread_pool *pool,
+                   struct thread_pool_group *group,
+                   thread_pool_fn fn,
+                   void *arg);
+
+/**
+ * thread_pool_group_wait() - Blocks until every job submitted as part of
+ * `group` has finished.
+ */
+void thread_pool_group_wait(struct thread_pool_group *group);
+
+#endif // _THREAD_POOL_H_
@@ -14,12 +14,106 @@
  * limitations under the License.
  */
 #include "video_decode.h"
+#include "codec_cache.h"
+#include "decoder_select.h"
+#include "format_cache.h"
+#include "frame_copy.h"
+#include "mem_stats.h"
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * NOTE(brendan): Random seeks use a per-thread generator, rather than the
+ * shared state behind rand(), so that threads decoding concurrently (e.g.
+ * without the GIL) neither race on it nor see correlated seeks. Zero means
+ * not yet seeded.
+ */
+static __thread uint64_t random_state;
+
+/**
+ * record_keyframe_packet() - Adds a demuxed video packet to the video's
+ * keyframe index, if it is a keyframe.
+ *
+ * @param vid_ctx Context needed to decode frames from the video stream.
+ * @param packet Packet demuxed from the video stream.
+ */
+static void
+record_keyframe_packet(struct video_stream_context *vid_ctx,
+                       const AVPacket *packet)
+{
+        if ((vid_ctx->keyframe_index == NULL) ||
+            !(packet->flags & AV_PKT_FLAG_KEY))
+                return;
+
+        if (packet->pts == AV_NOPTS_VALUE) {
+                /* NOTE(brendan): Unindexable, so break the contiguous run. */
+                vid_ctx->last_keyframe_pts = KEYFRAME_INDEX_UNKNOWN;
+                return;
+        }
+
+        keyframe_index_record(vid_ctx->keyframe_index,
+                              packet->pts,
+                              vid_ctx->last_keyframe_pts,
+                              KEYFRAME_INDEX_UNKNOWN);
+        vid_ctx->last_keyframe_pts = packet->pts;
+}
+
+/**
+ * track_received_frame() - Updates the display-order frame number in
+ * `vid_ctx` for the frame that was just received, and records the frame
+ * number of keyframes in the keyframe index.
+ *
+ * If the frame number is unknown (e.g., after a seek), and the received frame
+ * is an indexed keyframe with a known frame number, then frame numbering is
+ * resynchronized from the index.
+ *
+ * @param vid_ctx Context needed to decode frames from the video stream.
+ */
+static void
+track_received_frame(struct video_stream_context *vid_ctx)
+{
+        struct keyframe_entry keyframe;
+        int64_t pts = vid_ctx->frame->pts;
+
+        if (pts == AV_NOPTS_VALUE) {
+                vid_ctx->next_frame_number = KEYFRAME_INDEX_UNKNOWN;
+                return;
+        }
+
+        /**
+         * NOTE(brendan): Don't count repeated PTS, to match the FFmpeg
+         * duplicated frame workaround in decode_video_from_frame_nums.
+         */
+        if ((vid_ctx->last_pts != AV_NOPTS_VALUE) && (pts <= vid_ctx->last_pts))
+                return;
+        vid_ctx->last_pts = pts;
+
+        int64_t frame_number = vid_ctx->next_frame_number;
+        if (frame_number != KEYFRAME_INDEX_UNKNOWN)
+                ++vid_ctx->next_frame_number;
+
+        if ((vid_ctx->keyframe_index == NULL) || !vid_ctx->frame->key_frame)
+                return;
+
+        if (frame_number != KEYFRAME_INDEX_UNKNOWN) {
+                keyframe_index_record(vid_ctx->keyframe_index,
+                                      pts,
+                                      KEYFRAME_INDEX_UNKNOWN,
+                                      frame_number);
+        } else if (keyframe_index_find_pts(vid_ctx->keyframe_index,
+                                           pts,
+                                           &keyframe) &&
+                   (keyframe.frame_number != KEYFRAME_INDEX_UNKNOWN)) {
+                vid_ctx->next_frame_number = keyframe.frame_number + 1;
+        }
+}
 
 /**
  * Receives a complete frame from the video stream in format_context that
@@ -31,10 +125,11 @@
  * VID_DECODE_FFMPEG_ERR if an FFmpeg error occurred..
  */
 static int32_t
-receive_frame(struct video_stream_context *vid_ctx)
+receive_frame_from_decoder(struct video_stream_context *vid_ctx)
 {
         AVPacket packet;
         int32_t status;
+        int32_t read_status;
         bool was_frame_received;
 
         av_init_packet(&packet);
@@ -50,8 +145,11 @@ receive_frame(struct video_stream_context *vid_ctx)
 
         was_frame_received = false;
         while (!was_frame_received &&
-               (av_read_frame(vid_ctx->format_context, &packet) == 0)) {
+               ((read_status = av_read_frame(vid_ctx->format_context,
+                                             &packet)) == 0)) {
                 if (packet.stream_index == vid_ctx->video_stream_index) {
+                        record_keyframe_packet(vid_ctx, &packet);
+
                         status = avcodec_send_packet(vid_ctx->codec_context,
                                                      &packet);
                         if (status != 0) {
@@ -75,6 +173,14 @@ receive_frame(struct video_stream_context *vid_ctx)
         if (was_frame_received)
                 return VID_DECODE_SUCCESS;
 
+        if ((read_status == AVERROR_EOF) &&
+            (vid_ctx->keyframe_index != NULL) &&
+            (vid_ctx->last_keyframe_pts != KEYFRAME_INDEX_UNKNOWN)) {
+                keyframe_index_record_last(vid_ctx->keyframe_index,
+                                           vid_ctx->last_keyframe_pts);
+                vid_ctx->last_keyframe_pts = KEYFRAME_INDEX_UNKNOWN;
+        }
+
         /**
          * NOTE(brendan): Flush/drain the codec. After this, subsequent calls
          * to receive_frame will return frames until EOF.
@@ -102,6 +208,24 @@ receive_frame(struct video_stream_context *vid_ctx)
         return VID_DECODE_EOF;
 }
 
+/**
+ * Receives a complete frame from the video stream, keeping track of its
+ * display-order frame number.
+ *
+ * @param vid_ctx Context needed to decode frames from the video stream.
+ *
+ * @return The same status codes as `receive_frame_from_decoder`.
+ */
+static int32_t
+receive_frame(struct video_stream_context *vid_ctx)
+{
+        int32_t status = receive_frame_from_decoder(vid_ctx);
+        if (status == VID_DECODE_SUCCESS)
+                track_received_frame(vid_ctx);
+
+        return status;
+}
+
 /**
  * Allocates an RGB image frame.
  *
@@ -134,10 +258,181 @@ allocate_rgb_image(AVCodecContext *codec_context)
                 av_frame_free(&frame_rgb);
                 return NULL;
         }
+        mem_stats_add(MEM_STATS_FRAME_RGB, status);
 
         return frame_rgb;
 }
 
+/* free_rgb_image() - Frees an RGB image from `allocate_rgb_image`. */
+static void
+free_rgb_image(AVFrame **frame_rgb)
+{
+        mem_stats_sub(MEM_STATS_FRAME_RGB,
+                      av_image_get_buffer_size(AV_PIX_FMT_RGB24,
+                                               (*frame_rgb)->width,
+                                               (*frame_rgb)->height,
+                                               32));
+        av_freep((*frame_rgb)->data);
+        av_frame_free(frame_rgb);
+}
+
+/**
+ * struct frame_diff_state - Scratch frames for emitting a clip's temporal
+ * differences (see `struct frame_diff_output`) as its frames are converted.
+ * @out: The differences to emit.
+ * @prev_rgb: The previously converted frame, still in cache, or NULL if no
+ * differences are wanted.
+ * @first_rgb: A copy of the first converted frame, for looping padding, or
+ * NULL.
+ */
+struct frame_diff_state {
+        const struct frame_diff_output *out;
+        AVFrame *prev_rgb;
+        AVFrame *first_rgb;
+};
+
+static void
+init_frame_diff_state(struct frame_diff_state *diff,
+                      const struct video_stream_context *vid_ctx,
+                      enum vid_pad_mode pad_mode)
+{
+        diff->out = &vid_ctx->diff;
+        diff->prev_rgb = NULL;
+        diff->first_rgb = NULL;
+        if (vid_ctx->diff.type == FRAME_DIFF_NONE)
+                return;
+
+        diff->prev_rgb = allocate_rgb_image(vid_ctx->codec_context);
+        assert(diff->prev_rgb != NULL);
+        if (pad_mode == VID_PAD_LOOP) {
+                diff->first_rgb = allocate_rgb_image(vid_ctx->codec_context);
+                assert(diff->first_rgb != NULL);
+        }
+}
+
+static void
+free_frame_diff_state(struct frame_diff_state *diff)
+{
+        if (diff->prev_rgb != NULL)
+                free_rgb_image(&diff->prev_rgb);
+        if (diff->first_rgb != NULL)
+                free_rgb_image(&diff->first_rgb);
+}
+
+/**
+ * frame_diff_bytes() - Returns the size in bytes of each of `diff`'s
+ * difference frames.
+ */
+static uint64_t
+frame_diff_bytes(const struct frame_diff_state *diff)
+{
+        return (uint64_t)3*diff->prev_rgb->width*diff->prev_rgb->height*
+               frame_diff_type_size(diff->out->type);
+}
+
+/**
+ * emit_frame_diff() - Writes the difference between the just-converted frame
+ * number `frame_index` in `frame_rgb` and the frame before it, then keeps
+ * `frame_rgb` as the previous frame.
+ *
+ * NOTE(brendan): The two frames swap buffers rather than being copied, so
+ * that the previous frame is the one the scaler last wrote, and is likely
+ * still in cache.
+ */
+static void
+emit_frame_diff(struct frame_diff_state *diff,
+                AVFrame *frame_rgb,
+                uint32_t frame_index)
+{
+        if ((diff == NULL) || (diff->prev_rgb == NULL))
+                return;
+
+        AVFrame *prev_rgb = diff->prev_rgb;
+        if (frame_index > 0)
+                frame_diff_rows(diff->out->dest +
+                                (frame_index - 1)*frame_diff_bytes(diff),
+                                frame_rgb->data[0],
+                                frame_rgb->linesize[0],
+                                prev_rgb->data[0],
+                                prev_rgb->linesize[0],
+                                3*frame_rgb->width,
+                                frame_rgb->height,
+                                diff->out->type);
+        else if (diff->first_rgb != NULL)
+                for (int32_t row_index = 0;
+                     row_index < frame_rgb->height;
+                     ++row_index)
+                        memcpy(diff->first_rgb->data[0] +
+                               row_index*diff->first_rgb->linesize[0],
+                               frame_rgb->data[0] +
+                               row_index*frame_rgb->linesize[0],
+                               3*frame_rgb->width);
+
+        uint8_t *data = frame_rgb->data[0];
+        frame_rgb->data[0] = prev_rgb->data[0];
+        prev_rgb->data[0] = data;
+}
+
+/**
+ * pad_diffs_to_end() - Writes the differences of the frames that
+ * `pad_to_buffer_end` pads a clip of `frame_number` decoded frames with.
+ */
+static void
+pad_diffs_to_end(const struct frame_diff_state *diff,
+                 int32_t frame_number,
+                 int32_t num_requested_frames,
+                 enum vid_pad_mode pad_mode)
+{
+        if ((diff == NULL) ||
+            (diff->prev_rgb == NULL) ||
+            (frame_number >= num_requested_frames) ||
+            (pad_mode == VID_PAD_NONE))
+                return;
+
+        const AVFrame *last_rgb = diff->prev_rgb;
+        const AVFrame *first_rgb = diff->first_rgb;
+        const uint64_t diff_bytes = frame_diff_bytes(diff);
+        uint8_t *dest = diff->out->dest;
+
+        /**
+         * NOTE(brendan): Without any decoded frames, the clip is not padded
+         * either, so its differences are zeroed.
+         */
+        for (int32_t pad_index = (frame_number > 0) ? frame_number : 1;
+             pad_index < num_requested_frames;
+             ++pad_index) {
+                uint8_t *pad_diff = dest + (pad_index - 1)*diff_bytes;
+                if ((frame_number == 0) ||
+                    (pad_mode == VID_PAD_LAST) ||
+                    ((pad_mode == VID_PAD_ZEROS) &&
+                     (pad_index > frame_number)))
+                        memset(pad_diff, 0, diff_bytes);
+                else if (pad_mode == VID_PAD_ZEROS)
+                        frame_diff_rows(pad_diff,
+                                        NULL,
+                                        0,
+                                        last_rgb->data[0],
+                                        last_rgb->linesize[0],
+                                        3*last_rgb->width,
+                                        last_rgb->height,
+                                        diff->out->type);
+                else if ((pad_index % frame_number) == 0)
+                        frame_diff_rows(pad_diff,
+                                        first_rgb->data[0],
+                                        first_rgb->linesize[0],
+                                        last_rgb->data[0],
+                                        last_rgb->linesize[0],
+                                        3*last_rgb->width,
+                                        last_rgb->height,
+                                        diff->out->type);
+                else
+                        memcpy(pad_diff,
+                               dest + ((pad_index % frame_number) - 1)*
+                               diff_bytes,
+                               diff_bytes);
+        }
+}
+
 /**
  * Copies the received frame in `frame` to `dest`, using `frame_rgb` as
  * temporary storage for `sws_scale`.
@@ -148,6 +443,13 @@ allocate_rgb_image(AVCodecContext *codec_context)
  * @param sws_context Context to use for sws_scale operation.
  * @param copied_bytes Number of bytes already copied into dest from the video.
  * @param bytes_per_row Number of bytes per row in the video.
+ * @param use_streaming_stores Write `dest` with non-temporal stores (see
+ * frame_copy.h).
+ * @param tubelet Tubelet layout of `dest`, or NULL for plain frames. With
+ * tubelets, the frame is scattered to its place as frame number
+ * `copied_bytes`/(bytes per frame).
+ * @param diff State for emitting temporal differences, or NULL. `dest` may be
+ * NULL if only the differences are wanted.
  *
  * @return Number of bytes copied to `dest`, including the frame copied over by
  * this function.
@@ -159,8 +461,13 @@ copy_next_frame(uint8_t *dest,
                 AVCodecContext *codec_context,
                 struct SwsContext *sws_context,
                 uint32_t copied_bytes,
-                const uint32_t bytes_per_row)
+                const uint32_t bytes_per_row,
+                bool use_streaming_stores,
+                const struct tubelet_layout *tubelet,
+                struct frame_diff_state *diff)
 {
+        const uint32_t bytes_per_frame = bytes_per_row*frame_rgb->height;
+
         sws_scale(sws_context,
                   (const uint8_t * const *)(frame->data),
                   frame->linesize,
@@ -169,44 +476,130 @@ copy_next_frame(uint8_t *dest,
                   frame_rgb->data,
                   frame_rgb->linesize);
 
-        uint8_t *next_row = frame_rgb->data[0];
-        for (int32_t row_index = 0;
-             row_index < frame_rgb->height;
-             ++row_index) {
-                memcpy(dest + copied_bytes, next_row, bytes_per_row);
+        if ((dest != NULL) && (tubelet != NULL) && (tubelet->num_frames > 0))
+                frame_copy_to_tubelets(dest,
+                                       frame_rgb->data[0],
+                                       frame_rgb->linesize[0],
+                                       copied_bytes/bytes_per_frame,
+                                       frame_rgb->width,
+                                       frame_rgb->height,
+                                       tubelet,
+                                       use_streaming_stores);
+        else if (dest != NULL)
+                frame_copy_rows(dest + copied_bytes,
+                                frame_rgb->data[0],
+                                frame_rgb->linesize[0],
+                                bytes_per_row,
+                                frame_rgb->height,
+                                use_streaming_stores);
+
+        emit_frame_diff(diff, frame_rgb, copied_bytes/bytes_per_frame);
+
+        return copied_bytes + bytes_per_frame;
+}
+
+int32_t
+decode_next_frame(struct video_stream_context *vid_ctx,
+                  int64_t *frame_number_out)
+{
+        for (;;) {
+                int64_t next_frame_number = vid_ctx->next_frame_number;
+                int32_t status = receive_frame(vid_ctx);
+                if (status != VID_DECODE_SUCCESS)
+                        return status;
+
+                /**
+                 * NOTE(brendan): A known frame number that did not advance
+                 * means a repeated PTS, which is skipped as a duplicate.
+                 */
+                if ((next_frame_number != KEYFRAME_INDEX_UNKNOWN) &&
+                    (vid_ctx->next_frame_number == next_frame_number))
+                        continue;
 
-                next_row += frame_rgb->linesize[0];
-                copied_bytes += bytes_per_row;
+                *frame_number_out =
+                        (vid_ctx->next_frame_number != KEYFRAME_INDEX_UNKNOWN) ?
+                        vid_ctx->next_frame_number - 1 :
+                        KEYFRAME_INDEX_UNKNOWN;
+
+                return VID_DECODE_SUCCESS;
         }
+}
+
+int32_t
+copy_frame_to_rgb(uint8_t *dest, struct video_stream_context *vid_ctx)
+{
+        AVCodecContext *codec_context = vid_ctx->codec_context;
+        struct SwsContext *sws_context = codec_cache_get_scaler(
+                codec_context->width,
+                codec_context->height,
+                codec_context->pix_fmt,
+                vid_ctx->sws_flags);
+        if (sws_context == NULL)
+                return VID_DECODE_FFMPEG_ERR;
 
-        return copied_bytes;
+        uint8_t *const dest_planes[] = {dest};
+        const int32_t dest_linesizes[] = {3*codec_context->width};
+        sws_scale(sws_context,
+                  (const uint8_t * const *)(vid_ctx->frame->data),
+                  vid_ctx->frame->linesize,
+                  0,
+                  codec_context->height,
+                  dest_planes,
+                  dest_linesizes);
+
+        return VID_DECODE_SUCCESS;
 }
 
 /**
- * Loops the frames already received in `dest` until the `num_requested_frames`
- * have been satisfied.
+ * Pads `dest` past the frames already received, until the
+ * `num_requested_frames` have been satisfied.
  *
  * @param dest Output RGB24 frame buffer.
  * @param copied_bytes Number of bytes already copied into `dest`.
  * @param frame_number The number of the next frame to copy into `dest`.
  * @param bytes_per_frame The number of bytes per frame (3*width*height).
  * @param num_requested_frames The number of frames that were requested.
+ * @param pad_mode How to fill the remaining frames.
  */
 static void
-loop_to_buffer_end(uint8_t *dest,
-                   uint32_t copied_bytes,
-                   int32_t frame_number,
-                   uint32_t bytes_per_frame,
-                   int32_t num_requested_frames)
+pad_to_buffer_end(uint8_t *dest,
+                  uint32_t copied_bytes,
+                  int32_t frame_number,
+                  uint32_t bytes_per_frame,
+                  int32_t num_requested_frames,
+                  enum vid_pad_mode pad_mode)
 {
+        int32_t remaining_frames = (num_requested_frames - frame_number);
+        if ((remaining_frames <= 0) || (pad_mode == VID_PAD_NONE))
+                return;
+
+        if (pad_mode == VID_PAD_ZEROS) {
+                memset(dest + copied_bytes,
+                       0,
+                       remaining_frames*bytes_per_frame);
+                return;
+        }
+
         //fprintf(stderr, "Ran out of frames. Looping.\n");
         if (frame_number == 0) {
                 fprintf(stderr, "No frames received after seek.\n");
                 return;
         }
 
+        if (pad_mode == VID_PAD_LAST) {
+                const uint8_t *last_frame = dest + copied_bytes - bytes_per_frame;
+                for (;
+                     remaining_frames > 0;
+                     --remaining_frames) {
+                        memcpy(dest + copied_bytes,
+                               last_frame,
+                               bytes_per_frame);
+                        copied_bytes += bytes_per_frame;
+                }
+                return;
+        }
+
         uint32_t bytes_to_copy = copied_bytes;
-        int32_t remaining_frames = (num_requested_frames - frame_number);
         while (remaining_frames > 0) {
                 if (remaining_frames < frame_number)
                         bytes_to_copy = remaining_frames*bytes_per_frame;
@@ -218,40 +611,128 @@ loop_to_buffer_end(uint8_t *dest,
         }
 }
 
+/**
+ * pad_clip_to_end() - `pad_to_buffer_end` for a clip decoded by `vid_ctx`,
+ * which may be in tubelet order (see `struct tubelet_layout`), and its
+ * differences in `diff`, if any. `dest` is NULL if only the differences are
+ * wanted.
+ */
+static void
+pad_clip_to_end(uint8_t *dest,
+                uint32_t copied_bytes,
+                int32_t frame_number,
+                uint32_t bytes_per_frame,
+                int32_t num_requested_frames,
+                enum vid_pad_mode pad_mode,
+                const struct video_stream_context *vid_ctx,
+                const struct frame_diff_state *diff)
+{
+        pad_diffs_to_end(diff, frame_number, num_requested_frames, pad_mode);
+        if (dest == NULL)
+                return;
+
+        const struct tubelet_layout *tubelet = &vid_ctx->tubelet;
+        if (tubelet->num_frames == 0) {
+                pad_to_buffer_end(dest,
+                                  copied_bytes,
+                                  frame_number,
+                                  bytes_per_frame,
+                                  num_requested_frames,
+                                  pad_mode);
+                return;
+        }
+
+        if ((frame_number >= num_requested_frames) ||
+            (pad_mode == VID_PAD_NONE))
+                return;
+
+        if ((pad_mode != VID_PAD_ZEROS) && (frame_number == 0)) {
+                fprintf(stderr, "No frames received after seek.\n");
+                return;
+        }
+
+        for (int32_t pad_index = frame_number;
+             pad_index < num_requested_frames;
+             ++pad_index) {
+                int32_t src_index;
+                if (pad_mode == VID_PAD_ZEROS)
+                        src_index = -1;
+                else if (pad_mode == VID_PAD_LAST)
+                        src_index = frame_number - 1;
+                else
+                        src_index = pad_index % frame_number;
+
+                frame_copy_tubelet_frame(dest,
+                                         pad_index,
+                                         src_index,
+                                         vid_ctx->codec_context->width,
+                                         vid_ctx->codec_context->height,
+                                         tubelet);
+        }
+}
+
 void
+fill_pad_index_map(int32_t *index_map,
+                   int32_t num_decoded_frames,
+                   int32_t num_requested_frames,
+                   enum vid_pad_mode pad_mode)
+{
+        for (int32_t i = 0;
+             i < num_requested_frames;
+             ++i) {
+                if (i < num_decoded_frames)
+                        index_map[i] = i;
+                else if ((num_decoded_frames == 0) ||
+                         (pad_mode == VID_PAD_ZEROS) ||
+                         (pad_mode == VID_PAD_NONE))
+                        index_map[i] = -1;
+                else if (pad_mode == VID_PAD_LAST)
+                        index_map[i] = num_decoded_frames - 1;
+                else
+                        index_map[i] = i % num_decoded_frames;
+        }
+}
+
+int32_t
 decode_video_to_out_buffer(uint8_t *dest,
                            struct video_stream_context *vid_ctx,
-                           int32_t num_requested_frames)
+                           int32_t num_requested_frames,
+                           enum vid_pad_mode pad_mode)
 {
         AVCodecContext *codec_context = vid_ctx->codec_context;
-        struct SwsContext *sws_context = sws_getContext(codec_context->width,
-                                                        codec_context->height,
-                                                        codec_context->pix_fmt,
-                                                        codec_context->width,
-                                                        codec_context->height,
-                                                        AV_PIX_FMT_RGB24,
-                                                        SWS_BILINEAR,
-                                                        NULL,
-                                                        NULL,
-                                                        NULL);
+        struct SwsContext *sws_context = codec_cache_get_scaler(
+                codec_context->width,
+                codec_context->height,
+                codec_context->pix_fmt,
+                vid_ctx->sws_flags);
         assert(sws_context != NULL);
 
         AVFrame *frame_rgb = allocate_rgb_image(codec_context);
         assert(frame_rgb != NULL);
 
+        struct frame_diff_state diff;
+        init_frame_diff_state(&diff, vid_ctx, pad_mode);
+
         const uint32_t bytes_per_row = 3*frame_rgb->width;
         const uint32_t bytes_per_frame = bytes_per_row*frame_rgb->height;
+        const bool use_streaming_stores =
+                frame_copy_should_stream((uint64_t)num_requested_frames*
+                                         bytes_per_frame);
         uint32_t copied_bytes = 0;
-        for (int32_t frame_number = 0;
+        int32_t frame_number;
+        for (frame_number = 0;
              frame_number < num_requested_frames;
              ++frame_number) {
                 int32_t status = receive_frame(vid_ctx);
                 if (status == VID_DECODE_EOF) {
-                        loop_to_buffer_end(dest,
-                                           copied_bytes,
-                                           frame_number,
-                                           bytes_per_frame,
-                                           num_requested_frames);
+                        pad_clip_to_end(dest,
+                                        copied_bytes,
+                                        frame_number,
+                                        bytes_per_frame,
+                                        num_requested_frames,
+                                        pad_mode,
+                                        vid_ctx,
+                                        &diff);
                         break;
                 }
                 assert(status == VID_DECODE_SUCCESS);
@@ -262,13 +743,16 @@ decode_video_to_out_buffer(uint8_t *dest,
                                                codec_context,
                                                sws_context,
                                                copied_bytes,
-                                               bytes_per_row);
+                                               bytes_per_row,
+                                               use_streaming_stores,
+                                               &vid_ctx->tubelet,
+                                               &diff);
         }
 
-        av_freep(frame_rgb->data);
-        av_frame_free(&frame_rgb);
+        free_frame_diff_state(&diff);
+        free_rgb_image(&frame_rgb);
 
-        sws_freeContext(sws_context);
+        return frame_number;
 }
 
 int32_t read_memory(void *opaque, uint8_t *buffer, int32_t buf_size_bytes)
@@ -313,6 +797,92 @@ int64_t seek_memory(void *opaque, int64_t offset64, int32_t whence)
         return input_buf->offset_bytes;
 }
 
+int32_t read_memory_direct(void *opaque, uint8_t *buffer, int32_t buf_size_bytes)
+{
+        struct buffer_data *input_buf = (struct buffer_data *)opaque;
+        const char *next_bytes = input_buf->ptr + input_buf->offset_bytes;
+        int32_t bytes_remaining = (input_buf->total_size_bytes -
+                                   input_buf->offset_bytes);
+        if (bytes_remaining <= 0)
+                return AVERROR_EOF;
+        if (bytes_remaining < buf_size_bytes)
+                buf_size_bytes = bytes_remaining;
+
+        /**
+         * NOTE(brendan): The AV I/O buffer is a window onto the input, so
+         * normally the bytes are already in place. avio_read can also read
+         * large requests straight into the caller's buffer, which must be
+         * copied to, but the input itself must never be written.
+         */
+        if ((const char *)buffer != next_bytes) {
+                bool is_in_input = (((const char *)buffer >= input_buf->ptr) &&
+                                    ((const char *)buffer <
+                                     input_buf->ptr + input_buf->total_size_bytes));
+                if (is_in_input)
+                        return AVERROR_BUG;
+
+                memcpy(buffer, next_bytes, buf_size_bytes);
+        }
+
+        input_buf->offset_bytes += buf_size_bytes;
+
+        return buf_size_bytes;
+}
+
+int64_t seek_memory_direct(void *opaque, int64_t offset64, int32_t whence)
+{
+        struct buffer_data *input_buf = (struct buffer_data *)opaque;
+        int64_t offset;
+
+        switch (whence & ~AVSEEK_FORCE) {
+        case SEEK_CUR:
+                offset = input_buf->offset_bytes + offset64;
+                break;
+        case SEEK_END:
+                offset = input_buf->total_size_bytes - offset64;
+                break;
+        case SEEK_SET:
+                offset = offset64;
+                break;
+        case AVSEEK_SIZE:
+                return input_buf->total_size_bytes;
+        default:
+                return AVERROR(EINVAL);
+        }
+
+        if ((offset < 0) || (offset > input_buf->total_size_bytes))
+                return AVERROR(EINVAL);
+
+        /**
+         * NOTE(brendan): avio_seek only calls this for targets outside the
+         * current window, and then restarts its buffer at `avio_ctx->buffer`,
+         * so slide the window to start at the target.
+         */
+        AVIOContext *avio_ctx = input_buf->avio_ctx;
+        input_buf->offset_bytes = (int32_t)offset;
+        avio_ctx->buffer = (uint8_t *)input_buf->ptr + offset;
+        avio_ctx->buffer_size = input_buf->total_size_bytes - (int32_t)offset;
+
+        return offset;
+}
+
+int32_t read_fd(void *opaque, uint8_t *buffer, int32_t buf_size_bytes)
+{
+        const int32_t fd = *(const int32_t *)opaque;
+        ssize_t bytes_read;
+
+        do {
+                bytes_read = read(fd, buffer, buf_size_bytes);
+        } while ((bytes_read < 0) && (errno == EINTR));
+
+        if (bytes_read < 0)
+                return AVERROR(errno);
+        if (bytes_read == 0)
+                return AVERROR_EOF;
+
+        return (int32_t)bytes_read;
+}
+
 /**
  * Probes the input video and returns the resulting guessed file format.
  *
@@ -331,6 +901,7 @@ probe_input_format(struct buffer_data *input_buf, const uint32_t buffer_size)
                                   probe_buf_size_bytes,
                                   NULL};
         assert(probe_data.buf != NULL);
+        mem_stats_add(MEM_STATS_PROBE, probe_buf_size_bytes);
 
         memset(probe_data.buf, 0, probe_buf_size_bytes);
 
@@ -339,6 +910,7 @@ probe_input_format(struct buffer_data *input_buf, const uint32_t buffer_size)
 
         AVInputFormat *io_format = av_probe_input_format(&probe_data, 1);
         av_freep(&probe_data.buf);
+        mem_stats_sub(MEM_STATS_PROBE, probe_buf_size_bytes);
 
         return io_format;
 }
@@ -375,14 +947,14 @@ find_video_stream_index(AVFormatContext *format_context)
 int32_t
 setup_format_context(AVFormatContext **format_context_ptr,
                      AVIOContext *avio_ctx,
-                     struct buffer_data *input_buf,
-                     const uint32_t buffer_size)
+                     AVInputFormat *input_format,
+                     const struct video_meta *meta)
 {
         AVFormatContext *format_context = *format_context_ptr;
 
         format_context->pb = avio_ctx;
         format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
-        format_context->iformat = probe_input_format(input_buf, buffer_size);
+        format_context->iformat = input_format;
 
         int32_t status = avformat_open_input(format_context_ptr,
                                              "",
@@ -400,40 +972,239 @@ setup_format_context(AVFormatContext **format_context_ptr,
                 return VID_DECODE_FFMPEG_ERR;
         }
 
+        /**
+         * NOTE(brendan): With known metadata, skip the (expensive) decoding
+         * of the first packets done by avformat_find_stream_info, as long as
+         * the container header alone was enough to describe the video stream.
+         *
+         * That includes the pixel format, which the scaler is created from
+         * before any frame is decoded. E.g., the mov demuxer leaves it unset
+         * for H.264 until stream info is read.
+         */
+        if (meta != NULL) {
+                int32_t stream_index = find_video_stream_index(format_context);
+                if (stream_index >= 0) {
+                        AVCodecParameters *codecpar =
+                                format_context->streams[stream_index]->codecpar;
+                        if ((codecpar->codec_id != AV_CODEC_ID_NONE) &&
+                            (codecpar->width > 0) &&
+                            (codecpar->height > 0) &&
+                            (codecpar->format != AV_PIX_FMT_NONE))
+                                return stream_index;
+                }
+        }
+
         status = avformat_find_stream_info(format_context, NULL);
         assert(status >= 0);
 
         return find_video_stream_index(format_context);
 }
 
-AVCodecContext *open_video_codec_ctx(AVStream *video_stream)
+/**
+ * track_avio_buffer() - Accounts the AV I/O buffer of `format_context`, of
+ * `num_bytes` allocated by lintel, until `close_format_context`.
+ *
+ * NOTE(brendan): The size is kept in the format context's user data, since
+ * avformat may resize the buffer itself.
+ */
+static void
+track_avio_buffer(AVFormatContext *format_context, int64_t num_bytes)
+{
+        format_context->opaque = (void *)(intptr_t)num_bytes;
+        mem_stats_add(MEM_STATS_AVIO, num_bytes);
+}
+
+void close_format_context(AVFormatContext **format_context_ptr)
+{
+        AVFormatContext *format_context = *format_context_ptr;
+
+        mem_stats_sub(MEM_STATS_AVIO, (intptr_t)format_context->opaque);
+
+        /* NOTE(brendan): An in-place buffer belongs to the caller's input. */
+        if (format_context->pb->read_packet != read_memory_direct)
+                av_freep(&format_context->pb->buffer);
+        av_freep(&format_context->pb);
+        avformat_close_input(format_context_ptr);
+}
+
+/**
+ * rebase_pointer() - Returns the pointer at the same offset from `new_base` as
+ * `ptr` is from `old_base`. `old_base` may be dangling, so the offset is
+ * computed on integers rather than by pointer subtraction.
+ */
+static uint8_t *
+rebase_pointer(uint8_t *ptr, const char *old_base, const char *new_base)
+{
+        return (uint8_t *)new_base + ((uintptr_t)ptr - (uintptr_t)old_base);
+}
+
+void
+rebind_memory_input(AVIOContext *avio_ctx,
+                    struct buffer_data *input_buf,
+                    const char *old_ptr)
+{
+        avio_ctx->opaque = (void *)input_buf;
+        if (avio_ctx->read_packet != read_memory_direct)
+                return;
+
+        input_buf->avio_ctx = avio_ctx;
+        avio_ctx->buffer = rebase_pointer(avio_ctx->buffer,
+                                          old_ptr,
+                                          input_buf->ptr);
+        avio_ctx->buf_ptr = rebase_pointer(avio_ctx->buf_ptr,
+                                           old_ptr,
+                                           input_buf->ptr);
+        avio_ctx->buf_end = rebase_pointer(avio_ctx->buf_end,
+                                           old_ptr,
+                                           input_buf->ptr);
+}
+
+AVCodecContext *
+open_video_codec_ctx(AVStream *video_stream,
+                     int32_t thread_count,
+                     const struct decoder_config *decoder)
 {
         int32_t status;
         AVCodecContext *codec_context;
         AVCodec *video_codec;
+        AVDictionary *options;
 
-        video_codec = avcodec_find_decoder(video_stream->codecpar->codec_id);
+        video_codec = decoder_select_find(video_stream->codecpar->codec_id,
+                                          (decoder != NULL) ? decoder->name :
+                                                              NULL,
+                                          &options);
         if (video_codec == NULL)
                 return NULL;
 
+        /**
+         * NOTE(brendan): Decoders opened with per-decoder options are never
+         * cached, since the options are not part of the cache key. Neither
+         * are frame-threaded decoders, whose idle threads would escape the
+         * thread budget.
+         */
+        const AVCodecParameters *codecpar = video_stream->codecpar;
+        const struct codec_cache_key key = {
+                .codec = video_codec,
+                .thread_count = thread_count,
+                .fast = (decoder != NULL) && decoder->fast,
+                .width = codecpar->width,
+                .height = codecpar->height,
+                .format = codecpar->format,
+                .extradata = codecpar->extradata,
+                .extradata_size = codecpar->extradata_size,
+        };
+        const bool is_cacheable = (av_dict_count(options) == 0) &&
+                                  (thread_count <= 1);
+        if (is_cacheable) {
+                codec_context = codec_cache_acquire_decoder(&key);
+                if (codec_context != NULL)
+                        goto clean_up_options_success;
+        }
+
         codec_context = avcodec_alloc_context3(video_codec);
         if (codec_context == NULL)
-                return NULL;
+                goto clean_up_options;
 
         status = avcodec_parameters_to_context(codec_context,
                                                video_stream->codecpar);
-        if (status != 0) {
-                avcodec_free_context(&codec_context);
-                return NULL;
-        }
+        if (status != 0)
+                goto clean_up_codec_context;
 
-        status = avcodec_open2(codec_context, video_codec, NULL);
-        if (status != 0) {
-                avcodec_free_context(&codec_context);
-                return NULL;
+        codec_context->thread_count = thread_count;
+        codec_context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+        if ((decoder != NULL) && decoder->fast) {
+                codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+                codec_context->skip_loop_filter = AVDISCARD_ALL;
+                codec_context->skip_idct = AVDISCARD_NONREF;
         }
 
+        status = avcodec_open2(codec_context, video_codec, &options);
+        if (status != 0)
+                goto clean_up_codec_context;
+
+        if (is_cacheable)
+                codec_cache_tag_decoder(codec_context, &key);
+
+clean_up_options_success:
+        av_dict_free(&options);
+
         return codec_context;
+
+clean_up_codec_context:
+        avcodec_free_context(&codec_context);
+clean_up_options:
+        av_dict_free(&options);
+
+        return NULL;
+}
+
+void
+reset_vid_stream_position(struct video_stream_context *vid_ctx,
+                          struct keyframe_index *keyframe_index)
+{
+        vid_ctx->keyframe_index = keyframe_index;
+        vid_ctx->next_frame_number = 0;
+        vid_ctx->last_pts = AV_NOPTS_VALUE;
+        vid_ctx->last_keyframe_pts = KEYFRAME_INDEX_UNKNOWN;
+}
+
+/**
+ * Seeks backward to the closest keyframe before `timestamp`.
+ *
+ * If the keyframe index already knows exactly which keyframe that is, the
+ * seek targets that keyframe's PTS directly, so that demuxers with sparse or
+ * missing seek indices (e.g., webm without cues) land on it exactly.
+ *
+ * @param vid_ctx Context with video stream to seek in.
+ * @param timestamp Target timestamp, in the video stream's `time_base`.
+ *
+ * @return The status returned by `av_seek_frame`.
+ */
+static int32_t
+seek_to_keyframe(struct video_stream_context *vid_ctx, int64_t timestamp)
+{
+        struct keyframe_entry keyframe;
+
+        if ((vid_ctx->keyframe_index != NULL) &&
+            keyframe_index_find_closest(vid_ctx->keyframe_index,
+                                        timestamp,
+                                        &keyframe))
+                timestamp = keyframe.pts;
+
+        vid_ctx->next_frame_number = KEYFRAME_INDEX_UNKNOWN;
+        vid_ctx->last_pts = AV_NOPTS_VALUE;
+        vid_ctx->last_keyframe_pts = KEYFRAME_INDEX_UNKNOWN;
+
+        return av_seek_frame(vid_ctx->format_context,
+                             vid_ctx->video_stream_index,
+                             timestamp,
+                             AVSEEK_FLAG_BACKWARD);
+}
+
+void
+vid_decode_seed(uint64_t seed)
+{
+        /* NOTE(brendan): Avoid the unseeded state. */
+        random_state = (seed != 0) ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+uint64_t
+vid_decode_random(void)
+{
+        if (random_state == 0) {
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                vid_decode_seed(((uint64_t)now.tv_sec*1000000000ULL +
+                                 now.tv_nsec) ^
+                                (uintptr_t)&random_state);
+        }
+
+        uint64_t z = (random_state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+
+        return z ^ (z >> 31);
 }
 
 int64_t
@@ -469,7 +1240,8 @@ seek_to_closest_keypoint(float *seek_distance_out,
          * the PTS corresponding to timestamp will be dropped (i.e., frame
          * N - 2 could be dropped, leaving N - 1).
          */
-        int64_t timestamp = rand() % (valid_seek_frame_limit + 1);
+        int64_t timestamp =
+                vid_decode_random() % (uint64_t)(valid_seek_frame_limit + 1);
         if (timestamp == 0)
                 /* NOTE(brendan): Use AV_NOPTS_VALUE to represent no skip. */
                 return AV_NOPTS_VALUE;
@@ -495,10 +1267,7 @@ seek_to_closest_keypoint(float *seek_distance_out,
         if (seek_distance_out != NULL)
                 *seek_distance_out = seek_distance;
 
-        int32_t status = av_seek_frame(vid_ctx->format_context,
-                                       vid_ctx->video_stream_index,
-                                       timestamp,
-                                       AVSEEK_FLAG_BACKWARD);
+        int32_t status = seek_to_keyframe(vid_ctx, timestamp);
         assert(status >= 0);
 
         return timestamp;
@@ -522,37 +1291,39 @@ skip_past_timestamp(struct video_stream_context *vid_ctx, int64_t timestamp)
         return VID_DECODE_SUCCESS;
 }
 
-void
+int32_t
 decode_video_from_frame_nums(uint8_t *dest,
                              struct video_stream_context *vid_ctx,
                              int32_t num_requested_frames,
                              const int32_t *frame_numbers,
                              bool should_seek,
-                             bool use_frame)
+                             bool use_frame,
+                             enum vid_pad_mode pad_mode)
 {
         if (num_requested_frames <= 0)
-                return;
+                return 0;
 
         AVCodecContext *codec_context = vid_ctx->codec_context;
-        struct SwsContext *sws_context = sws_getContext(codec_context->width,
-                                                        codec_context->height,
-                                                        codec_context->pix_fmt,
-                                                        codec_context->width,
-                                                        codec_context->height,
-                                                        AV_PIX_FMT_RGB24,
-                                                        SWS_BILINEAR,
-                                                        NULL,
-                                                        NULL,
-                                                        NULL);
+        struct SwsContext *sws_context = codec_cache_get_scaler(
+                codec_context->width,
+                codec_context->height,
+                codec_context->pix_fmt,
+                vid_ctx->sws_flags);
         assert(sws_context != NULL);
 
         AVFrame *frame_rgb = allocate_rgb_image(codec_context);
         assert(frame_rgb != NULL);
 
+        struct frame_diff_state diff;
+        init_frame_diff_state(&diff, vid_ctx, pad_mode);
+
         int32_t status;
         uint32_t copied_bytes = 0;
         const uint32_t bytes_per_row = 3*frame_rgb->width;
         const uint32_t bytes_per_frame = bytes_per_row*frame_rgb->height;
+        const bool use_streaming_stores =
+                frame_copy_should_stream((uint64_t)num_requested_frames*
+                                         bytes_per_frame);
         int32_t current_frame_index = 0;
         int32_t out_frame_index = 0;
         int64_t prev_pts = 0;
@@ -574,16 +1345,26 @@ decode_video_from_frame_nums(uint8_t *dest,
                                               vid_ctx->nb_frames);
 //                printf('duration %d, nb_frames %d',vid_ctx->duration,vid_ctx->nb_frames);
                 int64_t timestamp;
+                struct keyframe_entry keyframe;
                 if (use_frame){
                      timestamp = frame_numbers[0]*avg_frame_duration;
+
+                     /**
+                      * NOTE(brendan): If the keyframe index knows which
+                      * keyframe precedes the first desired frame, seek to it
+                      * exactly. Receiving it resynchronizes the frame number
+                      * from the index (see track_received_frame).
+                      */
+                     if ((vid_ctx->keyframe_index != NULL) &&
+                         keyframe_index_find_frame(vid_ctx->keyframe_index,
+                                                   frame_numbers[0],
+                                                   &keyframe))
+                             timestamp = keyframe.pts;
                     }
                 else{
                     timestamp = frame_numbers[0]*time_unit;
                     }
-                status = av_seek_frame(vid_ctx->format_context,
-                                       vid_ctx->video_stream_index,
-                                       timestamp,
-                                       AVSEEK_FLAG_BACKWARD);
+                status = seek_to_keyframe(vid_ctx, timestamp);
                 assert(status >= 0);
 
                 /**
@@ -603,10 +1384,14 @@ decode_video_from_frame_nums(uint8_t *dest,
                  */
                 status = receive_frame(vid_ctx);
                 if (status == VID_DECODE_EOF)
-                        goto out_free_frame_rgb_and_sws;
+                        goto out_pad_to_buffer_end;
                 assert(status == VID_DECODE_SUCCESS);
 
-                if (use_frame){
+                if (use_frame &&
+                    (vid_ctx->next_frame_number != KEYFRAME_INDEX_UNKNOWN)) {
+                    current_frame_index = vid_ctx->next_frame_number - 1;
+                }
+                else if (use_frame){
                     current_frame_index = vid_ctx->frame->pts/avg_frame_duration;
                     if (current_frame_index > frame_numbers[0])
                             current_frame_index = frame_numbers[0];
@@ -635,7 +1420,10 @@ decode_video_from_frame_nums(uint8_t *dest,
                                                        codec_context,
                                                        sws_context,
                                                        copied_bytes,
-                                                       bytes_per_row);
+                                                       bytes_per_row,
+                                                       use_streaming_stores,
+                                                       &vid_ctx->tubelet,
+                                                       &diff);
                         ++out_frame_index;
                 }
                 ++current_frame_index;
@@ -650,15 +1438,9 @@ decode_video_from_frame_nums(uint8_t *dest,
                 assert((desired_frame_num >= current_frame_index) &&
                        (desired_frame_num >= 0));
 
-                /* Loop frames instead of aborting if we asked for too many. */
-                if (desired_frame_num > vid_ctx->nb_frames) {
-                        loop_to_buffer_end(dest,
-                                           copied_bytes,
-                                           out_frame_index,
-                                           bytes_per_frame,
-                                           num_requested_frames);
-                        goto out_free_frame_rgb_and_sws;
-                }
+                /* Pad frames instead of aborting if we asked for too many. */
+                if (desired_frame_num > vid_ctx->nb_frames)
+                        goto out_pad_to_buffer_end;
                 if (use_frame){
                      while (current_frame_index <= desired_frame_num) {
 //                        if (current_frame_index == desired_frame_num){
@@ -675,14 +1457,8 @@ decode_video_from_frame_nums(uint8_t *dest,
 
                         status = receive_frame(vid_ctx);
 //                        printf("2->> vid_ctx->frame->pts, %d \n",  vid_ctx->frame->pts);
-                        if (status == VID_DECODE_EOF) {
-                                loop_to_buffer_end(dest,
-                                                   copied_bytes,
-                                                   out_frame_index,
-                                                   bytes_per_frame,
-                                                   num_requested_frames);
-                                goto out_free_frame_rgb_and_sws;
-                        }
+                        if (status == VID_DECODE_EOF)
+                                goto out_pad_to_buffer_end;
                         assert(status == VID_DECODE_SUCCESS);
 
                         /**
@@ -712,14 +1488,8 @@ decode_video_from_frame_nums(uint8_t *dest,
 
                         status = receive_frame(vid_ctx);
 //                        printf("2->> vid_ctx->frame->pts, %d \n",  vid_ctx->frame->pts);
-                        if (status == VID_DECODE_EOF) {
-                                loop_to_buffer_end(dest,
-                                                   copied_bytes,
-                                                   out_frame_index,
-                                                   bytes_per_frame,
-                                                   num_requested_frames);
-                                goto out_free_frame_rgb_and_sws;
-                        }
+                        if (status == VID_DECODE_EOF)
+                                goto out_pad_to_buffer_end;
                         assert(status == VID_DECODE_SUCCESS);
 
                         /**
@@ -743,11 +1513,909 @@ decode_video_from_frame_nums(uint8_t *dest,
                                                codec_context,
                                                sws_context,
                                                copied_bytes,
-                                               bytes_per_row);
+                                               bytes_per_row,
+                                               use_streaming_stores,
+                                               &vid_ctx->tubelet,
+                                               &diff);
+        }
+
+out_pad_to_buffer_end:
+        pad_clip_to_end(dest,
+                        copied_bytes,
+                        out_frame_index,
+                        bytes_per_frame,
+                        num_requested_frames,
+                        pad_mode,
+                        vid_ctx,
+                        &diff);
+
+        free_frame_diff_state(&diff);
+        free_rgb_image(&frame_rgb);
+
+        return out_frame_index;
+}
+
+/**
+ * get_vid_stream_duration() - Fills in `vid_ctx`'s duration and number of
+ * frames from the container headers of its (already opened) video stream.
+ * @vid_ctx: Context with an opened format context and video stream index.
+ */
+static void
+get_vid_stream_duration(struct video_stream_context *vid_ctx)
+{
+        AVStream *video_stream =
+                vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+        if ((video_stream->duration <= 0) || (video_stream->nb_frames <= 0)) {
+                /**
+                 * Some video containers (e.g., webm) contain indices of only
+                 * frames-of-interest, e.g., keyframes, and therefore the whole
+                 * file must be parsed to get the number of frames (nb_frames
+                 * will be zero).
+                 *
+                 * Also, for webm only the duration of the entire file is
+                 * specified in the header (as opposed to the stream duration),
+                 * so the duration must be taken from the AVFormatContext, not
+                 * the AVStream.
+                 *
+                 * See this SO answer: https://stackoverflow.com/a/32538549
+                 */
+
+                /**
+                 * Compute nb_frames from fmt ctx duration (microseconds) and
+                 * stream FPS (frames/second).
+                 */
+                assert(video_stream->avg_frame_rate.den > 0);
+
+                enum AVRounding rnd = (enum AVRounding)(AV_ROUND_DOWN |
+                                                        AV_ROUND_PASS_MINMAX);
+                int64_t fps_num = video_stream->avg_frame_rate.num;
+                int64_t fps_den =
+                        video_stream->avg_frame_rate.den*(int64_t)AV_TIME_BASE;
+                vid_ctx->nb_frames =
+                        av_rescale_rnd(vid_ctx->format_context->duration,
+                                       fps_num,
+                                       fps_den,
+                                       rnd);
+
+                /**
+                 * NOTE(brendan): fmt ctx duration in microseconds =>
+                 *
+                 * fmt ctx duration == (stream duration)*(stream timebase)*1e6
+                 *
+                 * since stream timebase is in units of
+                 * seconds / (stream timestamp). The rest of the code expects
+                 * the duration in stream timestamps, so do the conversion
+                 * here.
+                 *
+                 * Multiply the timebase numerator by AV_TIME_BASE to get a
+                 * more accurate rounded duration by doing the rounding in the
+                 * higher precision units.
+                 */
+                int64_t tb_num = video_stream->time_base.num*(int64_t)AV_TIME_BASE;
+                int64_t tb_den = video_stream->time_base.den;
+                vid_ctx->duration =
+                        av_rescale_rnd(vid_ctx->format_context->duration,
+                                       tb_den,
+                                       tb_num,
+                                       rnd);
+        } else {
+                vid_ctx->duration = video_stream->duration;
+                vid_ctx->nb_frames = video_stream->nb_frames;
+        }
+}
+
+int32_t
+open_vid_stream_format(struct video_stream_context *vid_ctx,
+                       struct buffer_data *input_buf,
+                       const struct video_meta *meta)
+{
+        const uint32_t buffer_size = 32*1024;
+        AVInputFormat *input_format = probe_input_format(input_buf,
+                                                         buffer_size);
+
+        /**
+         * NOTE(brendan): Demux straight from the input, with the AV I/O
+         * buffer as a window onto it, unless the format could not be probed
+         * here: avformat_open_input would then probe it by reallocating the
+         * AV I/O buffer.
+         */
+        const bool is_in_place = (input_format != NULL);
+        uint8_t *avio_ctx_buffer;
+        AVIOContext *avio_ctx;
+        if (is_in_place) {
+                avio_ctx_buffer = (uint8_t *)input_buf->ptr;
+                avio_ctx = avio_alloc_context(avio_ctx_buffer,
+                                              input_buf->total_size_bytes,
+                                              0,
+                                              (void *)input_buf,
+                                              &read_memory_direct,
+                                              NULL,
+                                              &seek_memory_direct);
+                input_buf->avio_ctx = avio_ctx;
+        } else {
+                avio_ctx_buffer = av_malloc(buffer_size);
+                if (avio_ctx_buffer == NULL)
+                        return VID_DECODE_FFMPEG_ERR;
+
+                avio_ctx = avio_alloc_context(avio_ctx_buffer,
+                                              buffer_size,
+                                              0,
+                                              (void *)input_buf,
+                                              &read_memory,
+                                              NULL,
+                                              &seek_memory);
+        }
+        if (avio_ctx == NULL)
+                goto clean_up_avio_ctx_buffer;
+
+        vid_ctx->format_context = avformat_alloc_context();
+        if (vid_ctx->format_context == NULL)
+                goto clean_up_avio_ctx;
+
+        vid_ctx->video_stream_index =
+                setup_format_context(&vid_ctx->format_context,
+                                     avio_ctx,
+                                     input_format,
+                                     meta);
+        if (vid_ctx->video_stream_index < 0) {
+                fprintf(stderr, "Stream index not found.\n");
+
+                if (vid_ctx->video_stream_index == VID_DECODE_FFMPEG_ERR)
+                        /**
+                         * NOTE(brendan): Return a unique error code here so
+                         * that if there is no video stream a garbage buffer
+                         * can be returned.
+                         *
+                         * format_context, avio_ctx, and avio_ctx_buffer have
+                         * already been cleaned up (see setup_format_context
+                         * comment).
+                         */
+                        return VID_DECODE_ERR_STREAM_INDEX;
+
+                goto clean_up_format_context;
+        }
+
+        if (!is_in_place)
+                track_avio_buffer(vid_ctx->format_context, buffer_size);
+
+        if (meta == NULL)
+                get_vid_stream_duration(vid_ctx);
+
+        return VID_DECODE_SUCCESS;
+
+clean_up_format_context:
+        avformat_close_input(&vid_ctx->format_context);
+clean_up_avio_ctx:
+        av_freep(&avio_ctx);
+clean_up_avio_ctx_buffer:
+        if (!is_in_place)
+                av_freep(&avio_ctx_buffer);
+
+        return VID_DECODE_FFMPEG_ERR;
+}
+
+/**
+ * open_vid_stream_decoder() - Opens a decoder for the video stream of
+ * `vid_ctx`, whose demuxer has already been opened.
+ * @vid_ctx: Context whose `codec_context` and `frame` will be filled in.
+ * @keyframe_index: Keyframe index to update while decoding, or NULL. Held by
+ * `vid_ctx` from then on.
+ * @decoder: How to open the decoder, or NULL for the defaults.
+ *
+ * On failure, the demuxer is closed, `keyframe_index` is put, and
+ * VID_DECODE_FFMPEG_ERR is returned.
+ */
+static int32_t
+open_vid_stream_decoder(struct video_stream_context *vid_ctx,
+                        struct keyframe_index *keyframe_index,
+                        const struct decoder_config *decoder)
+{
+        AVStream *video_stream =
+                vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+        vid_ctx->thread_grant =
+                thread_budget_acquire(video_stream->codecpar->width,
+                                      video_stream->codecpar->height);
+        vid_ctx->codec_context =
+                open_video_codec_ctx(video_stream,
+                                     vid_ctx->thread_grant.num_threads,
+                                     decoder);
+        if (vid_ctx->codec_context == NULL)
+                goto clean_up_format_context;
+
+        vid_ctx->sws_flags = ((decoder != NULL) && decoder->fast_scale) ?
+                             SWS_POINT : SWS_BILINEAR;
+        vid_ctx->tubelet = (decoder != NULL) ? decoder->tubelet :
+                                               (struct tubelet_layout){0};
+        vid_ctx->diff = (struct frame_diff_output){.type = FRAME_DIFF_NONE,
+                                                   .dest = NULL};
+
+        vid_ctx->frame = av_frame_alloc();
+        if (vid_ctx->frame == NULL)
+                goto clean_up_avcodec;
+
+        /**
+         * NOTE(brendan): Estimate the decoder's frames as one per codec
+         * thread, plus the frames held back for reordering.
+         */
+        AVCodecContext *codec_context = vid_ctx->codec_context;
+        int32_t frame_size = av_image_get_buffer_size(codec_context->pix_fmt,
+                                                      codec_context->width,
+                                                      codec_context->height,
+                                                      1);
+        vid_ctx->decoder_mem_bytes =
+                (int64_t)FFMAX(frame_size, 0)*
+                (vid_ctx->thread_grant.num_threads +
+                 codec_context->has_b_frames +
+                 1);
+        mem_stats_add(MEM_STATS_DECODER, vid_ctx->decoder_mem_bytes);
+
+        reset_vid_stream_position(vid_ctx, keyframe_index);
+
+        return VID_DECODE_SUCCESS;
+
+clean_up_avcodec:
+        codec_cache_release_decoder(&vid_ctx->codec_context, 0);
+clean_up_format_context:
+        thread_budget_release(&vid_ctx->thread_grant);
+        keyframe_index_put(&keyframe_index);
+        close_format_context(&vid_ctx->format_context);
+
+        return VID_DECODE_FFMPEG_ERR;
+}
+
+int32_t
+setup_vid_stream_format(struct video_stream_context *vid_ctx,
+                        struct buffer_data *input_buf,
+                        const uint64_t *video_key,
+                        const struct video_meta *meta)
+{
+        memset(vid_ctx, 0, sizeof(*vid_ctx));
+
+        bool is_cached = ((video_key != NULL) &&
+                          format_cache_acquire(vid_ctx, input_buf, *video_key));
+        if (!is_cached) {
+                int32_t status = open_vid_stream_format(vid_ctx,
+                                                        input_buf,
+                                                        meta);
+                if (status != VID_DECODE_SUCCESS)
+                        return status;
+        }
+
+        if (meta != NULL) {
+                vid_ctx->duration = meta->duration;
+                vid_ctx->nb_frames = meta->nb_frames;
+        }
+
+        return VID_DECODE_SUCCESS;
+}
+
+int32_t
+setup_vid_stream_context(struct video_stream_context *vid_ctx,
+                         struct buffer_data *input_buf,
+                         const uint64_t *video_key,
+                         const struct video_meta *meta,
+                         const struct decoder_config *decoder)
+{
+        int32_t status = setup_vid_stream_format(vid_ctx,
+                                                 input_buf,
+                                                 video_key,
+                                                 meta);
+        if (status != VID_DECODE_SUCCESS)
+                return status;
+
+        struct keyframe_index *keyframe_index = NULL;
+        if (video_key != NULL)
+                keyframe_index = keyframe_index_get(*video_key);
+
+        return open_vid_stream_decoder(vid_ctx, keyframe_index, decoder);
+}
+
+int32_t
+setup_vid_stream_decoder(struct video_stream_context *vid_ctx,
+                         const struct decoder_config *decoder)
+{
+        return open_vid_stream_decoder(vid_ctx, NULL, decoder);
+}
+
+int32_t
+setup_vid_stream_reader(struct video_stream_context *vid_ctx,
+                        vid_stream_read_fn read_packet,
+                        void *opaque,
+                        uint32_t buffer_size,
+                        const struct decoder_config *decoder)
+{
+        uint8_t *avio_ctx_buffer = av_malloc(buffer_size);
+        if (avio_ctx_buffer == NULL)
+                return VID_DECODE_FFMPEG_ERR;
+
+        AVIOContext *avio_ctx = avio_alloc_context(avio_ctx_buffer,
+                                                   buffer_size,
+                                                   0,
+                                                   opaque,
+                                                   read_packet,
+                                                   NULL,
+                                                   NULL);
+        if (avio_ctx == NULL) {
+                av_freep(&avio_ctx_buffer);
+                return VID_DECODE_FFMPEG_ERR;
+        }
+        avio_ctx->seekable = 0;
+
+        vid_ctx->format_context = avformat_alloc_context();
+        if (vid_ctx->format_context == NULL)
+                goto clean_up_avio_ctx;
+
+        vid_ctx->format_context->pb = avio_ctx;
+        vid_ctx->format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+        /**
+         * NOTE(brendan): With no seek callback, the input format is probed
+         * from the start of the stream, which avformat buffers so that it can
+         * rewind after probing.
+         */
+        if (avformat_open_input(&vid_ctx->format_context, "", NULL, NULL) < 0)
+                goto clean_up_avio_ctx;
+        track_avio_buffer(vid_ctx->format_context, buffer_size);
+
+        if (avformat_find_stream_info(vid_ctx->format_context, NULL) < 0)
+                goto clean_up_format_context;
+
+        vid_ctx->video_stream_index =
+                find_video_stream_index(vid_ctx->format_context);
+        if (vid_ctx->video_stream_index < 0) {
+                close_format_context(&vid_ctx->format_context);
+                return VID_DECODE_ERR_STREAM_INDEX;
+        }
+
+        /* NOTE(brendan): Only known if the container header says so. */
+        AVStream *video_stream =
+                vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+        vid_ctx->duration = FFMAX(video_stream->duration, 0);
+        vid_ctx->nb_frames = FFMAX(video_stream->nb_frames, 0);
+
+        return open_vid_stream_decoder(vid_ctx, NULL, decoder);
+
+clean_up_format_context:
+        close_format_context(&vid_ctx->format_context);
+
+        return VID_DECODE_FFMPEG_ERR;
+
+clean_up_avio_ctx:
+        av_freep(&avio_ctx->buffer);
+        av_freep(&avio_ctx);
+
+        return VID_DECODE_FFMPEG_ERR;
+}
+
+void
+clean_up_vid_ctx(struct video_stream_context *vid_ctx,
+                 const struct buffer_data *input_buf,
+                 const uint64_t *video_key)
+{
+        av_frame_free(&vid_ctx->frame);
+        mem_stats_sub(MEM_STATS_DECODER, vid_ctx->decoder_mem_bytes);
+        codec_cache_release_decoder(&vid_ctx->codec_context,
+                                    vid_ctx->decoder_mem_bytes);
+        vid_ctx->decoder_mem_bytes = 0;
+        thread_budget_release(&vid_ctx->thread_grant);
+        keyframe_index_put(&vid_ctx->keyframe_index);
+
+        if ((video_key != NULL) &&
+            format_cache_release(vid_ctx, input_buf, *video_key))
+                return;
+
+        close_format_context(&vid_ctx->format_context);
+}
+
+/**
+ * push_pts() - Appends `pts` to the growable array `*pts_array`.
+ *
+ * Returns false if allocation failed.
+ */
+static bool
+push_pts(int64_t **pts_array, int64_t *length, int64_t *capacity, int64_t pts)
+{
+        if (*length == *capacity) {
+                int64_t new_capacity = (*capacity == 0) ? 256 : 2*(*capacity);
+                int64_t *new_array = realloc(*pts_array,
+                                             new_capacity*sizeof(int64_t));
+                if (new_array == NULL)
+                        return false;
+
+                *pts_array = new_array;
+                *capacity = new_capacity;
+        }
+
+        (*pts_array)[*length] = pts;
+        ++*length;
+
+        return true;
+}
+
+static int
+compare_pts(const void *a, const void *b)
+{
+        int64_t pts_a = *(const int64_t *)a;
+        int64_t pts_b = *(const int64_t *)b;
+
+        return (pts_a > pts_b) - (pts_a < pts_b);
+}
+
+/**
+ * find_frame_number() - Returns the display-order number of the frame at
+ * `pts`, or -1 if no frame in `layout` is at `pts`.
+ */
+static int64_t
+find_frame_number(const struct gop_layout *layout, int64_t pts)
+{
+        int64_t low = 0;
+        int64_t high = layout->num_frames;
+
+        while (low < high) {
+                int64_t mid = low + (high - low)/2;
+                if (layout->sorted_pts[mid] < pts)
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+
+        if ((low == layout->num_frames) || (layout->sorted_pts[low] != pts))
+                return -1;
+
+        return low;
+}
+
+int32_t
+scan_gop_layout(struct gop_layout *layout,
+                const struct buffer_data *input_buf,
+                const struct video_meta *meta)
+{
+        struct buffer_data scan_buf = {.ptr = input_buf->ptr,
+                                       .offset_bytes = 0,
+                                       .total_size_bytes =
+                                               input_buf->total_size_bytes,
+                                       .avio_ctx = NULL};
+        struct video_stream_context vid_ctx;
+        int64_t frames_capacity = 0;
+        int64_t gops_capacity = 0;
+        AVPacket packet;
+
+        memset(layout, 0, sizeof(*layout));
+
+        int32_t status = open_vid_stream_format(&vid_ctx, &scan_buf, meta);
+        if (status != VID_DECODE_SUCCESS)
+                return status;
+
+        av_init_packet(&packet);
+        while (av_read_frame(vid_ctx.format_context, &packet) == 0) {
+                bool is_ok = true;
+                if (packet.stream_index == vid_ctx.video_stream_index) {
+                        is_ok = ((packet.pts != AV_NOPTS_VALUE) &&
+                                 push_pts(&layout->sorted_pts,
+                                          &layout->num_frames,
+                                          &frames_capacity,
+                                          packet.pts));
+                        if (is_ok && (packet.flags & AV_PKT_FLAG_KEY))
+                                is_ok = push_pts(&layout->gop_pts,
+                                                 &layout->num_gops,
+                                                 &gops_capacity,
+                                                 packet.pts);
+                }
+                av_packet_unref(&packet);
+
+                if (!is_ok) {
+                        status = VID_DECODE_FFMPEG_ERR;
+                        break;
+                }
+        }
+        close_format_context(&vid_ctx.format_context);
+
+        if ((status != VID_DECODE_SUCCESS) ||
+            (layout->num_frames == 0) ||
+            (layout->num_gops == 0))
+                goto out_free_layout;
+
+        qsort(layout->sorted_pts,
+              layout->num_frames,
+              sizeof(int64_t),
+              compare_pts);
+        qsort(layout->gop_pts, layout->num_gops, sizeof(int64_t), compare_pts);
+
+        layout->gop_first_frame = malloc((layout->num_gops + 1)*
+                                         sizeof(int64_t));
+        if (layout->gop_first_frame == NULL)
+                goto out_free_layout;
+
+        for (int64_t i = 1;
+             i < layout->num_frames;
+             ++i) {
+                if (layout->sorted_pts[i] == layout->sorted_pts[i - 1])
+                        goto out_free_layout;
+        }
+
+        /**
+         * NOTE(brendan): The first GOP also owns any frames displayed before
+         * the first keyframe, since it is decoded from the start of the
+         * stream rather than from a seek.
+         */
+        int64_t num_gops = 0;
+        for (int64_t i = 0;
+             i < layout->num_gops;
+             ++i) {
+                int64_t first_frame = (num_gops == 0) ?
+                        0 : find_frame_number(layout, layout->gop_pts[i]);
+                if ((num_gops > 0) &&
+                    (first_frame <= layout->gop_first_frame[num_gops - 1]))
+                        continue;
+
+                layout->gop_pts[num_gops] = layout->gop_pts[i];
+                layout->gop_first_frame[num_gops] = first_frame;
+                ++num_gops;
         }
+        layout->num_gops = num_gops;
+        layout->gop_first_frame[num_gops] = layout->num_frames;
 
-out_free_frame_rgb_and_sws:
-        av_freep(frame_rgb->data);
-        av_frame_free(&frame_rgb);
-        sws_freeContext(sws_context);
+        return VID_DECODE_SUCCESS;
+
+out_free_layout:
+        free_gop_layout(layout);
+
+        return VID_DECODE_FFMPEG_ERR;
+}
+
+void free_gop_layout(struct gop_layout *layout)
+{
+        free(layout->sorted_pts);
+        free(layout->gop_pts);
+        free(layout->gop_first_frame);
+        memset(layout, 0, sizeof(*layout));
+}
+
+/**
+ * struct gop_job - A span of whole GOPs, decoded on a thread pool worker by a
+ * demuxer and decoder of its own.
+ * @input_buf: The shared encoded video.
+ * @meta: Known stream metadata, or NULL.
+ * @decoder: How to open the decoder, or NULL for the defaults.
+ * @layout: The video's layout.
+ * @first_gop: GOP that the span starts at.
+ * @first_frame: Display-order number of the span's first frame.
+ * @end_frame: Display-order number one past the span's last frame.
+ * @frame_numbers: Increasing frame numbers to write, or NULL to write every
+ * frame of the span.
+ * @first_slot: Output slot of the first frame written.
+ * @num_slots: Number of output slots of the job, i.e. the length of
+ * `frame_numbers`, or `end_frame - first_frame` if it is NULL.
+ * @dest: Output buffer, with frames written to consecutive slots from
+ * `first_slot`.
+ * @bytes_per_frame: Size of an output frame.
+ * @use_streaming_stores: See `copy_next_frame`.
+ * @num_decoded_frames: Output number of frames written.
+ */
+struct gop_job {
+        const struct buffer_data *input_buf;
+        const struct video_meta *meta;
+        const struct decoder_config *decoder;
+        const struct gop_layout *layout;
+        int64_t first_gop;
+        int64_t first_frame;
+        int64_t end_frame;
+        const int32_t *frame_numbers;
+        int64_t first_slot;
+        int64_t num_slots;
+        uint8_t *dest;
+        uint64_t bytes_per_frame;
+        bool use_streaming_stores;
+        int64_t num_decoded_frames;
+};
+
+static void
+run_gop_job(void *opaque)
+{
+        struct gop_job *job = (struct gop_job *)opaque;
+        const struct gop_layout *layout = job->layout;
+        struct buffer_data input_buf = {.ptr = job->input_buf->ptr,
+                                        .offset_bytes = 0,
+                                        .total_size_bytes =
+                                                job->input_buf->total_size_bytes,
+                                        .avio_ctx = NULL};
+        struct video_stream_context vid_ctx;
+        const int64_t end_of_slots = job->first_slot + job->num_slots;
+        int64_t end_slot = job->first_slot;
+        int64_t next_index = 0;
+
+        if (setup_vid_stream_context(&vid_ctx,
+                                     &input_buf,
+                                     NULL,
+                                     job->meta,
+                                     job->decoder) != VID_DECODE_SUCCESS)
+                goto out_zero_rest;
+
+        AVCodecContext *codec_context = vid_ctx.codec_context;
+        if ((uint64_t)3*codec_context->width*codec_context->height !=
+            job->bytes_per_frame)
+                goto out_clean_up_vid_ctx;
+
+        /* NOTE(brendan): The first GOP is decoded from the start, unseeked. */
+        if ((job->first_gop > 0) &&
+            (seek_to_keyframe(&vid_ctx, layout->gop_pts[job->first_gop]) < 0))
+                goto out_clean_up_vid_ctx;
+
+        struct SwsContext *sws_context = codec_cache_get_scaler(
+                codec_context->width,
+                codec_context->height,
+                codec_context->pix_fmt,
+                vid_ctx.sws_flags);
+        assert(sws_context != NULL);
+
+        AVFrame *frame_rgb = allocate_rgb_image(codec_context);
+        assert(frame_rgb != NULL);
+
+        const uint32_t bytes_per_row = 3*frame_rgb->width;
+        while (receive_frame(&vid_ctx) == VID_DECODE_SUCCESS) {
+                int64_t frame_number = find_frame_number(layout,
+                                                         vid_ctx.frame->pts);
+                /**
+                 * NOTE(brendan): Frames before the span are the leading
+                 * pictures of an open GOP, which belong to the previous span.
+                 */
+                if (frame_number < job->first_frame)
+                        continue;
+                if (frame_number >= job->end_frame)
+                        break;
+
+                int64_t slot = job->first_slot +
+                               (frame_number - job->first_frame);
+                if (job->frame_numbers != NULL) {
+                        while ((next_index < job->num_slots) &&
+                               (job->frame_numbers[next_index] < frame_number))
+                                ++next_index;
+                        if ((next_index == job->num_slots) ||
+                            (job->frame_numbers[next_index] != frame_number))
+                                continue;
+
+                        slot = job->first_slot + next_index;
+                        ++next_index;
+                }
+
+                /**
+                 * NOTE(brendan): Zero the slots passed over, i.e. those whose
+                 * frame was not found or was overtaken by a later one.
+                 */
+                if (slot > end_slot)
+                        memset(job->dest + end_slot*job->bytes_per_frame,
+                               0,
+                               (slot - end_slot)*job->bytes_per_frame);
+
+                copy_next_frame(job->dest + slot*job->bytes_per_frame,
+                                vid_ctx.frame,
+                                frame_rgb,
+                                codec_context,
+                                sws_context,
+                                0,
+                                bytes_per_row,
+                                job->use_streaming_stores,
+                                NULL,
+                                NULL);
+                ++job->num_decoded_frames;
+                if (slot >= end_slot)
+                        end_slot = slot + 1;
+        }
+
+        free_rgb_image(&frame_rgb);
+
+out_clean_up_vid_ctx:
+        clean_up_vid_ctx(&vid_ctx, &input_buf, NULL);
+
+out_zero_rest:
+        /* NOTE(brendan): Zero frames past a decode error or early EOF. */
+        if (end_slot < end_of_slots)
+                memset(job->dest + end_slot*job->bytes_per_frame,
+                       0,
+                       (end_of_slots - end_slot)*job->bytes_per_frame);
+}
+
+/**
+ * run_gop_jobs() - Runs every job in `jobs` on `pool`, or on the calling
+ * thread if it cannot be queued, and waits for them all to finish.
+ */
+static void
+run_gop_jobs(struct thread_pool *pool, struct gop_job *jobs, int64_t num_jobs)
+{
+        struct thread_pool_group group;
+
+        thread_pool_group_init(&group);
+        for (int64_t i = 0;
+             i < num_jobs;
+             ++i) {
+                if (thread_pool_submit(pool, &group, run_gop_job, jobs + i) != 0)
+                        run_gop_job(jobs + i);
+        }
+        thread_pool_group_wait(&group);
+        thread_pool_group_destroy(&group);
+}
+
+int64_t
+decode_video_gop_parallel(uint8_t *dest,
+                          uint32_t width,
+                          uint32_t height,
+                          const struct buffer_data *input_buf,
+                          const struct video_meta *meta,
+                          const struct decoder_config *decoder,
+                          const struct gop_layout *layout,
+                          struct thread_pool *pool,
+                          uint32_t num_segments)
+{
+        const uint64_t bytes_per_frame = (uint64_t)3*width*height;
+        const bool use_streaming_stores =
+                frame_copy_should_stream(layout->num_frames*bytes_per_frame);
+
+        if (num_segments == 0)
+                num_segments = thread_pool_num_threads(pool);
+        if (num_segments > layout->num_gops)
+                num_segments = layout->num_gops;
+
+        struct gop_job *jobs = calloc(num_segments, sizeof(*jobs));
+        if (jobs == NULL)
+                return 0;
+
+        /**
+         * NOTE(brendan): Split at the GOPs closest after every
+         * 1/num_segments of the frames, so that segments are balanced by
+         * frame count rather than by GOP count.
+         */
+        int64_t num_jobs = 0;
+        int64_t gop = 0;
+        for (uint32_t segment = 0;
+             segment < num_segments;
+             ++segment) {
+                int64_t end_target = ((segment + 1)*layout->num_frames)/
+                                     num_segments;
+                int64_t end_gop = gop + 1;
+                while ((end_gop < layout->num_gops) &&
+                       (layout->gop_first_frame[end_gop] < end_target))
+                        ++end_gop;
+                if (segment == num_segments - 1)
+                        end_gop = layout->num_gops;
+                if (gop >= end_gop)
+                        break;
+
+                struct gop_job *job = jobs + num_jobs;
+                job->input_buf = input_buf;
+                job->meta = meta;
+                job->decoder = decoder;
+                job->layout = layout;
+                job->first_gop = gop;
+                job->first_frame = layout->gop_first_frame[gop];
+                job->end_frame = layout->gop_first_frame[end_gop];
+                job->frame_numbers = NULL;
+                job->first_slot = job->first_frame;
+                job->num_slots = job->end_frame - job->first_frame;
+                job->dest = dest;
+                job->bytes_per_frame = bytes_per_frame;
+                job->use_streaming_stores = use_streaming_stores;
+                ++num_jobs;
+
+                gop = end_gop;
+        }
+
+        run_gop_jobs(pool, jobs, num_jobs);
+
+        int64_t num_decoded_frames = 0;
+        for (int64_t i = 0;
+             i < num_jobs;
+             ++i)
+                num_decoded_frames += jobs[i].num_decoded_frames;
+
+        free(jobs);
+
+        return num_decoded_frames;
+}
+
+/**
+ * find_gop() - Returns the GOP of `layout` that contains display-order frame
+ * `frame_number`.
+ */
+static int64_t
+find_gop(const struct gop_layout *layout, int64_t frame_number)
+{
+        int64_t low = 0;
+        int64_t high = layout->num_gops;
+
+        while (high - low > 1) {
+                int64_t mid = low + (high - low)/2;
+                if (layout->gop_first_frame[mid] <= frame_number)
+                        low = mid;
+                else
+                        high = mid;
+        }
+
+        return low;
+}
+
+int32_t
+decode_frame_nums_gop_parallel(uint8_t *dest,
+                               uint32_t width,
+                               uint32_t height,
+                               const struct buffer_data *input_buf,
+                               const struct video_meta *meta,
+                               const struct decoder_config *decoder,
+                               const struct gop_layout *layout,
+                               struct thread_pool *pool,
+                               int32_t num_requested_frames,
+                               const int32_t *frame_numbers,
+                               enum vid_pad_mode pad_mode)
+{
+        const uint64_t bytes_per_frame = (uint64_t)3*width*height;
+        const bool use_streaming_stores =
+                frame_copy_should_stream(num_requested_frames*bytes_per_frame);
+
+        /**
+         * NOTE(brendan): Frames past the end of the video are padded, so only
+         * the frames before them are decoded.
+         */
+        int32_t num_in_video = 0;
+        while ((num_in_video < num_requested_frames) &&
+               (frame_numbers[num_in_video] < layout->num_frames))
+                ++num_in_video;
+
+        struct gop_job *jobs = calloc(num_in_video + 1, sizeof(*jobs));
+        if (jobs == NULL)
+                return 0;
+
+        /* NOTE(brendan): One job per GOP that has requested frames. */
+        int64_t num_jobs = 0;
+        for (int32_t i = 0;
+             i < num_in_video;
+             ) {
+                assert((frame_numbers[i] >= 0) &&
+                       ((i == 0) || (frame_numbers[i] > frame_numbers[i - 1])));
+
+                int64_t gop = find_gop(layout, frame_numbers[i]);
+                int32_t end = i + 1;
+                while ((end < num_in_video) &&
+                       (frame_numbers[end] < layout->gop_first_frame[gop + 1]))
+                        ++end;
+
+                struct gop_job *job = jobs + num_jobs;
+                job->input_buf = input_buf;
+                job->meta = meta;
+                job->decoder = decoder;
+                job->layout = layout;
+                job->first_gop = gop;
+                job->first_frame = layout->gop_first_frame[gop];
+                job->end_frame = frame_numbers[end - 1] + 1;
+                job->frame_numbers = frame_numbers + i;
+                job->first_slot = i;
+                job->num_slots = end - i;
+                job->dest = dest;
+                job->bytes_per_frame = bytes_per_frame;
+                job->use_streaming_stores = use_streaming_stores;
+                ++num_jobs;
+
+                i = end;
+        }
+
+        run_gop_jobs(pool, jobs, num_jobs);
+
+        int32_t num_decoded_frames = 0;
+        for (int64_t i = 0;
+             i < num_jobs;
+             ++i)
+                num_decoded_frames += jobs[i].num_decoded_frames;
+
+        free(jobs);
+
+        /**
+         * NOTE(brendan): Slots of frames that could not be decoded were
+         * zeroed, so the padding follows every slot in the video.
+         */
+        pad_to_buffer_end(dest,
+                          num_in_video*bytes_per_frame,
+                          num_in_video,
+                          bytes_per_frame,
+                          num_requested_frames,
+                          pad_mode);
+
+        return num_decoded_frames;
 }
@@ -31,15 +31,109 @@ extern "C" {
 #endif
 #include <stdint.h>
 #include <stdbool.h>
+#include "frame_copy.h"
+#include "keyframe_index.h"
+#include "thread_budget.h"
+#include "thread_pool.h"
 
+#define VID_DECODE_ERR_STREAM_INDEX (-3)
 #define VID_DECODE_FFMPEG_ERR (-2)
 #define VID_DECODE_EOF (-1)
 #define VID_DECODE_SUCCESS 0
 
+/**
+ * enum vid_pad_mode - How to fill the rest of the output when a video runs out
+ * of frames before the number requested.
+ * @VID_PAD_LOOP: Loop the decoded frames from the start.
+ * @VID_PAD_LAST: Repeat the last decoded frame.
+ * @VID_PAD_ZEROS: Fill with black (all-zero) frames.
+ * @VID_PAD_NONE: Leave the rest of the output unwritten, e.g. so that the
+ * padding can instead be described by `fill_pad_index_map`.
+ */
+enum vid_pad_mode {
+        VID_PAD_LOOP,
+        VID_PAD_LAST,
+        VID_PAD_ZEROS,
+        VID_PAD_NONE,
+};
+
+/**
+ * struct buffer_data - An encoded video that is already in memory.
+ * @ptr: Start of the encoded video.
+ * @offset_bytes: Current read offset into `ptr`.
+ * @total_size_bytes: Size of the encoded video.
+ * @avio_ctx: If the AV I/O context reads `ptr` in place (see
+ * `read_memory_direct`), that context, whose buffer window is slid on seeks.
+ */
 struct buffer_data {
         const char *ptr;
         int32_t offset_bytes;
         int32_t total_size_bytes;
+        AVIOContext *avio_ctx;
+};
+
+/**
+ * struct video_meta - Video stream metadata that is known ahead of time, e.g.
+ * from a dataset index written by `index_video_file`, so that it does not
+ * need to be recomputed from the container when opening the video.
+ * @width: Width of the video, in pixels.
+ * @height: Height of the video, in pixels.
+ * @fps_num: Numerator of the average frame rate.
+ * @fps_den: Denominator of the average frame rate.
+ * @nb_frames: Exact number of frames in the video stream.
+ * @duration: Duration of the video stream, in the stream's timebase.
+ * @codec_id: `enum AVCodecID` of the video stream.
+ */
+struct video_meta {
+        int32_t width;
+        int32_t height;
+        int32_t fps_num;
+        int32_t fps_den;
+        int64_t nb_frames;
+        int64_t duration;
+        int32_t codec_id;
+};
+
+/**
+ * struct decoder_config - How to open the decoder of a video, and convert its
+ * frames.
+ * @name: Name of the decoder to use if it decodes the video's codec, or NULL
+ * for the process-wide choice (see `decoder_select_find`).
+ * @fast: Trade exactness for speed: allow non-spec-compliant speedups
+ * (AV_CODEC_FLAG2_FAST), skip the loop (deblocking) filter, and skip the
+ * IDCT of non-reference frames. Frames have artifacts, which e.g. do not hurt
+ * training after augmentation.
+ * @fast_scale: Upsample chroma with nearest-neighbour, rather than bilinear,
+ * interpolation when converting frames to RGB.
+ * @tubelet: Layout to write frames in. Zeroed for plain frames. Only the
+ * sequential decoders (`decode_video_to_out_buffer` and
+ * `decode_video_from_frame_nums`) support tubelets.
+ */
+struct decoder_config {
+        const char *name;
+        bool fast;
+        bool fast_scale;
+        struct tubelet_layout tubelet;
+};
+
+/**
+ * struct gop_layout - The GOPs of a video stream, found by demuxing (but not
+ * decoding) every packet of the stream.
+ * @sorted_pts: PTS of every frame in the stream, sorted, so that the
+ * display-order number of a frame is the index of its PTS.
+ * @num_frames: Exact number of frames in the stream, and length of
+ * `sorted_pts`.
+ * @gop_pts: PTS of the keyframe that starts each GOP.
+ * @gop_first_frame: Display-order number of the first frame of each GOP,
+ * increasing from 0, followed by `num_frames`.
+ * @num_gops: Number of GOPs.
+ */
+struct gop_layout {
+        int64_t *sorted_pts;
+        int64_t num_frames;
+        int64_t *gop_pts;
+        int64_t *gop_first_frame;
+        int64_t num_gops;
 };
 
 /**
@@ -51,6 +145,21 @@ struct buffer_data {
  * @video_stream_index: Index of video stream that frames will be read from.
  * @duration: Duration of the video in the timebase of the video stream.
  * @nb_frames: (Possibly approximate) number of frames in the video.
+ * @keyframe_index: Process-wide keyframe index for this video, which is
+ * updated as packets are demuxed and frames decoded, or NULL.
+ * @next_frame_number: Display-order number of the next frame to be received,
+ * or KEYFRAME_INDEX_UNKNOWN (e.g., after a seek to an unindexed keyframe).
+ * @last_pts: PTS of the last frame received, or AV_NOPTS_VALUE.
+ * @last_keyframe_pts: PTS of the last keyframe packet demuxed since the last
+ * seek, or KEYFRAME_INDEX_UNKNOWN.
+ * @thread_grant: Codec threads granted from the thread budget.
+ * @sws_flags: Interpolation flags for converting frames to RGB.
+ * @decoder_mem_bytes: Estimated bytes of frames held by the decoder, as
+ * accounted in `MEM_STATS_DECODER`.
+ * @tubelet: Layout that decoded clips are written in, from the decoder config.
+ * @diff: Temporal differences to emit alongside decoded clips. Zeroed when the
+ * stream is opened, and set by the caller. Only the sequential decoders
+ * support differences, and a clip's RGB output may then be NULL.
  */
 struct video_stream_context {
         AVFrame *frame;
@@ -59,6 +168,15 @@ struct video_stream_context {
         int32_t video_stream_index;
         int64_t duration;
         int64_t nb_frames;
+        struct keyframe_index *keyframe_index;
+        int64_t next_frame_number;
+        int64_t last_pts;
+        int64_t last_keyframe_pts;
+        struct thread_budget_grant thread_grant;
+        int32_t sws_flags;
+        int64_t decoder_mem_bytes;
+        struct tubelet_layout tubelet;
+        struct frame_diff_output diff;
 };
 
 /**
@@ -84,6 +202,55 @@ int32_t read_memory(void *opaque, uint8_t *buffer, int32_t buf_size_bytes);
  */
 int64_t seek_memory(void *opaque, int64_t offset64, int32_t whence);
 
+/**
+ * A zero-copy alternative to `read_memory`, for an AV I/O context whose buffer
+ * is a window onto `struct buffer_data`'s input rather than a separate
+ * allocation. The demuxer reads the input bytes in place, so this only
+ * advances the offset (or copies, if FFmpeg reads into a buffer of its own).
+ *
+ * @param opaque Pointer to the `struct buffer_data` instance.
+ * @param buffer Pointer to the buffer to fill.
+ * @param buf_size_bytes The size of `buffer`, in bytes.
+ *
+ * @return The number of bytes made available in `buffer`, or AVERROR_EOF.
+ */
+int32_t
+read_memory_direct(void *opaque, uint8_t *buffer, int32_t buf_size_bytes);
+
+/**
+ * The seek callback paired with `read_memory_direct`. Besides seeking, slides
+ * the AV I/O context's buffer window to start at the new offset.
+ *
+ * @param opaque Pointer to the `struct buffer_data` instance.
+ * @param offset64 Offset to seek.
+ * @param whence One of `SEEK_CUR`, `SEEK_END`, `SEEK_SET` or `AVSEEK_SIZE`.
+ *
+ * @return The new offset, or a negative AVERROR code for an invalid seek.
+ */
+int64_t seek_memory_direct(void *opaque, int64_t offset64, int32_t whence);
+
+/**
+ * A function for reading the next bytes of a (possibly non-seekable) input
+ * stream, with the same contract as `read_memory`, except that AVERROR_EOF is
+ * returned at the end of the stream, and a negative AVERROR code on failure.
+ */
+typedef int32_t (*vid_stream_read_fn)(void *opaque,
+                                      uint8_t *buffer,
+                                      int32_t buf_size_bytes);
+
+/**
+ * A `vid_stream_read_fn` that reads from a file descriptor, e.g. a pipe or a
+ * socket.
+ *
+ * @param opaque Pointer to the `int32_t` file descriptor to read from.
+ * @param buffer Pointer to the buffer to fill.
+ * @param buf_size_bytes The size of `buffer`, in bytes.
+ *
+ * @return The number of bytes written to `buffer`, AVERROR_EOF at the end of
+ * the stream, or a negative AVERROR code on failure.
+ */
+int32_t read_fd(void *opaque, uint8_t *buffer, int32_t buf_size_bytes);
+
 /**
  * Sets up the `AVFormatContext` pointed to by `format_context_ptr`, and finds
  * the first video stream index for `format_context`.
@@ -95,8 +262,11 @@ int64_t seek_memory(void *opaque, int64_t offset64, int32_t whence);
  * @param format_context_ptr Pointer to the (pointer to) the AVFormatContext to
  * be setup.
  * @param avio_ctx Byte-stream I/O context.
- * @param input_buf Buffer tracking the input byte string.
- * @param buffer_size Size allocated for the AV I/O context.
+ * @param input_format Input format probed from the start of the video, or NULL
+ * to let avformat_open_input probe it.
+ * @param meta Known stream metadata, or NULL. If set,
+ * `avformat_find_stream_info` is skipped when the container header fully
+ * describes the video stream.
  *
  * @return Index of the video stream corresponding to `format_context`, or a
  * negative error code on failure.
@@ -104,21 +274,194 @@ int64_t seek_memory(void *opaque, int64_t offset64, int32_t whence);
 int32_t
 setup_format_context(AVFormatContext **format_context_ptr,
                      AVIOContext *avio_ctx,
-                     struct buffer_data *input_buf,
-                     const uint32_t buffer_size);
+                     AVInputFormat *input_format,
+                     const struct video_meta *meta);
+
+/**
+ * close_format_context() - Closes a demuxer that was opened on custom I/O by
+ * `setup_format_context`, along with its AV I/O context and buffer.
+ * @format_context_ptr: Pointer to the demuxer to close, set to NULL.
+ */
+void close_format_context(AVFormatContext **format_context_ptr);
+
+/**
+ * rebind_memory_input() - Points an AV I/O context opened on an in-memory
+ * video at `input_buf`, which holds the same bytes at a different address
+ * (e.g. when a cached demuxer is reused).
+ * @avio_ctx: AV I/O context to rebind.
+ * @input_buf: New input buffer, whose offset has already been restored.
+ * @old_ptr: Previous value of `ptr` for the input. It is not dereferenced, but
+ * in-place buffer windows are rebased from it onto `input_buf->ptr`.
+ */
+void
+rebind_memory_input(AVIOContext *avio_ctx,
+                    struct buffer_data *input_buf,
+                    const char *old_ptr);
+
+/**
+ * open_vid_stream_format() - Opens a demuxer for the video in `input_buf`, and
+ * finds its video stream, duration and number of frames, without opening a
+ * decoder.
+ * @vid_ctx: Output context, whose `format_context`, `video_stream_index`,
+ * `duration` and `nb_frames` will be filled in.
+ * @input_buf: buffer_data structure injected into `vid_ctx`.
+ * @meta: Known stream metadata, or NULL.
+ *
+ * Returns the same status codes as `setup_vid_stream_context`. On success, the
+ * demuxer must be closed with `close_format_context`.
+ */
+int32_t
+open_vid_stream_format(struct video_stream_context *vid_ctx,
+                       struct buffer_data *input_buf,
+                       const struct video_meta *meta);
+
+/**
+ * setup_vid_stream_context() - Fills in the members of `vid_ctx` by allocating
+ * and setting up FFmpeg contexts through libavformat and libavcodec.
+ * @vid_ctx: Output video_stream_context to be filled in.
+ * @input_buf: buffer_data structure injected into `vid_ctx`, which should have
+ * the same lifetime as `vid_ctx`.
+ * @video_key: If not NULL, a key to look up an already-opened demuxer for this
+ * video in the format cache, skipping header parsing, and to find the video's
+ * keyframe index.
+ * @meta: Known stream metadata, or NULL. If set, the duration and number of
+ * frames are taken from `meta` instead of being estimated from the container.
+ * @decoder: How to open the decoder, or NULL for the defaults.
+ *
+ * VID_DECODE_ERR_STREAM_INDEX is returned if the video corresponding to
+ * `input_buf`'s stream index was not found. For other errors,
+ * VID_DECODE_FFMPEG_ERR is returned. VID_DECODE_SUCCESS is returned on
+ * success.
+ */
+int32_t
+setup_vid_stream_context(struct video_stream_context *vid_ctx,
+                         struct buffer_data *input_buf,
+                         const uint64_t *video_key,
+                         const struct video_meta *meta,
+                         const struct decoder_config *decoder);
+
+/**
+ * setup_vid_stream_format() - Like `setup_vid_stream_context`, but opens only
+ * the demuxer, e.g. for a decode whose frames are decoded by the decoders of
+ * GOP jobs.
+ * @vid_ctx: Output context, whose decoder members are zeroed.
+ * @input_buf: As for `setup_vid_stream_context`.
+ * @video_key: If not NULL, a key to look up an already-opened demuxer for this
+ * video in the format cache.
+ * @meta: As for `setup_vid_stream_context`.
+ *
+ * Returns the same status codes as `setup_vid_stream_context`. On success,
+ * `vid_ctx` must be cleaned up with `clean_up_vid_ctx`, whether or not its
+ * decoder is then opened by `setup_vid_stream_decoder`.
+ */
+int32_t
+setup_vid_stream_format(struct video_stream_context *vid_ctx,
+                        struct buffer_data *input_buf,
+                        const uint64_t *video_key,
+                        const struct video_meta *meta);
+
+/**
+ * setup_vid_stream_decoder() - Completes a `vid_ctx` whose demuxer was opened
+ * by `open_vid_stream_format` or `setup_vid_stream_format`, by opening its
+ * decoder, as `setup_vid_stream_context` would for a video without a key.
+ * @vid_ctx: Context opened by `open_vid_stream_format` or
+ * `setup_vid_stream_format`.
+ * @decoder: How to open the decoder, or NULL for the defaults.
+ *
+ * On failure, the demuxer is closed and VID_DECODE_FFMPEG_ERR is returned.
+ * On success, `vid_ctx` must be cleaned up with `clean_up_vid_ctx`.
+ */
+int32_t
+setup_vid_stream_decoder(struct video_stream_context *vid_ctx,
+                         const struct decoder_config *decoder);
+
+/**
+ * setup_vid_stream_reader() - Like `setup_vid_stream_context`, but for a
+ * non-seekable input stream that is read incrementally through `read_packet`,
+ * rather than a video that is already in memory.
+ * @vid_ctx: Output video_stream_context to be filled in.
+ * @read_packet: Reads the next bytes of the stream.
+ * @opaque: Passed to `read_packet`, which should have the same lifetime as
+ * `vid_ctx`.
+ * @buffer_size: Size of the AV I/O context's read buffer, in bytes.
+ * @decoder: As for `setup_vid_stream_context`.
+ *
+ * Only the AV I/O buffer, and the packets buffered by avformat while probing
+ * the stream, are held in memory, so memory use does not grow with the size
+ * of the video. Since the stream cannot seek, frames can only be decoded in
+ * order from the start of the stream, and the container must be streamable
+ * (e.g., not an MP4 with its `moov` atom at the end).
+ *
+ * `vid_ctx->duration` and `vid_ctx->nb_frames` are zero unless the container
+ * header specifies them. Returns the same status codes as
+ * `setup_vid_stream_context`, and `vid_ctx` must be cleaned up with
+ * `clean_up_vid_ctx(vid_ctx, NULL, NULL)`.
+ */
+int32_t
+setup_vid_stream_reader(struct video_stream_context *vid_ctx,
+                        vid_stream_read_fn read_packet,
+                        void *opaque,
+                        uint32_t buffer_size,
+                        const struct decoder_config *decoder);
+
+/**
+ * clean_up_vid_ctx() - Frees the FFmpeg contexts set up by
+ * `setup_vid_stream_context`.
+ * @vid_ctx: Context to clean up.
+ * @input_buf: Buffer injected into `vid_ctx`.
+ * @video_key: If not NULL, the demuxer is kept in the format cache under this
+ * key instead of being closed.
+ */
+void
+clean_up_vid_ctx(struct video_stream_context *vid_ctx,
+                 const struct buffer_data *input_buf,
+                 const uint64_t *video_key);
 
 /**
  * Allocates a codec context for video_stream, and opens it.  We cannot call
  * avcodec_open2 on an av_stream's codec context directly.
  *
  * @param video_stream Video stream to open codec context for.
+ * @param thread_count Number of decoding threads (frame or slice threads,
+ * whichever the codec supports).
+ * @param decoder How to open the decoder, or NULL for the defaults. The
+ * decoder, and its options, are chosen by `decoder_select_find`.
  *
  * @warning If successful, codec_context must be freed with
  * avcodec_free_context, and closed with avcodec_close.
  *
  * @return Opened copy of codec_context on success, NULL on failure.
  */
-AVCodecContext *open_video_codec_ctx(AVStream *video_stream);
+AVCodecContext *
+open_video_codec_ctx(AVStream *video_stream,
+                     int32_t thread_count,
+                     const struct decoder_config *decoder);
+
+/**
+ * reset_vid_stream_position() - Resets the position tracking in `vid_ctx` to
+ * the start of the video stream. Must be called after setting up `vid_ctx`,
+ * before any frames are received.
+ * @vid_ctx: Context to reset.
+ * @keyframe_index: Keyframe index to update while decoding, or NULL.
+ */
+void
+reset_vid_stream_position(struct video_stream_context *vid_ctx,
+                          struct keyframe_index *keyframe_index);
+
+/**
+ * vid_decode_seed() - Seeds the random seeks of `seek_to_closest_keypoint`
+ * made by the calling thread. Each thread has its own generator, seeded from
+ * the clock unless this is called.
+ */
+void
+vid_decode_seed(uint64_t seed);
+
+/**
+ * vid_decode_random() - Returns the next output of the calling thread's
+ * splitmix64 generator, seeding it from the clock and thread on first use.
+ */
+uint64_t
+vid_decode_random(void);
 
 /**
  * Seeks the video stream corresponding to `video_stream_index` in
@@ -164,25 +507,57 @@ skip_past_timestamp(struct video_stream_context *vid_ctx, int64_t timestamp);
  * into raw RGB24 frames in `dest`.
  *
  * If less than `num_requested_frames` are sent from the video stream, then
- * however many frames were received are looped until `num_requested_frames`,
- * unless no frames were received (in which case the output buffer is garbage
- * data).
+ * the rest of `dest` is padded according to `pad_mode`. Unless `pad_mode` is
+ * VID_PAD_ZEROS, the padding is garbage data if no frames were received.
  *
  * TODO(brendan): Support fixing the framerate?
  *
- * @param dest Output RGB24 frame buffer.
+ * @param dest Output RGB24 frame buffer, or NULL if only `vid_ctx->diff` is
+ * wanted.
  * @param vid_ctx Context needed to decode frames from the video stream.
  * @param num_requested_frames Number of frames requested to fill into `dest`.
+ * @param pad_mode How to pad `dest` if the video runs out of frames.
+ *
+ * @return The number of frames decoded into `dest`, not counting padding.
  */
-void
+int32_t
 decode_video_to_out_buffer(uint8_t *dest,
                            struct video_stream_context *vid_ctx,
-                           int32_t num_requested_frames);
+                           int32_t num_requested_frames,
+                           enum vid_pad_mode pad_mode);
+
+/**
+ * decode_next_frame() - Receives the next unique frame of the video stream
+ * into `vid_ctx->frame`, skipping frames with repeated timestamps, e.g. to
+ * decode one frame at a time from a coroutine.
+ * @vid_ctx: Context needed to decode frames from the video stream.
+ * @frame_number_out: Output display-order number of the frame, or
+ * KEYFRAME_INDEX_UNKNOWN if the frame has no timestamp (or is not numbered
+ * after a seek).
+ *
+ * Returns VID_DECODE_SUCCESS, VID_DECODE_EOF once the stream is drained, or
+ * VID_DECODE_FFMPEG_ERR.
+ */
+int32_t
+decode_next_frame(struct video_stream_context *vid_ctx,
+                  int64_t *frame_number_out);
+
+/**
+ * copy_frame_to_rgb() - Converts the frame last received into `vid_ctx` to
+ * packed RGB24 in `dest`, which must hold 3*width*height bytes of the codec
+ * context's size.
+ *
+ * Returns VID_DECODE_SUCCESS, or VID_DECODE_FFMPEG_ERR if no scaler could be
+ * set up.
+ */
+int32_t
+copy_frame_to_rgb(uint8_t *dest, struct video_stream_context *vid_ctx);
 
 /**
  * decode_video_from_frame_nums() - Decodes video from exactly the frames
  * numbered by `frame_numbers`.
- * @dest: Destination output buffer for decoded frames.
+ * @dest: Destination output buffer for decoded frames, or NULL if only
+ * `vid_ctx->diff` is wanted.
  * @vid_ctx: Context needed to decode frames from the video stream.
  * @num_requested_frames: Number of frames requested to fill into `dest`.
  * @frame_numbers: A list of frame numbers to extract.
@@ -194,16 +569,120 @@ decode_video_to_out_buffer(uint8_t *dest,
  * the assumption of a fixed FPS, and for variable framerate videos the
  * approximation of average PTS duration per frame is made to do the seek.
  *
+ * @pad_mode: How to pad `dest` if the video runs out of frames.
+ *
  * If there are less than `num_requested_frames` to decode from the video
- * stream, then the initial frames are looped repeatedly until the end of the
- * buffer.
+ * stream, then the rest of the buffer is padded according to `pad_mode`.
+ *
+ * Returns the number of frames decoded into `dest`, not counting padding.
  */
-void
+int32_t
 decode_video_from_frame_nums(uint8_t *dest,
                              struct video_stream_context *vid_ctx,
                              int32_t num_requested_frames,
                              const int32_t *frame_numbers,
                              bool should_seek,
-                             bool use_frame);
+                             bool use_frame,
+                             enum vid_pad_mode pad_mode);
+
+/**
+ * scan_gop_layout() - Demuxes every packet of the video stream in `input_buf`,
+ * with a demuxer of its own, to find its frames and GOPs.
+ * @layout: Output layout, to be freed with `free_gop_layout` on success.
+ * @input_buf: The encoded video. Only its bytes are used, not its offset.
+ * @meta: Known stream metadata, or NULL.
+ *
+ * Returns VID_DECODE_SUCCESS, or VID_DECODE_FFMPEG_ERR if the video could not
+ * be demuxed, or if its packets lack (unique) timestamps so that frames cannot
+ * be numbered without decoding from the start.
+ */
+int32_t
+scan_gop_layout(struct gop_layout *layout,
+                const struct buffer_data *input_buf,
+                const struct video_meta *meta);
+
+void free_gop_layout(struct gop_layout *layout);
+
+/**
+ * decode_video_gop_parallel() - Decodes every frame of a video into `dest`,
+ * like `decode_video_to_out_buffer` with all of the layout's frames requested,
+ * but split at keyframes into segments that are decoded in parallel.
+ * @dest: Output RGB24 frame buffer, with room for `layout->num_frames` frames.
+ * @width: Width of the video's frames.
+ * @height: Height of the video's frames.
+ * @input_buf: The encoded video. Each segment is decoded by its own demuxer and
+ * decoder over these bytes.
+ * @meta: Known stream metadata, or NULL.
+ * @decoder: How to open the decoders, or NULL for the defaults.
+ * @layout: The video's layout, from `scan_gop_layout`.
+ * @pool: Pool to decode the segments on.
+ * @num_segments: Number of segments, or 0 for one per thread of `pool`.
+ * Segments consist of whole GOPs, with about the same number of frames.
+ *
+ * Frames that could not be decoded are zeroed.
+ *
+ * Returns the number of frames decoded into `dest`.
+ */
+int64_t
+decode_video_gop_parallel(uint8_t *dest,
+                          uint32_t width,
+                          uint32_t height,
+                          const struct buffer_data *input_buf,
+                          const struct video_meta *meta,
+                          const struct decoder_config *decoder,
+                          const struct gop_layout *layout,
+                          struct thread_pool *pool,
+                          uint32_t num_segments);
+
+/**
+ * decode_frame_nums_gop_parallel() - Like `decode_video_from_frame_nums`, but
+ * the requested frames are grouped by GOP, and each group is decoded in
+ * parallel by its own demuxer and decoder, seeking straight to its keyframe.
+ * @dest: Output RGB24 frame buffer.
+ * @width: Width of the video's frames.
+ * @height: Height of the video's frames.
+ * @input_buf: The shared encoded video.
+ * @meta: Known stream metadata, or NULL.
+ * @decoder: How to open the decoders, or NULL for the defaults.
+ * @layout: The video's layout, from `scan_gop_layout`.
+ * @pool: Pool to decode the groups on.
+ * @num_requested_frames: Number of frames requested to fill into `dest`.
+ * @frame_numbers: Strictly increasing display-order frame numbers.
+ * @pad_mode: How to pad `dest` for frames past the end of the video.
+ *
+ * Frames are numbered exactly, by the rank of their PTS. Frames that could
+ * not be decoded are zeroed.
+ *
+ * Returns the number of requested frames that were decoded, i.e. not
+ * counting padding or zeroed frames.
+ */
+int32_t
+decode_frame_nums_gop_parallel(uint8_t *dest,
+                               uint32_t width,
+                               uint32_t height,
+                               const struct buffer_data *input_buf,
+                               const struct video_meta *meta,
+                               const struct decoder_config *decoder,
+                               const struct gop_layout *layout,
+                               struct thread_pool *pool,
+                               int32_t num_requested_frames,
+                               const int32_t *frame_numbers,
+                               enum vid_pad_mode pad_mode);
+
+/**
+ * fill_pad_index_map() - Describes the padding of a decode, without writing
+ * the padded frames.
+ * @index_map: Output map from each of the `num_requested_frames` output frames
+ * to the decoded frame it is a copy of, or -1 for an all-zero frame.
+ * @num_decoded_frames: Number of frames actually decoded, as returned by the
+ * decode functions called with VID_PAD_NONE.
+ * @num_requested_frames: Number of frames that were requested.
+ * @pad_mode: Padding to describe. VID_PAD_NONE is treated as VID_PAD_ZEROS.
+ */
+void
+fill_pad_index_map(int32_t *index_map,
+                   int32_t num_decoded_frames,
+                   int32_t num_requested_frames,
+                   enum vid_pad_mode pad_mode);
 
 #endif // _VIDEO_DECODE_H_
@@ -0,0 +1,333 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "video_index.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * read_file() - Reads the whole file at `path` into a `malloc`ed buffer.
+ *
+ * Returns the buffer, or NULL on failure (including files too large for the
+ * 32-bit offsets in `struct buffer_data`).
+ */
+static char *
+read_file(const char *path, int32_t *size_bytes)
+{
+        FILE *file = fopen(path, "rb");
+        if (file == NULL)
+                return NULL;
+
+        char *contents = NULL;
+        if (fseek(file, 0, SEEK_END) != 0)
+                goto out_close_file;
+
+        long file_size = ftell(file);
+        if ((file_size <= 0) || (file_size > INT32_MAX) ||
+            (fseek(file, 0, SEEK_SET) != 0))
+                goto out_close_file;
+
+        contents = malloc(file_size);
+        if (contents == NULL)
+                goto out_close_file;
+
+        if (fread(contents, 1, file_size, file) != (size_t)file_size) {
+                free(contents);
+                contents = NULL;
+                goto out_close_file;
+        }
+
+        *size_bytes = (int32_t)file_size;
+
+out_close_file:
+        fclose(file);
+
+        return contents;
+}
+
+/**
+ * push_keyframe() - Appends `pts` to `row`'s keyframes, growing the array
+ * geometrically.
+ */
+static bool
+push_keyframe(struct video_index_row *row, int64_t pts, int64_t *capacity)
+{
+        if (row->num_keyframes == *capacity) {
+                int64_t new_capacity = (*capacity == 0) ? 64 : 2*(*capacity);
+                int64_t *new_pts = realloc(row->keyframe_pts,
+                                           new_capacity*sizeof(*new_pts));
+                if (new_pts == NULL)
+                        return false;
+
+                row->keyframe_pts = new_pts;
+                *capacity = new_capacity;
+        }
+
+        row->keyframe_pts[row->num_keyframes] = pts;
+        ++row->num_keyframes;
+
+        return true;
+}
+
+/**
+ * scan_packets() - Demuxes every packet in the video stream of `vid_ctx`,
+ * counting frames and recording keyframes and the stream's extent.
+ */
+static int32_t
+scan_packets(struct video_stream_context *vid_ctx, struct video_index_row *row)
+{
+        AVPacket packet;
+        int64_t keyframe_capacity = 0;
+        int64_t first_pts = AV_NOPTS_VALUE;
+        int64_t end_pts = AV_NOPTS_VALUE;
+        int64_t nb_frames = 0;
+
+        av_init_packet(&packet);
+        while (av_read_frame(vid_ctx->format_context, &packet) == 0) {
+                if (packet.stream_index != vid_ctx->video_stream_index) {
+                        av_packet_unref(&packet);
+                        continue;
+                }
+
+                ++nb_frames;
+                if (packet.pts != AV_NOPTS_VALUE) {
+                        if ((first_pts == AV_NOPTS_VALUE) ||
+                            (packet.pts < first_pts))
+                                first_pts = packet.pts;
+                        if ((end_pts == AV_NOPTS_VALUE) ||
+                            (packet.pts + packet.duration > end_pts))
+                                end_pts = packet.pts + packet.duration;
+
+                        if ((packet.flags & AV_PKT_FLAG_KEY) &&
+                            !push_keyframe(row, packet.pts, &keyframe_capacity)) {
+                                av_packet_unref(&packet);
+                                return VID_DECODE_FFMPEG_ERR;
+                        }
+                }
+
+                av_packet_unref(&packet);
+        }
+
+        row->meta.nb_frames = nb_frames;
+
+        AVStream *video_stream =
+                vid_ctx->format_context->streams[vid_ctx->video_stream_index];
+        if (video_stream->duration > 0)
+                row->meta.duration = video_stream->duration;
+        else if (first_pts != AV_NOPTS_VALUE)
+                row->meta.duration = end_pts - first_pts;
+        else
+                row->meta.duration = vid_ctx->duration;
+
+        return VID_DECODE_SUCCESS;
+}
+
+int32_t index_video_file(const char *path, struct video_index_row *row)
+{
+        struct video_stream_context vid_ctx;
+        struct buffer_data input_buf = {.ptr = NULL,
+                                        .offset_bytes = 0,
+                                        .total_size_bytes = 0};
+
+        memset(row, 0, sizeof(*row));
+        row->status = VID_DECODE_FFMPEG_ERR;
+
+        char *video_bytes = read_file(path, &input_buf.total_size_bytes);
+        if (video_bytes == NULL)
+                return row->status;
+        input_buf.ptr = video_bytes;
+
+        row->status = open_vid_stream_format(&vid_ctx, &input_buf, NULL);
+        if (row->status != VID_DECODE_SUCCESS)
+                goto out_free_video_bytes;
+
+        AVStream *video_stream =
+                vid_ctx.format_context->streams[vid_ctx.video_stream_index];
+        AVCodecParameters *codecpar = video_stream->codecpar;
+        row->meta.width = codecpar->width;
+        row->meta.height = codecpar->height;
+        row->meta.fps_num = video_stream->avg_frame_rate.num;
+        row->meta.fps_den = video_stream->avg_frame_rate.den;
+        row->meta.codec_id = codecpar->codec_id;
+        row->time_base_num = video_stream->time_base.num;
+        row->time_base_den = video_stream->time_base.den;
+        strncpy(row->codec_name,
+                avcodec_get_name(codecpar->codec_id),
+                sizeof(row->codec_name) - 1);
+
+        row->status = scan_packets(&vid_ctx, row);
+
+        close_format_context(&vid_ctx.format_context);
+
+out_free_video_bytes:
+        free(video_bytes);
+
+        return row->status;
+}
+
+void free_video_index_row(struct video_index_row *row)
+{
+        free(row->keyframe_pts);
+        row->keyframe_pts = NULL;
+        row->num_keyframes = 0;
+}
+
+/**
+ * write_padded() - Writes `size_bytes` from `data`, followed by zeros up to
+ * the next multiple of 8 bytes.
+ */
+static bool
+write_padded(FILE *file, const void *data, uint64_t size_bytes)
+{
+        static const char zeros[8];
+
+        if ((size_bytes > 0) && (fwrite(data, size_bytes, 1, file) != 1))
+                return false;
+
+        uint64_t padding = (8 - (size_bytes % 8)) % 8;
+
+        return (padding == 0) || (fwrite(zeros, padding, 1, file) == 1);
+}
+
+/**
+ * write_int32_column() - Gathers the int32_t field at `field_offset` of each
+ * row into a column, and writes it.
+ */
+static bool
+write_int32_column(FILE *file,
+                   const struct video_index_row *rows,
+                   uint64_t num_rows,
+                   size_t field_offset,
+                   int32_t *column)
+{
+        for (uint64_t i = 0;
+             i < num_rows;
+             ++i)
+                memcpy(column + i,
+                       (const char *)(rows + i) + field_offset,
+                       sizeof(*column));
+
+        return write_padded(file, column, num_rows*sizeof(*column));
+}
+
+static bool
+write_int64_column(FILE *file,
+                   const struct video_index_row *rows,
+                   uint64_t num_rows,
+                   size_t field_offset,
+                   int64_t *column)
+{
+        for (uint64_t i = 0;
+             i < num_rows;
+             ++i)
+                memcpy(column + i,
+                       (const char *)(rows + i) + field_offset,
+                       sizeof(*column));
+
+        return write_padded(file, column, num_rows*sizeof(*column));
+}
+
+int32_t
+write_video_index(const char *path,
+                  const struct video_index_row *rows,
+                  uint64_t num_rows)
+{
+        static const size_t int32_fields[] = {
+                offsetof(struct video_index_row, status),
+                offsetof(struct video_index_row, meta.width),
+                offsetof(struct video_index_row, meta.height),
+                offsetof(struct video_index_row, meta.fps_num),
+                offsetof(struct video_index_row, meta.fps_den),
+                offsetof(struct video_index_row, time_base_num),
+                offsetof(struct video_index_row, time_base_den),
+                offsetof(struct video_index_row, meta.codec_id),
+        };
+        static const size_t int64_fields[] = {
+                offsetof(struct video_index_row, meta.nb_frames),
+                offsetof(struct video_index_row, meta.duration),
+        };
+
+        int64_t *column = malloc((num_rows + 1)*sizeof(int64_t));
+        if (column == NULL)
+                return -1;
+
+        FILE *file = fopen(path, "wb");
+        if (file == NULL) {
+                free(column);
+                return -1;
+        }
+
+        uint64_t num_keyframes = 0;
+        for (uint64_t i = 0;
+             i < num_rows;
+             ++i)
+                num_keyframes += rows[i].num_keyframes;
+
+        bool is_ok = true;
+        is_ok &= (fwrite(VIDEO_INDEX_MAGIC, 8, 1, file) == 1);
+        is_ok &= (fwrite(&num_rows, sizeof(num_rows), 1, file) == 1);
+        is_ok &= (fwrite(&num_keyframes, sizeof(num_keyframes), 1, file) == 1);
+
+        for (size_t i = 0;
+             is_ok && (i < sizeof(int32_fields)/sizeof(int32_fields[0]));
+             ++i)
+                is_ok &= write_int32_column(file,
+                                            rows,
+                                            num_rows,
+                                            int32_fields[i],
+                                            (int32_t *)column);
+
+        for (uint64_t i = 0;
+             is_ok && (i < num_rows);
+             ++i)
+                is_ok &= (fwrite(rows[i].codec_name,
+                                 VIDEO_INDEX_CODEC_NAME_SIZE,
+                                 1,
+                                 file) == 1);
+
+        for (size_t i = 0;
+             is_ok && (i < sizeof(int64_fields)/sizeof(int64_fields[0]));
+             ++i)
+                is_ok &= write_int64_column(file,
+                                            rows,
+                                            num_rows,
+                                            int64_fields[i],
+                                            column);
+
+        if (is_ok) {
+                column[0] = 0;
+                for (uint64_t i = 0;
+                     i < num_rows;
+                     ++i)
+                        column[i + 1] = column[i] + rows[i].num_keyframes;
+                is_ok &= write_padded(file,
+                                      column,
+                                      (num_rows + 1)*sizeof(*column));
+        }
+
+        for (uint64_t i = 0;
+             is_ok && (i < num_rows);
+             ++i)
+                is_ok &= write_padded(file,
+                                      rows[i].keyframe_pts,
+                                      rows[i].num_keyframes*sizeof(int64_t));
+
+        is_ok &= (fclose(file) == 0);
+        free(column);
+
+        return is_ok ? 0 : -1;
+}
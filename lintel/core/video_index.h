@@ -0,0 +1,102 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _VIDEO_INDEX_H_
+#define _VIDEO_INDEX_H_
+
+/**
+ * Dataset indexing: probes videos and scans their packets (without decoding)
+ * for exact frame counts and keyframe timestamps, and writes the results for
+ * a whole dataset to a single columnar file.
+ *
+ * File layout (native byte order), with every column padded to 8 bytes:
+ *
+ *      char magic[8] = "LNTLIDX1"
+ *      uint64_t num_rows
+ *      uint64_t num_keyframes
+ *      int32_t status[num_rows]
+ *      int32_t width[num_rows]
+ *      int32_t height[num_rows]
+ *      int32_t fps_num[num_rows]
+ *      int32_t fps_den[num_rows]
+ *      int32_t time_base_num[num_rows]
+ *      int32_t time_base_den[num_rows]
+ *      int32_t codec_id[num_rows]
+ *      char codec_name[num_rows][VIDEO_INDEX_CODEC_NAME_SIZE]
+ *      int64_t nb_frames[num_rows]
+ *      int64_t duration[num_rows]
+ *      int64_t keyframe_offsets[num_rows + 1]
+ *      int64_t keyframe_pts[num_keyframes]
+ *
+ * The keyframes of row i are keyframe_pts[keyframe_offsets[i]] up to (not
+ * including) keyframe_pts[keyframe_offsets[i + 1]].
+ */
+
+#include "video_decode.h"
+
+#define VIDEO_INDEX_MAGIC "LNTLIDX1"
+#define VIDEO_INDEX_CODEC_NAME_SIZE 16
+
+/**
+ * struct video_index_row - Index entry for a single video.
+ * @status: VID_DECODE_SUCCESS, or the error that occurred while indexing.
+ * @meta: Stream metadata, with an exact frame count.
+ * @time_base_num: Numerator of the video stream's timebase.
+ * @time_base_den: Denominator of the video stream's timebase.
+ * @codec_name: NUL-padded short name of the codec.
+ * @keyframe_pts: PTS of each keyframe, in stream timebase units. Allocated
+ * with `malloc`, and owned by the row.
+ * @num_keyframes: Length of `keyframe_pts`.
+ */
+struct video_index_row {
+        int32_t status;
+        struct video_meta meta;
+        int32_t time_base_num;
+        int32_t time_base_den;
+        char codec_name[VIDEO_INDEX_CODEC_NAME_SIZE];
+        int64_t *keyframe_pts;
+        int64_t num_keyframes;
+};
+
+/**
+ * index_video_file() - Indexes the video file at `path`, by probing the
+ * container and then demuxing (but not decoding) every packet of its video
+ * stream.
+ * @path: Path to the encoded video.
+ * @row: Output row. `row->status` is set even on failure.
+ *
+ * The frame count is the number of video packets, which is exact for codecs
+ * that store one frame per packet (as in MP4, MKV and WebM).
+ *
+ * Returns `row->status`.
+ */
+int32_t index_video_file(const char *path, struct video_index_row *row);
+
+/**
+ * free_video_index_row() - Frees memory owned by `row`.
+ */
+void free_video_index_row(struct video_index_row *row);
+
+/**
+ * write_video_index() - Writes `rows` to the columnar index file at `path`.
+ *
+ * Returns 0 on success, a negative value on failure.
+ */
+int32_t
+write_video_index(const char *path,
+                  const struct video_index_row *rows,
+                  uint64_t num_rows);
+
+#endif // _VIDEO_INDEX_H_
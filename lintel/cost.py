@@ -0,0 +1,176 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Decode cost estimates, e.g. for balancing batches across workers.
+
+The cost of a decode is predicted from the video's metadata and keyframes (a
+`lintel.VideoMeta` from a dataset index), and the frames requested, by a
+linear model of the work the decoder does: opening the video, seeking to
+keyframes, decoding every frame from each keyframe up to the requested frames,
+and converting the requested frames to RGB.
+"""
+import collections
+
+import numpy as np
+
+from lintel import sampling
+
+
+CostModel = collections.namedtuple('CostModel',
+                                   ['open_s',
+                                    'seek_s',
+                                    'decode_s_per_pixel',
+                                    'output_s_per_pixel'])
+CostModel.__doc__ = """Coefficients of the decode cost model, in seconds: per
+decode, per seek, per decoded pixel, and per output pixel."""
+
+# NOTE(brendan): Rough single-threaded figures for H.264 on a desktop CPU.
+# Run `lintel_benchmark --calibrate-cost` to fit a model to the actual machine
+# and codec.
+DEFAULT_COST_MODEL = CostModel(open_s=2e-3,
+                               seek_s=5e-4,
+                               decode_s_per_pixel=2.5e-9,
+                               output_s_per_pixel=1e-9)
+
+DecodeWork = collections.namedtuple('DecodeWork',
+                                    ['num_seeks',
+                                     'num_decoded_frames',
+                                     'num_output_frames'])
+DecodeWork.__doc__ = """The work done by one decode: seeks to keyframes,
+frames decoded (including frames decoded only to reach a requested frame),
+and frames output."""
+
+
+def keyframe_numbers(video_meta):
+    """Returns the approximate display-order frame numbers of the keyframes of
+    `video_meta`, from their PTS, the duration and the number of frames."""
+    keyframes = np.asarray(video_meta.keyframes, dtype=np.int64)
+    if ((len(keyframes) == 0) or
+            (video_meta.duration <= 0) or
+            (video_meta.nb_frames <= 0)):
+        return np.zeros(1, dtype=np.int64)
+
+    frames = ((keyframes - keyframes[0])*video_meta.nb_frames //
+              video_meta.duration)
+
+    return np.unique(np.clip(frames, 0, video_meta.nb_frames - 1))
+
+
+def expected_frame_nums(spec, nb_frames):
+    """Resolves `spec` to frame numbers for a video of `nb_frames` frames, as
+    `lintel.loadvid_frame_nums` would. Random specs are resolved to their
+    expected position, e.g. `random_dense` to a clip in the middle of the
+    video.
+
+    `spec` can also be a range or a sequence of frame numbers.
+    """
+    if not isinstance(spec, sampling.SamplingSpec):
+        return np.unique(np.asarray(list(spec), dtype=np.int64))
+
+    p0, p1, p2 = spec.params
+    if spec.kind == 'range':
+        stop = nb_frames if p1 == sampling._TO_END else p1
+        return np.arange(p0, stop, p2, dtype=np.int64)
+
+    if spec.kind == 'uniform':
+        return np.unique((2*np.arange(p0) + 1)*nb_frames//(2*p0))
+
+    if spec.kind == 'segments':
+        segment_length = max(nb_frames//p0, p1)
+        starts = (np.arange(p0)*segment_length +
+                  (segment_length - p1)//2)
+        return np.unique((starts[:, None] + np.arange(p1)).ravel())
+
+    if spec.kind == 'random_dense':
+        span = (p0 - 1)*p1 + 1
+        start = max(nb_frames - span, 0)//2
+        return start + p1*np.arange(p0, dtype=np.int64)
+
+    raise ValueError('unknown sampling spec kind {}'.format(spec.kind))
+
+
+def decode_work(video_meta, spec):
+    """Returns the `DecodeWork` of decoding the frames of `spec` from the video
+    of `video_meta`, seeking to the closest keyframe before a requested frame
+    whenever that skips decoding frames."""
+    frame_nums = expected_frame_nums(spec, video_meta.nb_frames)
+    frame_nums = frame_nums[frame_nums < max(video_meta.nb_frames, 1)]
+    keyframes = keyframe_numbers(video_meta)
+
+    num_seeks = 0
+    num_decoded_frames = 0
+    next_frame = None
+    for frame in frame_nums:
+        keyframe = keyframes[np.searchsorted(keyframes, frame, 'right') - 1]
+        if (next_frame is None) or (keyframe > next_frame):
+            num_seeks += 1
+            next_frame = keyframe
+
+        num_decoded_frames += frame - next_frame + 1
+        next_frame = frame + 1
+
+    return DecodeWork(num_seeks=num_seeks,
+                      num_decoded_frames=int(num_decoded_frames),
+                      num_output_frames=len(frame_nums))
+
+
+def _features(video_meta, spec):
+    work = decode_work(video_meta, spec)
+    pixels = video_meta.width*video_meta.height
+
+    return np.array([1.0,
+                     work.num_seeks,
+                     work.num_decoded_frames*pixels,
+                     work.num_output_frames*pixels])
+
+
+def estimate_cost(video_meta, spec, model=None):
+    """Predicts the time, in seconds, to decode the frames of `spec` from the
+    video of `video_meta`.
+
+    Args:
+        video_meta: A `lintel.VideoMeta`, e.g. `DatasetIndex.row(i)`.
+        spec: A `lintel.sampling` spec, a range, or a sequence of frame
+            numbers, as passed to `lintel.loadvid_frame_nums`.
+        model: A `CostModel`, or a dict from codec ID to `CostModel` (with
+            `None` as the fallback key). Defaults to `DEFAULT_COST_MODEL`.
+
+    Returns:
+        The predicted decode time, in seconds.
+    """
+    if model is None:
+        model = DEFAULT_COST_MODEL
+    if isinstance(model, dict):
+        model = model.get(video_meta.codec_id,
+                          model.get(None, DEFAULT_COST_MODEL))
+
+    return float(np.dot(_features(video_meta, spec), model))
+
+
+def fit_cost_model(samples):
+    """Fits a `CostModel` to measured decodes.
+
+    Args:
+        samples: A list of `(video_meta, spec, seconds)` tuples, with specs
+            that vary in their number of seeks and frames.
+
+    Returns:
+        The least-squares `CostModel`, with coefficients clipped to be
+        non-negative.
+    """
+    features = np.stack([_features(meta, spec) for meta, spec, _ in samples])
+    seconds = np.array([seconds for _, _, seconds in samples])
+    coefficients, _, _, _ = np.linalg.lstsq(features, seconds, rcond=None)
+
+    return CostModel(*np.maximum(coefficients, 0.0).tolist())
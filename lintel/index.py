@@ -0,0 +1,153 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Dataset indexing, and reading of the columnar index files it writes."""
+import collections
+import os
+
+import numpy as np
+
+import _lintel
+
+
+_MAGIC = b'LNTLIDX1'
+_CODEC_NAME_SIZE = 16
+_INT32_COLUMNS = ['status',
+                  'width',
+                  'height',
+                  'fps_num',
+                  'fps_den',
+                  'time_base_num',
+                  'time_base_den',
+                  'codec_id']
+_INT64_COLUMNS = ['nb_frames', 'duration']
+
+
+VideoMeta = collections.namedtuple('VideoMeta',
+                                   ['width',
+                                    'height',
+                                    'fps_num',
+                                    'fps_den',
+                                    'nb_frames',
+                                    'duration',
+                                    'codec_id',
+                                    'keyframes'])
+VideoMeta.__doc__ = """One row of a dataset index.
+
+Pass it as `meta=` to `lintel.loadvid` or `lintel.loadvid_frame_nums`, to skip
+`avformat_find_stream_info` and the estimation of the number of frames. The
+`keyframes` are PTS in the video stream's timebase.
+"""
+
+
+def _list_videos(paths):
+    """Expands `paths` (a directory, a manifest file with one path per line,
+    or a list of paths) into a list of video file paths."""
+    if isinstance(paths, str):
+        if os.path.isdir(paths):
+            return sorted(os.path.join(root, name)
+                          for root, _, names in os.walk(paths)
+                          for name in names)
+
+        with open(paths) as manifest:
+            return [line.strip() for line in manifest if line.strip()]
+
+    return list(paths)
+
+
+def index_dataset(paths, out, num_threads=0):
+    """Indexes a dataset of videos into a single columnar file.
+
+    Each video is probed, and its packets demuxed (but not decoded) to get an
+    exact frame count and the timestamps of its keyframes, on a native thread
+    pool.
+
+    Args:
+        paths: A directory (searched recursively), a manifest file with one
+            video path per line, or a list of video paths.
+        out: Path of the index file to write.
+        num_threads: Number of indexing threads, or 0 for one per CPU.
+
+    Returns:
+        The list of video paths, in the same order as the rows of the index.
+    """
+    video_paths = _list_videos(paths)
+    _lintel.index_dataset(video_paths, out=out, num_threads=num_threads)
+
+    return video_paths
+
+
+class DatasetIndex(object):
+    """A columnar index file written by `index_dataset`, memory-mapped.
+
+    Columns are exposed as numpy arrays, e.g. `index.nb_frames`, and
+    `index.row(i)` returns the `VideoMeta` for the i'th video.
+    """
+
+    def __init__(self, path):
+        data = np.memmap(path, dtype=np.uint8, mode='r')
+        if bytes(data[:8]) != _MAGIC:
+            raise ValueError('{} is not a lintel index file'.format(path))
+
+        num_rows, num_keyframes = np.frombuffer(data, np.uint64, 2, 8)
+        num_rows = int(num_rows)
+        num_keyframes = int(num_keyframes)
+
+        offset = 24
+        for name in _INT32_COLUMNS:
+            column = np.frombuffer(data, np.int32, num_rows, offset)
+            setattr(self, name, column)
+            offset += _padded(4*num_rows)
+
+        self.codec_name = np.frombuffer(data,
+                                        'S{}'.format(_CODEC_NAME_SIZE),
+                                        num_rows,
+                                        offset)
+        offset += _padded(_CODEC_NAME_SIZE*num_rows)
+
+        for name in _INT64_COLUMNS:
+            column = np.frombuffer(data, np.int64, num_rows, offset)
+            setattr(self, name, column)
+            offset += 8*num_rows
+
+        self.keyframe_offsets = np.frombuffer(data,
+                                              np.int64,
+                                              num_rows + 1,
+                                              offset)
+        offset += 8*(num_rows + 1)
+
+        self.keyframe_pts = np.frombuffer(data, np.int64, num_keyframes, offset)
+
+    def __len__(self):
+        return len(self.status)
+
+    def keyframes(self, i):
+        """Returns the keyframe PTS of the i'th video."""
+        start, end = self.keyframe_offsets[i:i + 2]
+        return self.keyframe_pts[start:end]
+
+    def row(self, i):
+        """Returns the `VideoMeta` of the i'th video."""
+        return VideoMeta(width=int(self.width[i]),
+                         height=int(self.height[i]),
+                         fps_num=int(self.fps_num[i]),
+                         fps_den=int(self.fps_den[i]),
+                         nb_frames=int(self.nb_frames[i]),
+                         duration=int(self.duration[i]),
+                         codec_id=int(self.codec_id[i]),
+                         keyframes=self.keyframes(i))
+
+
+def _padded(size_bytes):
+    return (size_bytes + 7) & ~7
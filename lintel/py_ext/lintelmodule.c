@@ -17,24 +17,149 @@
 /**
  * Load video data.
  */
+#include "core/codec_cache.h"
+#include "core/decoder_select.h"
+#include "core/format_cache.h"
+#include "core/frame_copy.h"
+#include "core/mem_stats.h"
+#include "core/quality_control.h"
+#include "core/sampling.h"
+#include "core/thread_budget.h"
+#include "core/thread_pool.h"
 #include "core/video_decode.h"
+#include "core/video_index.h"
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
 #include <Python.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/syscall.h>
 #include <time.h>
 
 #define UNUSED(x) x __attribute__ ((__unused__))
 
-#define LOADVID_SUCCESS 0
-#define LOADVID_ERR (-1)
-#define LOADVID_ERR_STREAM_INDEX (-2)
+#if PY_VERSION_HEX < 0x030900A4
+#define Py_SET_SIZE(ob, size) (Py_SIZE(ob) = (size))
+#endif
+
+#if PY_MAJOR_VERSION < 3
+#define PyMem_RawMalloc PyMem_Malloc
+#define PyMem_RawFree PyMem_Free
+#endif
 
 PyDoc_STRVAR(module_doc, "Module for loading video data.");
 
+/**
+ * struct lintel_stats - Counters of the decodes done through one instance of
+ * the module. Updated atomically, since decodes run without the GIL.
+ * @num_decodes: Calls that decoded a clip.
+ * @num_failed_decodes: Calls that returned no decoded frames.
+ * @num_frames_decoded: Unique frames decoded, not counting padding.
+ * @num_bytes_out: Bytes of decoded output returned.
+ */
+struct lintel_stats {
+        uint64_t num_decodes;
+        uint64_t num_failed_decodes;
+        uint64_t num_frames_decoded;
+        uint64_t num_bytes_out;
+};
+
+/**
+ * struct lintel_state - State of one instance of the module. Each
+ * (sub-)interpreter that imports `_lintel` gets its own instance.
+ * @pool_lock: Protects `pool`.
+ * @pool: Thread pool shared by this instance's calls, created on first use.
+ * @stats: See `struct lintel_stats`.
+ * @quality: Quality controller of this instance's decodes, set by
+ * `set_quality_control`.
+ *
+ * NOTE(brendan): The format cache, keyframe index store and thread budget stay
+ * process-wide, and are shared by every interpreter. They hold no Python
+ * objects, and are safe to use from any thread.
+ */
+struct lintel_state {
+        pthread_mutex_t pool_lock;
+        struct thread_pool *pool;
+        struct lintel_stats stats;
+        struct quality_control quality;
+};
+
+#if PY_MAJOR_VERSION < 3
+static struct lintel_state py2_state = {
+        .pool_lock = PTHREAD_MUTEX_INITIALIZER,
+        .quality = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                    .max_level = VID_QUALITY_NUM_LEVELS - 1},
+};
+#endif
+
+static struct lintel_state *
+get_state(PyObject *module)
+{
+#if PY_MAJOR_VERSION >= 3
+        return (struct lintel_state *)PyModule_GetState(module);
+#else
+        (void)module;
+        return &py2_state;
+#endif
+}
+
+/**
+ * get_shared_pool() - Returns the thread pool of `state`, starting it with
+ * one thread per CPU if needed, and caps the jobs it runs at once by the
+ * current thread budget. Can be called without the GIL.
+ *
+ * Returns NULL on failure.
+ */
+static struct thread_pool *
+get_shared_pool(struct lintel_state *state)
+{
+        pthread_mutex_lock(&state->pool_lock);
+        if (state->pool == NULL)
+                state->pool = thread_pool_create(0);
+        struct thread_pool *pool = state->pool;
+        pthread_mutex_unlock(&state->pool_lock);
+
+        /**
+         * NOTE(brendan): The budget can change after the pool starts, e.g.
+         * through `set_thread_budget`, so re-apply it on every use.
+         */
+        if (pool != NULL)
+                thread_pool_set_concurrency(pool, thread_budget_pool_size(0));
+
+        return pool;
+}
+
+/**
+ * record_decode() - Adds a decode that produced `num_decoded_frames` unique
+ * frames, and `num_bytes_out` bytes of output, to the stats of `state`.
+ */
+static void
+record_decode(struct lintel_state *state,
+              int32_t num_decoded_frames,
+              uint64_t num_bytes_out)
+{
+        struct lintel_stats *stats = &state->stats;
+
+        __atomic_add_fetch(&stats->num_decodes, 1, __ATOMIC_RELAXED);
+        if (num_decoded_frames <= 0) {
+                __atomic_add_fetch(&stats->num_failed_decodes,
+                                   1,
+                                   __ATOMIC_RELAXED);
+                return;
+        }
+
+        __atomic_add_fetch(&stats->num_frames_decoded,
+                           num_decoded_frames,
+                           __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->num_bytes_out,
+                           num_bytes_out,
+                           __ATOMIC_RELAXED);
+}
+
 /**
  * Allocates a PyByteArrayObject, and `out_size_bytes` of buffer for that
  * object.
@@ -44,7 +169,7 @@ PyDoc_STRVAR(module_doc, "Module for loading video data.");
  * reference is owned by the caller.
  */
 static PyByteArrayObject *
-alloc_pyarray(const uint32_t out_size_bytes)
+alloc_pyarray(const Py_ssize_t out_size_bytes)
 {
         PyByteArrayObject *frames = PyObject_New(PyByteArrayObject,
                                                  &PyByteArray_Type);
@@ -57,7 +182,7 @@ alloc_pyarray(const uint32_t out_size_bytes)
                 return (PyByteArrayObject *)PyErr_NoMemory();
         }
 
-        Py_SIZE(frames) = out_size_bytes;
+        Py_SET_SIZE(frames, out_size_bytes);
         frames->ob_alloc = out_size_bytes;
 #if PY_MAJOR_VERSION >= 3
         frames->ob_start = frames->ob_bytes;
@@ -67,460 +192,2844 @@ alloc_pyarray(const uint32_t out_size_bytes)
         return frames;
 }
 
-/**
- * setup_vid_stream_context() - Fills in the members of `vid_ctx` by allocating
- * and setting up FFmpeg contexts through libavformat and libavcodec.
- * @vid_ctx: Output video_stream_context to be filled in.
- * @input_buf: buffer_data structure injected into `vid_ctx`, which should have
- * the same lifetime as `vid_ctx`.
- *
- * LOADVID_ERR_STREAM_INDEX is returned if the video corresponding to
- * `input_buf`'s stream index was not found. For other errors, LOADVID_ERR is
- * returned. LOADVID_SUCCESS is returned on success.
- */
-static int32_t
-setup_vid_stream_context(struct video_stream_context *vid_ctx,
-                         struct buffer_data *input_buf)
-{
-        const uint32_t buffer_size = 32*1024;
-        uint8_t *avio_ctx_buffer = av_malloc(buffer_size);
-        if (avio_ctx_buffer == NULL)
-                return LOADVID_ERR;
-
-        AVIOContext *avio_ctx = avio_alloc_context(avio_ctx_buffer,
-                                                   buffer_size,
-                                                   0,
-                                                   (void *)input_buf,
-                                                   &read_memory,
-                                                   NULL,
-                                                   &seek_memory);
-        if (avio_ctx == NULL)
-                goto clean_up_avio_ctx_buffer;
-
-        vid_ctx->format_context = avformat_alloc_context();
-        if (vid_ctx->format_context == NULL)
-                goto clean_up_avio_ctx;
-
-        vid_ctx->video_stream_index =
-                setup_format_context(&vid_ctx->format_context,
-                                     avio_ctx,
-                                     input_buf,
-                                     buffer_size);
-        if (vid_ctx->video_stream_index < 0) {
-                fprintf(stderr, "Stream index not found.\n");
-
-                if (vid_ctx->video_stream_index == VID_DECODE_FFMPEG_ERR)
-                        /**
-                         * NOTE(brendan): Return a unique error code here so
-                         * that if there is no video stream a garbage buffer
-                         * can be returned.
-                         *
-                         * format_context, avio_ctx, and avio_ctx_buffer have
-                         * already been cleaned up (see setup_format_context
-                         * comment).
-                         */
-                        return LOADVID_ERR_STREAM_INDEX;
-
-                goto clean_up_format_context;
-        }
-
-        AVStream *video_stream =
-                vid_ctx->format_context->streams[vid_ctx->video_stream_index];
-        vid_ctx->codec_context = open_video_codec_ctx(video_stream);
-        if (vid_ctx->codec_context == NULL)
-                goto clean_up_format_context;
-
-        if ((video_stream->duration <= 0) || (video_stream->nb_frames <= 0)) {
-                /**
-                 * Some video containers (e.g., webm) contain indices of only
-                 * frames-of-interest, e.g., keyframes, and therefore the whole
-                 * file must be parsed to get the number of frames (nb_frames
-                 * will be zero).
-                 *
-                 * Also, for webm only the duration of the entire file is
-                 * specified in the header (as opposed to the stream duration),
-                 * so the duration must be taken from the AVFormatContext, not
-                 * the AVStream.
-                 *
-                 * See this SO answer: https://stackoverflow.com/a/32538549
-                 */
+/**
+ * get_video_key() - Converts a Python video ID to a key for the native caches.
+ * @video_id: A str, bytes or int object identifying the video, or None.
+ * @key: Output key.
+ *
+ * Strings and bytes are hashed with 64-bit FNV-1a rather than `PyObject_Hash`,
+ * so that keys are stable across processes (Python salts string hashes).
+ *
+ * Returns NULL if `video_id` is None, `key` on success, or NULL with a Python
+ * exception set on failure.
+ */
+static const uint64_t *
+get_video_key(PyObject *video_id, uint64_t *key)
+{
+        const char *id_bytes;
+        Py_ssize_t id_size_bytes;
+
+        if ((video_id == NULL) || (video_id == Py_None))
+                return NULL;
+
+        if (PyLong_Check(video_id)) {
+                *key = PyLong_AsUnsignedLongLongMask(video_id);
+                if (PyErr_Occurred())
+                        return NULL;
+
+                return key;
+        }
+
+#if PY_MAJOR_VERSION >= 3
+        if (PyUnicode_Check(video_id)) {
+                id_bytes = PyUnicode_AsUTF8AndSize(video_id, &id_size_bytes);
+                if (id_bytes == NULL)
+                        return NULL;
+        } else
+#endif
+        if (PyBytes_Check(video_id)) {
+                id_bytes = PyBytes_AS_STRING(video_id);
+                id_size_bytes = PyBytes_GET_SIZE(video_id);
+        } else {
+                PyErr_SetString(PyExc_TypeError,
+                                "video_id needs to be a str, bytes or int");
+                return NULL;
+        }
+
+        *key = 0xcbf29ce484222325ULL;
+        for (Py_ssize_t i = 0;
+             i < id_size_bytes;
+             ++i) {
+                *key ^= (uint8_t)id_bytes[i];
+                *key *= 0x100000001b3ULL;
+        }
+
+        return key;
+}
+
+/**
+ * get_video_meta() - Converts a row of a dataset index (a `lintel.VideoMeta`)
+ * to `struct video_meta`.
+ * @meta_obj: A tuple (width, height, fps_num, fps_den, nb_frames, duration,
+ * codec_id, ...), or None.
+ * @meta: Output metadata.
+ *
+ * Returns NULL if `meta_obj` is None, `meta` on success, or NULL with a Python
+ * exception set on failure.
+ */
+static const struct video_meta *
+get_video_meta(PyObject *meta_obj, struct video_meta *meta)
+{
+        PyObject *rest = NULL;
+        long long nb_frames;
+        long long duration;
+
+        if ((meta_obj == NULL) || (meta_obj == Py_None))
+                return NULL;
+
+        if (!PyTuple_Check(meta_obj)) {
+                PyErr_SetString(PyExc_TypeError,
+                                "meta needs to be a lintel.VideoMeta tuple");
+                return NULL;
+        }
+
+        if (!PyArg_ParseTuple(meta_obj,
+                              "iiiiLLi|O:meta",
+                              &meta->width,
+                              &meta->height,
+                              &meta->fps_num,
+                              &meta->fps_den,
+                              &nb_frames,
+                              &duration,
+                              &meta->codec_id,
+                              &rest))
+                return NULL;
+
+        if (nb_frames <= 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "meta has no frames (was indexing successful?)");
+                return NULL;
+        }
+
+        meta->nb_frames = nb_frames;
+        meta->duration = duration;
+
+        return meta;
+}
+
+/**
+ * get_pad_mode() - Converts the name of a padding policy ("loop", "last" or
+ * "zeros") to `enum vid_pad_mode`.
+ *
+ * Returns false with a Python exception set if `pad` is not a policy.
+ */
+static bool
+get_pad_mode(const char *pad, enum vid_pad_mode *pad_mode)
+{
+        if (strcmp(pad, "loop") == 0)
+                *pad_mode = VID_PAD_LOOP;
+        else if (strcmp(pad, "last") == 0)
+                *pad_mode = VID_PAD_LAST;
+        else if (strcmp(pad, "zeros") == 0)
+                *pad_mode = VID_PAD_ZEROS;
+        else {
+                PyErr_Format(PyExc_ValueError,
+                             "pad needs to be 'loop', 'last' or 'zeros', not "
+                             "'%s'",
+                             pad);
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * check_decoder_name() - Checks that `decoder_name`, if not NULL, names a
+ * video decoder in this build of FFmpeg.
+ *
+ * Returns false with a Python exception set if there is no such decoder.
+ */
+static bool
+check_decoder_name(const char *decoder_name)
+{
+        if (decoder_name == NULL)
+                return true;
+
+        AVCodec *codec = avcodec_find_decoder_by_name(decoder_name);
+        if ((codec == NULL) || (codec->type != AVMEDIA_TYPE_VIDEO)) {
+                PyErr_Format(PyExc_ValueError,
+                             "'%s' is not a video decoder",
+                             decoder_name);
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * get_tubelet_layout() - Converts a `tubelet` argument, None or a pair of
+ * positive ints (frames per tubelet, patch size), to `tubelet`.
+ * @lazy_pad: Whether lazy padding was also asked for.
+ * @parallel: Whether a parallel decode was also asked for.
+ *
+ * Returns false with a Python exception set if `tubelet_obj` is neither, or
+ * if it is combined with `lazy_pad` or `parallel`.
+ */
+static bool
+get_tubelet_layout(PyObject *tubelet_obj,
+                   struct tubelet_layout *tubelet,
+                   bool lazy_pad,
+                   bool parallel)
+{
+        *tubelet = (struct tubelet_layout){.num_frames = 0, .size = 0};
+        if ((tubelet_obj == NULL) || (tubelet_obj == Py_None))
+                return true;
+
+        if (!PyTuple_Check(tubelet_obj) ||
+            !PyArg_ParseTuple(tubelet_obj,
+                              "II",
+                              &tubelet->num_frames,
+                              &tubelet->size) ||
+            (tubelet->num_frames == 0) ||
+            (tubelet->size == 0)) {
+                PyErr_Clear();
+                PyErr_SetString(PyExc_ValueError,
+                                "tubelet needs to be None or a pair of "
+                                "positive ints (frames, patch size)");
+                return false;
+        }
+
+        if (lazy_pad || parallel) {
+                PyErr_SetString(PyExc_ValueError,
+                                "tubelet cannot be combined with lazy_pad or "
+                                "parallel");
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * check_tubelet_fits() - Checks that clips of `num_frames` frames of `width`
+ * by `height` pixels split evenly into `tubelet`s, if it is set.
+ *
+ * Returns false with a Python exception set if they do not.
+ */
+static bool
+check_tubelet_fits(const struct tubelet_layout *tubelet,
+                   uint64_t num_frames,
+                   uint32_t width,
+                   uint32_t height)
+{
+        if ((tubelet->num_frames == 0) ||
+            (((num_frames % tubelet->num_frames) == 0) &&
+             ((width % tubelet->size) == 0) &&
+             ((height % tubelet->size) == 0)))
+                return true;
+
+        PyErr_Format(PyExc_ValueError,
+                     "%llu frames of %ux%u do not split into tubelets of %u "
+                     "frames of %ux%u patches",
+                     (unsigned long long)num_frames,
+                     width,
+                     height,
+                     tubelet->num_frames,
+                     tubelet->size,
+                     tubelet->size);
+
+        return false;
+}
+
+/**
+ * get_frame_diff_type() - Converts a `temporal_diff` argument, None or the
+ * name of an element type ("int8", "int16" or "float32"), to `type`.
+ * @rgb: Whether the RGB frames are wanted too.
+ * @is_plain_output: Whether the output is plain frames, rather than lazily
+ * padded, decoded in parallel or in tubelet order.
+ *
+ * Returns false with a Python exception set if `diff_name` is not one of
+ * those, if neither RGB frames nor differences are wanted, or if
+ * differences are combined with another kind of output.
+ */
+static bool
+get_frame_diff_type(const char *diff_name,
+                    enum frame_diff_type *type,
+                    bool rgb,
+                    bool is_plain_output)
+{
+        *type = FRAME_DIFF_NONE;
+        if (diff_name == NULL) {
+                if (!rgb)
+                        PyErr_SetString(PyExc_ValueError,
+                                        "rgb=False needs temporal_diff");
+                return rgb;
+        }
+
+        if (strcmp(diff_name, "int8") == 0) {
+                *type = FRAME_DIFF_INT8;
+        } else if (strcmp(diff_name, "int16") == 0) {
+                *type = FRAME_DIFF_INT16;
+        } else if (strcmp(diff_name, "float32") == 0) {
+                *type = FRAME_DIFF_FLOAT32;
+        } else {
+                PyErr_Format(PyExc_ValueError,
+                             "temporal_diff needs to be None, 'int8', 'int16' "
+                             "or 'float32', not '%s'",
+                             diff_name);
+                return false;
+        }
+
+        if (!is_plain_output) {
+                PyErr_SetString(PyExc_ValueError,
+                                "temporal_diff cannot be combined with "
+                                "lazy_pad, parallel or tubelet");
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * get_sampling_kind() - Converts the name of a sampling spec kind ("range",
+ * "uniform", "segments" or "random_dense") to `enum frame_sampling_kind`.
+ *
+ * Returns false with a Python exception set if `kind` is not a spec kind.
+ */
+static bool
+get_sampling_kind(const char *kind, enum frame_sampling_kind *sampling_kind)
+{
+        if (strcmp(kind, "range") == 0)
+                *sampling_kind = FRAME_SAMPLING_RANGE;
+        else if (strcmp(kind, "uniform") == 0)
+                *sampling_kind = FRAME_SAMPLING_UNIFORM;
+        else if (strcmp(kind, "segments") == 0)
+                *sampling_kind = FRAME_SAMPLING_SEGMENTS;
+        else if (strcmp(kind, "random_dense") == 0)
+                *sampling_kind = FRAME_SAMPLING_RANDOM_DENSE;
+        else {
+                PyErr_Format(PyExc_ValueError,
+                             "unknown sampling spec kind '%s'",
+                             kind);
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * get_sampling_spec() - Converts `frame_nums` to a sampling spec, if it is
+ * one: either a `lintel.sampling.SamplingSpec`, i.e. a tuple
+ * `(kind, (param0, param1, param2))`, or a Python 3 `range`.
+ *
+ * Returns `spec` if `frame_nums` is a spec, otherwise NULL. The caller must
+ * check for a Python exception if NULL is returned.
+ */
+static const struct frame_sampling_spec *
+get_sampling_spec(PyObject *frame_nums, struct frame_sampling_spec *spec)
+{
+#if PY_MAJOR_VERSION >= 3
+        if (PyRange_Check(frame_nums)) {
+                static const char *attrs[] = {"start", "stop", "step"};
+                spec->kind = FRAME_SAMPLING_RANGE;
+                for (int32_t i = 0;
+                     i < 3;
+                     ++i) {
+                        PyObject *attr = PyObject_GetAttrString(frame_nums,
+                                                                attrs[i]);
+                        if (attr == NULL)
+                                return NULL;
+
+                        spec->params[i] = PyLong_AsLongLong(attr);
+                        Py_DECREF(attr);
+                        if (PyErr_Occurred())
+                                return NULL;
+                }
+                goto out_validate;
+        }
+
+        if (!PyTuple_Check(frame_nums) ||
+            (PyTuple_GET_SIZE(frame_nums) != 2) ||
+            !PyUnicode_Check(PyTuple_GET_ITEM(frame_nums, 0)))
+                return NULL;
+#else
+        if (!PyTuple_Check(frame_nums) ||
+            (PyTuple_GET_SIZE(frame_nums) != 2) ||
+            !PyString_Check(PyTuple_GET_ITEM(frame_nums, 0)))
+                return NULL;
+#endif
+
+        const char *kind;
+        long long params[3];
+        if (!PyArg_ParseTuple(frame_nums,
+                              "s(LLL):frame_nums",
+                              &kind,
+                              params,
+                              params + 1,
+                              params + 2))
+                return NULL;
+
+        if (!get_sampling_kind(kind, &spec->kind))
+                return NULL;
+
+        for (int32_t i = 0;
+             i < 3;
+             ++i)
+                spec->params[i] = params[i];
+
+#if PY_MAJOR_VERSION >= 3
+out_validate:
+#endif
+        if (!frame_sampling_is_valid(spec)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "invalid sampling spec parameters");
+                return NULL;
+        }
+
+        return spec;
+}
+
+/**
+ * copy_frame_nums_buffer() - Copies a 1-D buffer of int32 or int64 frame
+ * numbers, e.g. a numpy array, without boxing each element.
+ *
+ * Returns a buffer (to be freed with PyMem_RawFree) of `*num_frames` frame
+ * numbers, or NULL. If NULL is returned without a Python exception set, then
+ * `view` does not hold int32 or int64 data.
+ */
+static int32_t *
+copy_frame_nums_buffer(const Py_buffer *view, Py_ssize_t *num_frames)
+{
+        const char *format = (view->format != NULL) ? view->format : "B";
+        if (strchr("@=<", format[0]) != NULL)
+                ++format;
+
+        bool is_int32 = (view->itemsize == 4) && (strcmp(format, "i") == 0 ||
+                                                  strcmp(format, "l") == 0);
+        bool is_int64 = (view->itemsize == 8) && (strcmp(format, "l") == 0 ||
+                                                  strcmp(format, "q") == 0);
+        if ((view->ndim != 1) || !(is_int32 || is_int64))
+                return NULL;
+
+        *num_frames = view->shape[0];
+        int32_t *frame_nums_buf = PyMem_RawMalloc((*num_frames + 1)*
+                                                  sizeof(int32_t));
+        if (frame_nums_buf == NULL)
+                return (int32_t *)PyErr_NoMemory();
+
+        if (is_int32) {
+                memcpy(frame_nums_buf, view->buf, *num_frames*sizeof(int32_t));
+                return frame_nums_buf;
+        }
+
+        const int64_t *frame_nums64 = (const int64_t *)view->buf;
+        for (Py_ssize_t i = 0;
+             i < *num_frames;
+             ++i) {
+                if ((frame_nums64[i] < INT32_MIN) ||
+                    (frame_nums64[i] > INT32_MAX)) {
+                        PyMem_RawFree(frame_nums_buf);
+                        PyErr_SetString(PyExc_OverflowError,
+                                        "frame number does not fit in int32");
+                        return NULL;
+                }
+                frame_nums_buf[i] = frame_nums64[i];
+        }
+
+        return frame_nums_buf;
+}
+
+/**
+ * check_frame_nums_increasing() - Checks that `frame_nums` are non-negative
+ * and strictly increasing, as the GOP jobs of a parallel decode need.
+ *
+ * Returns false with a Python exception set if they are not.
+ */
+static bool
+check_frame_nums_increasing(const int32_t *frame_nums, Py_ssize_t num_frames)
+{
+        for (Py_ssize_t i = 0;
+             i < num_frames;
+             ++i) {
+                if ((frame_nums[i] < 0) ||
+                    ((i > 0) && (frame_nums[i] <= frame_nums[i - 1]))) {
+                        PyErr_SetString(PyExc_ValueError,
+                                        "parallel frame_nums need to be "
+                                        "non-negative, sorted and unique");
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/**
+ * get_frame_nums() - Converts the `frame_nums` argument of
+ * loadvid_frame_nums to frame numbers. `frame_nums` can be a sampling spec
+ * (see `get_sampling_spec`), resolved against `nb_frames`, a 1-D int32 or
+ * int64 buffer such as a numpy array, or any sequence of ints.
+ *
+ * Returns a buffer (to be freed with PyMem_RawFree) of `*num_frames` frame
+ * numbers, or NULL with a Python exception set.
+ */
+static int32_t *
+get_frame_nums(PyObject *frame_nums, int64_t nb_frames, Py_ssize_t *num_frames)
+{
+        struct frame_sampling_spec spec_buf;
+        const struct frame_sampling_spec *spec =
+                get_sampling_spec(frame_nums, &spec_buf);
+        if (PyErr_Occurred())
+                return NULL;
+
+        if (spec != NULL) {
+                int64_t num_spec_frames = frame_sampling_num_frames(spec,
+                                                                    nb_frames);
+                if (num_spec_frames > INT32_MAX) {
+                        PyErr_SetString(PyExc_OverflowError,
+                                        "sampling spec has too many frames");
+                        return NULL;
+                }
+
+                *num_frames = num_spec_frames;
+                int32_t *frame_nums_buf =
+                        PyMem_RawMalloc((*num_frames + 1)*sizeof(int32_t));
+                if (frame_nums_buf == NULL)
+                        return (int32_t *)PyErr_NoMemory();
+
+                frame_sampling_resolve(frame_nums_buf, spec, nb_frames);
+
+                return frame_nums_buf;
+        }
+
+        if (PyObject_CheckBuffer(frame_nums)) {
+                Py_buffer view;
+                if (PyObject_GetBuffer(frame_nums,
+                                       &view,
+                                       PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0) {
+                        int32_t *frame_nums_buf =
+                                copy_frame_nums_buffer(&view, num_frames);
+                        PyBuffer_Release(&view);
+                        if ((frame_nums_buf != NULL) || PyErr_Occurred())
+                                return frame_nums_buf;
+                } else {
+                        /* NOTE(brendan): Fall back to the sequence protocol. */
+                        PyErr_Clear();
+                }
+        }
+
+        if (!PySequence_Check(frame_nums)) {
+                PyErr_SetString(PyExc_TypeError,
+                                "frame_nums needs to be a sampling spec, an "
+                                "int buffer or a sequence");
+                return NULL;
+        }
+
+        *num_frames = PySequence_Size(frame_nums);
+        if (*num_frames < 0)
+                return NULL;
+
+        int32_t *frame_nums_buf = PyMem_RawMalloc((*num_frames + 1)*
+                                                  sizeof(int32_t));
+        if (frame_nums_buf == NULL)
+                return (int32_t *)PyErr_NoMemory();
+
+        for (Py_ssize_t i = 0;
+             i < *num_frames;
+             ++i) {
+                PyObject *item = PySequence_GetItem(frame_nums, i);
+                if (item == NULL)
+                        goto out_free_frame_nums;
+
+                frame_nums_buf[i] = PyLong_AsLong(item);
+                Py_DECREF(item);
+                if (PyErr_Occurred())
+                        goto out_free_frame_nums;
+        }
+
+        return frame_nums_buf;
+
+out_free_frame_nums:
+        PyMem_RawFree(frame_nums_buf);
+
+        return NULL;
+}
+
+/**
+ * make_pad_index_map() - For lazy padding, shrinks `frames` to hold only the
+ * `num_decoded_frames` unique decoded frames, and makes a bytearray of int32
+ * indices mapping each requested frame to its unique frame (-1 for zeros).
+ *
+ * Returns a new reference to the index map, or NULL with a Python exception
+ * set on failure.
+ */
+static PyByteArrayObject *
+make_pad_index_map(PyByteArrayObject *frames,
+                   int32_t num_decoded_frames,
+                   int32_t num_requested_frames,
+                   uint32_t bytes_per_frame,
+                   enum vid_pad_mode pad_mode)
+{
+        if (PyByteArray_Resize((PyObject *)frames,
+                               (Py_ssize_t)num_decoded_frames*bytes_per_frame) != 0)
+                return NULL;
+
+        PyByteArrayObject *index_map =
+                alloc_pyarray((Py_ssize_t)num_requested_frames*sizeof(int32_t));
+        if (index_map == NULL)
+                return NULL;
+
+        fill_pad_index_map((int32_t *)index_map->ob_bytes,
+                           num_decoded_frames,
+                           num_requested_frames,
+                           pad_mode);
+
+        return index_map;
+}
+
+/**
+ * append_output() - Appends an extra `output` (the index map of lazy padding,
+ * or temporal differences) to the `result` of a loadvid function. Steals both
+ * references.
+ *
+ * Returns `result` unchanged if `output` is NULL, otherwise a new tuple:
+ * `(result, output)` if `result` is just the frames, or `result` extended
+ * with `output` if it was already a tuple.
+ */
+static PyObject *
+append_output(PyObject *result, PyByteArrayObject *output)
+{
+        if (output == NULL)
+                return result;
+
+        PyObject *appended = NULL;
+        if (result != NULL) {
+                if (PyTuple_Check(result)) {
+                        PyObject *tail = PyTuple_Pack(1, output);
+                        if (tail != NULL) {
+                                appended = PySequence_Concat(result, tail);
+                                Py_DECREF(tail);
+                        }
+                } else {
+                        appended = PyTuple_Pack(2, result, output);
+                }
+                Py_DECREF(result);
+        }
+        Py_DECREF(output);
+
+        return appended;
+}
+
+/**
+ * alloc_frame_diffs() - Allocates the `num_frames` - 1 temporal differences of
+ * `type` of a clip of `width` by `height` frames, and points `vid_ctx`'s
+ * differences at them if `vid_ctx` is open.
+ *
+ * Returns a new reference, or NULL with a Python exception set on failure.
+ */
+static PyByteArrayObject *
+alloc_frame_diffs(struct video_stream_context *vid_ctx,
+                  bool is_vid_ctx_open,
+                  enum frame_diff_type type,
+                  uint64_t num_frames,
+                  uint32_t width,
+                  uint32_t height)
+{
+        const uint64_t num_diffs = (num_frames > 0) ? num_frames - 1 : 0;
+        PyByteArrayObject *diffs =
+                alloc_pyarray(num_diffs*width*height*3*
+                              frame_diff_type_size(type));
+        if ((diffs != NULL) && is_vid_ctx_open)
+                vid_ctx->diff = (struct frame_diff_output){
+                        .type = type,
+                        .dest = (uint8_t *)diffs->ob_bytes};
+
+        return diffs;
+}
+
+/**
+ * get_vid_width_height() - Sets `width` and `height` dynamically based on the
+ * video's `AVCodecContext` if they are not already set.
+ * @width: In/out pointer to width (unchecked for NULL).
+ * @height: In/out pointer to height (unchecked for NULL).
+ * @vid_ctx: Context whose decoder, or else whose demuxer, is open. If neither
+ * is, `width` and `height` are left as they are.
+ *
+ * Returns true iff the size has been set dynamically.
+ * Also, checks that the width/height matches the video's regardless (via
+ * assert).
+ */
+static bool
+get_vid_width_height(uint32_t *width,
+                     uint32_t *height,
+                     const struct video_stream_context *vid_ctx)
+{
+        /* NOTE(brendan): If no size is passed, dynamically find size. */
+        bool is_size_dynamic = (*width == 0) && (*height == 0);
+
+        /**
+         * NOTE(brendan): A context opened for a parallel decode has no
+         * decoder, so its size is that of the stream's parameters.
+         */
+        int32_t vid_width;
+        int32_t vid_height;
+        if (vid_ctx->codec_context != NULL) {
+                vid_width = vid_ctx->codec_context->width;
+                vid_height = vid_ctx->codec_context->height;
+        } else if (vid_ctx->format_context != NULL) {
+                const AVCodecParameters *codecpar =
+                        vid_ctx->format_context->
+                        streams[vid_ctx->video_stream_index]->codecpar;
+                vid_width = codecpar->width;
+                vid_height = codecpar->height;
+        } else {
+                return is_size_dynamic;
+        }
+
+        if (is_size_dynamic) {
+                *width = vid_width;
+                *height = vid_height;
+        }
+
+        assert(((uint32_t)vid_width == *width) &&
+               ((uint32_t)vid_height == *height));
+
+        return is_size_dynamic;
+}
+
+/**
+ * open_vid_stream() - Opens the video in `input_buf` for `loadvid` or
+ * `loadvid_frame_nums`. A parallel decode only needs the demuxer, as in
+ * `open_batch_job`, since its GOP jobs open decoders of their own.
+ *
+ * Returns the same status codes as `setup_vid_stream_context`.
+ */
+static int32_t
+open_vid_stream(struct video_stream_context *vid_ctx,
+                struct buffer_data *input_buf,
+                const uint64_t *video_key,
+                const struct video_meta *meta,
+                const struct decoder_config *decoder,
+                bool is_parallel)
+{
+        if (is_parallel)
+                return setup_vid_stream_format(vid_ctx,
+                                               input_buf,
+                                               video_key,
+                                               meta);
+
+        return setup_vid_stream_context(vid_ctx,
+                                        input_buf,
+                                        video_key,
+                                        meta,
+                                        decoder);
+}
+
+static PyObject *
+loadvid_frame_nums(PyObject *module, PyObject *args, PyObject *kw)
+{
+        PyObject *result = NULL;
+        const char *video_bytes = NULL;
+        Py_ssize_t in_size_bytes = 0;
+        PyObject *frame_nums = NULL;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        /* NOTE(brendan): should_seek must be int (not bool) because Python. */
+        int32_t should_seek = 0;
+        int32_t use_frame = 0;
+        PyObject *video_id = NULL;
+        uint64_t video_key_buf;
+        PyObject *meta_obj = NULL;
+        struct video_meta meta_buf;
+        const char *pad = "loop";
+        int32_t lazy_pad = 0;
+        enum vid_pad_mode pad_mode;
+        int32_t num_decoded_frames = 0;
+        PyByteArrayObject *index_map = NULL;
+        int32_t parallel = 0;
+        struct decoder_config decoder = {.name = NULL, .fast = false};
+        int32_t fast_decode = 0;
+        PyObject *tubelet_obj = NULL;
+        const char *diff_name = NULL;
+        enum frame_diff_type diff_type;
+        PyByteArrayObject *diffs = NULL;
+        int32_t rgb = 1;
+        struct thread_pool *pool = NULL;
+        struct gop_layout layout = {.num_frames = 0};
+        static char *kwlist[] = {"encoded_video",
+                                 "frame_nums",
+                                 "width",
+                                 "height",
+                                 "should_seek",
+                                 "use_frame",
+                                 "video_id",
+                                 "meta",
+                                 "pad",
+                                 "lazy_pad",
+                                 "parallel",
+                                 "decoder",
+                                 "fast_decode",
+                                 "tubelet",
+                                 "temporal_diff",
+                                 "rgb",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+#if PY_MAJOR_VERSION >= 3
+                                         "y#|$OIIiiOOsiiziOzi:loadvid_frame_nums",
+#else
+                                         "s#|OIIiiOOsiiziOzi:loadvid_frame_nums",
+#endif
+                                         kwlist,
+                                         &video_bytes,
+                                         &in_size_bytes,
+                                         &frame_nums,
+                                         &width,
+                                         &height,
+                                         &should_seek,
+                                         &use_frame,
+                                         &video_id,
+                                         &meta_obj,
+                                         &pad,
+                                         &lazy_pad,
+                                         &parallel,
+                                         &decoder.name,
+                                         &fast_decode,
+                                         &tubelet_obj,
+                                         &diff_name,
+                                         &rgb))
+                return NULL;
+
+        if (!get_pad_mode(pad, &pad_mode) ||
+            !check_decoder_name(decoder.name) ||
+            !get_tubelet_layout(tubelet_obj,
+                                &decoder.tubelet,
+                                lazy_pad != 0,
+                                parallel != 0) ||
+            !get_frame_diff_type(diff_name,
+                                 &diff_type,
+                                 rgb != 0,
+                                 !lazy_pad &&
+                                 !parallel &&
+                                 (decoder.tubelet.num_frames == 0)))
+                return NULL;
+        decoder.fast = (fast_decode != 0);
+
+        const uint64_t *video_key = get_video_key(video_id, &video_key_buf);
+        if (PyErr_Occurred())
+                return NULL;
+
+        const struct video_meta *meta = get_video_meta(meta_obj, &meta_buf);
+        if (PyErr_Occurred())
+                return NULL;
+
+        struct video_stream_context vid_ctx;
+        struct buffer_data input_buf = {.ptr = video_bytes,
+                                        .offset_bytes = 0,
+                                        .total_size_bytes = in_size_bytes};
+        int32_t status = open_vid_stream(&vid_ctx,
+                                         &input_buf,
+                                         video_key,
+                                         meta,
+                                         &decoder,
+                                         parallel != 0);
+
+        bool is_size_dynamic = get_vid_width_height(&width,
+                                                    &height,
+                                                    &vid_ctx);
+
+        /**
+         * TODO(brendan): There is a hole in the logic here, where a bad status
+         * could be returned from `setup_vid_stream_context`, but the width and
+         * height from `codec_context` is still used to allocate `frames`.
+         *
+         * It is safer to pass the width and height as arguments, if there is a
+         * possibility that videos in the dataset have no video stream.
+         */
+        int64_t nb_frames = (status == VID_DECODE_SUCCESS) ?
+                            vid_ctx.nb_frames : 0;
+
+        /**
+         * NOTE(brendan): Grouping the requested frames by GOP needs the
+         * keyframes, and exact frame numbers, from a demux-only pass. If the
+         * video cannot be scanned, fall back to decoding sequentially.
+         */
+        if (parallel && (status == VID_DECODE_SUCCESS)) {
+                struct lintel_state *state = get_state(module);
+                int32_t scan_status;
+                Py_BEGIN_ALLOW_THREADS
+                pool = get_shared_pool(state);
+                scan_status = scan_gop_layout(&layout, &input_buf, meta);
+                Py_END_ALLOW_THREADS
+                if ((pool != NULL) && (scan_status == VID_DECODE_SUCCESS)) {
+                        nb_frames = layout.num_frames;
+                } else {
+                        pool = NULL;
+                        free_gop_layout(&layout);
+                        status = setup_vid_stream_decoder(&vid_ctx, &decoder);
+                        if (status != VID_DECODE_SUCCESS)
+                                nb_frames = 0;
+                }
+        }
+
+        Py_ssize_t num_frames = 0;
+        int32_t *frame_nums_buf = get_frame_nums(frame_nums,
+                                                 nb_frames,
+                                                 &num_frames);
+        if ((frame_nums_buf != NULL) &&
+            ((parallel &&
+              !check_frame_nums_increasing(frame_nums_buf, num_frames)) ||
+             ((status == VID_DECODE_SUCCESS) &&
+              !check_tubelet_fits(&decoder.tubelet,
+                                  num_frames,
+                                  width,
+                                  height)))) {
+                PyMem_RawFree(frame_nums_buf);
+                frame_nums_buf = NULL;
+        }
+        if (frame_nums_buf == NULL) {
+                free_gop_layout(&layout);
+                if (status == VID_DECODE_SUCCESS)
+                        clean_up_vid_ctx(&vid_ctx, &input_buf, video_key);
+                return NULL;
+        }
+
+        if (diff_type != FRAME_DIFF_NONE) {
+                diffs = alloc_frame_diffs(&vid_ctx,
+                                          status == VID_DECODE_SUCCESS,
+                                          diff_type,
+                                          num_frames,
+                                          width,
+                                          height);
+                if (diffs == NULL) {
+                        free_gop_layout(&layout);
+                        PyMem_RawFree(frame_nums_buf);
+                        if (status == VID_DECODE_SUCCESS)
+                                clean_up_vid_ctx(&vid_ctx,
+                                                 &input_buf,
+                                                 video_key);
+                        return NULL;
+                }
+        }
+
+        PyByteArrayObject *frames =
+                alloc_pyarray(rgb ? num_frames*width*height*3 : 0);
+        if (PyErr_Occurred() || (frames == NULL)) {
+                free_gop_layout(&layout);
+                PyMem_RawFree(frame_nums_buf);
+                Py_XDECREF(diffs);
+                if (status == VID_DECODE_SUCCESS)
+                        clean_up_vid_ctx(&vid_ctx, &input_buf, video_key);
+                return (PyObject *)frames;
+        }
+
+        if (status != VID_DECODE_SUCCESS) {
+                PyMem_RawFree(frame_nums_buf);
+                if (status == VID_DECODE_ERR_STREAM_INDEX)
+                        goto return_frames;
+
+                Py_XDECREF(diffs);
+                return NULL;
+        }
+
+        const Py_ssize_t output_bytes =
+                Py_SIZE(frames) + ((diffs != NULL) ? Py_SIZE(diffs) : 0);
+        mem_stats_add(MEM_STATS_OUTPUT, output_bytes);
+        if (pool != NULL) {
+                Py_BEGIN_ALLOW_THREADS
+                num_decoded_frames = decode_frame_nums_gop_parallel(
+                        (uint8_t *)(frames->ob_bytes),
+                        width,
+                        height,
+                        &input_buf,
+                        meta,
+                        &decoder,
+                        &layout,
+                        pool,
+                        num_frames,
+                        frame_nums_buf,
+                        lazy_pad ? VID_PAD_NONE : pad_mode);
+                Py_END_ALLOW_THREADS
+                free_gop_layout(&layout);
+        } else {
+                num_decoded_frames = decode_video_from_frame_nums(
+                        rgb ? (uint8_t *)(frames->ob_bytes) : NULL,
+                        &vid_ctx,
+                        num_frames,
+                        frame_nums_buf,
+                        should_seek != 0,
+                        use_frame != 0,
+                        lazy_pad ? VID_PAD_NONE : pad_mode);
+        }
+        mem_stats_sub(MEM_STATS_OUTPUT, output_bytes);
+        PyMem_RawFree(frame_nums_buf);
+
+        clean_up_vid_ctx(&vid_ctx, &input_buf, video_key);
+
+return_frames:
+        record_decode(get_state(module),
+                      num_decoded_frames,
+                      (uint64_t)num_frames*width*height*3);
+
+        if (lazy_pad) {
+                index_map = make_pad_index_map(frames,
+                                               num_decoded_frames,
+                                               num_frames,
+                                               width*height*3,
+                                               pad_mode);
+                if (index_map == NULL) {
+                        Py_DECREF(frames);
+                        Py_XDECREF(diffs);
+                        return NULL;
+                }
+        }
+
+        if (!is_size_dynamic)
+                return append_output(append_output((PyObject *)frames,
+                                                   index_map),
+                                     diffs);
+
+        result = Py_BuildValue("Oii", frames, width, height);
+        Py_DECREF(frames);
+
+        return append_output(append_output(result, index_map), diffs);
+}
+
+static PyObject *
+loadvid(PyObject *module, PyObject *args, PyObject *kw)
+{
+        PyObject *result = NULL;
+        const char *video_bytes = NULL;
+        Py_ssize_t in_size_bytes = 0;
+        int32_t should_random_seek = 1;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t num_frames = 32;
+        float seek_distance = 0.0f;
+        PyObject *video_id = NULL;
+        uint64_t video_key_buf;
+        PyObject *meta_obj = NULL;
+        struct video_meta meta_buf;
+        const char *pad = "loop";
+        int32_t lazy_pad = 0;
+        enum vid_pad_mode pad_mode;
+        int32_t num_decoded_frames = 0;
+        PyByteArrayObject *index_map = NULL;
+        int32_t parallel = 0;
+        struct decoder_config decoder = {.name = NULL, .fast = false};
+        int32_t fast_decode = 0;
+        PyObject *tubelet_obj = NULL;
+        const char *diff_name = NULL;
+        enum frame_diff_type diff_type;
+        PyByteArrayObject *diffs = NULL;
+        int32_t rgb = 1;
+        struct thread_pool *pool = NULL;
+        struct gop_layout layout = {.num_frames = 0};
+        static char *kwlist[] = {"encoded_video",
+                                 "should_random_seek",
+                                 "width",
+                                 "height",
+                                 "num_frames",
+                                 "video_id",
+                                 "meta",
+                                 "pad",
+                                 "lazy_pad",
+                                 "parallel",
+                                 "decoder",
+                                 "fast_decode",
+                                 "tubelet",
+                                 "temporal_diff",
+                                 "rgb",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+#if PY_MAJOR_VERSION >= 3
+                                         "y#|$iIIIOOsiiziOzi:loadvid",
+#else
+                                         "s#|iIIIOOsiiziOzi:loadvid",
+#endif
+                                         kwlist,
+                                         &video_bytes,
+                                         &in_size_bytes,
+                                         &should_random_seek,
+                                         &width,
+                                         &height,
+                                         &num_frames,
+                                         &video_id,
+                                         &meta_obj,
+                                         &pad,
+                                         &lazy_pad,
+                                         &parallel,
+                                         &decoder.name,
+                                         &fast_decode,
+                                         &tubelet_obj,
+                                         &diff_name,
+                                         &rgb))
+                return NULL;
+
+        if (!get_pad_mode(pad, &pad_mode) ||
+            !check_decoder_name(decoder.name) ||
+            !get_tubelet_layout(tubelet_obj,
+                                &decoder.tubelet,
+                                lazy_pad != 0,
+                                parallel != 0) ||
+            !get_frame_diff_type(diff_name,
+                                 &diff_type,
+                                 rgb != 0,
+                                 !lazy_pad &&
+                                 !parallel &&
+                                 (decoder.tubelet.num_frames == 0)))
+                return NULL;
+        decoder.fast = (fast_decode != 0);
+
+        const uint64_t *video_key = get_video_key(video_id, &video_key_buf);
+        if (PyErr_Occurred())
+                return NULL;
+
+        const struct video_meta *meta = get_video_meta(meta_obj, &meta_buf);
+        if (PyErr_Occurred())
+                return NULL;
+
+        struct video_stream_context vid_ctx;
+        struct buffer_data input_buf = {.ptr = video_bytes,
+                                        .offset_bytes = 0,
+                                        .total_size_bytes = in_size_bytes};
+        bool full_video = (num_frames == 0);
+        int32_t status = open_vid_stream(&vid_ctx,
+                                         &input_buf,
+                                         video_key,
+                                         meta,
+                                         &decoder,
+                                         full_video && parallel);
+
+        bool is_size_dynamic = get_vid_width_height(&width,
+                                                    &height,
+                                                    &vid_ctx);
+													
+		if (full_video) {
+			assert(should_random_seek == 0);
+			num_frames = vid_ctx.nb_frames;
+		}
+
+        /**
+         * NOTE(brendan): A parallel full-video decode needs the exact frame
+         * count and the keyframes up front, from a demux-only pass. If the
+         * video cannot be scanned (e.g., packets without timestamps), fall
+         * back to decoding sequentially.
+         */
+        if (full_video && parallel && (status == VID_DECODE_SUCCESS)) {
+                struct lintel_state *state = get_state(module);
+                int32_t scan_status;
+                Py_BEGIN_ALLOW_THREADS
+                pool = get_shared_pool(state);
+                scan_status = scan_gop_layout(&layout, &input_buf, meta);
+                Py_END_ALLOW_THREADS
+                if ((pool != NULL) && (scan_status == VID_DECODE_SUCCESS)) {
+                        num_frames = layout.num_frames;
+                } else {
+                        pool = NULL;
+                        free_gop_layout(&layout);
+                        status = setup_vid_stream_decoder(&vid_ctx, &decoder);
+                }
+        }
+
+        if ((status == VID_DECODE_SUCCESS) &&
+            !check_tubelet_fits(&decoder.tubelet, num_frames, width, height)) {
+                clean_up_vid_ctx(&vid_ctx, &input_buf, video_key);
+                return NULL;
+        }
+
+        if (diff_type != FRAME_DIFF_NONE) {
+                diffs = alloc_frame_diffs(&vid_ctx,
+                                          status == VID_DECODE_SUCCESS,
+                                          diff_type,
+                                          num_frames,
+                                          width,
+                                          height);
+                if (diffs == NULL) {
+                        free_gop_layout(&layout);
+                        if (status == VID_DECODE_SUCCESS)
+                                clean_up_vid_ctx(&vid_ctx,
+                                                 &input_buf,
+                                                 video_key);
+                        return NULL;
+                }
+        }
+
+        PyByteArrayObject *frames =
+                alloc_pyarray(rgb ? (uint64_t)num_frames*width*height*3 : 0);
+        if (PyErr_Occurred() || (frames == NULL)) {
+                free_gop_layout(&layout);
+                Py_XDECREF(diffs);
+                if (status == VID_DECODE_SUCCESS)
+                        clean_up_vid_ctx(&vid_ctx, &input_buf, video_key);
+                return (PyObject *)frames;
+        }
+
+        if (status != VID_DECODE_SUCCESS) {
+                /**
+                 * NOTE(brendan): In case there was a stream index error,
+                 * return a garbage buffer.
+                 */
+                if (status == VID_DECODE_ERR_STREAM_INDEX)
+                          goto return_frames;
+
+                Py_XDECREF(diffs);
+                return NULL;
+        }
+
+        const Py_ssize_t output_bytes =
+                Py_SIZE(frames) + ((diffs != NULL) ? Py_SIZE(diffs) : 0);
+        mem_stats_add(MEM_STATS_OUTPUT, output_bytes);
+        if (pool != NULL) {
+                result = (PyObject *)frames;
+                Py_BEGIN_ALLOW_THREADS
+                num_decoded_frames =
+                        decode_video_gop_parallel((uint8_t *)frames->ob_bytes,
+                                                  width,
+                                                  height,
+                                                  &input_buf,
+                                                  meta,
+                                                  &decoder,
+                                                  &layout,
+                                                  pool,
+                                                  0);
+                Py_END_ALLOW_THREADS
+                free_gop_layout(&layout);
+                goto clean_up_av_frame;
+        }
+
+        int64_t timestamp = seek_to_closest_keypoint(&seek_distance,
+                                                     &vid_ctx,
+                                                     should_random_seek != 0,
+                                                     num_frames);
+
+        /*
+         * NOTE(brendan): after this point, the only possible errors are due to
+         * not having enough frames in the video stream past the initial seek
+         * point. All other errors are covered by asserts.
+         *
+         * Therefore we return the frames buffer regardless, and it is a
+         * feature to return garbage in the decoded video output buffer, rather
+         * than returning an error, if there weren't any frames to decode in
+         * the first place.
+         */
+        result = (PyObject *)frames;
+
+        status = skip_past_timestamp(&vid_ctx, timestamp);
+        if (status != VID_DECODE_SUCCESS)
+                goto clean_up_av_frame;
+
+        num_decoded_frames =
+                decode_video_to_out_buffer(rgb ?
+                                           (uint8_t *)(frames->ob_bytes) :
+                                           NULL,
+                                           &vid_ctx,
+                                           num_frames,
+                                           lazy_pad ? VID_PAD_NONE : pad_mode);
+
+clean_up_av_frame:
+        mem_stats_sub(MEM_STATS_OUTPUT, output_bytes);
+        clean_up_vid_ctx(&vid_ctx, &input_buf, video_key);
+
+        if (result != (PyObject *)frames) {
+                Py_CLEAR(frames);
+                Py_XDECREF(diffs);
+                return result;
+        }
+
+return_frames:
+        record_decode(get_state(module),
+                      num_decoded_frames,
+                      (uint64_t)num_frames*width*height*3);
+
+        if (lazy_pad) {
+                index_map = make_pad_index_map(frames,
+                                               num_decoded_frames,
+                                               num_frames,
+                                               width*height*3,
+                                               pad_mode);
+                if (index_map == NULL) {
+                        Py_DECREF(frames);
+                        Py_XDECREF(diffs);
+                        return NULL;
+                }
+        }
+
+        if (!is_size_dynamic)
+                result = Py_BuildValue("Of", frames, seek_distance);
+        else if (full_video)
+				result = Py_BuildValue("Oiii",
+                                       frames,
+                                       width,
+                                       height,
+                                       num_frames);
+		else
+                result = Py_BuildValue("Oiif",
+                                       frames,
+                                       width,
+                                       height,
+                                       seek_distance);
+        Py_DECREF(frames);
+
+        return append_output(append_output(result, index_map), diffs);
+}
+
+/**
+ * struct py_stream_reader - A Python object that a video stream is read from.
+ * @source: Object with a `readinto` or `read` method, e.g. a file object.
+ * @use_readinto: If true, read directly into FFmpeg's buffer with `readinto`
+ * rather than copying the bytes returned by `read`.
+ * @thread_state: The calling thread's state, saved while decoding without the
+ * GIL.
+ */
+struct py_stream_reader {
+        PyObject *source;
+        bool use_readinto;
+        PyThreadState *thread_state;
+};
+
+/**
+ * read_py_stream() - A `vid_stream_read_fn` that reads from a Python object.
+ *
+ * Called without the GIL held, so the GIL is taken for the call into Python.
+ * If that call raises, the exception is left set for the caller to raise once
+ * decoding has stopped.
+ *
+ * NOTE(brendan): The caller's saved thread state is restored, rather than
+ * using PyGILState_Ensure, which always attaches to the main interpreter.
+ */
+static int32_t
+read_py_stream(void *opaque, uint8_t *buffer, int32_t buf_size_bytes)
+{
+        struct py_stream_reader *reader = (struct py_stream_reader *)opaque;
+        Py_ssize_t bytes_read = -1;
+        PyObject *result;
+
+        PyEval_RestoreThread(reader->thread_state);
+        if (PyErr_Occurred())
+                goto out_release_gil;
+
+#if PY_MAJOR_VERSION >= 3
+        if (reader->use_readinto) {
+                PyObject *view = PyMemoryView_FromMemory((char *)buffer,
+                                                         buf_size_bytes,
+                                                         PyBUF_WRITE);
+                if (view == NULL)
+                        goto out_release_gil;
+
+                result = PyObject_CallMethod(reader->source,
+                                             "readinto",
+                                             "O",
+                                             view);
+                Py_DECREF(view);
+                if (result == NULL)
+                        goto out_release_gil;
+
+                /* NOTE(brendan): None means no data from a non-blocking read. */
+                bytes_read = (result == Py_None) ? 0 : PyLong_AsSsize_t(result);
+                Py_DECREF(result);
+                if (!PyErr_Occurred() &&
+                    ((bytes_read < 0) || (bytes_read > buf_size_bytes)))
+                        PyErr_SetString(PyExc_ValueError,
+                                        "readinto() needs to return at most "
+                                        "the number of bytes requested");
+                goto out_release_gil;
+        }
+#endif
+
+        result = PyObject_CallMethod(reader->source,
+                                     "read",
+                                     "n",
+                                     (Py_ssize_t)buf_size_bytes);
+        if (result == NULL)
+                goto out_release_gil;
+
+        if (!PyBytes_Check(result) ||
+            (PyBytes_GET_SIZE(result) > buf_size_bytes)) {
+                PyErr_SetString(PyExc_TypeError,
+                                "read() needs to return at most the requested "
+                                "number of bytes");
+        } else {
+                bytes_read = PyBytes_GET_SIZE(result);
+                memcpy(buffer, PyBytes_AS_STRING(result), bytes_read);
+        }
+        Py_DECREF(result);
+
+out_release_gil:
+        if (PyErr_Occurred())
+                bytes_read = -1;
+        reader->thread_state = PyEval_SaveThread();
+
+        if (bytes_read < 0)
+                return AVERROR(EIO);
+        if (bytes_read == 0)
+                return AVERROR_EOF;
+
+        return (int32_t)bytes_read;
+}
+
+static PyObject *
+loadvid_stream(PyObject *module, PyObject *args, PyObject *kw)
+{
+        PyObject *result = NULL;
+        PyObject *source = NULL;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t num_frames = 32;
+        uint32_t buffer_size = 64*1024;
+        int32_t fd = -1;
+        struct py_stream_reader reader = {.source = NULL,
+                                          .use_readinto = false,
+                                          .thread_state = NULL};
+        vid_stream_read_fn read_packet;
+        void *opaque;
+        const char *pad = "loop";
+        int32_t lazy_pad = 0;
+        enum vid_pad_mode pad_mode;
+        PyByteArrayObject *index_map = NULL;
+        struct decoder_config decoder = {.name = NULL, .fast = false};
+        int32_t fast_decode = 0;
+        static char *kwlist[] = {"source",
+                                 "width",
+                                 "height",
+                                 "num_frames",
+                                 "buffer_size",
+                                 "pad",
+                                 "lazy_pad",
+                                 "decoder",
+                                 "fast_decode",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+#if PY_MAJOR_VERSION >= 3
+                                         "O|$IIIIsizi:loadvid_stream",
+#else
+                                         "O|IIIIsizi:loadvid_stream",
+#endif
+                                         kwlist,
+                                         &source,
+                                         &width,
+                                         &height,
+                                         &num_frames,
+                                         &buffer_size,
+                                         &pad,
+                                         &lazy_pad,
+                                         &decoder.name,
+                                         &fast_decode))
+                return NULL;
+
+        if (!get_pad_mode(pad, &pad_mode) || !check_decoder_name(decoder.name))
+                return NULL;
+        decoder.fast = (fast_decode != 0);
+
+        if ((num_frames == 0) || (buffer_size == 0)) {
+                PyErr_SetString(PyExc_ValueError,
+                                "num_frames and buffer_size need to be "
+                                "positive");
+                return NULL;
+        }
+        if ((num_frames > INT32_MAX) || (buffer_size > INT32_MAX)) {
+                PyErr_SetString(PyExc_OverflowError,
+                                "num_frames and buffer_size need to be at "
+                                "most INT32_MAX");
+                return NULL;
+        }
+
+        if (PyLong_Check(source)) {
+                fd = PyLong_AsLong(source);
+                if (PyErr_Occurred())
+                        return NULL;
+
+                read_packet = read_fd;
+                opaque = &fd;
+        } else if (PyObject_HasAttrString(source, "readinto") ||
+                   PyObject_HasAttrString(source, "read")) {
+                reader.source = source;
+                reader.use_readinto = PyObject_HasAttrString(source,
+                                                             "readinto");
+                read_packet = read_py_stream;
+                opaque = &reader;
+        } else {
+                PyErr_SetString(PyExc_TypeError,
+                                "source needs to be a file descriptor, or an "
+                                "object with a readinto or read method");
+                return NULL;
+        }
+
+        struct video_stream_context vid_ctx;
+        int32_t status;
+        reader.thread_state = PyEval_SaveThread();
+        status = setup_vid_stream_reader(&vid_ctx,
+                                         read_packet,
+                                         opaque,
+                                         buffer_size,
+                                         &decoder);
+        PyEval_RestoreThread(reader.thread_state);
+        if (PyErr_Occurred()) {
+                if (status == VID_DECODE_SUCCESS)
+                        clean_up_vid_ctx(&vid_ctx, NULL, NULL);
+                return NULL;
+        }
+
+        if (status != VID_DECODE_SUCCESS) {
+                PyErr_SetString(PyExc_IOError,
+                                (status == VID_DECODE_ERR_STREAM_INDEX) ?
+                                "no video stream found in source" :
+                                "could not open video stream from source");
+                return NULL;
+        }
+
+        bool is_size_dynamic = get_vid_width_height(&width,
+                                                    &height,
+                                                    &vid_ctx);
+
+        const uint64_t out_size_bytes = (uint64_t)num_frames*width*height*3;
+        if (out_size_bytes > PY_SSIZE_T_MAX) {
+                PyErr_NoMemory();
+                goto clean_up;
+        }
+
+        PyByteArrayObject *frames = alloc_pyarray(out_size_bytes);
+        if (frames == NULL)
+                goto clean_up;
+
+        int32_t num_decoded_frames;
+        mem_stats_add(MEM_STATS_OUTPUT, Py_SIZE(frames));
+        reader.thread_state = PyEval_SaveThread();
+        num_decoded_frames =
+                decode_video_to_out_buffer((uint8_t *)(frames->ob_bytes),
+                                           &vid_ctx,
+                                           num_frames,
+                                           lazy_pad ? VID_PAD_NONE : pad_mode);
+        PyEval_RestoreThread(reader.thread_state);
+        mem_stats_sub(MEM_STATS_OUTPUT, Py_SIZE(frames));
+        if (PyErr_Occurred()) {
+                Py_CLEAR(frames);
+                goto clean_up;
+        }
+
+        record_decode(get_state(module), num_decoded_frames, out_size_bytes);
+
+        if (lazy_pad) {
+                index_map = make_pad_index_map(frames,
+                                               num_decoded_frames,
+                                               num_frames,
+                                               width*height*3,
+                                               pad_mode);
+                if (index_map == NULL) {
+                        Py_CLEAR(frames);
+                        goto clean_up;
+                }
+        }
+
+        if (is_size_dynamic)
+                result = Py_BuildValue("Oii", frames, width, height);
+        else
+                result = (PyObject *)frames;
+
+        if (result != (PyObject *)frames)
+                Py_DECREF(frames);
+        result = append_output(result, index_map);
+
+clean_up:
+        clean_up_vid_ctx(&vid_ctx, NULL, NULL);
+
+        return result;
+}
+
+/* Alignment of each clip in a batch arena, for streaming stores. */
+#define BATCH_CLIP_ALIGN_BYTES 64
+
+/**
+ * Columns of a batch layout row: offset_bytes, num_frames, height, width and
+ * quality_level.
+ */
+#define BATCH_LAYOUT_COLUMNS 5
+
+/**
+ * struct batch_params - Arguments of loadvid_batch shared by every clip.
+ */
+struct batch_params {
+        uint32_t num_frames;
+        bool should_random_seek;
+        uint32_t width;
+        uint32_t height;
+        enum vid_pad_mode pad_mode;
+        struct decoder_config decoder;
+        enum vid_quality_level quality_level;
+};
+
+/**
+ * struct batch_job - One clip of a loadvid_batch call, probed by
+ * `open_batch_job` and then decoded by `decode_batch_job` on the thread pool.
+ * @params: Shared arguments.
+ * @input_buf: The encoded video.
+ * @vid_ctx: Decoding context. Only its demuxer is open between the two jobs,
+ * if `is_open`.
+ * @is_open: True if the demuxer was opened, and the clip has the requested
+ * size.
+ * @is_failed: True if the decoder of an open clip could not be opened, or
+ * decoded no frames, in which case its slot is zeroed.
+ * @codec_id: Codec of the clip's stream, once open.
+ * @pix_fmt: Pixel format of the clip's stream, once open.
+ * @width: Width of the clip's frames, once open.
+ * @height: Height of the clip's frames, once open.
+ * @dest: Where the clip is decoded to, in the arena.
+ * @seed: Seed for the random seek, drawn from the calling thread's generator
+ * so that the batch is reproducible whichever worker decodes each clip.
+ * @seek_distance: Output seek distance, as for loadvid.
+ * @num_decoded_frames: Output number of unique frames decoded.
+ */
+struct batch_job {
+        const struct batch_params *params;
+        struct buffer_data input_buf;
+        struct video_stream_context vid_ctx;
+        bool is_open;
+        bool is_failed;
+        int32_t codec_id;
+        int32_t pix_fmt;
+        uint32_t width;
+        uint32_t height;
+        uint8_t *dest;
+        uint64_t seed;
+        float seek_distance;
+        int32_t num_decoded_frames;
+};
+
+/**
+ * open_batch_job() - Opens the demuxer of a clip to learn its stream's codec,
+ * size and pixel format, without opening a decoder, so that the batch holds
+ * no decoders until the clips are decoded.
+ */
+static void
+open_batch_job(void *opaque)
+{
+        struct batch_job *job = (struct batch_job *)opaque;
+        const struct batch_params *params = job->params;
+
+        int32_t status = open_vid_stream_format(&job->vid_ctx,
+                                                &job->input_buf,
+                                                NULL);
+        if (status != VID_DECODE_SUCCESS)
+                return;
+
+        const AVFormatContext *format_context = job->vid_ctx.format_context;
+        const AVCodecParameters *codecpar =
+                format_context->streams[job->vid_ctx.video_stream_index]->
+                codecpar;
+        job->codec_id = codecpar->codec_id;
+        job->pix_fmt = codecpar->format;
+        job->width = codecpar->width;
+        job->height = codecpar->height;
+        bool is_size_dynamic = (params->width == 0) && (params->height == 0);
+        const struct tubelet_layout *tubelet = &params->decoder.tubelet;
+        bool is_tubelet_misfit =
+                (tubelet->num_frames != 0) &&
+                (((job->width % tubelet->size) != 0) ||
+                 ((job->height % tubelet->size) != 0));
+        if ((!is_size_dynamic &&
+             ((job->width != params->width) ||
+              (job->height != params->height))) ||
+            is_tubelet_misfit) {
+                close_format_context(&job->vid_ctx.format_context);
+                return;
+        }
+
+        job->is_open = true;
+}
+
+/**
+ * decode_batch_job() - Opens the decoder of a clip probed by `open_batch_job`
+ * and decodes the clip, so that a worker's cached decoder is reused by the
+ * next clip of the same bucket it decodes.
+ */
+static void
+decode_batch_job(void *opaque)
+{
+        struct batch_job *job = (struct batch_job *)opaque;
+        const struct batch_params *params = job->params;
+
+        if (!job->is_open)
+                return;
+
+        job->is_open = false;
+        const uint64_t clip_bytes =
+                (uint64_t)params->num_frames*job->width*job->height*3;
+        if (setup_vid_stream_decoder(&job->vid_ctx, &params->decoder) !=
+            VID_DECODE_SUCCESS) {
+                memset(job->dest, 0, clip_bytes);
+                job->is_failed = true;
+                return;
+        }
+
+        /**
+         * NOTE(brendan): The decoder writes frames of its own size, which
+         * must be the size the clip's slot was laid out for.
+         */
+        if ((job->vid_ctx.codec_context->width != (int32_t)job->width) ||
+            (job->vid_ctx.codec_context->height != (int32_t)job->height)) {
+                clean_up_vid_ctx(&job->vid_ctx, &job->input_buf, NULL);
+                memset(job->dest, 0, clip_bytes);
+                job->is_failed = true;
+                return;
+        }
+
+        vid_decode_seed(job->seed);
+        int64_t timestamp = seek_to_closest_keypoint(&job->seek_distance,
+                                                     &job->vid_ctx,
+                                                     params->should_random_seek,
+                                                     params->num_frames);
+        /**
+         * NOTE(brendan): At VID_QUALITY_KEYFRAME_SEEK, the clip starts at the
+         * keyframe the seek landed on, so the seek distance is approximate.
+         */
+        if ((params->quality_level >= VID_QUALITY_KEYFRAME_SEEK) ||
+            (skip_past_timestamp(&job->vid_ctx, timestamp) ==
+             VID_DECODE_SUCCESS))
+                job->num_decoded_frames =
+                        decode_video_to_out_buffer(job->dest,
+                                                   &job->vid_ctx,
+                                                   params->num_frames,
+                                                   params->pad_mode);
+
+        clean_up_vid_ctx(&job->vid_ctx, &job->input_buf, NULL);
+
+        /**
+         * NOTE(brendan): Without a decoded frame there is nothing to pad
+         * from, so nothing was written.
+         */
+        if (job->num_decoded_frames <= 0) {
+                memset(job->dest, 0, clip_bytes);
+                job->is_failed = true;
+        }
+}
+
+/**
+ * run_batch_jobs() - Runs `job_fn` on every job in `jobs`, in order, on `pool`
+ * if it is not NULL and otherwise on the calling thread. Can be called without
+ * the GIL.
+ */
+static void
+run_batch_jobs(struct thread_pool *pool,
+               thread_pool_fn job_fn,
+               struct batch_job *const *jobs,
+               Py_ssize_t num_jobs)
+{
+        struct thread_pool_group group;
+
+        thread_pool_group_init(&group);
+        for (Py_ssize_t i = 0;
+             i < num_jobs;
+             ++i) {
+                if ((pool == NULL) ||
+                    (thread_pool_submit(pool, &group, job_fn, jobs[i]) != 0))
+                        job_fn(jobs[i]);
+        }
+        thread_pool_group_wait(&group);
+        thread_pool_group_destroy(&group);
+}
+
+/**
+ * compare_batch_job_buckets() - qsort comparator ordering opened jobs by
+ * codec, frame size and pixel format, with jobs that failed to open last.
+ *
+ * NOTE(brendan): Submitting each bucket's clips back to back means that pool
+ * workers mostly decode clips like their last one, so that their cached
+ * scalers and decoders are reused.
+ */
+static int
+compare_batch_job_buckets(const void *a, const void *b)
+{
+        const struct batch_job *job_a = *(struct batch_job *const *)a;
+        const struct batch_job *job_b = *(struct batch_job *const *)b;
+
+        if (job_a->is_open != job_b->is_open)
+                return job_a->is_open ? -1 : 1;
+        if (!job_a->is_open)
+                return (job_a > job_b) - (job_a < job_b);
+
+        const int64_t keys[][2] = {
+                {job_a->codec_id, job_b->codec_id},
+                {job_a->width, job_b->width},
+                {job_a->height, job_b->height},
+                {job_a->pix_fmt, job_b->pix_fmt},
+        };
+        for (uint32_t i = 0;
+             i < sizeof(keys)/sizeof(keys[0]);
+             ++i) {
+                if (keys[i][0] != keys[i][1])
+                        return (keys[i][0] < keys[i][1]) ? -1 : 1;
+        }
+
+        /* NOTE(brendan): Keep the batch order within a bucket. */
+        return (job_a > job_b) - (job_a < job_b);
+}
+
+/**
+ * get_batch_layout() - Fills in the layout table of a batch, placing each
+ * opened clip back to back (aligned to BATCH_CLIP_ALIGN_BYTES) in an arena.
+ *
+ * With a fixed width and height, every clip instead gets a slot of the same
+ * size, unaligned and including clips that failed to open (with zero frames
+ * in the table), so that the arena is a dense
+ * (batch, num_frames, height, width, 3) array.
+ *
+ * Returns the size of the arena in bytes.
+ */
+static uint64_t
+get_batch_layout(int64_t *layout,
+                 const struct batch_job *jobs,
+                 Py_ssize_t num_jobs,
+                 const struct batch_params *params)
+{
+        const bool is_size_dynamic = (params->width == 0) &&
+                                     (params->height == 0);
+        uint64_t offset_bytes = 0;
+
+        for (Py_ssize_t i = 0;
+             i < num_jobs;
+             ++i) {
+                int64_t *row = layout + i*BATCH_LAYOUT_COLUMNS;
+                const struct batch_job *job = jobs + i;
+
+                row[0] = offset_bytes;
+                row[1] = job->is_open ? params->num_frames : 0;
+                row[4] = params->quality_level;
+                if (!is_size_dynamic) {
+                        row[2] = params->height;
+                        row[3] = params->width;
+                        offset_bytes += ((uint64_t)params->num_frames*
+                                         row[2]*row[3]*3);
+                        continue;
+                }
+
+                row[2] = job->is_open ? job->height : 0;
+                row[3] = job->is_open ? job->width : 0;
+
+                offset_bytes += (uint64_t)row[1]*row[2]*row[3]*3;
+                offset_bytes = ((offset_bytes + BATCH_CLIP_ALIGN_BYTES - 1) /
+                                BATCH_CLIP_ALIGN_BYTES)*BATCH_CLIP_ALIGN_BYTES;
+        }
+
+        return offset_bytes;
+}
+
+static PyObject *
+loadvid_batch(PyObject *module, PyObject *args, PyObject *kw)
+{
+        PyObject *result = NULL;
+        PyObject *encoded_videos = NULL;
+        int32_t should_random_seek = 1;
+        const char *pad = "loop";
+        struct batch_params params = {.num_frames = 32,
+                                      .width = 0,
+                                      .height = 0,
+                                      .decoder = {.name = NULL,
+                                                  .fast = false}};
+        int32_t fast_decode = 0;
+        PyObject *tubelet_obj = NULL;
+        PyObject *arena = NULL;
+        PyObject *out = NULL;
+        Py_buffer out_view = {.buf = NULL, .obj = NULL};
+        static char *kwlist[] = {"encoded_videos",
+                                 "should_random_seek",
+                                 "width",
+                                 "height",
+                                 "num_frames",
+                                 "pad",
+                                 "out",
+                                 "decoder",
+                                 "fast_decode",
+                                 "tubelet",
+                                 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+#if PY_MAJOR_VERSION >= 3
+                                         "O|$iIIIsOziO:loadvid_batch",
+#else
+                                         "O|iIIIsOziO:loadvid_batch",
+#endif
+                                         kwlist,
+                                         &encoded_videos,
+                                         &should_random_seek,
+                                         &params.width,
+                                         &params.height,
+                                         &params.num_frames,
+                                         &pad,
+                                         &out,
+                                         &params.decoder.name,
+                                         &fast_decode,
+                                         &tubelet_obj))
+                return NULL;
+
+        if (!get_pad_mode(pad, &params.pad_mode) ||
+            !check_decoder_name(params.decoder.name) ||
+            !get_tubelet_layout(tubelet_obj,
+                                &params.decoder.tubelet,
+                                false,
+                                false))
+                return NULL;
+        params.decoder.fast = (fast_decode != 0);
+
+        /**
+         * NOTE(brendan): Under load, the quality controller may step the
+         * whole batch down to a cheaper quality level.
+         */
+        struct lintel_state *state = get_state(module);
+        struct timespec start_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        params.quality_level = quality_control_level(&state->quality);
+        if (params.quality_level >= VID_QUALITY_FAST_DECODE)
+                params.decoder.fast = true;
+        if (params.quality_level >= VID_QUALITY_FAST_SCALE)
+                params.decoder.fast_scale = true;
+        params.should_random_seek = (should_random_seek != 0);
+
+        if (params.num_frames == 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "num_frames needs to be positive");
+                return NULL;
+        }
+
+        /**
+         * NOTE(brendan): Clips of a dynamic size are checked as they are
+         * opened, and the ones that do not fit the tubelets are dropped.
+         */
+        const bool is_size_dynamic = (params.width == 0) &&
+                                     (params.height == 0);
+        const uint32_t patch_size = params.decoder.tubelet.size;
+        if (!check_tubelet_fits(&params.decoder.tubelet,
+                                params.num_frames,
+                                is_size_dynamic ? patch_size : params.width,
+                                is_size_dynamic ? patch_size : params.height))
+                return NULL;
+
+        /* NOTE(brendan): The tuple keeps every encoded video alive. */
+        PyObject *videos_seq = PySequence_Tuple(encoded_videos);
+        if (videos_seq == NULL)
+                return NULL;
+
+        const Py_ssize_t num_videos = PyTuple_GET_SIZE(videos_seq);
+        struct batch_job *jobs = PyMem_Calloc(num_videos + 1, sizeof(*jobs));
+        struct batch_job **job_order = PyMem_Calloc(num_videos + 1,
+                                                    sizeof(*job_order));
+        PyByteArrayObject *layout = (PyByteArrayObject *)
+                PyByteArray_FromStringAndSize(NULL,
+                                              num_videos*BATCH_LAYOUT_COLUMNS*
+                                              sizeof(int64_t));
+        PyByteArrayObject *seek_distances = (PyByteArrayObject *)
+                PyByteArray_FromStringAndSize(NULL,
+                                              num_videos*sizeof(float));
+        if ((jobs == NULL) ||
+            (job_order == NULL) ||
+            (layout == NULL) ||
+            (seek_distances == NULL)) {
+                if (!PyErr_Occurred())
+                        PyErr_NoMemory();
+                goto out_free_jobs;
+        }
+
+        for (Py_ssize_t i = 0;
+             i < num_videos;
+             ++i) {
+                char *video_bytes;
+                Py_ssize_t in_size_bytes;
+                if (PyBytes_AsStringAndSize(PyTuple_GET_ITEM(videos_seq, i),
+                                            &video_bytes,
+                                            &in_size_bytes) != 0)
+                        goto out_free_jobs;
+
+                jobs[i].params = &params;
+                jobs[i].input_buf.ptr = video_bytes;
+                jobs[i].input_buf.offset_bytes = 0;
+                jobs[i].input_buf.total_size_bytes = in_size_bytes;
+                jobs[i].seed = vid_decode_random();
+                job_order[i] = jobs + i;
+        }
+
+        if ((out != NULL) && (out != Py_None)) {
+                if (PyObject_GetBuffer(out,
+                                       &out_view,
+                                       PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) != 0)
+                        goto out_free_jobs;
+                arena = out;
+                Py_INCREF(arena);
+        }
+
+        /**
+         * NOTE(brendan): Probe every clip first to learn its size, so that
+         * the arena can be allocated once, then open the decoder of each clip
+         * and decode it into the arena, in buckets.
+         */
+        struct thread_pool *pool;
+        uint32_t queue_depth = 0;
+        Py_BEGIN_ALLOW_THREADS
+        pool = get_shared_pool(state);
+        if (pool != NULL)
+                queue_depth = thread_pool_queue_depth(pool);
+        run_batch_jobs(pool, open_batch_job, job_order, num_videos);
+        Py_END_ALLOW_THREADS
+
+        int64_t *layout_table = (int64_t *)PyByteArray_AS_STRING(layout);
+        uint64_t arena_size_bytes = get_batch_layout(layout_table,
+                                                     jobs,
+                                                     num_videos,
+                                                     &params);
+        uint8_t *arena_bytes = NULL;
+        if (out_view.buf != NULL) {
+                if (arena_size_bytes <= (uint64_t)out_view.len)
+                        arena_bytes = out_view.buf;
+                else
+                        PyErr_Format(PyExc_ValueError,
+                                     "out has %zd bytes, but the batch needs "
+                                     "%llu",
+                                     out_view.len,
+                                     (unsigned long long)arena_size_bytes);
+        } else if (arena_size_bytes > PY_SSIZE_T_MAX) {
+                PyErr_NoMemory();
+        } else {
+                arena = (PyObject *)alloc_pyarray(arena_size_bytes);
+                if (arena != NULL)
+                        arena_bytes = (uint8_t *)
+                                ((PyByteArrayObject *)arena)->ob_bytes;
+        }
+        if (arena_bytes == NULL) {
+                for (Py_ssize_t i = 0;
+                     i < num_videos;
+                     ++i) {
+                        if (jobs[i].is_open)
+                                close_format_context(
+                                        &jobs[i].vid_ctx.format_context);
+                }
+                goto out_free_jobs;
+        }
+
+        /**
+         * NOTE(brendan): Zero the alignment padding after each clip, and the
+         * slots of clips that failed to open, so that the arena is
+         * deterministic. The clips themselves are fully written (including
+         * padding frames) by the decoder.
+         */
+        for (Py_ssize_t i = 0;
+             i < num_videos;
+             ++i) {
+                const int64_t *row = layout_table + i*BATCH_LAYOUT_COLUMNS;
+                uint64_t clip_end = row[0] + (uint64_t)row[1]*row[2]*row[3]*3;
+                uint64_t next_offset = (i + 1 < num_videos) ?
+                                       (uint64_t)row[BATCH_LAYOUT_COLUMNS] :
+                                       arena_size_bytes;
+
+                jobs[i].dest = arena_bytes + row[0];
+                memset(arena_bytes + clip_end, 0, next_offset - clip_end);
+        }
+
+        mem_stats_add(MEM_STATS_OUTPUT, arena_size_bytes);
+        Py_BEGIN_ALLOW_THREADS
+        qsort(job_order,
+              num_videos,
+              sizeof(*job_order),
+              compare_batch_job_buckets);
+        run_batch_jobs(pool, decode_batch_job, job_order, num_videos);
+        Py_END_ALLOW_THREADS
+        mem_stats_sub(MEM_STATS_OUTPUT, arena_size_bytes);
+
+        struct timespec end_time;
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        quality_control_update(&state->quality,
+                               (end_time.tv_sec - start_time.tv_sec) +
+                               1e-9*(end_time.tv_nsec - start_time.tv_nsec),
+                               queue_depth,
+                               (pool != NULL) ? thread_pool_concurrency(pool) :
+                                                1);
+
+        float *seek_distances_out =
+                (float *)PyByteArray_AS_STRING(seek_distances);
+        for (Py_ssize_t i = 0;
+             i < num_videos;
+             ++i) {
+                int64_t *row = layout_table + i*BATCH_LAYOUT_COLUMNS;
+                if (jobs[i].is_failed)
+                        row[1] = 0;
+
+                seek_distances_out[i] = jobs[i].seek_distance;
+                record_decode(state,
+                              jobs[i].num_decoded_frames,
+                              (uint64_t)row[1]*row[2]*row[3]*3);
+        }
+
+        result = Py_BuildValue("OOO", arena, layout, seek_distances);
+
+out_free_jobs:
+        if (out_view.obj != NULL)
+                PyBuffer_Release(&out_view);
+        Py_XDECREF(arena);
+        Py_XDECREF(seek_distances);
+        Py_XDECREF(layout);
+        PyMem_Free(job_order);
+        PyMem_Free(jobs);
+        Py_DECREF(videos_seq);
+
+        return result;
+}
+
+static PyObject *
+set_format_cache_capacity(PyObject *UNUSED(dummy), PyObject *args)
+{
+        uint32_t capacity;
+
+        if (!PyArg_ParseTuple(args, "I:set_format_cache_capacity", &capacity))
+                return NULL;
+
+        if (format_cache_set_capacity(capacity) != VID_DECODE_SUCCESS)
+                return PyErr_NoMemory();
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+set_streaming_store_threshold(PyObject *UNUSED(dummy), PyObject *args)
+{
+        long long threshold_bytes;
+
+        if (!PyArg_ParseTuple(args,
+                              "L:set_streaming_store_threshold",
+                              &threshold_bytes))
+                return NULL;
+
+        frame_copy_set_stream_threshold(threshold_bytes);
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+set_thread_budget(PyObject *UNUSED(dummy), PyObject *args, PyObject *kw)
+{
+        uint32_t max_threads;
+        const char *shared_name = NULL;
+        static char *kwlist[] = {"max_threads", "shared_name", 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "I|z:set_thread_budget",
+                                         kwlist,
+                                         &max_threads,
+                                         &shared_name))
+                return NULL;
+
+        if (thread_budget_configure(max_threads, shared_name) != 0) {
+                if (errno == EEXIST) {
+                        PyErr_Format(PyExc_ValueError,
+                                     "Shared thread budget %s is in use with a different max_threads",
+                                     shared_name);
+                        return NULL;
+                }
+                return PyErr_SetFromErrnoWithFilename(PyExc_OSError,
+                                                      shared_name);
+        }
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+set_decoder_preference(PyObject *UNUSED(dummy), PyObject *args)
+{
+        PyObject *result = NULL;
+        PyObject *decoders;
+        const char *names[DECODER_SELECT_MAX_DECODERS];
+
+        if (!PyArg_ParseTuple(args, "O:set_decoder_preference", &decoders))
+                return NULL;
+
+        PyObject *decoders_seq = PySequence_Fast(decoders,
+                                                 "decoders needs to be a "
+                                                 "sequence of decoder names");
+        if (decoders_seq == NULL)
+                return NULL;
+
+        const Py_ssize_t num_names = PySequence_Fast_GET_SIZE(decoders_seq);
+        if (num_names > DECODER_SELECT_MAX_DECODERS) {
+                PyErr_Format(PyExc_ValueError,
+                             "at most %d decoders can be preferred",
+                             DECODER_SELECT_MAX_DECODERS);
+                goto out_decref_seq;
+        }
+
+        for (Py_ssize_t i = 0;
+             i < num_names;
+             ++i) {
+                PyObject *name = PySequence_Fast_GET_ITEM(decoders_seq, i);
+                names[i] = PyUnicode_AsUTF8(name);
+                if (names[i] == NULL)
+                        goto out_decref_seq;
+        }
+
+        int32_t status = decoder_select_set_preference(names, num_names);
+        if (status != 0) {
+                PyErr_Format(PyExc_ValueError,
+                             "'%s' is not a video decoder",
+                             names[status - 1]);
+                goto out_decref_seq;
+        }
+
+        Py_INCREF(Py_None);
+        result = Py_None;
+
+out_decref_seq:
+        Py_DECREF(decoders_seq);
+
+        return result;
+}
+
+static PyObject *
+set_decoder_options(PyObject *UNUSED(dummy), PyObject *args)
+{
+        const char *decoder_name;
+        PyObject *options_obj = Py_None;
+        AVDictionary *options = NULL;
+        PyObject *key;
+        PyObject *value;
+        Py_ssize_t pos = 0;
+
+        if (!PyArg_ParseTuple(args,
+                              "s|O:set_decoder_options",
+                              &decoder_name,
+                              &options_obj))
+                return NULL;
+
+        if ((options_obj != Py_None) && !PyDict_Check(options_obj)) {
+                PyErr_SetString(PyExc_TypeError,
+                                "options needs to be a dict or None");
+                return NULL;
+        }
+
+        /**
+         * NOTE(brendan): Values are converted with str(), so that e.g.
+         * {'framethreads': 4} works as well as {'framethreads': '4'}.
+         */
+        while ((options_obj != Py_None) &&
+               PyDict_Next(options_obj, &pos, &key, &value)) {
+                PyObject *value_str = PyObject_Str(value);
+                if (value_str == NULL)
+                        goto out_free_options;
+
+                const char *key_utf8 = PyUnicode_AsUTF8(key);
+                const char *value_utf8 = PyUnicode_AsUTF8(value_str);
+                if ((key_utf8 != NULL) && (value_utf8 != NULL))
+                        av_dict_set(&options, key_utf8, value_utf8, 0);
+                Py_DECREF(value_str);
+                if (PyErr_Occurred())
+                        goto out_free_options;
+        }
+
+        int32_t status = decoder_select_set_options(decoder_name, options);
+        if (status > 0)
+                PyErr_Format(PyExc_ValueError,
+                             "'%s' is not a video decoder",
+                             decoder_name);
+        else if (status < 0)
+                PyErr_Format(PyExc_ValueError,
+                             "at most %d decoders can have options",
+                             DECODER_SELECT_MAX_DECODERS);
+
+out_free_options:
+        av_dict_free(&options);
+        if (PyErr_Occurred())
+                return NULL;
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+set_quality_control(PyObject *module, PyObject *args, PyObject *kw)
+{
+        double target_latency_s;
+        int32_t max_level = VID_QUALITY_NUM_LEVELS - 1;
+        static char *kwlist[] = {"target_latency", "max_level", 0};
+
+        if (!PyArg_ParseTupleAndKeywords(args,
+                                         kw,
+                                         "d|i:set_quality_control",
+                                         kwlist,
+                                         &target_latency_s,
+                                         &max_level))
+                return NULL;
+
+        if ((target_latency_s < 0.0) ||
+            (max_level < VID_QUALITY_EXACT) ||
+            (max_level >= VID_QUALITY_NUM_LEVELS)) {
+                PyErr_Format(PyExc_ValueError,
+                             "target_latency needs to be non-negative, and "
+                             "max_level between 0 and %d",
+                             VID_QUALITY_NUM_LEVELS - 1);
+                return NULL;
+        }
+
+        quality_control_configure(&get_state(module)->quality,
+                                  target_latency_s,
+                                  max_level);
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+seed(PyObject *UNUSED(dummy), PyObject *args)
+{
+        unsigned long long seed_value;
+
+        if (!PyArg_ParseTuple(args, "K:seed", &seed_value))
+                return NULL;
+
+        vid_decode_seed(seed_value);
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+save_keyframe_index(PyObject *UNUSED(dummy), PyObject *args)
+{
+        const char *path;
+
+        if (!PyArg_ParseTuple(args, "s:save_keyframe_index", &path))
+                return NULL;
+
+        if (keyframe_index_save(path) != 0)
+                return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+
+        Py_RETURN_NONE;
+}
+
+static PyObject *
+set_keyframe_index_capacity(PyObject *UNUSED(dummy), PyObject *args)
+{
+        uint32_t capacity;
+
+        if (!PyArg_ParseTuple(args,
+                              "I:set_keyframe_index_capacity",
+                              &capacity))
+                return NULL;
 
-                /**
-                 * Compute nb_frames from fmt ctx duration (microseconds) and
-                 * stream FPS (frames/second).
-                 */
-                assert(video_stream->avg_frame_rate.den > 0);
-
-                enum AVRounding rnd = (enum AVRounding)(AV_ROUND_DOWN |
-                                                        AV_ROUND_PASS_MINMAX);
-                int64_t fps_num = video_stream->avg_frame_rate.num;
-                int64_t fps_den =
-                        video_stream->avg_frame_rate.den*(int64_t)AV_TIME_BASE;
-                vid_ctx->nb_frames =
-                        av_rescale_rnd(vid_ctx->format_context->duration,
-                                       fps_num,
-                                       fps_den,
-                                       rnd);
+        keyframe_index_set_capacity(capacity);
 
-                /**
-                 * NOTE(brendan): fmt ctx duration in microseconds =>
-                 *
-                 * fmt ctx duration == (stream duration)*(stream timebase)*1e6
-                 *
-                 * since stream timebase is in units of
-                 * seconds / (stream timestamp). The rest of the code expects
-                 * the duration in stream timestamps, so do the conversion
-                 * here.
-                 *
-                 * Multiply the timebase numerator by AV_TIME_BASE to get a
-                 * more accurate rounded duration by doing the rounding in the
-                 * higher precision units.
-                 */
-                int64_t tb_num = video_stream->time_base.num*(int64_t)AV_TIME_BASE;
-                int64_t tb_den = video_stream->time_base.den;
-                vid_ctx->duration =
-                        av_rescale_rnd(vid_ctx->format_context->duration,
-                                       tb_den,
-                                       tb_num,
-                                       rnd);
-        } else {
-                vid_ctx->duration = video_stream->duration;
-                vid_ctx->nb_frames = video_stream->nb_frames;
-        }
+        Py_RETURN_NONE;
+}
 
-        vid_ctx->frame = av_frame_alloc();
-        if (vid_ctx->frame == NULL)
-                goto clean_up_avcodec;
+static PyObject *
+load_keyframe_index(PyObject *UNUSED(dummy), PyObject *args)
+{
+        const char *path;
 
-        return LOADVID_SUCCESS;
+        if (!PyArg_ParseTuple(args, "s:load_keyframe_index", &path))
+                return NULL;
 
-clean_up_avcodec:
-        avcodec_close(vid_ctx->codec_context);
-        avcodec_free_context(&vid_ctx->codec_context);
-clean_up_format_context:
-        avformat_close_input(&vid_ctx->format_context);
-clean_up_avio_ctx:
-        av_freep(&avio_ctx);
-clean_up_avio_ctx_buffer:
-        av_freep(&avio_ctx_buffer);
+        if (keyframe_index_load(path) != 0) {
+                PyErr_Format(PyExc_IOError,
+                             "could not load keyframe index from %s",
+                             path);
+                return NULL;
+        }
 
-        return LOADVID_ERR;
+        Py_RETURN_NONE;
 }
 
+/**
+ * struct index_job - Arguments and result of indexing a single video on the
+ * thread pool.
+ */
+struct index_job {
+        char *path;
+        struct video_index_row *row;
+};
+
 static void
-clean_up_vid_ctx(struct video_stream_context *vid_ctx)
+run_index_job(void *opaque)
 {
-        av_frame_free(&vid_ctx->frame);
-        avcodec_close(vid_ctx->codec_context);
-        avcodec_free_context(&vid_ctx->codec_context);
-        av_freep(&vid_ctx->format_context->pb->buffer);
-        av_freep(&vid_ctx->format_context->pb);
-        avformat_close_input(&vid_ctx->format_context);
+        struct index_job *job = (struct index_job *)opaque;
+
+        index_video_file(job->path, job->row);
 }
 
 /**
- * get_vid_width_height() - Sets `width` and `height` dynamically based on the
- * video's `AVCodecContext` if they are not already set.
- * @width: In/out pointer to width (unchecked for NULL).
- * @height: In/out pointer to height (unchecked for NULL).
- * @codec_context: Already-opened video `AVCodecContext`.
+ * run_index_jobs() - Indexes every video in `jobs`, and writes the resulting
+ * rows to `out_path`. Uses the module's shared thread pool if `num_threads` is
+ * zero, and otherwise a new pool of `num_threads` threads. Does not touch
+ * Python objects, so it can run without the GIL.
  *
- * Returns true iff the size has been set dynamically.
- * Also, checks that the width/height matches the AVCodecContext regardless
- * (via assert).
+ * Returns 0 on success, a negative value on failure.
  */
-static bool
-get_vid_width_height(uint32_t *width,
-                     uint32_t *height,
-                     AVCodecContext *codec_context)
+static int32_t
+run_index_jobs(struct lintel_state *state,
+               struct index_job *jobs,
+               struct video_index_row *rows,
+               uint64_t num_jobs,
+               uint32_t num_threads,
+               const char *out_path)
 {
-        /* NOTE(brendan): If no size is passed, dynamically find size. */
-        bool is_size_dynamic = (*width == 0) && (*height == 0);
-        if (is_size_dynamic) {
-                *width = codec_context->width;
-                *height = codec_context->height;
-        }
+        struct thread_pool_group group;
+        struct thread_pool *pool;
 
-        assert(((uint32_t)codec_context->width == *width) &&
-               ((uint32_t)codec_context->height == *height));
+        if (num_threads == 0)
+                pool = get_shared_pool(state);
+        else
+                pool = thread_pool_create(thread_budget_pool_size(num_threads));
+        if (pool == NULL)
+                return -1;
 
-        return is_size_dynamic;
+        thread_pool_group_init(&group);
+        for (uint64_t i = 0;
+             i < num_jobs;
+             ++i) {
+                if (thread_pool_submit(pool,
+                                       &group,
+                                       run_index_job,
+                                       jobs + i) != 0)
+                        run_index_job(jobs + i);
+        }
+        thread_pool_group_wait(&group);
+        thread_pool_group_destroy(&group);
+        if (num_threads != 0)
+                thread_pool_destroy(pool);
+
+        return write_video_index(out_path, rows, num_jobs);
 }
 
 static PyObject *
-loadvid_frame_nums(PyObject *UNUSED(dummy), PyObject *args, PyObject *kw)
+index_dataset(PyObject *module, PyObject *args, PyObject *kw)
 {
         PyObject *result = NULL;
-        const char *video_bytes = NULL;
-        Py_ssize_t in_size_bytes = 0;
-        PyObject *frame_nums = NULL;
-        uint32_t width = 0;
-        uint32_t height = 0;
-        /* NOTE(brendan): should_seek must be int (not bool) because Python. */
-        int32_t should_seek = 0;
-        int32_t use_frame = 0;
-        static char *kwlist[] = {"encoded_video",
-                                 "frame_nums",
-                                 "width",
-                                 "height",
-                                 "should_seek",
-                                 "use_frame",
-                                 0};
+        PyObject *paths = NULL;
+        const char *out_path = NULL;
+        uint32_t num_threads = 0;
+        static char *kwlist[] = {"paths", "out", "num_threads", 0};
 
         if (!PyArg_ParseTupleAndKeywords(args,
                                          kw,
-#if PY_MAJOR_VERSION >= 3
-                                         "y#|$OIIii:loadvid_frame_nums",
-#else
-                                         "s#|OIIii:loadvid_frame_nums",
-#endif
+                                         "Os|I:index_dataset",
                                          kwlist,
-                                         &video_bytes,
-                                         &in_size_bytes,
-                                         &frame_nums,
-                                         &width,
-                                         &height,
-                                         &should_seek,
-                                         &use_frame))
-                return NULL;
-
-        if (!PySequence_Check(frame_nums)) {
-                PyErr_SetString(PyExc_TypeError,
-                                "frame_nums needs to be a sequence");
+                                         &paths,
+                                         &out_path,
+                                         &num_threads))
                 return NULL;
-        }
-
-        struct video_stream_context vid_ctx;
-        struct buffer_data input_buf = {.ptr = video_bytes,
-                                        .offset_bytes = 0,
-                                        .total_size_bytes = in_size_bytes};
-        int32_t status = setup_vid_stream_context(&vid_ctx, &input_buf);
-
-        bool is_size_dynamic = get_vid_width_height(&width,
-                                                    &height,
-                                                    vid_ctx.codec_context);
 
         /**
-         * TODO(brendan): There is a hole in the logic here, where a bad status
-         * could be returned from `setup_vid_stream_context`, but the width and
-         * height from `codec_context` is still used to allocate `frames`.
-         *
-         * It is safer to pass the width and height as arguments, if there is a
-         * possibility that videos in the dataset have no video stream.
+         * NOTE(brendan): Copy to a tuple, since without the GIL a list could
+         * be mutated while its borrowed items are in use.
          */
-        const Py_ssize_t num_frames = PySequence_Size(frame_nums);
-        PyByteArrayObject *frames = alloc_pyarray(num_frames*width*height*3);
-        if (PyErr_Occurred() || (frames == NULL))
-                return (PyObject *)frames;
-
-
-        if (status != LOADVID_SUCCESS) {
-                if (status == LOADVID_ERR_STREAM_INDEX)
-                        return (PyObject *)frames;
-
+        PyObject *paths_seq = PySequence_Tuple(paths);
+        if (paths_seq == NULL)
                 return NULL;
+
+        const Py_ssize_t num_paths = PySequence_Fast_GET_SIZE(paths_seq);
+        struct index_job *jobs = PyMem_Calloc(num_paths + 1, sizeof(*jobs));
+        struct video_index_row *rows = PyMem_Calloc(num_paths + 1,
+                                                    sizeof(*rows));
+        if ((jobs == NULL) || (rows == NULL)) {
+                PyErr_NoMemory();
+                goto out_free_jobs;
         }
-#if PY_MAJOR_VERSION >= 3
-        int32_t *frame_nums_buf = PyMem_RawMalloc(num_frames*sizeof(int32_t));
-#else
-        int32_t *frame_nums_buf = PyMem_Malloc(num_frames*sizeof(int32_t));
-#endif
-        if (frame_nums_buf == NULL)
-                return PyErr_NoMemory();
 
-        for (int32_t i = 0;
-             i < num_frames;
+        for (Py_ssize_t i = 0;
+             i < num_paths;
              ++i) {
-                PyObject *item = PySequence_GetItem(frame_nums, i);
-                if (item == NULL)
-                        goto clean_up;
+                PyObject *path = PySequence_Fast_GET_ITEM(paths_seq, i);
+                const char *path_str = PyUnicode_AsUTF8(path);
+                if (path_str == NULL)
+                        goto out_free_jobs;
 
-                frame_nums_buf[i] = PyLong_AsLong(item);
-                Py_DECREF(item);
-                if (PyErr_Occurred())
-                        goto clean_up;
+                jobs[i].path = strdup(path_str);
+                if (jobs[i].path == NULL) {
+                        PyErr_NoMemory();
+                        goto out_free_jobs;
+                }
+                jobs[i].row = rows + i;
         }
 
-        result = (PyObject *)frames;
-
-        decode_video_from_frame_nums((uint8_t *)(frames->ob_bytes),
-                                     &vid_ctx,
-                                     num_frames,
-                                     frame_nums_buf,
-                                     should_seek != 0,
-                                     use_frame != 0);
-#if PY_MAJOR_VERSION >= 3
-        PyMem_RawFree(frame_nums_buf);
-#else
-        PyMem_Free(frame_nums_buf);
-#endif
-		
-clean_up:
-        clean_up_vid_ctx(&vid_ctx);
+        struct lintel_state *state = get_state(module);
+        int32_t status;
+        Py_BEGIN_ALLOW_THREADS
+        status = run_index_jobs(state,
+                                jobs,
+                                rows,
+                                num_paths,
+                                num_threads,
+                                out_path);
+        Py_END_ALLOW_THREADS
 
-        if (result != (PyObject *)frames) {
-                Py_CLEAR(frames);
-                return result;
+        if (status != 0) {
+                PyErr_SetFromErrnoWithFilename(PyExc_IOError, out_path);
+                goto out_free_jobs;
         }
 
-        if (!is_size_dynamic)
-                return (PyObject *)frames;
+        Py_INCREF(Py_None);
+        result = Py_None;
 
-        result = Py_BuildValue("Oii", frames, width, height);
-        Py_DECREF(frames);
+out_free_jobs:
+        for (Py_ssize_t i = 0;
+             (jobs != NULL) && (rows != NULL) && (i < num_paths);
+             ++i) {
+                free(jobs[i].path);
+                free_video_index_row(rows + i);
+        }
+        PyMem_Free(rows);
+        PyMem_Free(jobs);
+        Py_DECREF(paths_seq);
 
         return result;
 }
 
+/**
+ * get_memory_stats() - Returns a dict of {subsystem: {'current': bytes,
+ * 'peak': bytes}} from the process-wide memory accounting.
+ */
 static PyObject *
-loadvid(PyObject *UNUSED(dummy), PyObject *args, PyObject *kw)
+get_memory_stats(void)
 {
-        PyObject *result = NULL;
-        const char *video_bytes = NULL;
-        Py_ssize_t in_size_bytes = 0;
-        int32_t should_random_seek = 1;
-        uint32_t width = 0;
-        uint32_t height = 0;
-        uint32_t num_frames = 32;
-        float seek_distance = 0.0f;
-        static char *kwlist[] = {"encoded_video",
-                                 "should_random_seek",
-                                 "width",
-                                 "height",
-                                 "num_frames",
-                                 0};
-
-        if (!PyArg_ParseTupleAndKeywords(args,
-                                         kw,
-#if PY_MAJOR_VERSION >= 3
-                                         "y#|$iIII:loadvid",
-#else
-                                         "s#|iIII:loadvid",
-#endif
-                                         kwlist,
-                                         &video_bytes,
-                                         &in_size_bytes,
-                                         &should_random_seek,
-                                         &width,
-                                         &height,
-                                         &num_frames))
+        PyObject *memory = PyDict_New();
+        if (memory == NULL)
                 return NULL;
 
-        struct video_stream_context vid_ctx;
-        struct buffer_data input_buf = {.ptr = video_bytes,
-                                        .offset_bytes = 0,
-                                        .total_size_bytes = in_size_bytes};
-        int32_t status = setup_vid_stream_context(&vid_ctx, &input_buf);
+        for (uint32_t i = 0;
+             i < MEM_STATS_NUM_SUBSYSTEMS;
+             ++i) {
+                int64_t current_bytes;
+                int64_t peak_bytes;
+                mem_stats_get(i, &current_bytes, &peak_bytes);
 
-        bool is_size_dynamic = get_vid_width_height(&width,
-                                                    &height,
-                                                    vid_ctx.codec_context);
-													
-		bool full_video = false;
-		if (num_frames == 0) {
-			assert(should_random_seek == 0);
-			num_frames = vid_ctx.nb_frames;
-			full_video = true;
-		}
+                PyObject *counter = Py_BuildValue("{sLsL}",
+                                                  "current",
+                                                  (long long)current_bytes,
+                                                  "peak",
+                                                  (long long)peak_bytes);
+                if ((counter == NULL) ||
+                    (PyDict_SetItemString(memory,
+                                          mem_stats_name(i),
+                                          counter) != 0)) {
+                        Py_XDECREF(counter);
+                        Py_DECREF(memory);
+                        return NULL;
+                }
+                Py_DECREF(counter);
+        }
 
-        PyByteArrayObject *frames = alloc_pyarray(num_frames*width*height*3);
-        if (PyErr_Occurred() || (frames == NULL))
-                return (PyObject *)frames;
+        return memory;
+}
 
-        if (status != LOADVID_SUCCESS) {
-                /**
-                 * NOTE(brendan): In case there was a stream index error,
-                 * return a garbage buffer.
-                 */
-                if (status == LOADVID_ERR_STREAM_INDEX)
-                          goto return_frames;
+static PyObject *
+stats(PyObject *module, PyObject *UNUSED(args))
+{
+        struct lintel_state *state = get_state(module);
+        struct lintel_stats *stats = &state->stats;
+        struct codec_cache_stats cache_stats;
+        struct thread_budget_stats budget_stats;
 
-                return NULL;
-        }
+        codec_cache_get_stats(&cache_stats);
+        thread_budget_get_stats(&budget_stats);
 
-        int64_t timestamp = seek_to_closest_keypoint(&seek_distance,
-                                                     &vid_ctx,
-                                                     should_random_seek != 0,
-                                                     num_frames);
+        PyObject *memory = get_memory_stats();
+        if (memory == NULL)
+                return NULL;
 
-        /*
-         * NOTE(brendan): after this point, the only possible errors are due to
-         * not having enough frames in the video stream past the initial seek
-         * point. All other errors are covered by asserts.
-         *
-         * Therefore we return the frames buffer regardless, and it is a
-         * feature to return garbage in the decoded video output buffer, rather
-         * than returning an error, if there weren't any frames to decode in
-         * the first place.
-         */
-        result = (PyObject *)frames;
+        return Py_BuildValue(
+                "{sKsKsKsKsisKsKsKsKs{sIsIsI}sN}",
+                "num_decodes",
+                __atomic_load_n(&stats->num_decodes, __ATOMIC_RELAXED),
+                "num_failed_decodes",
+                __atomic_load_n(&stats->num_failed_decodes, __ATOMIC_RELAXED),
+                "num_frames_decoded",
+                __atomic_load_n(&stats->num_frames_decoded, __ATOMIC_RELAXED),
+                "num_bytes_out",
+                __atomic_load_n(&stats->num_bytes_out, __ATOMIC_RELAXED),
+                "quality_level",
+                (int)quality_control_level(&state->quality),
+                "scaler_reuses",
+                (unsigned long long)cache_stats.scaler_reuses,
+                "scaler_creates",
+                (unsigned long long)cache_stats.scaler_creates,
+                "decoder_reuses",
+                (unsigned long long)cache_stats.decoder_reuses,
+                "decoder_creates",
+                (unsigned long long)cache_stats.decoder_creates,
+                "thread_budget",
+                "max_threads",
+                budget_stats.max_threads,
+                "threads_in_use",
+                budget_stats.num_threads_in_use,
+                "decodes",
+                budget_stats.num_decodes,
+                "memory",
+                memory);
+}
 
-        status = skip_past_timestamp(&vid_ctx, timestamp);
-        if (status != VID_DECODE_SUCCESS)
-                goto clean_up_av_frame;
+static PyObject *
+reset_memory_peaks(PyObject *UNUSED(dummy), PyObject *UNUSED(args))
+{
+        mem_stats_reset_peaks();
 
-        decode_video_to_out_buffer((uint8_t *)(frames->ob_bytes),
-                                   &vid_ctx,
-                                   num_frames);
+        Py_RETURN_NONE;
+}
 
-clean_up_av_frame:
-        clean_up_vid_ctx(&vid_ctx);
+static PyObject *
+set_max_alloc(PyObject *UNUSED(dummy), PyObject *args)
+{
+        unsigned long long max_alloc_bytes;
 
-        if (result != (PyObject *)frames) {
-                Py_CLEAR(frames);
-                return result;
-        }
+        if (!PyArg_ParseTuple(args, "K:set_max_alloc", &max_alloc_bytes))
+                return NULL;
 
-return_frames:
-        if (!is_size_dynamic)
-                result = Py_BuildValue("Of", frames, seek_distance);
-        else if (full_video)
-				result = Py_BuildValue("Oiii",
-                                       frames,
-                                       width,
-                                       height,
-                                       num_frames);
-		else
-                result = Py_BuildValue("Oiif",
-                                       frames,
-                                       width,
-                                       height,
-                                       seek_distance);
-        Py_DECREF(frames);
+        av_max_alloc(max_alloc_bytes);
 
-        return result;
+        Py_RETURN_NONE;
 }
 
 static PyMethodDef lintel_methods[] = {
         {"loadvid",
          (PyCFunction)loadvid,
          METH_VARARGS | METH_KEYWORDS,
-         PyDoc_STR("loadvid(encoded_video, should_random_seek, width, height, num_frames) -> "
+         PyDoc_STR("loadvid(encoded_video, should_random_seek, width, height, num_frames, video_id, meta, pad, lazy_pad, parallel, decoder, fast_decode, tubelet, temporal_diff, rgb) -> "
                    "tuple(decoded video ByteArray object, seek_distance) or\n"
                    "tuple(decoded video ByteArray object, width, height, seek_distance)\n"
-                   "if width and height are not passed as arguments.")},
+                   "if width and height are not passed as arguments.\n"
+                   "With lazy_pad, only unique frames are returned, followed by "
+                   "an int32 index map ByteArray (-1 for zero frames).\n"
+                   "With num_frames=0 and parallel, the whole video is split "
+                   "at keyframes into segments decoded in parallel on the "
+                   "module's thread pool.\n"
+                   "decoder names the decoder to use (e.g. 'libdav1d') if it "
+                   "decodes the video's codec, overriding "
+                   "set_decoder_preference.\n"
+                   "fast_decode trades exactness for speed, skipping the "
+                   "loop filter, and the IDCT of non-reference frames.\n"
+                   "tubelet=(t, p) writes the frames in video transformer "
+                   "tubelet order, as a (num_frames/t, height/p, width/p, "
+                   "t, p, p, 3) array; num_frames must be a multiple of t, "
+                   "and width and height multiples of p.\n"
+                   "temporal_diff ('int8' (saturated), 'int16' or 'float32') "
+                   "appends the num_frames - 1 frame differences "
+                   "x[t + 1] - x[t], of that type, computed as the frames are "
+                   "converted. With rgb=False, only the differences are "
+                   "written, and the frames ByteArray is empty.")},
         {"loadvid_frame_nums",
          (PyCFunction)loadvid_frame_nums,
          METH_VARARGS | METH_KEYWORDS,
-         PyDoc_STR("loadvid_frame_nums(encoded_video, frame_nums, width, height, should_seek) -> "
+         PyDoc_STR("loadvid_frame_nums(encoded_video, frame_nums, width, height, should_seek, use_frame, video_id, meta, pad, lazy_pad, parallel, decoder, fast_decode, tubelet, temporal_diff, rgb) -> "
                    "decoded video ByteArray object or\n"
                    "tuple(decoded video ByteArray object, width, height)\n"
-                   "if width and height are not passed as arguments.")},
+                   "if width and height are not passed as arguments.\n"
+                   "frame_nums can be a sequence of ints, an int32/int64 "
+                   "buffer (e.g. a numpy array), a range, or a "
+                   "lintel.sampling spec resolved against the video's "
+                   "number of frames.\n"
+                   "With parallel, the frames are grouped by GOP, and the "
+                   "groups decoded in parallel on the module's thread pool, "
+                   "with exact frame numbers (should_seek and use_frame are "
+                   "ignored).\n"
+                   "With lazy_pad, only unique frames are returned, followed by "
+                   "an int32 index map ByteArray (-1 for zero frames).\n"
+                   "tubelet=(t, p) writes the frames in tubelet order, and "
+                   "temporal_diff and rgb append frame differences, as for "
+                   "loadvid.")},
+        {"loadvid_stream",
+         (PyCFunction)loadvid_stream,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("loadvid_stream(source, width, height, num_frames, "
+                   "buffer_size, pad, lazy_pad, decoder, fast_decode) -> "
+                   "frames\n"
+                   "Decodes the first num_frames frames of a video read "
+                   "incrementally from a non-seekable source: a file "
+                   "descriptor (e.g. a pipe or socket), or an object with a "
+                   "readinto or read method.")},
+        {"index_dataset",
+         (PyCFunction)index_dataset,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("index_dataset(paths, out, num_threads) -> None\n"
+                   "Probes and scans the keyframes of each video file in "
+                   "paths on a native thread pool, and writes the columnar "
+                   "index file out.")},
+        {"loadvid_batch",
+         (PyCFunction)loadvid_batch,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("loadvid_batch(encoded_videos, should_random_seek, width, height, num_frames, pad, out, decoder, fast_decode, tubelet) -> "
+                   "tuple(arena ByteArray object, layout, seek_distances)\n"
+                   "Decodes a clip of num_frames from each encoded video on "
+                   "the module's thread pool, back to back into one arena. "
+                   "layout is an int64 ByteArray with one row per video of "
+                   "(offset_bytes, num_frames, height, width, quality_level), "
+                   "where "
+                   "num_frames is 0 if the video could not be opened (or did "
+                   "not match the requested width and height, or tubelet). "
+                   "seek_distances is a float32 ByteArray.\n"
+                   "With width and height, clips are packed densely as a "
+                   "(batch, num_frames, height, width, 3) array, and can be "
+                   "written to a preallocated writable buffer passed as out "
+                   "(e.g. a pinned tensor's numpy view), which is then "
+                   "returned in place of the arena. Random seeks are seeded "
+                   "from the calling thread's generator (see seed).\n"
+                   "tubelet=(t, p) writes each clip in tubelet order, as for "
+                   "loadvid.")},
+        {"set_format_cache_capacity",
+         (PyCFunction)set_format_cache_capacity,
+         METH_VARARGS,
+         PyDoc_STR("set_format_cache_capacity(capacity) -> None\n"
+                   "Sets how many opened demuxers are cached by video_id. "
+                   "Zero disables the cache.")},
+        {"set_streaming_store_threshold",
+         (PyCFunction)set_streaming_store_threshold,
+         METH_VARARGS,
+         PyDoc_STR("set_streaming_store_threshold(threshold_bytes) -> None\n"
+                   "Sets the output size above which decoded frames are "
+                   "written with non-temporal stores. A negative value "
+                   "restores the default, the last-level cache size.")},
+        {"set_thread_budget",
+         (PyCFunction)set_thread_budget,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("set_thread_budget(max_threads, shared_name=None) -> None\n"
+                   "Caps the total decoding threads, shared by every decode "
+                   "in the process, or by every process using the same "
+                   "shared_name (a POSIX shared memory name, e.g. '/lintel'). "
+                   "Zero (the default) leaves decoders single-threaded.")},
+        {"set_decoder_preference",
+         (PyCFunction)set_decoder_preference,
+         METH_VARARGS,
+         PyDoc_STR("set_decoder_preference(decoders) -> None\n"
+                   "Sets the preferred decoders by name, most preferred "
+                   "first, e.g. ['libdav1d', 'libvpx-vp9']. Each video is "
+                   "decoded by the first preferred decoder for its codec, or "
+                   "by FFmpeg's default decoder. An empty list restores the "
+                   "defaults. Applies to the whole process.")},
+        {"set_decoder_options",
+         (PyCFunction)set_decoder_options,
+         METH_VARARGS,
+         PyDoc_STR("set_decoder_options(decoder, options=None) -> None\n"
+                   "Sets the options that the named decoder is opened with, "
+                   "e.g. {'framethreads': 4, 'tilethreads': 2} for libdav1d. "
+                   "None clears them. Applies to the whole process.")},
+        {"set_quality_control",
+         (PyCFunction)set_quality_control,
+         METH_VARARGS | METH_KEYWORDS,
+         PyDoc_STR("set_quality_control(target_latency, max_level=3) -> None\n"
+                   "Steps loadvid_batch down to cheaper quality levels while "
+                   "batches take longer than target_latency seconds (or jobs "
+                   "back up in the thread pool), and back up once they catch "
+                   "up. Levels: 0 exact, 1 fast_decode, 2 clips start at "
+                   "keyframes, 3 nearest-neighbour chroma upsampling. "
+                   "target_latency=0 disables it.")},
+        {"seed",
+         (PyCFunction)seed,
+         METH_VARARGS,
+         PyDoc_STR("seed(seed) -> None\n"
+                   "Seeds the random seeks made by the calling thread. Each "
+                   "thread has its own generator.")},
+        {"stats",
+         (PyCFunction)stats,
+         METH_NOARGS,
+         PyDoc_STR("stats() -> dict\n"
+                   "Returns counters of the decodes done by this interpreter: "
+                   "num_decodes, num_failed_decodes (decodes that returned no "
+                   "frames), num_frames_decoded (unique frames, excluding "
+                   "padding), num_bytes_out, and the current quality_level "
+                   "(see set_quality_control), plus process-wide "
+                   "scaler_reuses, scaler_creates, decoder_reuses and "
+                   "decoder_creates counting how often per-thread scalers "
+                   "and decoders were reused rather than set up, "
+                   "thread_budget, the max_threads of the budget (see "
+                   "set_thread_budget) and the threads_in_use and decodes "
+                   "that hold grants from it, and memory, "
+                   "the current and peak bytes held by each stage of "
+                   "decoding (avio, probe, frame_rgb, decoder (estimated), "
+                   "output, caches, and their total).")},
+        {"reset_memory_peaks",
+         (PyCFunction)reset_memory_peaks,
+         METH_NOARGS,
+         PyDoc_STR("reset_memory_peaks() -> None\n"
+                   "Resets the memory peaks in stats() to the current values, "
+                   "e.g. to measure the peaks of one call.")},
+        {"set_max_alloc",
+         (PyCFunction)set_max_alloc,
+         METH_VARARGS,
+         PyDoc_STR("set_max_alloc(max_alloc_bytes) -> None\n"
+                   "Caps the size of any single FFmpeg allocation, so that a "
+                   "decode needing more fails rather than exhausting memory "
+                   "(FFmpeg's default is INT_MAX).")},
+        {"save_keyframe_index",
+         (PyCFunction)save_keyframe_index,
+         METH_VARARGS,
+         PyDoc_STR("save_keyframe_index(path) -> None\n"
+                   "Saves the keyframes learned so far for every video_id.")},
+        {"load_keyframe_index",
+         (PyCFunction)load_keyframe_index,
+         METH_VARARGS,
+         PyDoc_STR("load_keyframe_index(path) -> None\n"
+                   "Merges keyframes saved by save_keyframe_index.")},
+        {"set_keyframe_index_capacity",
+         (PyCFunction)set_keyframe_index_capacity,
+         METH_VARARGS,
+         PyDoc_STR("set_keyframe_index_capacity(capacity) -> None\n"
+                   "Sets how many videos' keyframes are indexed, evicting the "
+                   "least recently used. Zero disables the index.")},
         {NULL, NULL, 0, NULL}
 };
 
+static pthread_once_t ffmpeg_init_once = PTHREAD_ONCE_INIT;
+
+static void
+init_ffmpeg(void)
+{
+        av_register_all();
+        av_log_set_level(AV_LOG_ERROR);
+}
+
 #if PY_MAJOR_VERSION >= 3
+/**
+ * lintel_exec() - Initializes a new instance of the module, e.g. when it is
+ * imported by another sub-interpreter. FFmpeg itself is only initialized once
+ * per process.
+ */
+static int
+lintel_exec(PyObject *module)
+{
+        struct lintel_state *state = get_state(module);
+
+        pthread_once(&ffmpeg_init_once, init_ffmpeg);
+
+        memset(state, 0, sizeof(*state));
+        if (pthread_mutex_init(&state->pool_lock, NULL) != 0) {
+                PyErr_SetString(PyExc_RuntimeError,
+                                "could not initialize _lintel state");
+                return -1;
+        }
+        quality_control_init(&state->quality);
+
+        return 0;
+}
+
+static void
+lintel_free(void *module)
+{
+        struct lintel_state *state = get_state((PyObject *)module);
+        if (state == NULL)
+                return;
+
+        if (state->pool != NULL)
+                thread_pool_destroy(state->pool);
+        state->pool = NULL;
+        pthread_mutex_destroy(&state->pool_lock);
+        quality_control_destroy(&state->quality);
+}
+
+static PyModuleDef_Slot lintel_slots[] = {
+        {Py_mod_exec, lintel_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+        /**
+         * NOTE(brendan): Module state is per-interpreter, and the process-wide
+         * state holds no Python objects, so each sub-interpreter can have its
+         * own GIL.
+         */
+        {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+        /**
+         * NOTE(brendan): All native state is either per-call, per-thread or
+         * behind its own lock, so free-threaded builds need not re-enable the
+         * GIL for this module.
+         */
+        {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+        {0, NULL}
+};
+
 static struct PyModuleDef
 lintelmodule = {
         PyModuleDef_HEAD_INIT,
         "_lintel",
         module_doc,
-        0,
+        sizeof(struct lintel_state),
         lintel_methods,
+        lintel_slots,
         NULL,
         NULL,
-        NULL,
-        NULL
+        lintel_free
 };
 #endif
 
@@ -531,13 +3040,10 @@ PyInit__lintel(void)
 init_lintel(void)
 #endif
 {
-        av_register_all();
-        av_log_set_level(AV_LOG_ERROR);
-        srand(time(NULL));
-		
 #if PY_MAJOR_VERSION >= 3
         return PyModuleDef_Init(&lintelmodule);
 #else
-		return Py_InitModule("_lintel", lintel_methods);
+        pthread_once(&ffmpeg_init_once, init_ffmpeg);
+        Py_InitModule("_lintel", lintel_methods);
 #endif
 }
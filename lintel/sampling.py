@@ -0,0 +1,64 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+"""Declarative frame sampling specs for `lintel.loadvid_frame_nums`.
+
+A spec is passed as `frame_nums`, and resolved natively against the video's
+actual number of frames, so that a sampler does not need to know the length of
+each video or build a list of frame numbers per sample. Random specs use the
+calling thread's generator, which `lintel.seed` seeds.
+
+Specs always resolve to increasing frame numbers. If a video is too short for
+`uniform`, `segments` or `random_dense`, its first frames are used and the
+rest are padded according to `pad`.
+"""
+import collections
+
+
+SamplingSpec = collections.namedtuple('SamplingSpec', ['kind', 'params'])
+SamplingSpec.__doc__ = """A frame sampling spec: a kind, and three integer
+parameters whose meaning depends on the kind."""
+
+# NOTE(brendan): Matches FRAME_SAMPLING_TO_END in core/sampling.h.
+_TO_END = -1
+
+
+def frame_range(start=0, stop=None, step=1):
+    """Frames `start`, `start + step`, ... before `stop`, or before the end of
+    the video if `stop` is None. A Python `range` can be passed as
+    `frame_nums` directly, if `stop` is known."""
+    if stop is None:
+        stop = _TO_END
+
+    return SamplingSpec('range', (start, stop, step))
+
+
+def uniform(num_frames):
+    """`num_frames` frames, one from the middle of each of `num_frames` equal
+    parts of the video."""
+    return SamplingSpec('uniform', (num_frames, 0, 0))
+
+
+def segments(num_segments, per_segment=1):
+    """`per_segment` consecutive frames at a random offset within each of
+    `num_segments` equal parts of the video, as in Temporal Segment
+    Networks."""
+    return SamplingSpec('segments', (num_segments, per_segment, 0))
+
+
+def random_dense(num_frames, stride=1):
+    """`num_frames` frames, `stride` frames apart, starting from a random
+    frame such that the clip fits in the video."""
+    return SamplingSpec('random_dense', (num_frames, stride, 0))
@@ -0,0 +1,212 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Decode throughput benchmark for loadvid."""
+import os
+import subprocess
+import tempfile
+import time
+
+import click
+
+import lintel
+import lintel.cost
+
+
+# NOTE(brendan): Larger than any last-level cache, so streaming stores are
+# never used.
+_STREAMING_STORES_OFF = 2**62
+
+
+def _make_synthetic_video(width,
+                          height,
+                          num_frames,
+                          directory,
+                          encoder='libx264'):
+    """Encodes a synthetic test pattern video with the ffmpeg CLI, by default
+    as H.264."""
+    filename = os.path.join(directory,
+                            'synthetic_{}x{}_{}.mkv'.format(width,
+                                                            height,
+                                                            encoder))
+    subprocess.check_call(['ffmpeg',
+                           '-loglevel', 'error',
+                           '-y',
+                           '-f', 'lavfi',
+                           '-i', 'testsrc2=size={}x{}:rate=30'.format(width,
+                                                                     height),
+                           '-frames:v', str(num_frames),
+                           '-c:v', encoder,
+                           '-pix_fmt', 'yuv420p',
+                           '-g', '30',
+                           filename])
+
+    return filename
+
+
+def _time_loadvid(encoded_video,
+                  num_frames,
+                  num_iters,
+                  decoder=None,
+                  fast_decode=False):
+    """Returns decoded frames per second over `num_iters` calls to loadvid,
+    each decoding `num_frames` frames from the start of the video."""
+    start = time.perf_counter()
+    for _ in range(num_iters):
+        lintel.loadvid(encoded_video,
+                       should_random_seek=False,
+                       num_frames=num_frames,
+                       decoder=decoder,
+                       fast_decode=fast_decode)
+    end = time.perf_counter()
+
+    return num_iters*num_frames/(end - start)
+
+
+def _calibrate_cost(filename, num_iters):
+    """Fits a `lintel.cost.CostModel` to decodes of `filename` with a range of
+    sampling specs, and prints it."""
+    with tempfile.TemporaryDirectory() as directory:
+        index_path = os.path.join(directory, 'index')
+        lintel.index_dataset([filename], out=index_path)
+        meta = lintel.DatasetIndex(index_path).row(0)
+
+    with open(filename, 'rb') as f:
+        encoded_video = f.read()
+
+    specs = ([lintel.sampling.frame_range(0, n) for n in [1, 8, 32, 128]] +
+             [lintel.sampling.uniform(n) for n in [2, 4, 8, 16]] +
+             [lintel.sampling.segments(n, k) for n in [4, 8] for k in [1, 4]] +
+             [lintel.sampling.random_dense(16, stride)
+              for stride in [1, 4]])
+
+    samples = []
+    for spec in specs:
+        lintel.loadvid_frame_nums(encoded_video,
+                                  frame_nums=spec,
+                                  should_seek=True,
+                                  meta=meta)
+        start = time.perf_counter()
+        for _ in range(num_iters):
+            lintel.loadvid_frame_nums(encoded_video,
+                                      frame_nums=spec,
+                                      should_seek=True,
+                                      meta=meta)
+        end = time.perf_counter()
+        samples.append((meta, spec, (end - start)/num_iters))
+
+    model = lintel.cost.fit_cost_model(samples)
+    print('cost model: {}'.format(model))
+    for meta, spec, seconds in samples:
+        estimate = lintel.cost.estimate_cost(meta, spec, model)
+        print('  {}: measured {:.2f} ms, estimated {:.2f} ms'.format(
+            spec, 1e3*seconds, 1e3*estimate))
+
+
+@click.command()
+@click.option('--filename',
+              default=None,
+              type=str,
+              help='Input video. If not passed, a synthetic video is encoded '
+                   'with the ffmpeg CLI.')
+@click.option('--width',
+              default=1920,
+              type=int,
+              help='Width of the synthetic video.')
+@click.option('--height',
+              default=1080,
+              type=int,
+              help='Height of the synthetic video.')
+@click.option('--num-frames',
+              default=64,
+              type=int,
+              help='Number of frames decoded per loadvid call.')
+@click.option('--num-iters',
+              default=10,
+              type=int,
+              help='Number of loadvid calls per measurement.')
+@click.option('--encoder',
+              default='libx264',
+              type=str,
+              help='ffmpeg encoder of the synthetic video, e.g. libaom-av1 '
+                   'or libvpx-vp9.')
+@click.option('--decoders',
+              default=None,
+              type=str,
+              help='Comma-separated decoders to compare, e.g. '
+                   'libdav1d,libaom-av1,av1.')
+@click.option('--calibrate-cost',
+              is_flag=True,
+              help='Fit the lintel.cost model to this machine, with a '
+                   'synthetic video 10s long (or --filename).')
+def benchmark(filename,
+              width,
+              height,
+              num_frames,
+              num_iters,
+              encoder,
+              decoders,
+              calibrate_cost):
+    """Measures single-threaded decode throughput, with and without
+    non-temporal (streaming) stores for the decoded output, with and without
+    fast (approximate) decoding, and optionally of each of a list of decoders.
+    """
+    with tempfile.TemporaryDirectory() as directory:
+        if calibrate_cost:
+            if filename is None:
+                filename = _make_synthetic_video(width,
+                                                 height,
+                                                 300,
+                                                 directory,
+                                                 encoder)
+            _calibrate_cost(filename, num_iters)
+            return
+
+        if filename is None:
+            filename = _make_synthetic_video(width,
+                                             height,
+                                             num_frames,
+                                             directory,
+                                             encoder)
+
+        with open(filename, 'rb') as f:
+            encoded_video = f.read()
+
+    # NOTE(brendan): Warm up, so that the first measurement is not penalized.
+    _time_loadvid(encoded_video, num_frames, 1)
+
+    for name, threshold in [('regular stores', _STREAMING_STORES_OFF),
+                            ('streaming stores', 0),
+                            ('default', -1)]:
+        lintel.set_streaming_store_threshold(threshold)
+        fps = _time_loadvid(encoded_video, num_frames, num_iters)
+        print('{}: {:.1f} frames/s'.format(name, fps))
+
+    lintel.set_streaming_store_threshold(-1)
+
+    exact_fps = _time_loadvid(encoded_video, num_frames, num_iters)
+    fast_fps = _time_loadvid(encoded_video,
+                             num_frames,
+                             num_iters,
+                             fast_decode=True)
+    print('fast_decode: {:.1f} frames/s ({:+.1f}%)'.format(
+        fast_fps, 100*(fast_fps/exact_fps - 1)))
+
+    if decoders is None:
+        return
+
+    for decoder in decoders.split(','):
+        _time_loadvid(encoded_video, num_frames, 1, decoder)
+        fps = _time_loadvid(encoded_video, num_frames, num_iters, decoder)
+        print('{}: {:.1f} frames/s'.format(decoder, fps))
@@ -0,0 +1,157 @@
+/**
+ * Copyright 2018 Brendan Duke.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Checks the C++20 coroutine interface of `frames.hpp` against a video file,
+ * and doubles as an example of its use:
+ *
+ *         make -C lintel/test check VIDEO=<video-filename>
+ *
+ * The frames of a range yielded by the `lintel::frames` generator must be
+ * numbered in order, and match the clip that `lintel::reader::decode_clip`
+ * decodes on a thread pool.
+ */
+#include "frames.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+namespace {
+
+/**
+ * detached - A coroutine that starts eagerly and is never awaited, e.g. one
+ * request handler of a server.
+ */
+struct detached {
+        struct promise_type {
+                detached get_return_object() { return {}; }
+
+                std::suspend_never initial_suspend() noexcept { return {}; }
+
+                std::suspend_never final_suspend() noexcept { return {}; }
+
+                void return_void() noexcept {}
+
+                void unhandled_exception() { std::terminate(); }
+        };
+};
+
+/**
+ * decode_clip_to() - Decodes the clip of `spec` on `pool`, and hands it (or
+ * the decode's exception) to `result`. Resumes on the pool worker.
+ */
+detached
+decode_clip_to(lintel::reader &reader,
+               thread_pool *pool,
+               frame_sampling_spec spec,
+               std::promise<lintel::clip> &result)
+{
+        try {
+                result.set_value(co_await reader.decode_clip(pool, spec));
+        } catch (...) {
+                result.set_exception(std::current_exception());
+        }
+}
+
+std::vector<uint8_t>
+read_file(const char *path)
+{
+        std::ifstream file{path, std::ios::binary};
+        if (!file)
+                throw std::runtime_error{std::string{"could not open "} + path};
+
+        return std::vector<uint8_t>{std::istreambuf_iterator<char>{file},
+                                    std::istreambuf_iterator<char>{}};
+}
+
+bool
+check(bool is_ok, const char *what)
+{
+        if (!is_ok)
+                std::fprintf(stderr, "frames_test: %s\n", what);
+
+        return is_ok;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+        if (argc != 2) {
+                std::fprintf(stderr, "usage: %s <video-filename>\n", argv[0]);
+                return 2;
+        }
+
+        av_register_all();
+
+        const std::vector<uint8_t> encoded_video = read_file(argv[1]);
+        const frame_sampling_spec spec{FRAME_SAMPLING_RANGE, {0, 16, 1}};
+
+        std::vector<int64_t> frame_numbers;
+        std::vector<uint8_t> generated;
+        lintel::reader frame_reader{encoded_video};
+        for (const lintel::frame &frame : lintel::frames(frame_reader, spec)) {
+                frame_numbers.push_back(frame.number);
+                generated.insert(generated.end(),
+                                 frame.rgb.begin(),
+                                 frame.rgb.end());
+        }
+
+        thread_pool *pool = thread_pool_create(2);
+        if (pool == nullptr) {
+                std::fprintf(stderr, "frames_test: no thread pool\n");
+                return 1;
+        }
+
+        lintel::reader clip_reader{encoded_video};
+        std::promise<lintel::clip> result;
+        std::future<lintel::clip> future = result.get_future();
+        decode_clip_to(clip_reader, pool, spec, result);
+        const lintel::clip clip = future.get();
+        /* NOTE(brendan): Joins the worker that finished the coroutine. */
+        thread_pool_destroy(pool);
+
+        bool is_ok = check(!frame_numbers.empty(), "no frames yielded");
+        for (size_t i = 0;
+             i < frame_numbers.size();
+             ++i)
+                is_ok &= check(frame_numbers[i] == static_cast<int64_t>(i),
+                               "frames yielded out of order");
+
+        is_ok &= check(clip.num_decoded_frames ==
+                       static_cast<int32_t>(frame_numbers.size()),
+                       "clip and generator decoded different frame counts");
+        is_ok &= check((clip.rgb.size() >= generated.size()) &&
+                       std::equal(generated.begin(),
+                                  generated.end(),
+                                  clip.rgb.begin()),
+                       "clip and generator decoded different frames");
+
+        if (!is_ok)
+                return 1;
+
+        std::printf("frames_test: ok\n");
+
+        return 0;
+}
@@ -13,7 +13,12 @@
 # limitations under the License.
 
 """Unit test for loadvid."""
+import io
+import os
 import random
+import subprocess
+import tempfile
+import threading
 import time
 
 import click
@@ -23,6 +28,880 @@ import matplotlib.pyplot as plt
 import lintel
 
 
+# NOTE(brendan): Multiples of 16, so that tubelet and chroma subsampling
+# checks divide evenly.
+_CHECK_WIDTH = 64
+_CHECK_HEIGHT = 48
+
+
+def _make_test_video(directory,
+                     name,
+                     num_frames,
+                     ffmpeg_args=(),
+                     width=_CHECK_WIDTH,
+                     height=_CHECK_HEIGHT):
+    """Encodes a synthetic test pattern video named `name` (whose extension
+    picks the container) with the ffmpeg CLI, as H.264 with a GOP of 8 frames
+    unless `ffmpeg_args` says otherwise, and returns its encoded bytes and
+    filename."""
+    filename = os.path.join(directory, name)
+    subprocess.check_call(['ffmpeg',
+                           '-loglevel', 'error',
+                           '-y',
+                           '-f', 'lavfi',
+                           '-i', 'testsrc2=size={}x{}:rate=30'.format(width,
+                                                                     height),
+                           '-frames:v', str(num_frames),
+                           '-c:v', 'libx264',
+                           '-pix_fmt', 'yuv420p',
+                           '-g', '8'] +
+                          list(ffmpeg_args) +
+                          [filename])
+
+    with open(filename, 'rb') as f:
+        return f.read(), filename
+
+
+def _as_frames(frames, width=_CHECK_WIDTH, height=_CHECK_HEIGHT):
+    """Views a decoded ByteArray as a (T, H, W, 3) uint8 array."""
+    return np.frombuffer(frames, dtype=np.uint8).reshape((-1, height, width, 3))
+
+
+def _check_meta_mp4(directory):
+    """Checks that an H.264 MP4, whose pixel format the mov demuxer only knows
+    after reading stream info, decodes the same with `meta` from a dataset
+    index as without."""
+    encoded_video, filename = _make_test_video(directory, 'meta.mp4', 48)
+    index_path = os.path.join(directory, 'meta.index')
+    lintel.index_dataset([filename], out=index_path)
+    meta = lintel.DatasetIndex(index_path).row(0)
+
+    expected = lintel.loadvid_frame_nums(encoded_video,
+                                         frame_nums=list(range(16)),
+                                         width=_CHECK_WIDTH,
+                                         height=_CHECK_HEIGHT)
+    actual = lintel.loadvid_frame_nums(encoded_video,
+                                       frame_nums=list(range(16)),
+                                       width=_CHECK_WIDTH,
+                                       height=_CHECK_HEIGHT,
+                                       meta=meta)
+    assert actual == expected
+
+    actual, _ = lintel.loadvid(encoded_video,
+                               should_random_seek=False,
+                               width=_CHECK_WIDTH,
+                               height=_CHECK_HEIGHT,
+                               num_frames=16,
+                               meta=meta)
+    assert actual == expected
+
+
+def _check_keyframe_index(directory):
+    """Checks that seeks through the keyframe index learned with a `video_id`,
+    and through the index saved and loaded again, decode the same frames as a
+    decode with no index."""
+    encoded_video, _ = _make_test_video(directory, 'keyframes.mp4', 96)
+    frame_nums = [5, 40, 41, 90]
+    expected = lintel.loadvid_frame_nums(encoded_video,
+                                         frame_nums=frame_nums,
+                                         width=_CHECK_WIDTH,
+                                         height=_CHECK_HEIGHT)
+
+    for should_seek in [False, True]:
+        actual = lintel.loadvid_frame_nums(encoded_video,
+                                           frame_nums=frame_nums,
+                                           width=_CHECK_WIDTH,
+                                           height=_CHECK_HEIGHT,
+                                           should_seek=should_seek,
+                                           video_id='keyframes.mp4')
+        assert actual == expected
+
+    index_path = os.path.join(directory, 'keyframes.index')
+    lintel.save_keyframe_index(index_path)
+    lintel.set_keyframe_index_capacity(0)
+    lintel.set_keyframe_index_capacity(16384)
+    lintel.load_keyframe_index(index_path)
+
+    actual = lintel.loadvid_frame_nums(encoded_video,
+                                       frame_nums=frame_nums,
+                                       width=_CHECK_WIDTH,
+                                       height=_CHECK_HEIGHT,
+                                       should_seek=True,
+                                       video_id='keyframes.mp4')
+    assert actual == expected
+
+
+# NOTE(brendan): Open GOPs with B-frames, so that frames after each keyframe
+# can reference the previous GOP.
+_OPEN_GOP_ARGS = ['-bf', '2', '-x264-params', 'open-gop=1']
+
+
+def _check_parallel_full_decode(directory):
+    """Checks that decoding a whole video in parallel segments is
+    byte-identical to the sequential full decode, with closed and open
+    GOPs."""
+    for name, ffmpeg_args in [('closed_gop.mp4', []),
+                              ('open_gop.mp4', _OPEN_GOP_ARGS)]:
+        encoded_video, _ = _make_test_video(directory, name, 100, ffmpeg_args)
+
+        expected, _ = lintel.loadvid(encoded_video,
+                                     should_random_seek=False,
+                                     width=_CHECK_WIDTH,
+                                     height=_CHECK_HEIGHT,
+                                     num_frames=0)
+        actual, _ = lintel.loadvid(encoded_video,
+                                   should_random_seek=False,
+                                   width=_CHECK_WIDTH,
+                                   height=_CHECK_HEIGHT,
+                                   num_frames=0,
+                                   parallel=True)
+        assert len(expected) == 100*_CHECK_HEIGHT*_CHECK_WIDTH*3
+        assert actual == expected
+
+
+def _check_parallel_frame_nums(directory):
+    """Checks that decoding frame numbers grouped by GOP in parallel matches
+    the sequential decode, for sparse frames across many GOPs, and frames past
+    the end of the video under each padding policy, and that unsorted or
+    repeated frame numbers are rejected."""
+    frame_nums = [0, 3, 17, 18, 40, 77, 78, 101, 119, 125, 130]
+    for name, ffmpeg_args in [('sparse.mp4', []),
+                              ('sparse_open_gop.mp4', _OPEN_GOP_ARGS)]:
+        encoded_video, _ = _make_test_video(directory, name, 120, ffmpeg_args)
+
+        for pad in ['loop', 'last', 'zeros']:
+            expected = lintel.loadvid_frame_nums(encoded_video,
+                                                 frame_nums=frame_nums,
+                                                 width=_CHECK_WIDTH,
+                                                 height=_CHECK_HEIGHT,
+                                                 pad=pad)
+            actual = lintel.loadvid_frame_nums(encoded_video,
+                                               frame_nums=frame_nums,
+                                               width=_CHECK_WIDTH,
+                                               height=_CHECK_HEIGHT,
+                                               pad=pad,
+                                               parallel=True)
+            assert actual == expected, (name, pad)
+
+    for bad_frame_nums in [[50, 3], [3, 3]]:
+        try:
+            lintel.loadvid_frame_nums(encoded_video,
+                                      frame_nums=bad_frame_nums,
+                                      width=_CHECK_WIDTH,
+                                      height=_CHECK_HEIGHT,
+                                      parallel=True)
+        except ValueError:
+            pass
+        else:
+            assert False, bad_frame_nums
+
+
+def _find_frame_nums(frames, reference):
+    """Returns the frame number of each frame of `frames` in the full decode
+    `reference` (the test pattern changes every frame)."""
+    reference_nums = {frame.tobytes(): i for i, frame in enumerate(reference)}
+    return [reference_nums[frame.tobytes()] for frame in frames]
+
+
+def _check_frame_nums_specs(directory):
+    """Checks each form of `frame_nums`: int32 and int64 numpy arrays, a
+    range, and each `lintel.sampling` spec, whose resolved frame numbers are
+    found in a full decode, that `lintel.seed` makes random specs
+    reproducible, and that specs past int32 frame numbers are rejected."""
+    nb_frames = 60
+    encoded_video, _ = _make_test_video(directory, 'specs.mp4', nb_frames)
+
+    def decode(frame_nums):
+        return lintel.loadvid_frame_nums(encoded_video,
+                                         frame_nums=frame_nums,
+                                         width=_CHECK_WIDTH,
+                                         height=_CHECK_HEIGHT)
+
+    reference, _ = lintel.loadvid(encoded_video,
+                                  should_random_seek=False,
+                                  width=_CHECK_WIDTH,
+                                  height=_CHECK_HEIGHT,
+                                  num_frames=0)
+    reference = _as_frames(reference)
+    assert len(set(frame.tobytes() for frame in reference)) == nb_frames
+
+    frame_nums = [1, 2, 9, 30, 31, 59]
+    expected = decode(frame_nums)
+    assert decode(np.array(frame_nums, dtype=np.int32)) == expected
+    assert decode(np.array(frame_nums, dtype=np.int64)) == expected
+    assert decode(range(2, 50, 7)) == decode(list(range(2, 50, 7)))
+
+    spec_frames = _as_frames(decode(lintel.sampling.frame_range(2, step=5)))
+    assert (_find_frame_nums(spec_frames, reference) ==
+            list(range(2, nb_frames, 5)))
+
+    spec_frames = _as_frames(decode(lintel.sampling.uniform(8)))
+    assert (_find_frame_nums(spec_frames, reference) ==
+            [((2*i + 1)*nb_frames)//16 for i in range(8)])
+
+    for spec in [lintel.sampling.segments(4, per_segment=2),
+                 lintel.sampling.random_dense(8, stride=2)]:
+        lintel.seed(1234)
+        first = decode(spec)
+        lintel.seed(1234)
+        assert decode(spec) == first, spec
+
+        resolved = _find_frame_nums(_as_frames(first), reference)
+        if spec.kind == 'segments':
+            for segment in range(4):
+                start, second = resolved[2*segment:2*segment + 2]
+                assert second == start + 1
+                assert (segment*nb_frames)//4 <= start
+                assert second < ((segment + 1)*nb_frames)//4
+        else:
+            assert resolved == list(range(resolved[0], resolved[0] + 16, 2))
+
+    for spec in [range(0, 2**40, 2**35),
+                 lintel.sampling.segments(2**16, per_segment=2**16),
+                 lintel.sampling.random_dense(2**16, stride=2**16)]:
+        try:
+            decode(spec)
+        except ValueError:
+            pass
+        else:
+            assert False, spec
+
+
+def _check_batch(directory):
+    """Checks `loadvid_batch` and `unpack_batch` on clips of mixed resolutions
+    and a clip that fails to open: 64-byte aligned clips matching `loadvid`,
+    dense fixed-size batches, and `out` buffers."""
+    num_frames = 8
+    small_video, _ = _make_test_video(directory, 'small.mp4', 24)
+    large_video, _ = _make_test_video(directory, 'large.mp4', 24,
+                                      width=96, height=80)
+    videos = [small_video, b'not a video', large_video, small_video]
+    sizes = [(_CHECK_WIDTH, _CHECK_HEIGHT), None, (96, 80),
+             (_CHECK_WIDTH, _CHECK_HEIGHT)]
+
+    arena, layout, _ = lintel.loadvid_batch(videos,
+                                            should_random_seek=False,
+                                            num_frames=num_frames)
+    rows = lintel.batch_layout(layout)
+    assert all(offset % 64 == 0 for offset in rows[:, 0])
+    for video, size, row, clip in zip(videos,
+                                      sizes,
+                                      rows,
+                                      lintel.unpack_batch(arena, layout)):
+        if size is None:
+            assert row[1] == 0
+            assert clip.size == 0
+            continue
+
+        width, height = size
+        assert list(row[1:4]) == [num_frames, height, width]
+        expected, _ = lintel.loadvid(video,
+                                     should_random_seek=False,
+                                     width=width,
+                                     height=height,
+                                     num_frames=num_frames)
+        assert clip.tobytes() == expected
+
+    clip_bytes = num_frames*_CHECK_HEIGHT*_CHECK_WIDTH*3
+    expected, _ = lintel.loadvid(small_video,
+                                 should_random_seek=False,
+                                 width=_CHECK_WIDTH,
+                                 height=_CHECK_HEIGHT,
+                                 num_frames=num_frames)
+    out = np.full(len(videos)*clip_bytes, 0xff, dtype=np.uint8)
+    arena, layout, _ = lintel.loadvid_batch(videos,
+                                            should_random_seek=False,
+                                            width=_CHECK_WIDTH,
+                                            height=_CHECK_HEIGHT,
+                                            num_frames=num_frames,
+                                            out=out)
+    assert arena is out
+    assert list(lintel.batch_layout(layout)[:, 1]) == [num_frames, 0, 0,
+                                                       num_frames]
+    clips = out.reshape((len(videos), -1))
+    assert clips[0].tobytes() == expected
+    assert not clips[1].any()
+    assert not clips[2].any()
+    assert clips[3].tobytes() == expected
+
+    try:
+        lintel.loadvid_batch(videos,
+                             should_random_seek=False,
+                             width=_CHECK_WIDTH,
+                             height=_CHECK_HEIGHT,
+                             num_frames=num_frames,
+                             out=np.empty(clip_bytes, dtype=np.uint8))
+    except ValueError:
+        pass
+    else:
+        assert False, 'out too small was accepted'
+
+
+def _to_tubelets(frames, tubelet_frames, patch_size):
+    """Rearranges a decoded clip into a
+    (T/t, H/p, W/p, t, p, p, 3) tubelet array."""
+    frames = _as_frames(frames)
+    num_frames, height, width, _ = frames.shape
+    tubelets = frames.reshape((num_frames//tubelet_frames,
+                               tubelet_frames,
+                               height//patch_size,
+                               patch_size,
+                               width//patch_size,
+                               patch_size,
+                               3))
+
+    return tubelets.transpose((0, 2, 4, 1, 3, 5, 6))
+
+
+def _check_tubelet(directory):
+    """Checks that tubelet output is the plain clip rearranged into tubelets,
+    including frames padded past the end of the video under each padding
+    policy."""
+    encoded_video, _ = _make_test_video(directory, 'tubelet.mp4', 10)
+    tubelet = (2, 16)
+
+    for pad in ['loop', 'last', 'zeros']:
+        expected, _ = lintel.loadvid(encoded_video,
+                                     should_random_seek=False,
+                                     width=_CHECK_WIDTH,
+                                     height=_CHECK_HEIGHT,
+                                     num_frames=14,
+                                     pad=pad)
+        actual, _ = lintel.loadvid(encoded_video,
+                                   should_random_seek=False,
+                                   width=_CHECK_WIDTH,
+                                   height=_CHECK_HEIGHT,
+                                   num_frames=14,
+                                   pad=pad,
+                                   tubelet=tubelet)
+        assert actual == _to_tubelets(expected, *tubelet).tobytes(), pad
+
+        frame_nums = list(range(4, 12))
+        expected = lintel.loadvid_frame_nums(encoded_video,
+                                             frame_nums=frame_nums,
+                                             width=_CHECK_WIDTH,
+                                             height=_CHECK_HEIGHT,
+                                             pad=pad)
+        actual = lintel.loadvid_frame_nums(encoded_video,
+                                           frame_nums=frame_nums,
+                                           width=_CHECK_WIDTH,
+                                           height=_CHECK_HEIGHT,
+                                           pad=pad,
+                                           tubelet=tubelet)
+        assert actual == _to_tubelets(expected, *tubelet).tobytes(), pad
+
+
+_DIFF_DTYPES = {'int8': np.int8, 'int16': np.int16, 'float32': np.float32}
+
+
+def _expected_diffs(frames, diff_type):
+    """Returns np.diff of a decoded clip along time, as `diff_type`, with int8
+    saturated to [-128, 127]."""
+    diffs = np.diff(_as_frames(frames).astype(np.int16), axis=0)
+    if diff_type == 'int8':
+        diffs = np.clip(diffs, -128, 127)
+
+    return diffs.astype(_DIFF_DTYPES[diff_type])
+
+
+def _check_temporal_diff(directory):
+    """Checks temporal differences against np.diff of the decoded frames:
+    int8 saturation, int16 and float32 exactness, rgb=False, and the
+    differences of padded frames, e.g. the wrap-around of loop padding."""
+    encoded_video, _ = _make_test_video(directory, 'diff.mp4', 10)
+
+    for diff_type in ['int8', 'int16', 'float32']:
+        for pad in ['loop', 'last', 'zeros']:
+            frames, _, diffs = lintel.loadvid(encoded_video,
+                                              should_random_seek=False,
+                                              width=_CHECK_WIDTH,
+                                              height=_CHECK_HEIGHT,
+                                              num_frames=16,
+                                              pad=pad,
+                                              temporal_diff=diff_type)
+            expected = _expected_diffs(frames, diff_type)
+            assert diffs == expected.tobytes(), (diff_type, pad)
+
+            # NOTE(brendan): Zero padding steps from bright pixels down to
+            # black, so the int8 differences must saturate.
+            if pad == 'zeros':
+                exact = _expected_diffs(frames, 'int16')
+                assert exact.min() < -128
+
+            frame_nums = [0, 1, 5, 8, 9, 12]
+            frames, diffs = lintel.loadvid_frame_nums(encoded_video,
+                                                      frame_nums=frame_nums,
+                                                      width=_CHECK_WIDTH,
+                                                      height=_CHECK_HEIGHT,
+                                                      pad=pad,
+                                                      temporal_diff=diff_type)
+            expected = _expected_diffs(frames, diff_type)
+            assert diffs == expected.tobytes(), (diff_type, pad)
+
+            no_rgb, rgb_free_diffs = lintel.loadvid_frame_nums(
+                encoded_video,
+                frame_nums=frame_nums,
+                width=_CHECK_WIDTH,
+                height=_CHECK_HEIGHT,
+                pad=pad,
+                temporal_diff=diff_type,
+                rgb=False)
+            assert len(no_rgb) == 0
+            assert rgb_free_diffs == diffs, (diff_type, pad)
+
+
+class _ReadOnlyStream(object):
+    """File-like object with only a `read` method, optionally raising
+    `error` once `fail_after` bytes have been read."""
+
+    def __init__(self, data, fail_after=None, error=None):
+        self._stream = io.BytesIO(data)
+        self._fail_after = fail_after
+        self._error = error
+
+    def read(self, size=-1):
+        if ((self._fail_after is not None) and
+                (self._stream.tell() >= self._fail_after)):
+            raise self._error
+
+        return self._stream.read(size)
+
+
+class _OverlongReadinto(io.RawIOBase):
+    """Readable stream whose `readinto` claims more bytes than fit."""
+
+    def readable(self):
+        return True
+
+    def readinto(self, buf):
+        return len(buf) + 1
+
+
+class _FailingReadinto(io.RawIOBase):
+    """Readable stream whose `readinto` raises `error`."""
+
+    def __init__(self, error):
+        super(_FailingReadinto, self).__init__()
+        self._error = error
+
+    def readable(self):
+        return True
+
+    def readinto(self, buf):
+        raise self._error
+
+
+def _check_loadvid_stream(directory):
+    """Checks that `loadvid_stream` decodes the same frames from a pipe and
+    from file-like objects as `loadvid_frame_nums` does from bytes, and that an
+    exception raised by the source's read or readinto propagates."""
+    # NOTE(brendan): Matroska, since MP4 needs to seek to its moov atom.
+    encoded_video, _ = _make_test_video(directory, 'stream.mkv', 40)
+    num_frames = 16
+    expected = lintel.loadvid_frame_nums(encoded_video,
+                                         frame_nums=list(range(num_frames)),
+                                         width=_CHECK_WIDTH,
+                                         height=_CHECK_HEIGHT)
+
+    def decode(source, buffer_size=64*1024):
+        return lintel.loadvid_stream(source,
+                                     width=_CHECK_WIDTH,
+                                     height=_CHECK_HEIGHT,
+                                     num_frames=num_frames,
+                                     buffer_size=buffer_size)
+
+    read_fd, write_fd = os.pipe()
+
+    def write_video():
+        with os.fdopen(write_fd, 'wb') as f:
+            try:
+                f.write(encoded_video)
+            except BrokenPipeError:
+                pass
+
+    writer = threading.Thread(target=write_video)
+    writer.start()
+    try:
+        assert decode(read_fd) == expected
+    finally:
+        os.close(read_fd)
+        writer.join()
+
+    assert decode(io.BytesIO(encoded_video)) == expected
+    assert decode(_ReadOnlyStream(encoded_video)) == expected
+
+    # NOTE(brendan): Small reads, so that the failing read comes before the
+    # clip is decoded.
+    for source in [_FailingReadinto(KeyError('readinto')),
+                   _ReadOnlyStream(encoded_video,
+                                   fail_after=1024,
+                                   error=KeyError('read'))]:
+        try:
+            decode(source, buffer_size=1024)
+        except KeyError:
+            pass
+        else:
+            assert False, 'source exception was swallowed'
+
+    try:
+        decode(_OverlongReadinto())
+    except ValueError:
+        pass
+    else:
+        assert False, 'readinto() past the buffer was accepted'
+
+
+def _check_format_cache(directory):
+    """Checks that decodes through a cached demuxer, on a miss and then a hit
+    for the same `video_id`, match uncached decodes, and that a cached entry
+    is dropped for a different-sized video under the same `video_id`."""
+    encoded_video, _ = _make_test_video(directory, 'cached.mp4', 48)
+    other_video, _ = _make_test_video(directory, 'recached.mp4', 24)
+    assert len(other_video) != len(encoded_video)
+    frame_nums = [2, 17, 30]
+
+    def decode(video, video_id=None):
+        frames = lintel.loadvid_frame_nums(video,
+                                           frame_nums=frame_nums,
+                                           width=_CHECK_WIDTH,
+                                           height=_CHECK_HEIGHT,
+                                           video_id=video_id)
+        clip, _ = lintel.loadvid(video,
+                                 should_random_seek=False,
+                                 width=_CHECK_WIDTH,
+                                 height=_CHECK_HEIGHT,
+                                 num_frames=8,
+                                 video_id=video_id)
+        return frames, clip
+
+    expected = decode(encoded_video)
+    for _ in range(2):
+        assert decode(encoded_video, video_id='cached.mp4') == expected
+
+    assert (decode(other_video, video_id='cached.mp4') ==
+            decode(other_video))
+
+
+def _gather_lazy(frames, index_map):
+    """Gathers lazily padded `frames` through `index_map`, as a collate
+    function would, into the eagerly padded clip's bytes."""
+    frames = _as_frames(frames)
+    index_map = np.frombuffer(index_map, dtype=np.int32)
+    padded = np.zeros((len(index_map),) + frames.shape[1:], dtype=np.uint8)
+    padded[index_map >= 0] = frames[index_map[index_map >= 0]]
+
+    return padded.tobytes()
+
+
+def _check_lazy_pad(directory):
+    """Checks that frames gathered through the `lazy_pad` index map equal the
+    eagerly padded output, for loop and last padding."""
+    encoded_video, _ = _make_test_video(directory, 'lazy_pad.mp4', 10)
+    frame_nums = [1, 4, 9, 12, 20]
+
+    for pad in ['loop', 'last']:
+        expected, _ = lintel.loadvid(encoded_video,
+                                     should_random_seek=False,
+                                     width=_CHECK_WIDTH,
+                                     height=_CHECK_HEIGHT,
+                                     num_frames=16,
+                                     pad=pad)
+        frames, _, index_map = lintel.loadvid(encoded_video,
+                                              should_random_seek=False,
+                                              width=_CHECK_WIDTH,
+                                              height=_CHECK_HEIGHT,
+                                              num_frames=16,
+                                              pad=pad,
+                                              lazy_pad=True)
+        assert len(frames) < len(expected), pad
+        assert _gather_lazy(frames, index_map) == expected, pad
+
+        expected = lintel.loadvid_frame_nums(encoded_video,
+                                             frame_nums=frame_nums,
+                                             width=_CHECK_WIDTH,
+                                             height=_CHECK_HEIGHT,
+                                             pad=pad)
+        frames, index_map = lintel.loadvid_frame_nums(encoded_video,
+                                                      frame_nums=frame_nums,
+                                                      width=_CHECK_WIDTH,
+                                                      height=_CHECK_HEIGHT,
+                                                      pad=pad,
+                                                      lazy_pad=True)
+        assert _gather_lazy(frames, index_map) == expected, pad
+
+
+def _check_thread_budget(directory):
+    """Checks that batch and parallel decodes under a small thread budget
+    match unbudgeted decodes, and that every grant is released."""
+    encoded_video, _ = _make_test_video(directory, 'budget.mp4', 64)
+    videos = [encoded_video]*6
+
+    def decode():
+        arena, layout, _ = lintel.loadvid_batch(videos,
+                                                should_random_seek=False,
+                                                width=_CHECK_WIDTH,
+                                                height=_CHECK_HEIGHT,
+                                                num_frames=8)
+        frames, _ = lintel.loadvid(encoded_video,
+                                   should_random_seek=False,
+                                   width=_CHECK_WIDTH,
+                                   height=_CHECK_HEIGHT,
+                                   num_frames=0,
+                                   parallel=True)
+        sparse = lintel.loadvid_frame_nums(encoded_video,
+                                           frame_nums=[3, 20, 41, 60],
+                                           width=_CHECK_WIDTH,
+                                           height=_CHECK_HEIGHT,
+                                           parallel=True)
+        return bytes(arena), bytes(layout), frames, sparse
+
+    expected = decode()
+    lintel.set_thread_budget(2)
+    try:
+        assert lintel.stats()['thread_budget']['max_threads'] == 2
+        assert decode() == expected
+        budget = lintel.stats()['thread_budget']
+        assert budget['decodes'] == 0
+        assert budget['threads_in_use'] == 0
+    finally:
+        lintel.set_thread_budget(0)
+
+
+def _check_decoder_name(directory):
+    """Checks that decodes with a `decoder=` for the video's codec match the
+    default decoder's, and that an unknown decoder name is rejected."""
+    encoded_video, _ = _make_test_video(directory, 'decoder.mp4', 24)
+
+    def decode(decoder):
+        clip, _ = lintel.loadvid(encoded_video,
+                                 should_random_seek=False,
+                                 width=_CHECK_WIDTH,
+                                 height=_CHECK_HEIGHT,
+                                 num_frames=8,
+                                 decoder=decoder)
+        arena, _, _ = lintel.loadvid_batch([encoded_video],
+                                           should_random_seek=False,
+                                           width=_CHECK_WIDTH,
+                                           height=_CHECK_HEIGHT,
+                                           num_frames=8,
+                                           decoder=decoder)
+        return clip, bytes(arena)
+
+    assert decode('h264') == decode(None)
+
+    try:
+        decode('no-such-decoder')
+    except ValueError:
+        pass
+    else:
+        assert False, 'unknown decoder was accepted'
+
+
+def _check_fast_decode(directory):
+    """Checks that `fast_decode` decodes clips of the requested shape from
+    each API."""
+    encoded_video, _ = _make_test_video(directory, 'fast.mp4', 24)
+    clip_bytes = 8*_CHECK_HEIGHT*_CHECK_WIDTH*3
+
+    clip, _ = lintel.loadvid(encoded_video,
+                             should_random_seek=False,
+                             width=_CHECK_WIDTH,
+                             height=_CHECK_HEIGHT,
+                             num_frames=8,
+                             fast_decode=True)
+    assert _as_frames(clip).shape == (8, _CHECK_HEIGHT, _CHECK_WIDTH, 3)
+
+    frames = lintel.loadvid_frame_nums(encoded_video,
+                                       frame_nums=list(range(0, 24, 3)),
+                                       width=_CHECK_WIDTH,
+                                       height=_CHECK_HEIGHT,
+                                       fast_decode=True)
+    assert len(frames) == clip_bytes
+
+    arena, layout, _ = lintel.loadvid_batch([encoded_video]*2,
+                                            should_random_seek=False,
+                                            width=_CHECK_WIDTH,
+                                            height=_CHECK_HEIGHT,
+                                            num_frames=8,
+                                            fast_decode=True)
+    for clip in lintel.unpack_batch(arena, layout):
+        assert clip.shape == (8, _CHECK_HEIGHT, _CHECK_WIDTH, 3)
+
+
+def _check_quality_control(directory):
+    """Checks that a quality controller that can never meet its target steps
+    down one level at a time to `max_level`, that the batch layout tags each
+    clip with the level it was decoded at, and that disabling the controller
+    returns to exact decoding."""
+    encoded_video, _ = _make_test_video(directory, 'quality.mp4', 24)
+
+    def decode():
+        _, layout, _ = lintel.loadvid_batch([encoded_video]*2,
+                                            should_random_seek=False,
+                                            width=_CHECK_WIDTH,
+                                            height=_CHECK_HEIGHT,
+                                            num_frames=8)
+        return lintel.batch_layout(layout)
+
+    lintel.set_quality_control(1e-9, max_level=3)
+    try:
+        levels = []
+        for _ in range(16):
+            level = lintel.stats()['quality_level']
+            rows = decode()
+            assert list(rows[:, 4]) == [level, level]
+            levels.append(level)
+    finally:
+        lintel.set_quality_control(0)
+
+    assert levels[0] == 0
+    assert levels[-1] == 3
+    assert all(0 <= b - a <= 1 for a, b in zip(levels, levels[1:]))
+
+    assert lintel.stats()['quality_level'] == 0
+    assert not decode()[:, 4].any()
+
+
+def _check_estimate_cost(directory):
+    """Checks that `estimate_cost` grows with the number of frames requested,
+    and with the video's resolution."""
+    _, filename = _make_test_video(directory, 'cost.mp4', 96)
+    index_path = os.path.join(directory, 'cost.index')
+    lintel.index_dataset([filename], out=index_path)
+    meta = lintel.DatasetIndex(index_path).row(0)
+
+    costs = [lintel.estimate_cost(meta, range(num_frames))
+             for num_frames in [1, 8, 32, 96]]
+    assert all(a < b for a, b in zip(costs, costs[1:])), costs
+
+    costs = [lintel.estimate_cost(meta._replace(width=scale*meta.width,
+                                                height=scale*meta.height),
+                                  lintel.sampling.uniform(8))
+             for scale in [1, 2, 4]]
+    assert all(a < b for a, b in zip(costs, costs[1:])), costs
+
+
+def _check_codec_reuse(directory):
+    """Checks that repeated decodes on one thread reuse its cached scaler and
+    decoder, and decode the same frames as the first decode."""
+    encoded_video, _ = _make_test_video(directory, 'reuse.mp4', 24)
+
+    def decode():
+        clip, _ = lintel.loadvid(encoded_video,
+                                 should_random_seek=False,
+                                 width=_CHECK_WIDTH,
+                                 height=_CHECK_HEIGHT,
+                                 num_frames=8)
+        return clip
+
+    expected = decode()
+    before = lintel.stats()
+    for _ in range(3):
+        assert decode() == expected
+    after = lintel.stats()
+
+    for counter in ['scaler_reuses', 'decoder_reuses']:
+        assert after[counter] >= before[counter] + 3, counter
+
+
+def _check_pool_stress(directory):
+    """Checks that batches of many clips, submitted by several threads at
+    once to a thread pool capped at two workers, match sequential decodes of
+    each clip."""
+    num_frames = 4
+    videos = [_make_test_video(directory,
+                               'stress{}.mp4'.format(i),
+                               12 + 4*i)[0]
+              for i in range(4)]
+    expected = []
+    for video in videos:
+        clip, _ = lintel.loadvid(video,
+                                 should_random_seek=False,
+                                 width=_CHECK_WIDTH,
+                                 height=_CHECK_HEIGHT,
+                                 num_frames=num_frames)
+        expected.append(clip)
+    batch = videos*16
+    batch_expected = b''.join(expected*16)
+
+    results = []
+
+    def decode_batches():
+        for _ in range(4):
+            arena, _, _ = lintel.loadvid_batch(batch,
+                                               should_random_seek=False,
+                                               width=_CHECK_WIDTH,
+                                               height=_CHECK_HEIGHT,
+                                               num_frames=num_frames)
+            results.append(bytes(arena) == batch_expected)
+
+    lintel.set_thread_budget(2)
+    try:
+        threads = [threading.Thread(target=decode_batches) for _ in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+    finally:
+        lintel.set_thread_budget(0)
+
+    assert len(results) == 16
+    assert all(results)
+
+
+def _check_memory_stats(directory):
+    """Checks that a decode raises the peaks of the stages it goes through,
+    and returns its output buffer's bytes once done."""
+    encoded_video, _ = _make_test_video(directory, 'memory.mp4', 24)
+
+    lintel.reset_memory_peaks()
+    before = lintel.stats()['memory']
+    clip, _ = lintel.loadvid(encoded_video,
+                             should_random_seek=False,
+                             width=_CHECK_WIDTH,
+                             height=_CHECK_HEIGHT,
+                             num_frames=8)
+    after = lintel.stats()['memory']
+
+    assert after['output']['peak'] >= before['output']['current'] + len(clip)
+    assert after['output']['current'] == before['output']['current']
+    assert after['decoder']['peak'] > before['decoder']['current']
+    assert after['frame_rgb']['peak'] > before['frame_rgb']['current']
+    assert after['total']['peak'] > before['total']['peak']
+
+
+# NOTE(brendan): Each check takes a temporary directory to encode its test
+# videos into, and raises AssertionError on failure.
+_CHECKS = [_check_meta_mp4,
+           _check_keyframe_index,
+           _check_parallel_full_decode,
+           _check_parallel_frame_nums,
+           _check_frame_nums_specs,
+           _check_batch,
+           _check_tubelet,
+           _check_temporal_diff,
+           _check_loadvid_stream,
+           _check_format_cache,
+           _check_lazy_pad,
+           _check_thread_budget,
+           _check_decoder_name,
+           _check_fast_decode,
+           _check_quality_control,
+           _check_estimate_cost,
+           _check_codec_reuse,
+           _check_pool_stress,
+           _check_memory_stats]
+
+
+def _run_checks():
+    """Runs every check in `_CHECKS` against synthetic videos encoded with the
+    ffmpeg CLI, and prints the name of each check that passes."""
+    with tempfile.TemporaryDirectory() as directory:
+        for check in _CHECKS:
+            check(directory)
+            print('{}: ok'.format(check.__name__))
+
+
 def _loadvid_test_vanilla(filename, width, height):
     """Tests the usual loadvid call.
 
@@ -134,6 +1013,11 @@ def _loadvid_test_frame_nums(filename,
 @click.option('--loadvid',
               'test_name',
               flag_value='loadvid')
+@click.option('--checks',
+              'test_name',
+              flag_value='checks',
+              help='Run the assertion checks against synthetic videos, '
+                   'instead of plotting frames of --filename.')
 @click.option('--should-seek/--no-should-seek',
               default=False,
               help='Whether to use the potentially frame-inaccurate seek.')
@@ -156,6 +1040,10 @@ def loadvid_test(dynamic_size,
     This program also acts as a sample use case for the APIs provided by
     Lintel.
     """
+    if test_name == 'checks':
+        _run_checks()
+        return
+
     if dynamic_size:
         width = 0
         height = 0
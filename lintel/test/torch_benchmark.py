@@ -0,0 +1,136 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Minibatch throughput of lintel.torch against a per-clip Dataset."""
+import shutil
+import tempfile
+import time
+
+import click
+import numpy as np
+import torch
+import torch.utils.data
+
+import lintel
+import lintel.torch
+from lintel.test.benchmark import _make_synthetic_video
+
+
+class _PerClipDataset(torch.utils.data.Dataset):
+    """The README recipe: one loadvid call per clip, collated by the default
+    DataLoader collate function."""
+
+    def __init__(self, paths, num_frames, width, height):
+        self.paths = paths
+        self.num_frames = num_frames
+        self.width = width
+        self.height = height
+
+    def __len__(self):
+        return len(self.paths)
+
+    def __getitem__(self, index):
+        with open(self.paths[index], 'rb') as f:
+            encoded_video = f.read()
+
+        frames, _ = lintel.loadvid(encoded_video,
+                                   should_random_seek=True,
+                                   width=self.width,
+                                   height=self.height,
+                                   num_frames=self.num_frames)
+        frames = np.frombuffer(frames, dtype=np.uint8)
+        frames = frames.reshape((self.num_frames, self.height, self.width, 3))
+
+        return torch.from_numpy(frames.copy()), index
+
+
+def _time_loader(loader, num_epochs):
+    """Returns clips per second over `num_epochs` passes of `loader`."""
+    num_clips = 0
+    start = time.perf_counter()
+    for _ in range(num_epochs):
+        for batch in loader:
+            num_clips += len(batch[0])
+    end = time.perf_counter()
+
+    return num_clips/(end - start)
+
+
+@click.command()
+@click.option('--num-videos',
+              default=64,
+              type=int,
+              help='Number of videos in the synthetic corpus.')
+@click.option('--width',
+              default=320,
+              type=int,
+              help='Width of the synthetic videos, and of the decoded clips.')
+@click.option('--height',
+              default=240,
+              type=int,
+              help='Height of the synthetic videos, and of the decoded clips.')
+@click.option('--num-frames',
+              default=32,
+              type=int,
+              help='Number of frames per clip.')
+@click.option('--batch-size',
+              default=16,
+              type=int,
+              help='Clips per minibatch.')
+@click.option('--num-workers',
+              default=0,
+              type=int,
+              help='DataLoader worker processes.')
+@click.option('--num-epochs',
+              default=2,
+              type=int,
+              help='Passes over the corpus per measurement.')
+def torch_benchmark(num_videos,
+                    width,
+                    height,
+                    num_frames,
+                    batch_size,
+                    num_workers,
+                    num_epochs):
+    """Measures DataLoader throughput on a synthetic corpus, for a per-clip
+    Dataset and for lintel.torch.VideoClipDataset.
+    """
+    directory = tempfile.mkdtemp()
+    try:
+        video = _make_synthetic_video(width, height, 4*num_frames, directory)
+        paths = [video]*num_videos
+
+        per_clip = torch.utils.data.DataLoader(
+            _PerClipDataset(paths, num_frames, width, height),
+            batch_size=batch_size,
+            shuffle=True,
+            num_workers=num_workers,
+            worker_init_fn=lintel.torch.worker_init_fn)
+        batched = lintel.torch.clip_loader(
+            lintel.torch.VideoClipDataset(paths,
+                                          num_frames,
+                                          width=width,
+                                          height=height),
+            batch_size=batch_size,
+            num_workers=num_workers)
+
+        for name, loader in [('per-clip', per_clip),
+                             ('lintel.torch', batched)]:
+            # NOTE(brendan): Warm up, so that the first measurement is not
+            # penalized.
+            _time_loader(loader, 1)
+            clips_per_s = _time_loader(loader, num_epochs)
+            print('{}: {:.1f} clips/s'.format(name, clips_per_s))
+    finally:
+        shutil.rmtree(directory)
@@ -0,0 +1,162 @@
+# Copyright 2018 Brendan Duke.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""PyTorch dataset of video clips, decoded one minibatch at a time.
+
+Requires PyTorch, which is not a dependency of lintel itself. Install it with
+`pip install lintel[torch]`.
+"""
+from __future__ import absolute_import
+
+import operator
+
+import torch
+import torch.utils.data
+
+import _lintel
+from lintel.batch import batch_layout, unpack_batch
+
+
+class VideoClipDataset(torch.utils.data.Dataset):
+    """Clips of `num_frames` frames from a list of video files.
+
+    Indexing with a list of indices (as given by a `BatchSampler`) decodes the
+    whole minibatch in a single call to `lintel.loadvid_batch`, on lintel's
+    native thread pool and with the GIL released. With `width` and `height`,
+    the clips are written straight into one uint8 tensor of shape
+    `(batch_size, num_frames, height, width, 3)`, in pinned memory if
+    `pin_memory` is set, so no collation copy is made. Pinning needs CUDA, so
+    set `pin_memory` only when loading in the main process
+    (`num_workers=0`).
+
+    Without `width` and `height`, a minibatch is a list of tensors of shape
+    `(num_frames, height, width, 3)`, one per video.
+
+    A minibatch is returned as `(clips, indices, quality_levels)`, where
+    `quality_levels` is an int64 tensor of the quality level each clip was
+    decoded at (see `lintel.set_quality_control`).
+
+    Clips whose video could not be decoded are all zeros. With `fast_decode`,
+    frames are decoded approximately (see `lintel.loadvid`), which is usually
+    harmless after augmentation.
+    """
+
+    def __init__(self,
+                 paths,
+                 num_frames,
+                 width=0,
+                 height=0,
+                 should_random_seek=True,
+                 pad='loop',
+                 pin_memory=False,
+                 fast_decode=False):
+        if (width == 0) != (height == 0):
+            raise ValueError('Pass both width and height, or neither.')
+
+        self.paths = list(paths)
+        self.num_frames = num_frames
+        self.width = width
+        self.height = height
+        self.should_random_seek = should_random_seek
+        self.pad = pad
+        self.pin_memory = pin_memory
+        self.fast_decode = fast_decode
+
+    def __len__(self):
+        return len(self.paths)
+
+    def __getitem__(self, index):
+        # NOTE(brendan): Any integer, e.g. a numpy integer from a sampler, is
+        # one clip; anything else is a minibatch of indices.
+        try:
+            index = operator.index(index)
+        except TypeError:
+            return self._load_batch(list(index))
+
+        clips, _, quality_levels = self._load_batch([index])
+        return clips[0], index, int(quality_levels[0])
+
+    def _load_batch(self, indices):
+        encoded_videos = []
+        for i in indices:
+            with open(self.paths[i], 'rb') as f:
+                encoded_videos.append(f.read())
+
+        indices = torch.tensor(indices, dtype=torch.int64)
+
+        if self.width == 0:
+            arena, layout, _ = _lintel.loadvid_batch(
+                encoded_videos,
+                should_random_seek=self.should_random_seek,
+                num_frames=self.num_frames,
+                pad=self.pad,
+                fast_decode=self.fast_decode)
+            clips = [torch.from_numpy(clip)
+                     for clip in unpack_batch(arena, layout)]
+            return clips, indices, _quality_levels(layout)
+
+        clips = torch.empty((len(encoded_videos),
+                             self.num_frames,
+                             self.height,
+                             self.width,
+                             3),
+                            dtype=torch.uint8,
+                            pin_memory=self.pin_memory)
+        _, layout, _ = _lintel.loadvid_batch(
+            encoded_videos,
+            should_random_seek=self.should_random_seek,
+            width=self.width,
+            height=self.height,
+            num_frames=self.num_frames,
+            pad=self.pad,
+            out=clips.numpy(),
+            fast_decode=self.fast_decode)
+
+        return clips, indices, _quality_levels(layout)
+
+
+def _quality_levels(layout):
+    """Returns the quality level column of a batch layout as a tensor."""
+    return torch.from_numpy(batch_layout(layout)[:, 4].copy())
+
+
+def worker_init_fn(worker_id):
+    """Seeds lintel's random seeks in a `DataLoader` worker from the seed
+    PyTorch gives the worker, so that runs seeded with `torch.manual_seed`
+    are reproducible."""
+    _lintel.seed(torch.initial_seed() % 2**64)
+
+
+def clip_loader(dataset,
+                batch_size,
+                shuffle=True,
+                drop_last=False,
+                num_workers=0):
+    """Returns a `DataLoader` that decodes each minibatch of `dataset` with one
+    native batch decode, rather than one decode per clip followed by a
+    collation copy.
+    """
+    if shuffle:
+        sampler = torch.utils.data.RandomSampler(dataset)
+    else:
+        sampler = torch.utils.data.SequentialSampler(dataset)
+    batch_sampler = torch.utils.data.BatchSampler(sampler,
+                                                  batch_size,
+                                                  drop_last)
+
+    return torch.utils.data.DataLoader(dataset,
+                                       batch_size=None,
+                                       sampler=batch_sampler,
+                                       num_workers=num_workers,
+                                       worker_init_fn=worker_init_fn)
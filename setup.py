@@ -14,17 +14,36 @@
 
 """Installs Lintel, the video decoding Python module."""
 import distutils.core
+import sys
+
 import setuptools
 
 
+# NOTE(brendan): shm_open needs librt on Linux, for the shared thread budget.
+libraries = ['avformat', 'avcodec', 'swscale', 'avutil', 'swresample',
+             'pthread']
+if sys.platform.startswith('linux'):
+    libraries.append('rt')
+
 lintel_module = distutils.core.Extension(
     '_lintel',
     define_macros=[('MAJOR_VERSION', '1'), ('MINOR_VERSION', '0')],
     undef_macros=['NDEBUG'],
     include_dirs=['/usr/include/ffmpeg', 'lintel'],
-    libraries=['avformat', 'avcodec', 'swscale', 'avutil', 'swresample'],
+    libraries=libraries,
     sources=['lintel/py_ext/lintelmodule.c',
-             'lintel/core/video_decode.c'])
+             'lintel/core/codec_cache.c',
+             'lintel/core/decoder_select.c',
+             'lintel/core/format_cache.c',
+             'lintel/core/frame_copy.c',
+             'lintel/core/keyframe_index.c',
+             'lintel/core/mem_stats.c',
+             'lintel/core/quality_control.c',
+             'lintel/core/sampling.c',
+             'lintel/core/thread_budget.c',
+             'lintel/core/thread_pool.c',
+             'lintel/core/video_decode.c',
+             'lintel/core/video_index.c'])
 
 
 setuptools.setup(author='Brendan Duke',
@@ -38,10 +57,15 @@ setuptools.setup(author='Brendan Duke',
                  entry_points="""
                      [console_scripts]
                      lintel_test=lintel.test.loadvid_test:loadvid_test
+                     lintel_benchmark=lintel.test.benchmark:benchmark
+                     lintel_torch_benchmark=lintel.test.torch_benchmark:torch_benchmark
                  """,
                  install_requires=['Click', 'numpy'],
+                 extras_require={'torch': ['torch']},
                  ext_modules=[lintel_module],
                  packages=setuptools.find_packages(),
-                 py_modules=['lintel.test.loadvid_test'],
+                 py_modules=['lintel.test.benchmark',
+                             'lintel.test.loadvid_test',
+                             'lintel.test.torch_benchmark'],
                  url='https://brendanduke.ca',
                  version='1.0')